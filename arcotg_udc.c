@@ -39,6 +39,8 @@
 #include <linux/platform_device.h>
 #include <linux/fsl_devices.h>
 #include <linux/dmapool.h>
+#include <linux/pm_qos_params.h>
+#include <linux/cpufreq.h>
 
 #include <asm/processor.h>
 #include <asm/byteorder.h>
@@ -50,6 +52,9 @@
 #include <asm/cacheflush.h>
 
 #include "arcotg_udc.h"
+#include "ep_batch.h"
+#include "usb_mem.h"
+#include "usb_sched.h"
 #include <mach/arc_otg.h>
 #include <linux/iram_alloc.h>
 
@@ -82,6 +87,18 @@ volatile static struct usb_sys_interface *usb_sys_regs;
 static struct fsl_udc *udc_controller;
 static struct workqueue_struct *usb_gadget_queue;
 
+/* the clock gating work on usb_gadget_queue */
+static struct usb_sched gadget_work_sched = USB_SCHED_DEFAULT;
+USB_SCHED_MODULE_PARAMETERS(gadget_work, gadget_work_sched);
+
+/* fsl_req objects come from their own slab, so they show in slabinfo;
+ * fsl_mem counts them, the dTDs, and the buffers mapped for DMA */
+static struct kmem_cache *fsl_req_cache;
+static struct usb_mem_account fsl_mem = USB_MEM_ACCOUNT("mem");
+#ifdef CONFIG_USB_GADGET_DEBUG_FS
+static struct dentry *fsl_debugfs_root;
+#endif
+
 #ifdef POSTPONE_FREE_LAST_DTD
 static struct ep_td_struct *last_free_td;
 #endif
@@ -188,15 +205,22 @@ static void reset_phy(void)
 #else
 static void reset_phy(void){; }
 #endif
+
+static inline void fsl_free_dtd(struct fsl_udc *udc, struct ep_td_struct *td)
+{
+	usb_mem_sub(&fsl_mem, sizeof *td);
+	dma_pool_free(udc->td_pool, td, td->td_dma);
+}
+
 /*-----------------------------------------------------------------
- * done() - retire a request; caller blocked irqs
+ * retire() - unlink a request and release its dtds and mapping,
+ *	without calling it back; caller blocked irqs
  * @status : request status to be set, only works when
  *	request is still in progress.
  *--------------------------------------------------------------*/
-static void done(struct fsl_ep *ep, struct fsl_req *req, int status)
+static void retire(struct fsl_ep *ep, struct fsl_req *req, int status)
 {
 	struct fsl_udc *udc = NULL;
-	unsigned char stopped = ep->stopped;
 	struct ep_td_struct *curr_td, *next_td;
 	int j;
 
@@ -217,17 +241,16 @@ static void done(struct fsl_ep *ep, struct fsl_req *req, int status)
 		if (j != req->dtd_count - 1) {
 			next_td = curr_td->next_td_virt;
 #ifdef POSTPONE_FREE_LAST_DTD
-			dma_pool_free(udc->td_pool, curr_td, curr_td->td_dma);
+			fsl_free_dtd(udc, curr_td);
 		} else {
 			if (last_free_td != NULL)
-				dma_pool_free(udc->td_pool, last_free_td,
-						last_free_td->td_dma);
+				fsl_free_dtd(udc, last_free_td);
 			last_free_td = curr_td;
 		}
 #else
 		}
 
-		dma_pool_free(udc->td_pool, curr_td, curr_td->td_dma);
+		fsl_free_dtd(udc, curr_td);
 #endif
 	}
 
@@ -242,6 +265,7 @@ static void done(struct fsl_ep *ep, struct fsl_req *req, int status)
 			ep_is_in(ep)
 				? DMA_TO_DEVICE
 				: DMA_FROM_DEVICE);
+		usb_mem_dma_unmap(&fsl_mem, req->req.length);
 		req->req.dma = DMA_ADDR_INVALID;
 		req->mapped = 0;
 	} else
@@ -255,7 +279,16 @@ static void done(struct fsl_ep *ep, struct fsl_req *req, int status)
 		VDBG("complete %s req %p stat %d len %u/%u",
 			ep->ep.name, &req->req, status,
 			req->req.actual, req->req.length);
+}
+
+/*-----------------------------------------------------------------
+ * done() - retire a request and call it back; caller blocked irqs
+ *--------------------------------------------------------------*/
+static void done(struct fsl_ep *ep, struct fsl_req *req, int status)
+{
+	unsigned char stopped = ep->stopped;
 
+	retire(ep, req, status);
 	ep->stopped = 1;
 
 	spin_unlock(&ep->udc->lock);
@@ -268,6 +301,21 @@ static void done(struct fsl_ep *ep, struct fsl_req *req, int status)
 	ep->stopped = stopped;
 }
 
+/*-----------------------------------------------------------------
+ * done_list() - call back a list of retired requests at once, for
+ *	gadget drivers which set ep->complete_list; caller blocked irqs
+ *--------------------------------------------------------------*/
+static void done_list(struct fsl_ep *ep, struct list_head *reqs)
+{
+	unsigned char stopped = ep->stopped;
+
+	ep->stopped = 1;
+	spin_unlock(&ep->udc->lock);
+	ep->complete_list(&ep->ep, reqs);
+	spin_lock(&ep->udc->lock);
+	ep->stopped = stopped;
+}
+
 /*-----------------------------------------------------------------
  * nuke(): delete all requests related to this ep
  * called with spinlock held
@@ -818,6 +866,7 @@ static int fsl_ep_disable(struct usb_ep *_ep)
 	/* nuke all pending requests (does flush) */
 	nuke(ep, -ESHUTDOWN);
 
+	ep->complete_list = NULL;
 	ep->desc = 0;
 	ep->stopped = 1;
 	spin_unlock_irqrestore(&udc->lock, flags);
@@ -836,9 +885,10 @@ fsl_alloc_request(struct usb_ep *_ep, gfp_t gfp_flags)
 {
 	struct fsl_req *req = NULL;
 
-	req = kzalloc(sizeof *req, gfp_flags);
+	req = kmem_cache_zalloc(fsl_req_cache, gfp_flags);
 	if (!req)
 		return NULL;
+	atomic_inc(&fsl_mem.requests);
 
 	req->req.dma = DMA_ADDR_INVALID;
 	pr_debug("udc: req=0x%p   set req.dma=0x%x\n", req, req->req.dma);
@@ -853,8 +903,10 @@ static void fsl_free_request(struct usb_ep *_ep, struct usb_request *_req)
 
 	req = container_of(_req, struct fsl_req, req);
 
-	if (_req)
-		kfree(req);
+	if (_req) {
+		atomic_dec(&fsl_mem.requests);
+		kmem_cache_free(fsl_req_cache, req);
+	}
 }
 
 static void update_qh(struct fsl_req *req)
@@ -955,6 +1007,7 @@ static struct ep_td_struct *fsl_build_dtd(struct fsl_req *req, unsigned *length,
 	dtd = dma_pool_alloc(udc_controller->td_pool, GFP_KERNEL, dma);
 	if (dtd == NULL)
 		return dtd;
+	usb_mem_add(&fsl_mem, sizeof *dtd);
 
 	dtd->td_dma = *dma;
 	/* Clear reserved field */
@@ -1058,43 +1111,23 @@ static int fsl_req_to_dtd(struct fsl_req *req)
 	return 0;
 }
 
-/* queues (submits) an I/O request to an endpoint */
-static int
-fsl_ep_queue(struct usb_ep *_ep, struct usb_request *_req, gfp_t gfp_flags)
+/* map a request and build its dtds; caller holds udc->lock */
+static int fsl_prep_req(struct fsl_ep *ep, struct fsl_req *req)
 {
-	struct fsl_ep *ep = container_of(_ep, struct fsl_ep, ep);
-	struct fsl_req *req = container_of(_req, struct fsl_req, req);
-	struct fsl_udc *udc;
-	unsigned long flags;
-	int is_iso = 0;
+	struct fsl_udc *udc = ep->udc;
 
-	spin_lock_irqsave(&udc->lock, flags);
-
-	if (!_ep || !ep->desc) {
-		VDBG("%s, bad ep\n", __func__);
-		spin_unlock_irqrestore(&udc->lock, flags);
-		return -EINVAL;
-	}
 	/* catch various bogus parameters */
-	if (!_req || !req->req.buf || (ep_index(ep)
-				      && !list_empty(&req->queue))) {
+	if (!req->req.buf || (ep_index(ep) && !list_empty(&req->queue))) {
 		VDBG("%s, bad params\n", __func__);
-		spin_unlock_irqrestore(&udc->lock, flags);
 		return -EINVAL;
 	}
 	if (ep->desc->bmAttributes == USB_ENDPOINT_XFER_ISOC) {
-		if (req->req.length > ep->ep.maxpacket) {
-			spin_unlock_irqrestore(&udc->lock, flags);
+		if (req->req.length > ep->ep.maxpacket)
 			return -EMSGSIZE;
-		}
-		is_iso = 1;
 	}
 
-	udc = ep->udc;
-	if (!udc->driver || udc->gadget.speed == USB_SPEED_UNKNOWN) {
-		spin_unlock_irqrestore(&udc->lock, flags);
+	if (!udc->driver || udc->gadget.speed == USB_SPEED_UNKNOWN)
 		return -ESHUTDOWN;
-	}
 	req->ep = ep;
 
 	/* map virtual address to hardware */
@@ -1104,6 +1137,7 @@ fsl_ep_queue(struct usb_ep *_ep, struct usb_request *_req, gfp_t gfp_flags)
 					req->req.length, ep_is_in(ep)
 						? DMA_TO_DEVICE
 						: DMA_FROM_DEVICE);
+		usb_mem_dma_map(&fsl_mem, req->req.length);
 		req->mapped = 1;
 	} else {
 		dma_sync_single_for_device(ep->udc->gadget.dev.parent,
@@ -1122,19 +1156,120 @@ fsl_ep_queue(struct usb_ep *_ep, struct usb_request *_req, gfp_t gfp_flags)
 		req->buffer_offset = 0;
 	}
 
-	/* build dtds and push them to device queue */
-	if (!fsl_req_to_dtd(req)) {
-		fsl_queue_td(ep, req);
-	} else {
-		spin_unlock_irqrestore(&udc->lock, flags);
+	/* build dtds */
+	if (fsl_req_to_dtd(req))
 		return -ENOMEM;
+	return 0;
+}
+
+/* queues (submits) an I/O request to an endpoint */
+static int
+fsl_ep_queue(struct usb_ep *_ep, struct usb_request *_req, gfp_t gfp_flags)
+{
+	struct fsl_ep *ep = container_of(_ep, struct fsl_ep, ep);
+	struct fsl_req *req = container_of(_req, struct fsl_req, req);
+	struct fsl_udc *udc;
+	unsigned long flags;
+	int status;
+
+	if (!_ep || !_req) {
+		VDBG("%s, bad params\n", __func__);
+		return -EINVAL;
 	}
+	udc = ep->udc;
+
+	spin_lock_irqsave(&udc->lock, flags);
 
-	/* irq handler advances the queue */
-	if (req != NULL)
+	if (!ep->desc) {
+		VDBG("%s, bad ep\n", __func__);
+		spin_unlock_irqrestore(&udc->lock, flags);
+		return -EINVAL;
+	}
+
+	/* push dtds to device queue; irq handler advances the queue */
+	status = fsl_prep_req(ep, req);
+	if (status == 0) {
+		fsl_queue_td(ep, req);
 		list_add_tail(&req->queue, &ep->queue);
+	}
+	spin_unlock_irqrestore(&udc->lock, flags);
+
+	return status;
+}
+
+/* queues a list of requests (linked through req.list) with one lock
+ * round trip: their dtd chains are linked to each other first, then
+ * handed to the dQH together, so the endpoint is primed at most once.
+ */
+static int
+fsl_ep_queue_list(struct usb_ep *_ep, struct list_head *reqs, gfp_t gfp_flags)
+{
+	struct fsl_ep *ep = container_of(_ep, struct fsl_ep, ep);
+	struct fsl_req *req, *first = NULL, *prev = NULL;
+	struct usb_request *_req, *tmp;
+	struct fsl_udc *udc;
+	LIST_HEAD(batch);
+	unsigned long flags;
+	int status = 0;
+
+	if (!_ep)
+		return -EINVAL;
+	udc = ep->udc;
+
+	spin_lock_irqsave(&udc->lock, flags);
+
+	if (!ep->desc) {
+		VDBG("%s, bad ep\n", __func__);
+		spin_unlock_irqrestore(&udc->lock, flags);
+		return -EINVAL;
+	}
+
+	list_for_each_entry_safe(_req, tmp, reqs, list) {
+		req = container_of(_req, struct fsl_req, req);
+		status = fsl_prep_req(ep, req);
+		if (status)
+			break;
+		list_del_init(&_req->list);
+
+		/* the iram bounce buffer holds one dtd at a time */
+		if (NEED_IRAM(ep)) {
+			fsl_queue_td(ep, req);
+			list_add_tail(&req->queue, &ep->queue);
+			continue;
+		}
+
+		if (prev)
+			prev->tail->next_td_ptr =
+			    cpu_to_hc32(req->head->td_dma & DTD_ADDR_MASK);
+		else
+			first = req;
+		list_add_tail(&req->queue, &batch);
+		prev = req;
+	}
+
+	if (first) {
+		wmb();
+		fsl_queue_td(ep, first);
+		list_splice_tail(&batch, &ep->queue);
+	}
 	spin_unlock_irqrestore(&udc->lock, flags);
 
+	return status;
+}
+
+/* sets or clears the batched completion callback, see ep_batch.h */
+static int fsl_ep_set_complete_list(struct usb_ep *_ep,
+		void (*complete_list)(struct usb_ep *, struct list_head *))
+{
+	struct fsl_ep *ep = container_of(_ep, struct fsl_ep, ep);
+	unsigned long flags;
+
+	if (!_ep || !ep->desc || !ep_index(ep))
+		return -EINVAL;
+
+	spin_lock_irqsave(&ep->udc->lock, flags);
+	ep->complete_list = complete_list;
+	spin_unlock_irqrestore(&ep->udc->lock, flags);
 	return 0;
 }
 
@@ -1339,19 +1474,23 @@ static void fsl_ep_fifo_flush(struct usb_ep *_ep)
 	} while (fsl_readl(&dr_regs->endptstatus) & bits);
 }
 
-static struct usb_ep_ops fsl_ep_ops = {
-	.enable = fsl_ep_enable,
-	.disable = fsl_ep_disable,
+static struct usb_ep_batch_ops fsl_ep_ops = {
+	.ops = {
+		.enable = fsl_ep_enable,
+		.disable = fsl_ep_disable,
 
-	.alloc_request = fsl_alloc_request,
-	.free_request = fsl_free_request,
+		.alloc_request = fsl_alloc_request,
+		.free_request = fsl_free_request,
 
-	.queue = fsl_ep_queue,
-	.dequeue = fsl_ep_dequeue,
+		.queue = fsl_ep_queue,
+		.dequeue = fsl_ep_dequeue,
 
-	.set_halt = fsl_ep_set_halt,
-	.fifo_status = arcotg_fifo_status,
-	.fifo_flush = fsl_ep_fifo_flush,	/* flush fifo */
+		.set_halt = fsl_ep_set_halt,
+		.fifo_status = arcotg_fifo_status,
+		.fifo_flush = fsl_ep_fifo_flush,	/* flush fifo */
+	},
+	.queue_list = fsl_ep_queue_list,
+	.set_complete_list = fsl_ep_set_complete_list,
 };
 
 /*-------------------------------------------------------------------------
@@ -1913,6 +2052,191 @@ static int process_ep_req(struct fsl_udc *udc, int pipe,
 	return 0;
 }
 
+/*-------------------------------------------------------------------------
+		Boost while traffic is flowing
+-------------------------------------------------------------------------*/
+
+/*
+ * With aggressive cpufreq and cpuidle settings, a transfer starting on an
+ * idle board runs at the lowest operating point, paying the deepest idle
+ * state's wakeup latency on every interrupt, until the governor notices.
+ * So the completion interrupt counts the bytes moved on non-control
+ * endpoints.  Once one sampling window sees boost_threshold of them, a
+ * CPU DMA latency constraint and a cpufreq floor are put in place; they
+ * are dropped again after boost_idle_ms without such a window.
+ *
+ * The knobs are attributes of the platform device; a zero threshold
+ * turns the whole thing off, a zero boost_min_khz means the top speed.
+ */
+
+static void fsl_boost_arm(struct fsl_udc *udc)
+{
+	mod_timer(&udc->boost_timer, jiffies +
+		max(msecs_to_jiffies(udc->boost_window_ms), 1UL));
+}
+
+/* called from dtd_complete_irq() with udc->lock held */
+static inline void fsl_boost_account(struct fsl_udc *udc, unsigned bytes)
+{
+	udc->boost_bytes += bytes;
+	if (udc->boost_threshold && !udc->boost_active
+			&& !timer_pending(&udc->boost_timer))
+		fsl_boost_arm(udc);
+}
+
+static void fsl_boost_timer(unsigned long data)
+{
+	struct fsl_udc *udc = (struct fsl_udc *)data;
+	unsigned long flags;
+	bool busy, want;
+
+	spin_lock_irqsave(&udc->lock, flags);
+	busy = udc->boost_threshold
+		&& udc->boost_bytes >= udc->boost_threshold;
+	udc->boost_bytes = 0;
+	if (busy)
+		udc->boost_busy = jiffies;
+
+	want = busy || (udc->boost_active && udc->boost_threshold
+			&& time_before_eq(jiffies, udc->boost_busy
+				+ msecs_to_jiffies(udc->boost_idle_ms)));
+	if (want != udc->boost_active) {
+		udc->boost_active = want;
+		schedule_work(&udc->boost_work);
+	}
+
+	/* keep sampling while boosted; else the next completion re-arms */
+	if (want)
+		fsl_boost_arm(udc);
+	spin_unlock_irqrestore(&udc->lock, flags);
+}
+
+static void fsl_boost_work(struct work_struct *work)
+{
+	struct fsl_udc *udc = container_of(work, struct fsl_udc, boost_work);
+	unsigned long flags;
+#ifdef CONFIG_CPU_FREQ
+	int cpu;
+#endif
+
+	spin_lock_irqsave(&udc->lock, flags);
+	udc->boost_applied = udc->boost_active;
+	spin_unlock_irqrestore(&udc->lock, flags);
+	if (udc->boost_qos)
+		pm_qos_update_request(udc->boost_qos, udc->boost_applied
+				? udc->boost_latency_us : PM_QOS_DEFAULT_VALUE);
+#ifdef CONFIG_CPU_FREQ
+	/* fsl_boost_policy() applies the floor as the policy is rebuilt */
+	for_each_online_cpu(cpu)
+		cpufreq_update_policy(cpu);
+#endif
+	DBG("boost %s", udc->boost_applied ? "on" : "off");
+}
+
+#ifdef CONFIG_CPU_FREQ
+static int fsl_boost_policy(struct notifier_block *nb, unsigned long event,
+		void *data)
+{
+	struct fsl_udc *udc = container_of(nb, struct fsl_udc, boost_nb);
+	struct cpufreq_policy *policy = data;
+	unsigned int floor;
+
+	if (event != CPUFREQ_ADJUST || !udc->boost_applied)
+		return NOTIFY_DONE;
+
+	floor = udc->boost_min_khz ? : policy->cpuinfo.max_freq;
+	cpufreq_verify_within_limits(policy, floor, policy->cpuinfo.max_freq);
+	return NOTIFY_OK;
+}
+#endif
+
+#define FSL_BOOST_ATTR(name)						\
+static ssize_t show_##name(struct device *dev,				\
+		struct device_attribute *attr, char *buf)		\
+{									\
+	return sprintf(buf, "%u\n", udc_controller->name);		\
+}									\
+static ssize_t store_##name(struct device *dev,				\
+		struct device_attribute *attr, const char *buf, size_t n) \
+{									\
+	unsigned long val;						\
+									\
+	if (strict_strtoul(buf, 0, &val))				\
+		return -EINVAL;						\
+	udc_controller->name = val;					\
+	schedule_work(&udc_controller->boost_work);			\
+	return n;							\
+}									\
+static DEVICE_ATTR(name, 0644, show_##name, store_##name)
+
+FSL_BOOST_ATTR(boost_threshold);	/* bytes per window */
+FSL_BOOST_ATTR(boost_window_ms);
+FSL_BOOST_ATTR(boost_idle_ms);
+FSL_BOOST_ATTR(boost_latency_us);
+FSL_BOOST_ATTR(boost_min_khz);
+
+static ssize_t show_boost_active(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%d\n", udc_controller->boost_applied);
+}
+static DEVICE_ATTR(boost_active, 0444, show_boost_active, NULL);
+
+static struct attribute *fsl_boost_attrs[] = {
+	&dev_attr_boost_threshold.attr,
+	&dev_attr_boost_window_ms.attr,
+	&dev_attr_boost_idle_ms.attr,
+	&dev_attr_boost_latency_us.attr,
+	&dev_attr_boost_min_khz.attr,
+	&dev_attr_boost_active.attr,
+	NULL,
+};
+
+static const struct attribute_group fsl_boost_group = {
+	.attrs = fsl_boost_attrs,
+};
+
+static void fsl_boost_init(struct fsl_udc *udc, struct device *dev)
+{
+	udc->boost_threshold = 64 * 1024;
+	udc->boost_window_ms = 20;
+	udc->boost_idle_ms = 500;
+	udc->boost_latency_us = 0;
+	udc->boost_min_khz = 0;
+	setup_timer(&udc->boost_timer, fsl_boost_timer, (unsigned long)udc);
+	INIT_WORK(&udc->boost_work, fsl_boost_work);
+
+	udc->boost_qos = pm_qos_add_request(PM_QOS_CPU_DMA_LATENCY,
+			PM_QOS_DEFAULT_VALUE);
+	if (!udc->boost_qos)
+		ERR("can't add a PM QoS request, no latency boost\n");
+#ifdef CONFIG_CPU_FREQ
+	udc->boost_nb.notifier_call = fsl_boost_policy;
+	if (cpufreq_register_notifier(&udc->boost_nb,
+				CPUFREQ_POLICY_NOTIFIER))
+		ERR("can't watch cpufreq policies, no frequency boost\n");
+#endif
+	if (sysfs_create_group(&dev->kobj, &fsl_boost_group))
+		ERR("can't create boost attributes\n");
+}
+
+static void fsl_boost_exit(struct fsl_udc *udc, struct device *dev)
+{
+	sysfs_remove_group(&dev->kobj, &fsl_boost_group);
+	del_timer_sync(&udc->boost_timer);
+	spin_lock_irq(&udc->lock);
+	udc->boost_active = false;
+	spin_unlock_irq(&udc->lock);
+	cancel_work_sync(&udc->boost_work);
+	if (udc->boost_applied)
+		fsl_boost_work(&udc->boost_work);
+#ifdef CONFIG_CPU_FREQ
+	cpufreq_unregister_notifier(&udc->boost_nb, CPUFREQ_POLICY_NOTIFIER);
+#endif
+	if (udc->boost_qos)
+		pm_qos_remove_request(udc->boost_qos);
+}
+
 /* Process a DTD completion interrupt */
 static void dtd_complete_irq(struct fsl_udc *udc)
 {
@@ -1920,6 +2244,7 @@ static void dtd_complete_irq(struct fsl_udc *udc)
 	int i, ep_num, direction, bit_mask, status;
 	struct fsl_ep *curr_ep;
 	struct fsl_req *curr_req, *temp_req;
+	LIST_HEAD(batch);
 
 	/* Clear the bits in the register */
 	bit_pos = fsl_readl(&dr_regs->endptcomplete);
@@ -1961,15 +2286,24 @@ static void dtd_complete_irq(struct fsl_udc *udc)
 				ep0_req_complete(udc, curr_ep, curr_req);
 				break;
 			} else {
+				fsl_boost_account(udc, curr_req->req.actual);
 				if (NEED_IRAM(curr_ep)) {
 					if (curr_req->last_one)
 						done(curr_ep, curr_req, status);
 					/* only check the 1th req */
 					break;
+				} else if (curr_ep->complete_list) {
+					retire(curr_ep, curr_req, status);
+					list_add_tail(&curr_req->req.list,
+							&batch);
 				} else
 					done(curr_ep, curr_req, status);
 			}
 		}
+		if (!list_empty(&batch)) {
+			done_list(curr_ep, &batch);
+			INIT_LIST_HEAD(&batch);
+		}
 		dump_ep_queue(curr_ep);
 	}
 }
@@ -2756,7 +3090,7 @@ static int __init struct_ep_setup(struct fsl_udc *udc, unsigned char index,
 	strcpy(ep->name, name);
 	ep->ep.name = ep->name;
 
-	ep->ep.ops = &fsl_ep_ops;
+	ep->ep.ops = &fsl_ep_ops.ops;
 	ep->stopped = 0;
 
 	/* for ep0: maxP defined in desc
@@ -2944,7 +3278,10 @@ static int __init fsl_udc_probe(struct platform_device *pdev)
 		}
 	}
 
-	usb_gadget_queue = create_workqueue("usb_gadget_workqueue");
+	usb_gadget_queue = usb_sched_create_workqueue("usb_gadget_workqueue",
+			&gadget_work_sched);
+	if (usb_gadget_queue == NULL)
+		usb_gadget_queue = create_workqueue("usb_gadget_workqueue");
 	if (usb_gadget_queue == NULL) {
 		printk(KERN_ERR "Coulndn't create usb gadget work queue\n");
 		return -ENOMEM;
@@ -2977,6 +3314,12 @@ static int __init fsl_udc_probe(struct platform_device *pdev)
 	dr_clk_gate(false);
 
 	create_proc_file();
+#ifdef CONFIG_USB_GADGET_DEBUG_FS
+	fsl_debugfs_root = debugfs_create_dir(driver_name, NULL);
+	if (!IS_ERR_OR_NULL(fsl_debugfs_root))
+		usb_mem_register(&fsl_mem, fsl_debugfs_root);
+#endif
+	fsl_boost_init(udc_controller, &pdev->dev);
 	return 0;
 
 err4:
@@ -3014,20 +3357,26 @@ static int __exit fsl_udc_remove(struct platform_device *pdev)
 		dr_clk_gate(true);
 
 	/* DR has been stopped in usb_gadget_unregister_driver() */
+	fsl_boost_exit(udc_controller, &pdev->dev);
 	remove_proc_file();
+#ifdef CONFIG_USB_GADGET_DEBUG_FS
+	if (!IS_ERR_OR_NULL(fsl_debugfs_root)) {
+		usb_mem_unregister(&fsl_mem, fsl_debugfs_root);
+		debugfs_remove(fsl_debugfs_root);
+	}
+#endif
 
 	/* Free allocated memory */
 	if (g_iram_size)
 		iram_free(g_iram_base, IRAM_PPH_NTD * g_iram_size);
 	kfree(udc_controller->status_req->req.buf);
-	kfree(udc_controller->status_req);
+	fsl_free_request(NULL, &udc_controller->status_req->req);
 	kfree(udc_controller->data_req->req.buf);
-	kfree(udc_controller->data_req);
+	fsl_free_request(NULL, &udc_controller->data_req->req);
 	kfree(udc_controller->eps);
 #ifdef POSTPONE_FREE_LAST_DTD
 	if (last_free_td != NULL)
-		dma_pool_free(udc_controller->td_pool, last_free_td,
-				last_free_td->td_dma);
+		fsl_free_dtd(udc_controller, last_free_td);
 #endif
 	dma_pool_destroy(udc_controller->td_pool);
 	free_irq(udc_controller->irq, udc_controller);
@@ -3258,8 +3607,16 @@ static struct platform_driver udc_driver = {
 
 static int __init udc_init(void)
 {
+	int ret;
+
 	printk(KERN_INFO "%s (%s)\n", driver_desc, DRIVER_VERSION);
-	return platform_driver_register(&udc_driver);
+	fsl_req_cache = KMEM_CACHE(fsl_req, 0);
+	if (!fsl_req_cache)
+		return -ENOMEM;
+	ret = platform_driver_register(&udc_driver);
+	if (ret)
+		kmem_cache_destroy(fsl_req_cache);
+	return ret;
 }
 #ifdef CONFIG_MXS_VBUS_CURRENT_DRAW
 	fs_initcall(udc_init);
@@ -3269,6 +3626,7 @@ static int __init udc_init(void)
 static void __exit udc_exit(void)
 {
 	platform_driver_unregister(&udc_driver);
+	kmem_cache_destroy(fsl_req_cache);
 	printk(KERN_INFO "%s unregistered \n", driver_desc);
 }
 
@@ -570,6 +570,9 @@ struct fsl_ep {
 
 	char name[14];
 	unsigned stopped:1;
+
+	/* batched completions, see ep_batch.h */
+	void (*complete_list)(struct usb_ep *ep, struct list_head *done);
 };
 
 #define EP_DIR_IN	1
@@ -624,6 +627,22 @@ struct fsl_udc {
 	u32 iram_buffer[IRAM_PPH_NTD];
 	void *iram_buffer_v[IRAM_PPH_NTD];
 	struct work_struct 		usb_gadget_work;
+
+	/* PM QoS and cpufreq boost while traffic flows */
+	struct timer_list boost_timer;
+	struct work_struct boost_work;
+	struct pm_qos_request_list *boost_qos;
+	struct notifier_block boost_nb;	/* cpufreq policy notifier */
+	u32 boost_bytes;		/* moved in the current window */
+	unsigned long boost_busy;	/* jiffies at the last busy window */
+	/* not bitfields:  written from the timer and the work */
+	bool boost_active;		/* wanted, per the timer */
+	bool boost_applied;		/* in effect, per the work */
+	u32 boost_threshold;		/* bytes per window; 0 = off */
+	u32 boost_window_ms;
+	u32 boost_idle_ms;
+	u32 boost_latency_us;		/* PM_QOS_CPU_DMA_LATENCY */
+	u32 boost_min_khz;		/* cpufreq floor; 0 = top speed */
 };
 
 /*-------------------------------------------------------------------------*/
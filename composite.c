@@ -27,6 +27,11 @@
 
 #include <linux/usb/composite.h>
 
+#include "gadgetmon.h"
+#ifdef CONFIG_USB_GADGETMON
+#include "gadgetmon.c"
+#endif
+
 
 /*
  * The code in this file is utility code, used to build a gadget driver
@@ -957,6 +962,7 @@ composite_unbind(struct usb_gadget *gadget)
 	kfree(cdev);
 	set_gadget_data(gadget, NULL);
 	device_remove_file(&gadget->dev, &dev_attr_suspended);
+	gadgetmon_detach(gadget);
 	composite = NULL;
 }
 
@@ -996,6 +1002,9 @@ static int composite_bind(struct usb_gadget *gadget)
 	set_gadget_data(gadget, cdev);
 	INIT_LIST_HEAD(&cdev->configs);
 
+	/* before anyone can submit requests */
+	gadgetmon_attach(gadget);
+
 	/* preallocate control response and buffer */
 	cdev->req = usb_ep_alloc_request(gadget->ep0, GFP_KERNEL);
 	if (!cdev->req)
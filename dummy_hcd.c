@@ -48,6 +48,16 @@
 #include <linux/usb.h>
 #include <linux/usb/gadget.h>
 #include <linux/usb/hcd.h>
+#include <linux/ctype.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/kthread.h>
+#include <linux/hrtimer.h>
+#include <linux/uaccess.h>
+#include <linux/workqueue.h>
+#include <linux/cpumask.h>
+
+#include "ep_batch.h"
 
 #include <asm/byteorder.h>
 #include <asm/io.h>
@@ -70,6 +80,17 @@ MODULE_DESCRIPTION (DRIVER_DESC);
 MODULE_AUTHOR ("David Brownell");
 MODULE_LICENSE ("GPL");
 
+/* By default one timer, under one lock, moves every transfer; that
+ * serializes gadget drivers that could otherwise use several cores.
+ * With "parallel" set, each enabled bulk endpoint gets its own URB
+ * queue, lock, and worker bound to a CPU, driven by enqueue/queue events
+ * instead of the 1 msec frame timer.  Control, interrupt and iso traffic
+ * still goes through the timer.
+ */
+static int parallel;
+module_param (parallel, bool, S_IRUGO);
+MODULE_PARM_DESC (parallel, "process bulk endpoints concurrently, one worker each");
+
 /*-------------------------------------------------------------------------*/
 
 /* gadget side driver data structres */
@@ -83,6 +104,18 @@ struct dummy_ep {
 	unsigned			wedged : 1;
 	unsigned			already_seen : 1;
 	unsigned			setup_stage : 1;
+
+	/* batched completions, see ep_batch.h */
+	struct list_head		done;
+	void				(*complete_list)(struct usb_ep *,
+						struct list_head *);
+
+	/* "parallel" mode:  bulk URBs for this endpoint, its worker */
+	unsigned			lane : 1;
+	spinlock_t			lock;
+	struct list_head		urbp_list;
+	struct work_struct		work;
+	int				cpu;
 };
 
 struct dummy_request {
@@ -182,6 +215,12 @@ struct dummy {
 
 	struct usb_device		*udev;
 	struct list_head		urbp_list;
+	struct workqueue_struct		*wq;		/* "parallel" only */
+
+#ifdef CONFIG_USB_GADGET_DEBUG_FS
+	struct dentry			*debugfs_root;
+	struct dummy_replay		*replay;
+#endif
 };
 
 static inline struct dummy *hcd_to_dummy (struct usb_hcd *hcd)
@@ -225,9 +264,102 @@ static struct dummy			*the_controller;
 
 /* SLAVE/GADGET SIDE UTILITY ROUTINES */
 
-/* called with spinlock held */
+/* lanes (bulk endpoints in "parallel" mode) guard their request and URB
+ * queues with their own lock, nested inside dum->lock when both are held.
+ * everything else is guarded by dum->lock.  ep->lane itself only changes
+ * with both locks held, so either one keeps it stable.
+ */
+
+/* caller holds dum->lock */
+static inline spinlock_t *ep_lock (struct dummy *dum, struct dummy_ep *ep)
+{
+	return ep->lane ? &ep->lock : &dum->lock;
+}
+
+/* take whichever lock guards ep's queues; irqs must be off */
+static spinlock_t *ep_lock_queue (struct dummy *dum, struct dummy_ep *ep)
+{
+	spin_lock (&dum->lock);
+	if (!ep->lane)
+		return &dum->lock;
+	spin_lock (&ep->lock);
+	spin_unlock (&dum->lock);
+	return &ep->lock;
+}
+
+/* wake an endpoint's worker; it runs until the lane NAKs */
+static void ep_kick (struct dummy *dum, struct dummy_ep *ep)
+{
+	if (!dum->wq)
+		return;
+	if (cpu_online (ep->cpu))
+		queue_work_on (ep->cpu, dum->wq, &ep->work);
+	else
+		queue_work (dum->wq, &ep->work);
+}
+
+static void kick_lanes (struct dummy *dum)
+{
+	int		i;
+
+	for (i = 1; i < DUMMY_ENDPOINTS; i++) {
+		if (!list_empty (&dum->ep [i].urbp_list))
+			ep_kick (dum, &dum->ep [i]);
+	}
+}
+
+/* hand over the requests retired by this pass of the timer or a lane
+ * worker, with one callback when the gadget driver asked for that.
+ * called with the endpoint's lock held; it's dropped around callbacks.
+ */
+static void flush_done (struct dummy_ep *ep, spinlock_t *lock)
+{
+	void			(*complete_list)(struct usb_ep *,
+					struct list_head *);
+	struct usb_request	*req, *tmp;
+	LIST_HEAD(done);
+
+	if (list_empty (&ep->done))
+		return;
+	list_splice_init (&ep->done, &done);
+	complete_list = ep->complete_list;
+
+	spin_unlock (lock);
+	if (complete_list)
+		complete_list (&ep->ep, &done);
+	else {
+		list_for_each_entry_safe (req, tmp, &done, list) {
+			list_del_init (&req->list);
+			req->complete (&ep->ep, req);
+		}
+	}
+	spin_lock (lock);
+}
+
+/* called with dum->lock held */
 static void nuke (struct dummy *dum, struct dummy_ep *ep)
 {
+	spinlock_t		*lock = ep_lock (dum, ep);
+
+	if (lock != &dum->lock)
+		spin_lock (lock);
+
+	/* requests retired before this keep their status */
+	while (!list_empty (&ep->done)) {
+		struct usb_request	*req;
+
+		req = list_entry (ep->done.next, struct usb_request, list);
+		list_del_init (&req->list);
+
+		if (lock != &dum->lock)
+			spin_unlock (lock);
+		spin_unlock (&dum->lock);
+		req->complete (&ep->ep, req);
+		spin_lock (&dum->lock);
+		if (lock != &dum->lock)
+			spin_lock (lock);
+	}
+
 	while (!list_empty (&ep->queue)) {
 		struct dummy_request	*req;
 
@@ -235,10 +367,16 @@ static void nuke (struct dummy *dum, struct dummy_ep *ep)
 		list_del_init (&req->queue);
 		req->req.status = -ESHUTDOWN;
 
+		if (lock != &dum->lock)
+			spin_unlock (lock);
 		spin_unlock (&dum->lock);
 		req->req.complete (&ep->ep, &req->req);
 		spin_lock (&dum->lock);
+		if (lock != &dum->lock)
+			spin_lock (lock);
 	}
+	if (lock != &dum->lock)
+		spin_unlock (lock);
 }
 
 /* caller must hold lock */
@@ -333,7 +471,10 @@ dummy_enable (struct usb_ep *_ep, const struct usb_endpoint_descriptor *desc)
 {
 	struct dummy		*dum;
 	struct dummy_ep		*ep;
+	struct urbp		*urbp, *tmp;
 	unsigned		max;
+	unsigned long		flags;
+	int			lane;
 	int			retval;
 
 	ep = usb_ep_to_dummy_ep (_ep);
@@ -417,7 +558,36 @@ dummy_enable (struct usb_ep *_ep, const struct usb_endpoint_descriptor *desc)
 	}
 
 	_ep->maxpacket = max;
+	lane = dum->wq && (desc->bmAttributes & 0x03)
+				== USB_ENDPOINT_XFER_BULK;
+
+	/* URBs submitted while this was no lane are on the timer's list;
+	 * the worker takes them over, so the timer never touches a lane
+	 */
+	spin_lock_irqsave (&dum->lock, flags);
+	spin_lock (&ep->lock);
 	ep->desc = desc;
+	ep->lane = lane;
+	if (lane) {
+		list_for_each_entry_safe (urbp, tmp, &dum->urbp_list,
+				urbp_list) {
+			struct urb	*urb = urbp->urb;
+			u8		address;
+
+			if (usb_pipetype (urb->pipe) != PIPE_BULK)
+				continue;
+			address = usb_pipeendpoint (urb->pipe);
+			if (usb_pipein (urb->pipe))
+				address |= USB_DIR_IN;
+			if (address == desc->bEndpointAddress)
+				list_move_tail (&urbp->urbp_list,
+						&ep->urbp_list);
+		}
+	}
+	spin_unlock (&ep->lock);
+	spin_unlock_irqrestore (&dum->lock, flags);
+	if (lane && !list_empty (&ep->urbp_list))
+		ep_kick (dum, ep);
 
 	dev_dbg (udc_dev(dum), "enabled %s (ep%d%s-%s) maxpacket %d\n",
 		_ep->name,
@@ -455,14 +625,25 @@ static int dummy_disable (struct usb_ep *_ep)
 
 	spin_lock_irqsave (&dum->lock, flags);
 	ep->desc = NULL;
+	ep->complete_list = NULL;
 	retval = 0;
 	nuke (dum, ep);
+	spin_lock (&ep->lock);
+	ep->lane = 0;
+	spin_unlock (&ep->lock);
 	spin_unlock_irqrestore (&dum->lock, flags);
 
+	/* fail any URBs still waiting on the lane */
+	if (!list_empty (&ep->urbp_list))
+		ep_kick (dum, ep);
+
 	dev_dbg (udc_dev(dum), "disabled %s\n", _ep->name);
 	return retval;
 }
 
+/* requests get their own slab, so they show up in /proc/slabinfo */
+static struct kmem_cache *dummy_req_cache;
+
 static struct usb_request *
 dummy_alloc_request (struct usb_ep *_ep, gfp_t mem_flags)
 {
@@ -473,7 +654,7 @@ dummy_alloc_request (struct usb_ep *_ep, gfp_t mem_flags)
 		return NULL;
 	ep = usb_ep_to_dummy_ep (_ep);
 
-	req = kzalloc(sizeof(*req), mem_flags);
+	req = kmem_cache_zalloc (dummy_req_cache, mem_flags);
 	if (!req)
 		return NULL;
 	INIT_LIST_HEAD (&req->queue);
@@ -492,7 +673,7 @@ dummy_free_request (struct usb_ep *_ep, struct usb_request *_req)
 
 	req = usb_request_to_dummy_request (_req);
 	WARN_ON (!list_empty (&req->queue));
-	kfree (req);
+	kmem_cache_free (dummy_req_cache, req);
 }
 
 static void
@@ -507,6 +688,7 @@ dummy_queue (struct usb_ep *_ep, struct usb_request *_req,
 	struct dummy_ep		*ep;
 	struct dummy_request	*req;
 	struct dummy		*dum;
+	spinlock_t		*lock;
 	unsigned long		flags;
 
 	req = usb_request_to_dummy_request (_req);
@@ -528,7 +710,16 @@ dummy_queue (struct usb_ep *_ep, struct usb_request *_req,
 
 	_req->status = -EINPROGRESS;
 	_req->actual = 0;
-	spin_lock_irqsave (&dum->lock, flags);
+
+	/* lanes skip the FIFO emulation, its buffer is shared */
+	local_irq_save (flags);
+	lock = ep_lock_queue (dum, ep);
+	if (lock == &ep->lock) {
+		list_add_tail (&req->queue, &ep->queue);
+		spin_unlock_irqrestore (lock, flags);
+		ep_kick (dum, ep);
+		return 0;
+	}
 
 	/* implement an emulated single-request FIFO */
 	if (ep->desc && (ep->desc->bEndpointAddress & USB_DIR_IN) &&
@@ -558,6 +749,72 @@ dummy_queue (struct usb_ep *_ep, struct usb_request *_req,
 	return 0;
 }
 
+static int
+dummy_queue_list (struct usb_ep *_ep, struct list_head *reqs,
+		gfp_t mem_flags)
+{
+	struct dummy_ep		*ep;
+	struct dummy		*dum;
+	struct usb_request	*_req, *tmp;
+	spinlock_t		*lock;
+	unsigned long		flags;
+
+	ep = usb_ep_to_dummy_ep (_ep);
+	if (!_ep || (!ep->desc && _ep->name != ep0name))
+		return -EINVAL;
+
+	dum = ep_to_dummy (ep);
+	if (!dum->driver || !is_enabled (dum))
+		return -ESHUTDOWN;
+
+	list_for_each_entry (_req, reqs, list) {
+		struct dummy_request	*req;
+
+		req = usb_request_to_dummy_request (_req);
+		if (!list_empty (&req->queue) || !_req->complete)
+			return -EINVAL;
+	}
+
+	/* one trip through the lock for the whole batch; like the lanes,
+	 * this skips the single-request FIFO emulation
+	 */
+	local_irq_save (flags);
+	lock = ep_lock_queue (dum, ep);
+	list_for_each_entry_safe (_req, tmp, reqs, list) {
+		list_del_init (&_req->list);
+		_req->status = -EINPROGRESS;
+		_req->actual = 0;
+		list_add_tail (&usb_request_to_dummy_request (_req)->queue,
+				&ep->queue);
+	}
+	spin_unlock_irqrestore (lock, flags);
+
+	if (lock == &ep->lock)
+		ep_kick (dum, ep);
+	return 0;
+}
+
+static int
+dummy_set_complete_list (struct usb_ep *_ep,
+		void (*complete_list)(struct usb_ep *, struct list_head *))
+{
+	struct dummy_ep		*ep;
+	struct dummy		*dum;
+	spinlock_t		*lock;
+	unsigned long		flags;
+
+	ep = usb_ep_to_dummy_ep (_ep);
+	if (!_ep || !ep->desc || _ep->name == ep0name)
+		return -EINVAL;
+	dum = ep_to_dummy (ep);
+
+	local_irq_save (flags);
+	lock = ep_lock_queue (dum, ep);
+	ep->complete_list = complete_list;
+	spin_unlock_irqrestore (lock, flags);
+	return 0;
+}
+
 static int dummy_dequeue (struct usb_ep *_ep, struct usb_request *_req)
 {
 	struct dummy_ep		*ep;
@@ -565,6 +822,7 @@ static int dummy_dequeue (struct usb_ep *_ep, struct usb_request *_req)
 	int			retval = -EINVAL;
 	unsigned long		flags;
 	struct dummy_request	*req = NULL;
+	spinlock_t		*lock;
 
 	if (!_ep || !_req)
 		return retval;
@@ -575,7 +833,7 @@ static int dummy_dequeue (struct usb_ep *_ep, struct usb_request *_req)
 		return -ESHUTDOWN;
 
 	local_irq_save (flags);
-	spin_lock (&dum->lock);
+	lock = ep_lock_queue (dum, ep);
 	list_for_each_entry (req, &ep->queue, queue) {
 		if (&req->req == _req) {
 			list_del_init (&req->queue);
@@ -584,7 +842,7 @@ static int dummy_dequeue (struct usb_ep *_ep, struct usb_request *_req)
 			break;
 		}
 	}
-	spin_unlock (&dum->lock);
+	spin_unlock (lock);
 
 	if (retval == 0) {
 		dev_dbg (udc_dev(dum),
@@ -601,6 +859,9 @@ dummy_set_halt_and_wedge(struct usb_ep *_ep, int value, int wedged)
 {
 	struct dummy_ep		*ep;
 	struct dummy		*dum;
+	spinlock_t		*lock;
+	unsigned long		flags;
+	int			retval = 0;
 
 	if (!_ep)
 		return -EINVAL;
@@ -608,18 +869,25 @@ dummy_set_halt_and_wedge(struct usb_ep *_ep, int value, int wedged)
 	dum = ep_to_dummy (ep);
 	if (!dum->driver)
 		return -ESHUTDOWN;
+
+	/* lane workers test ep->halted concurrently */
+	local_irq_save (flags);
+	lock = ep_lock_queue (dum, ep);
 	if (!value)
 		ep->halted = ep->wedged = 0;
 	else if (ep->desc && (ep->desc->bEndpointAddress & USB_DIR_IN) &&
 			!list_empty (&ep->queue))
-		return -EAGAIN;
+		retval = -EAGAIN;
 	else {
 		ep->halted = 1;
 		if (wedged)
 			ep->wedged = 1;
 	}
+	spin_unlock_irqrestore (lock, flags);
+	if (lock == &ep->lock && !value)
+		ep_kick (dum, ep);
 	/* FIXME clear emulated data toggle too */
-	return 0;
+	return retval;
 }
 
 static int
@@ -635,18 +903,22 @@ static int dummy_set_wedge(struct usb_ep *_ep)
 	return dummy_set_halt_and_wedge(_ep, 1, 1);
 }
 
-static const struct usb_ep_ops dummy_ep_ops = {
-	.enable		= dummy_enable,
-	.disable	= dummy_disable,
+static const struct usb_ep_batch_ops dummy_ep_ops = {
+	.ops = {
+		.enable		= dummy_enable,
+		.disable	= dummy_disable,
 
-	.alloc_request	= dummy_alloc_request,
-	.free_request	= dummy_free_request,
+		.alloc_request	= dummy_alloc_request,
+		.free_request	= dummy_free_request,
 
-	.queue		= dummy_queue,
-	.dequeue	= dummy_dequeue,
+		.queue		= dummy_queue,
+		.dequeue	= dummy_dequeue,
 
-	.set_halt	= dummy_set_halt,
-	.set_wedge	= dummy_set_wedge,
+		.set_halt	= dummy_set_halt,
+		.set_wedge	= dummy_set_wedge,
+	},
+	.queue_list		= dummy_queue_list,
+	.set_complete_list	= dummy_set_complete_list,
 };
 
 /*-------------------------------------------------------------------------*/
@@ -775,15 +1047,17 @@ usb_gadget_register_driver (struct usb_gadget_driver *driver)
 		if (!ep_name [i])
 			break;
 		ep->ep.name = ep_name [i];
-		ep->ep.ops = &dummy_ep_ops;
+		ep->ep.ops = &dummy_ep_ops.ops;
 		list_add_tail (&ep->ep.ep_list, &dum->gadget.ep_list);
 		ep->halted = ep->wedged = ep->already_seen =
-				ep->setup_stage = 0;
+				ep->setup_stage = ep->lane = 0;
 		ep->ep.maxpacket = ~0;
 		ep->last_io = jiffies;
 		ep->gadget = &dum->gadget;
 		ep->desc = NULL;
 		INIT_LIST_HEAD (&ep->queue);
+		INIT_LIST_HEAD (&ep->done);
+		ep->complete_list = NULL;
 	}
 
 	dum->gadget.ep0 = &dum->ep [0].ep;
@@ -986,6 +1260,26 @@ static int dummy_urb_enqueue (
 		goto done;
 	}
 
+	urb->hcpriv = urbp;
+
+	/* bulk endpoints with their own worker bypass the timer */
+	if (dum->wq && usb_pipetype (urb->pipe) == PIPE_BULK) {
+		struct dummy_ep	*ep;
+		u8		address;
+
+		address = usb_pipeendpoint (urb->pipe);
+		if (usb_pipein (urb->pipe))
+			address |= USB_DIR_IN;
+		ep = find_endpoint (dum, address);
+		if (ep && ep->lane) {
+			spin_lock (&ep->lock);
+			list_add_tail (&urbp->urbp_list, &ep->urbp_list);
+			spin_unlock (&ep->lock);
+			ep_kick (dum, ep);
+			goto done;
+		}
+	}
+
 	if (!dum->udev) {
 		dum->udev = urb->dev;
 		usb_get_dev (dum->udev);
@@ -993,7 +1287,6 @@ static int dummy_urb_enqueue (
 		dev_err (dummy_dev(dum), "usb_device address has changed!\n");
 
 	list_add_tail (&urbp->urbp_list, &dum->urbp_list);
-	urb->hcpriv = urbp;
 	if (usb_pipetype (urb->pipe) == PIPE_CONTROL)
 		urb->error_count = 1;		/* mark as a new urb */
 
@@ -1023,13 +1316,19 @@ static int dummy_urb_dequeue(struct usb_hcd *hcd, struct urb *urb, int status)
 		mod_timer (&dum->timer, jiffies);
 
 	spin_unlock_irqrestore (&dum->lock, flags);
+
+	/* the URB may be on a lane; those only run when kicked */
+	if (!rc && dum->wq)
+		kick_lanes (dum);
 	return rc;
 }
 
-/* transfer up to a frame's worth; caller must own lock */
+/* transfer up to a frame's worth; caller must own lock, which is
+ * dropped around gadget side completions
+ */
 static int
 transfer(struct dummy *dum, struct urb *urb, struct dummy_ep *ep, int limit,
-		int *status)
+		int *status, spinlock_t *lock)
 {
 	struct dummy_request	*req;
 
@@ -1127,9 +1426,14 @@ top:
 		if (req->req.status != -EINPROGRESS) {
 			list_del_init (&req->queue);
 
-			spin_unlock (&dum->lock);
-			req->req.complete (&ep->ep, &req->req);
-			spin_lock (&dum->lock);
+			/* batched completions wait for the end of the pass */
+			if (ep->complete_list)
+				list_add_tail (&req->req.list, &ep->done);
+			else {
+				spin_unlock (lock);
+				req->req.complete (&ep->ep, &req->req);
+				spin_lock (lock);
+			}
 
 			/* requests might have been unlinked... */
 			rescan = 1;
@@ -1368,7 +1672,11 @@ restart:
 						value = -EOPNOTSUPP;
 						break;
 					}
+					if (ep2->lane)
+						spin_lock (&ep2->lock);
 					ep2->halted = 1;
+					if (ep2->lane)
+						spin_unlock (&ep2->lock);
 					value = 0;
 					status = 0;
 				}
@@ -1393,8 +1701,14 @@ restart:
 						value = -EOPNOTSUPP;
 						break;
 					}
+					if (ep2->lane)
+						spin_lock (&ep2->lock);
 					if (!ep2->wedged)
 						ep2->halted = 0;
+					if (ep2->lane) {
+						spin_unlock (&ep2->lock);
+						ep_kick (dum, ep2);
+					}
 					value = 0;
 					status = 0;
 				}
@@ -1491,7 +1805,8 @@ restart:
 		default:
 		treat_control_like_bulk:
 			ep->last_io = jiffies;
-			total = transfer(dum, urb, ep, limit, &status);
+			total = transfer(dum, urb, ep, limit, &status,
+					&dum->lock);
 			break;
 		}
 
@@ -1513,6 +1828,12 @@ return_urb:
 		goto restart;
 	}
 
+	/* lanes flush their own */
+	for (i = 1; i < DUMMY_ENDPOINTS; i++) {
+		if (!dum->ep [i].lane)
+			flush_done (&dum->ep [i], &dum->lock);
+	}
+
 	if (list_empty (&dum->urbp_list)) {
 		usb_put_dev (dum->udev);
 		dum->udev = NULL;
@@ -1524,6 +1845,62 @@ return_urb:
 	spin_unlock_irqrestore (&dum->lock, flags);
 }
 
+/* "parallel" mode:  drive one bulk endpoint's URBs, much like the timer
+ * does for everything else, but only under that endpoint's lock.  There's
+ * no per-frame bandwidth model; each URB moves as much data as the gadget
+ * has queued.  The worker stops when the lane NAKs, and is kicked again by
+ * URB submission or unlinking, usb_ep_queue(), halt changes, and resume.
+ */
+static void dummy_ep_work (struct work_struct *work)
+{
+	struct dummy_ep		*ep = container_of (work, struct dummy_ep, work);
+	struct dummy		*dum = ep_to_dummy (ep);
+	struct usb_hcd		*hcd = dummy_to_hcd (dum);
+	unsigned long		flags;
+
+	spin_lock_irqsave (&ep->lock, flags);
+	while (!list_empty (&ep->urbp_list)) {
+		struct urbp	*urbp;
+		struct urb	*urb;
+		u8		address;
+		int		status = -EINPROGRESS;
+
+		urbp = list_entry (ep->urbp_list.next, struct urbp, urbp_list);
+		urb = urbp->urb;
+		address = usb_pipeendpoint (urb->pipe);
+		if (usb_pipein (urb->pipe))
+			address |= USB_DIR_IN;
+
+		/* port and root hub state are sampled without dum->lock;
+		 * a stale view just costs one more pass
+		 */
+		if (urb->unlinked)
+			status = urb->unlinked;
+		else if (dum->rh_state != DUMMY_RH_RUNNING)
+			break;
+		else if (!ep->lane || find_endpoint (dum, address) != ep)
+			status = -EPROTO;
+		else if (ep->halted)
+			status = -EPIPE;
+		else
+			transfer (dum, urb, ep, INT_MAX, &status, &ep->lock);
+
+		/* NAKing; usb_ep_queue() will kick us again */
+		if (status == -EINPROGRESS)
+			break;
+
+		list_del (&urbp->urbp_list);
+		kfree (urbp);
+
+		usb_hcd_unlink_urb_from_ep (hcd, urb);
+		spin_unlock (&ep->lock);
+		usb_hcd_giveback_urb (hcd, urb, status);
+		spin_lock (&ep->lock);
+	}
+	flush_done (ep, &ep->lock);
+	spin_unlock_irqrestore (&ep->lock, flags);
+}
+
 /*-------------------------------------------------------------------------*/
 
 #define PORT_C_MASK \
@@ -1749,11 +2126,643 @@ static int dummy_bus_resume (struct usb_hcd *hcd)
 		hcd->state = HC_STATE_RUNNING;
 	}
 	spin_unlock_irq (&dum->lock);
+	if (!rc && dum->wq)
+		kick_lanes (dum);
 	return rc;
 }
 
 /*-------------------------------------------------------------------------*/
 
+#ifdef CONFIG_USB_GADGET_DEBUG_FS
+
+/*
+ * usbmon trace replay
+ *
+ * Write a usbmon text trace ("cat /sys/kernel/debug/usb/usbmon/Nu") into
+ * debugfs dummy_hcd/replay_trace; only submissions ('S' lines) for the
+ * first device other than a root hub are kept.  Then write "start" to
+ * dummy_hcd/replay, optionally followed by a time scale in percent (100
+ * is the captured timing, 50 twice as fast, 0 back-to-back).  The same
+ * transfers are resubmitted to whatever gadget is enumerated right now,
+ * at the same relative times, and reading dummy_hcd/replay reports how
+ * long the gadget took to complete them, per endpoint.
+ *
+ * Limitations:  usbmon text only captures 32 data bytes, so longer OUT
+ * payloads are zero padded; isochronous transfers are skipped; and so
+ * are SET_ADDRESS and SET_CONFIGURATION, since usbcore owns those.
+ * SET_INTERFACE goes through usb_set_interface() so usbcore stays in
+ * sync with the gadget.
+ */
+
+#define REPLAY_DATA_MAX		32
+#define REPLAY_MAX_EVENTS	(256 * 1024)
+#define REPLAY_LINE_MAX		256
+
+struct replay_event {
+	u32			usec;		/* usbmon timestamp */
+	u8			type;		/* PIPE_* */
+	u8			ep;		/* number, USB_DIR_IN */
+	u8			data_len;	/* captured OUT bytes */
+	u32			length;
+	struct usb_ctrlrequest	setup;
+	u8			data [REPLAY_DATA_MAX];
+};
+
+struct replay_stats {
+	unsigned long		submitted;
+	unsigned long		completed;
+	unsigned long		errors;
+	u64			bytes;
+	s64			lat_min;	/* all in ns */
+	s64			lat_max;
+	s64			lat_sum;
+};
+
+struct dummy_replay {
+	struct mutex		lock;		/* events, thread, line */
+	struct replay_event	*events;
+	unsigned		count;
+	unsigned		size;
+	unsigned		skipped;
+	int			devnum;		/* filter, from the trace */
+	char			line [REPLAY_LINE_MAX];
+	unsigned		line_len;
+
+	struct task_struct	*thread;
+	unsigned		scale;
+	int			status;
+	unsigned		done:1;
+	struct usb_anchor	anchor;
+
+	spinlock_t		stats_lock;
+	/* index: endpoint number, plus 16 for IN */
+	struct replay_stats	stats [32];
+	s64			max_lag;
+	ktime_t			started;
+	ktime_t			finished;
+};
+
+struct replay_urb {
+	struct dummy_replay	*replay;
+	ktime_t			submitted;
+	unsigned		slot;
+};
+
+static inline unsigned replay_slot (u8 ep)
+{
+	return (ep & USB_ENDPOINT_NUMBER_MASK) + ((ep & USB_DIR_IN) ? 16 : 0);
+}
+
+/* parse one usbmon text line; returns 1 if an event was added */
+static int replay_parse (struct dummy_replay *r, char *line)
+{
+	struct replay_event	ev;
+	unsigned		usec, bus, devnum, epnum, len;
+	char			event, type, dir;
+	int			pos = 0;
+	char			*p;
+
+	if (sscanf (line, "%*s %u %c %c%c:%u:%u:%u %n", &usec, &event,
+			&type, &dir, &bus, &devnum, &epnum, &pos) != 7
+			|| !pos || event != 'S')
+		return 0;
+
+	/* device 1 is the root hub; stick to one device after that */
+	if (devnum == 1)
+		return 0;
+	if (r->devnum < 0)
+		r->devnum = devnum;
+	else if (devnum != r->devnum)
+		return 0;
+
+	memset (&ev, 0, sizeof ev);
+	ev.usec = usec;
+	ev.ep = (epnum & USB_ENDPOINT_NUMBER_MASK)
+			| (dir == 'i' ? USB_DIR_IN : 0);
+	switch (type) {
+	case 'C':	ev.type = PIPE_CONTROL; break;
+	case 'B':	ev.type = PIPE_BULK; break;
+	case 'I':	ev.type = PIPE_INTERRUPT; break;
+	default:
+		r->skipped++;
+		return 0;
+	}
+
+	p = line + pos;
+	pos = 0;
+	if (*p == 's') {
+		unsigned	bRequestType, bRequest;
+		unsigned	wValue, wIndex, wLength;
+
+		if (sscanf (p, "s %x %x %x %x %x %n", &bRequestType,
+				&bRequest, &wValue, &wIndex, &wLength,
+				&pos) != 5)
+			return 0;
+		ev.setup.bRequestType = bRequestType;
+		ev.setup.bRequest = bRequest;
+		ev.setup.wValue = cpu_to_le16 (wValue);
+		ev.setup.wIndex = cpu_to_le16 (wIndex);
+		ev.setup.wLength = cpu_to_le16 (wLength);
+		ev.ep = bRequestType & USB_DIR_IN;
+
+		if (bRequestType == USB_RECIP_DEVICE
+				&& (bRequest == USB_REQ_SET_ADDRESS
+				|| bRequest == USB_REQ_SET_CONFIGURATION)) {
+			r->skipped++;
+			return 0;
+		}
+	} else if (sscanf (p, "%*d %n", &pos) != 0 || !pos)
+		return 0;
+	p += pos;
+
+	pos = 0;
+	if (sscanf (p, "%u %n", &len, &pos) != 1)
+		return 0;
+	ev.length = len;
+	p += pos;
+
+	/* "= 55534243 01000000 ..." carries the first bytes of OUT data */
+	if (*p == '=' && !(ev.ep & USB_DIR_IN)) {
+		p++;
+		while (ev.data_len < min_t (u32, len, REPLAY_DATA_MAX)) {
+			unsigned	byte;
+
+			while (*p == ' ')
+				p++;
+			if (!isxdigit (p [0]) || !isxdigit (p [1])
+					|| sscanf (p, "%2x", &byte) != 1)
+				break;
+			ev.data [ev.data_len++] = byte;
+			p += 2;
+		}
+	}
+
+	if (r->count == r->size) {
+		struct replay_event	*events;
+		unsigned		size = r->size ? 2 * r->size : 1024;
+
+		if (size > REPLAY_MAX_EVENTS)
+			return -ENOSPC;
+		events = krealloc (r->events, size * sizeof *events,
+				GFP_KERNEL);
+		if (!events)
+			return -ENOMEM;
+		r->events = events;
+		r->size = size;
+	}
+	r->events [r->count++] = ev;
+	return 1;
+}
+
+static void replay_complete (struct urb *urb)
+{
+	struct replay_urb	*ctx = urb->context;
+	struct dummy_replay	*r = ctx->replay;
+	struct replay_stats	*s = &r->stats [ctx->slot];
+	s64			ns;
+	unsigned long		flags;
+
+	ns = ktime_to_ns (ktime_sub (ktime_get (), ctx->submitted));
+
+	spin_lock_irqsave (&r->stats_lock, flags);
+	if (urb->status) {
+		s->errors++;
+	} else {
+		if (!s->completed || ns < s->lat_min)
+			s->lat_min = ns;
+		if (ns > s->lat_max)
+			s->lat_max = ns;
+		s->lat_sum += ns;
+		s->completed++;
+		s->bytes += urb->actual_length;
+	}
+	spin_unlock_irqrestore (&r->stats_lock, flags);
+
+	kfree (urb->setup_packet);
+	kfree (ctx);
+}
+
+static void replay_submit (struct dummy_replay *r, struct usb_device *udev,
+		struct replay_event *ev)
+{
+	struct replay_stats	*s = &r->stats [replay_slot (ev->ep)];
+	struct replay_urb	*ctx;
+	struct urb		*urb;
+	u8			*buf = NULL;
+	unsigned		pipe;
+	int			status = -ENOMEM;
+
+	/* usbcore must see altsetting changes */
+	if (ev->type == PIPE_CONTROL
+			&& ev->setup.bRequestType == USB_RECIP_INTERFACE
+			&& ev->setup.bRequest == USB_REQ_SET_INTERFACE) {
+		ktime_t		t0 = ktime_get ();
+		s64		ns;
+
+		status = usb_set_interface (udev,
+				le16_to_cpu (ev->setup.wIndex),
+				le16_to_cpu (ev->setup.wValue));
+		ns = ktime_to_ns (ktime_sub (ktime_get (), t0));
+
+		spin_lock_irq (&r->stats_lock);
+		s->submitted++;
+		if (status) {
+			s->errors++;
+		} else {
+			if (!s->completed || ns < s->lat_min)
+				s->lat_min = ns;
+			if (ns > s->lat_max)
+				s->lat_max = ns;
+			s->lat_sum += ns;
+			s->completed++;
+		}
+		spin_unlock_irq (&r->stats_lock);
+		return;
+	}
+
+	ctx = kmalloc (sizeof *ctx, GFP_KERNEL);
+	urb = usb_alloc_urb (0, GFP_KERNEL);
+	if (ev->length)
+		buf = kzalloc (ev->length, GFP_KERNEL);
+	if (!ctx || !urb || (ev->length && !buf))
+		goto fail;
+	if (buf)
+		memcpy (buf, ev->data, ev->data_len);
+
+	switch (ev->type) {
+	case PIPE_CONTROL: {
+		struct usb_ctrlrequest	*setup;
+
+		setup = kmemdup (&ev->setup, sizeof *setup, GFP_KERNEL);
+		if (!setup)
+			goto fail;
+		pipe = (ev->ep & USB_DIR_IN)
+				? usb_rcvctrlpipe (udev, 0)
+				: usb_sndctrlpipe (udev, 0);
+		usb_fill_control_urb (urb, udev, pipe, (u8 *) setup,
+				buf, ev->length, replay_complete, ctx);
+		break;
+		}
+	case PIPE_BULK:
+		pipe = (ev->ep & USB_DIR_IN)
+				? usb_rcvbulkpipe (udev, ev->ep & 0x0f)
+				: usb_sndbulkpipe (udev, ev->ep & 0x0f);
+		usb_fill_bulk_urb (urb, udev, pipe, buf, ev->length,
+				replay_complete, ctx);
+		break;
+	default: {
+		struct usb_host_endpoint	*hep;
+
+		hep = (ev->ep & USB_DIR_IN)
+				? udev->ep_in [ev->ep & 0x0f]
+				: udev->ep_out [ev->ep & 0x0f];
+		pipe = (ev->ep & USB_DIR_IN)
+				? usb_rcvintpipe (udev, ev->ep & 0x0f)
+				: usb_sndintpipe (udev, ev->ep & 0x0f);
+		usb_fill_int_urb (urb, udev, pipe, buf, ev->length,
+				replay_complete, ctx,
+				hep ? hep->desc.bInterval : 1);
+		break;
+		}
+	}
+	urb->transfer_flags |= URB_FREE_BUFFER;
+	buf = NULL;
+
+	ctx->replay = r;
+	ctx->slot = replay_slot (ev->ep);
+	ctx->submitted = ktime_get ();
+
+	spin_lock_irq (&r->stats_lock);
+	s->submitted++;
+	spin_unlock_irq (&r->stats_lock);
+
+	usb_anchor_urb (urb, &r->anchor);
+	status = usb_submit_urb (urb, GFP_KERNEL);
+	if (status) {
+		usb_unanchor_urb (urb);
+		kfree (urb->setup_packet);
+		spin_lock_irq (&r->stats_lock);
+		s->errors++;
+		spin_unlock_irq (&r->stats_lock);
+	} else
+		ctx = NULL;
+	usb_free_urb (urb);
+	kfree (ctx);
+	return;
+
+fail:
+	spin_lock_irq (&r->stats_lock);
+	s->submitted++;
+	s->errors++;
+	spin_unlock_irq (&r->stats_lock);
+	usb_free_urb (urb);
+	kfree (buf);
+	kfree (ctx);
+}
+
+static int replay_thread (void *_dum)
+{
+	struct dummy		*dum = _dum;
+	struct dummy_replay	*r = dum->replay;
+	struct usb_device	*root_hub, *udev;
+	ktime_t			start;
+	unsigned		i;
+
+	/* dum->udev is only set while URBs are queued; ask the hub */
+	root_hub = dummy_to_hcd (dum)->self.root_hub;
+	usb_lock_device (root_hub);
+	udev = root_hub->children [0];
+	if (udev)
+		usb_get_dev (udev);
+	usb_unlock_device (root_hub);
+
+	if (!udev) {
+		r->status = -ENODEV;
+		goto idle;
+	}
+
+	start = ktime_get ();
+	r->started = start;
+	for (i = 0; i < r->count && !kthread_should_stop (); i++) {
+		struct replay_event	*ev = &r->events [i];
+
+		if (r->scale) {
+			u64	offset;
+			ktime_t	due;
+			s64	lag;
+
+			/* u32 arithmetic copes with timestamp wraparound */
+			offset = (u64) (u32) (ev->usec - r->events [0].usec)
+					* NSEC_PER_USEC * r->scale;
+			due = ktime_add_ns (start, div_u64 (offset, 100));
+
+			set_current_state (TASK_INTERRUPTIBLE);
+			if (!kthread_should_stop ())
+				schedule_hrtimeout (&due, HRTIMER_MODE_ABS);
+			__set_current_state (TASK_RUNNING);
+
+			lag = ktime_to_ns (ktime_sub (ktime_get (), due));
+			if (lag > r->max_lag)
+				r->max_lag = lag;
+		}
+		replay_submit (r, udev, ev);
+	}
+
+	/* give stragglers a moment, then cancel whatever is left */
+	usb_wait_anchor_empty_timeout (&r->anchor, 1000);
+	usb_kill_anchored_urbs (&r->anchor);
+	r->finished = ktime_get ();
+	usb_put_dev (udev);
+
+idle:
+	r->done = 1;
+	while (!kthread_should_stop ()) {
+		set_current_state (TASK_INTERRUPTIBLE);
+		if (!kthread_should_stop ())
+			schedule ();
+		__set_current_state (TASK_RUNNING);
+	}
+	return 0;
+}
+
+/* caller holds r->lock */
+static void replay_stop (struct dummy_replay *r)
+{
+	if (r->thread) {
+		kthread_stop (r->thread);
+		r->thread = NULL;
+	}
+}
+
+static int replay_start (struct dummy *dum, unsigned scale)
+{
+	struct dummy_replay	*r = dum->replay;
+	struct task_struct	*thread;
+
+	replay_stop (r);
+	if (!r->count)
+		return -ENODATA;
+
+	spin_lock_irq (&r->stats_lock);
+	memset (r->stats, 0, sizeof r->stats);
+	r->max_lag = 0;
+	spin_unlock_irq (&r->stats_lock);
+	r->scale = scale;
+	r->status = 0;
+	r->done = 0;
+	r->started = r->finished = ktime_set (0, 0);
+
+	thread = kthread_run (replay_thread, dum, "dummy_replay");
+	if (IS_ERR (thread))
+		return PTR_ERR (thread);
+	r->thread = thread;
+	return 0;
+}
+
+static ssize_t replay_trace_write (struct file *file,
+		const char __user *ubuf, size_t count, loff_t *ppos)
+{
+	struct dummy		*dum = file->private_data;
+	struct dummy_replay	*r = dum->replay;
+	char			*buf;
+	size_t			done = 0;
+	int			status = 0;
+
+	buf = (char *) __get_free_page (GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	mutex_lock (&r->lock);
+	if (r->thread && !r->done) {
+		status = -EBUSY;
+		goto out;
+	}
+
+	while (done < count && status >= 0) {
+		size_t	chunk = min_t (size_t, count - done, PAGE_SIZE);
+		size_t	i;
+
+		if (copy_from_user (buf, ubuf + done, chunk)) {
+			status = -EFAULT;
+			break;
+		}
+
+		/* lines may straddle write() calls */
+		for (i = 0; i < chunk && status >= 0; i++) {
+			if (buf [i] != '\n') {
+				if (r->line_len < REPLAY_LINE_MAX - 1)
+					r->line [r->line_len++] = buf [i];
+				continue;
+			}
+			r->line [r->line_len] = 0;
+			r->line_len = 0;
+			status = replay_parse (r, r->line);
+		}
+		done += chunk;
+	}
+out:
+	mutex_unlock (&r->lock);
+	free_page ((unsigned long) buf);
+	return status < 0 ? status : count;
+}
+
+static int replay_trace_open (struct inode *inode, struct file *file)
+{
+	file->private_data = inode->i_private;
+	return 0;
+}
+
+static const struct file_operations replay_trace_fops = {
+	.owner		= THIS_MODULE,
+	.open		= replay_trace_open,
+	.write		= replay_trace_write,
+};
+
+static int replay_show (struct seq_file *m, void *_d)
+{
+	struct dummy		*dum = m->private;
+	struct dummy_replay	*r = dum->replay;
+	unsigned		i;
+
+	mutex_lock (&r->lock);
+	seq_printf (m, "events %u, skipped %u, device %d\n",
+			r->count, r->skipped, r->devnum);
+	if (!r->thread) {
+		seq_printf (m, "state: idle\n");
+		goto out;
+	}
+	seq_printf (m, "state: %s, scale %u%%, status %d\n",
+			r->done ? "done" : "running", r->scale, r->status);
+	if (r->done && r->status == 0)
+		seq_printf (m, "elapsed %lld us, max lag %lld us\n",
+			ktime_to_us (ktime_sub (r->finished, r->started)),
+			div_s64 (r->max_lag, NSEC_PER_USEC));
+
+	spin_lock_irq (&r->stats_lock);
+	for (i = 0; i < ARRAY_SIZE (r->stats); i++) {
+		struct replay_stats	*s = &r->stats [i];
+
+		if (!s->submitted)
+			continue;
+		seq_printf (m, "ep%u%s: submitted %lu completed %lu "
+				"errors %lu bytes %llu",
+				i & 0x0f, (i & 0x10) ? "in" : "out",
+				s->submitted, s->completed, s->errors,
+				(unsigned long long) s->bytes);
+		if (s->completed)
+			seq_printf (m, " latency us min %lld avg %lld max %lld",
+				div_s64 (s->lat_min, NSEC_PER_USEC),
+				div_s64 (div_s64 (s->lat_sum, s->completed),
+						NSEC_PER_USEC),
+				div_s64 (s->lat_max, NSEC_PER_USEC));
+		seq_printf (m, "\n");
+	}
+	spin_unlock_irq (&r->stats_lock);
+out:
+	mutex_unlock (&r->lock);
+	return 0;
+}
+
+static int replay_open (struct inode *inode, struct file *file)
+{
+	return single_open (file, replay_show, inode->i_private);
+}
+
+/* "start [scale]", "stop", or "clear" */
+static ssize_t replay_write (struct file *file, const char __user *ubuf,
+		size_t count, loff_t *ppos)
+{
+	struct dummy		*dum =
+			((struct seq_file *) file->private_data)->private;
+	struct dummy_replay	*r = dum->replay;
+	char			cmd [32];
+	unsigned		scale = 100;
+	int			status = 0;
+
+	if (count >= sizeof cmd)
+		return -EINVAL;
+	if (copy_from_user (cmd, ubuf, count))
+		return -EFAULT;
+	cmd [count] = 0;
+
+	mutex_lock (&r->lock);
+	if (!strncmp (cmd, "start", 5)) {
+		sscanf (cmd + 5, "%u", &scale);
+		status = replay_start (dum, scale);
+	} else if (!strncmp (cmd, "stop", 4)) {
+		replay_stop (r);
+	} else if (!strncmp (cmd, "clear", 5)) {
+		replay_stop (r);
+		kfree (r->events);
+		r->events = NULL;
+		r->count = r->size = r->skipped = 0;
+		r->line_len = 0;
+		r->devnum = -1;
+	} else
+		status = -EINVAL;
+	mutex_unlock (&r->lock);
+
+	return status ? status : count;
+}
+
+static const struct file_operations replay_fops = {
+	.owner		= THIS_MODULE,
+	.open		= replay_open,
+	.read		= seq_read,
+	.write		= replay_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void create_debug_files (struct dummy *dum)
+{
+	struct dummy_replay	*r;
+
+	r = kzalloc (sizeof *r, GFP_KERNEL);
+	if (!r)
+		return;
+	mutex_init (&r->lock);
+	spin_lock_init (&r->stats_lock);
+	init_usb_anchor (&r->anchor);
+	r->devnum = -1;
+	dum->replay = r;
+
+	dum->debugfs_root = debugfs_create_dir (driver_name, NULL);
+	if (IS_ERR_OR_NULL (dum->debugfs_root))
+		return;
+	debugfs_create_file ("replay_trace", S_IWUSR, dum->debugfs_root,
+			dum, &replay_trace_fops);
+	debugfs_create_file ("replay", S_IRUGO | S_IWUSR, dum->debugfs_root,
+			dum, &replay_fops);
+}
+
+static void remove_debug_files (struct dummy *dum)
+{
+	struct dummy_replay	*r = dum->replay;
+
+	if (!IS_ERR_OR_NULL (dum->debugfs_root))
+		debugfs_remove_recursive (dum->debugfs_root);
+	dum->debugfs_root = NULL;
+	if (!r)
+		return;
+
+	mutex_lock (&r->lock);
+	replay_stop (r);
+	mutex_unlock (&r->lock);
+	kfree (r->events);
+	kfree (r);
+	dum->replay = NULL;
+}
+
+#else
+
+#define create_debug_files(dum) do {} while (0)
+#define remove_debug_files(dum) do {} while (0)
+
+#endif	/* CONFIG_USB_GADGET_DEBUG_FS */
+
+/*-------------------------------------------------------------------------*/
+
 static inline ssize_t
 show_urb (char *buf, size_t size, struct urb *urb)
 {
@@ -1806,6 +2815,7 @@ static DEVICE_ATTR (urbs, S_IRUGO, show_urbs, NULL);
 static int dummy_start (struct usb_hcd *hcd)
 {
 	struct dummy		*dum;
+	int			i, cpu = -1;
 
 	dum = hcd_to_dummy (hcd);
 
@@ -1822,6 +2832,24 @@ static int dummy_start (struct usb_hcd *hcd)
 
 	INIT_LIST_HEAD (&dum->urbp_list);
 
+	/* per-endpoint lanes, spread round-robin over the online CPUs */
+	for (i = 0; i < DUMMY_ENDPOINTS; i++) {
+		struct dummy_ep	*ep = &dum->ep [i];
+
+		spin_lock_init (&ep->lock);
+		INIT_LIST_HEAD (&ep->urbp_list);
+		INIT_WORK (&ep->work, dummy_ep_work);
+		cpu = cpumask_next (cpu, cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first (cpu_online_mask);
+		ep->cpu = cpu;
+	}
+	if (parallel) {
+		dum->wq = create_workqueue (driver_name);
+		if (!dum->wq)
+			return -ENOMEM;
+	}
+
 	hcd->power_budget = POWER_BUDGET;
 	hcd->state = HC_STATE_RUNNING;
 	hcd->uses_new_polling = 1;
@@ -1830,6 +2858,8 @@ static int dummy_start (struct usb_hcd *hcd)
 	hcd->self.otg_port = 1;
 #endif
 
+	create_debug_files (dum);
+
 	/* FIXME 'urbs' should be a per-device thing, maybe in usbcore */
 	return device_create_file (dummy_dev(dum), &dev_attr_urbs);
 }
@@ -1840,8 +2870,13 @@ static void dummy_stop (struct usb_hcd *hcd)
 
 	dum = hcd_to_dummy (hcd);
 
+	remove_debug_files (dum);
 	device_remove_file (dummy_dev(dum), &dev_attr_urbs);
 	usb_gadget_unregister_driver (dum->driver);
+	if (dum->wq) {
+		destroy_workqueue (dum->wq);
+		dum->wq = NULL;
+	}
 	dev_info (dummy_dev(dum), "stopped\n");
 }
 
@@ -1957,9 +2992,13 @@ static int __init init (void)
 	if (usb_disabled ())
 		return -ENODEV;
 
+	dummy_req_cache = KMEM_CACHE (dummy_request, 0);
+	if (!dummy_req_cache)
+		return retval;
+
 	the_hcd_pdev = platform_device_alloc(driver_name, -1);
 	if (!the_hcd_pdev)
-		return retval;
+		goto err_alloc_hcd;
 	the_udc_pdev = platform_device_alloc(gadget_name, -1);
 	if (!the_udc_pdev)
 		goto err_alloc_udc;
@@ -1989,6 +3028,8 @@ err_register_hcd_driver:
 	platform_device_put(the_udc_pdev);
 err_alloc_udc:
 	platform_device_put(the_hcd_pdev);
+err_alloc_hcd:
+	kmem_cache_destroy (dummy_req_cache);
 	return retval;
 }
 module_init (init);
@@ -1999,5 +3040,6 @@ static void __exit cleanup (void)
 	platform_device_unregister(the_hcd_pdev);
 	platform_driver_unregister(&dummy_udc_driver);
 	platform_driver_unregister(&dummy_hcd_driver);
+	kmem_cache_destroy (dummy_req_cache);
 }
 module_exit (cleanup);
@@ -0,0 +1,112 @@
+/*
+ * ep_batch.h - submit and complete several usb_requests at a time
+ *
+ * Refilling an endpoint one usb_ep_queue() at a time costs a controller
+ * lock round trip (and on most controllers a "prime" register write) per
+ * request; completing them one req->complete() at a time costs the same
+ * again.  Controller drivers which can do better expose their endpoint
+ * operations as a struct usb_ep_batch_ops, with the plain usb_ep_ops
+ * embedded first; gadget_supports_batch() says which ones do.  Function
+ * drivers just call usb_ep_queue_list(), which falls back to queueing
+ * one request at a time on every other controller, and may ask for
+ * batched completions with usb_ep_set_complete_list().
+ *
+ * This software is distributed under the terms of the GNU General
+ * Public License ("GPL") as published by the Free Software Foundation,
+ * either version 2 of that License or (at your option) any later version.
+ */
+
+#ifndef __EP_BATCH_H
+#define __EP_BATCH_H
+
+#include <linux/list.h>
+#include <linux/usb/gadget.h>
+
+#include "gadget_chips.h"
+
+struct usb_ep_batch_ops {
+	struct usb_ep_ops	ops;		/* must be first */
+
+	/* queue every request on @reqs (linked through req->list) in
+	 * order, or as many as possible.  Each request is unlinked from
+	 * @reqs before it can complete; on error the ones not queued are
+	 * left there, and a negative errno is returned.
+	 */
+	int	(*queue_list)(struct usb_ep *ep, struct list_head *reqs,
+				gfp_t gfp_flags);
+
+	/* see usb_ep_set_complete_list() */
+	int	(*set_complete_list)(struct usb_ep *ep,
+				void (*complete_list)(struct usb_ep *ep,
+						struct list_head *done));
+};
+
+static inline const struct usb_ep_batch_ops *
+usb_ep_batch_ops(struct usb_ep *ep)
+{
+	return container_of(ep->ops, struct usb_ep_batch_ops, ops);
+}
+
+/**
+ * usb_ep_queue_list - queue a list of I/O requests to an endpoint
+ * @gadget: the controller @ep belongs to
+ * @ep: the endpoint the requests are queued to
+ * @reqs: requests, linked through their "list" field
+ * @gfp_flags: GFP_* flags to use if the controller needs memory
+ *
+ * Works like calling usb_ep_queue() for each request in turn, but lets
+ * controllers that support it take their lock and start the endpoint
+ * just once.  Requests leave @reqs as they are queued; if an error is
+ * returned, those still on @reqs were not queued.
+ */
+static inline int usb_ep_queue_list(struct usb_gadget *gadget,
+		struct usb_ep *ep, struct list_head *reqs, gfp_t gfp_flags)
+{
+	struct usb_request	*req, *tmp;
+	int			status = 0;
+
+	if (list_empty(reqs))
+		return 0;
+	if (gadget_supports_batch(gadget))
+		return usb_ep_batch_ops(ep)->queue_list(ep, reqs, gfp_flags);
+
+	list_for_each_entry_safe(req, tmp, reqs, list) {
+		list_del_init(&req->list);
+		status = usb_ep_queue(ep, req, gfp_flags);
+		if (status < 0) {
+			list_add(&req->list, reqs);
+			break;
+		}
+	}
+	return status;
+}
+
+/**
+ * usb_ep_set_complete_list - ask for completions a list at a time
+ * @gadget: the controller @ep belongs to
+ * @ep: an enabled endpoint other than ep0
+ * @complete_list: callback, or NULL for per-request callbacks again
+ *
+ * Once set, the requests the controller retires in one interrupt or
+ * polling pass are handed to @complete_list in a single call, linked in
+ * completion order through their "list" field, with req->status and
+ * req->actual set as usual.  The callback runs in the same context as
+ * req->complete() would, owns those requests, and may queue them again.
+ *
+ * Shutdown paths (usb_ep_dequeue(), usb_ep_disable(), disconnect) still
+ * call each request's complete(), so that must be set too.  Disabling
+ * the endpoint clears @complete_list.
+ *
+ * Returns -EOPNOTSUPP on controllers that can't do this; callers then
+ * keep getting one complete() call per request.
+ */
+static inline int usb_ep_set_complete_list(struct usb_gadget *gadget,
+		struct usb_ep *ep,
+		void (*complete_list)(struct usb_ep *ep, struct list_head *done))
+{
+	if (!gadget_supports_batch(gadget))
+		return -EOPNOTSUPP;
+	return usb_ep_batch_ops(ep)->set_complete_list(ep, complete_list);
+}
+
+#endif /* __EP_BATCH_H */
@@ -15,19 +15,28 @@
 #include <asm/atomic.h>
 
 #include "u_audio.h"
+#include "usb_sched.h"
 
-#define OUT_EP_MAX_PACKET_SIZE	200
-static int req_buf_size = OUT_EP_MAX_PACKET_SIZE;
+/* Largest isochronous packet per (micro)frame without high bandwidth */
+#define FS_ISO_MAX_PACKET_SIZE	1023
+#define HS_ISO_MAX_PACKET_SIZE	1024
+
+static int req_buf_size;
 module_param(req_buf_size, int, S_IRUGO);
-MODULE_PARM_DESC(req_buf_size, "ISO OUT endpoint request buffer size");
+MODULE_PARM_DESC(req_buf_size, "ISO OUT endpoint request buffer size "
+		"(0: one (micro)frame worth of audio at the playback rate)");
 
 static int req_count = 256;
 module_param(req_count, int, S_IRUGO);
 MODULE_PARM_DESC(req_count, "ISO OUT endpoint request count");
 
-static int audio_buf_size = 48000;
+static int audio_buf_size;
 module_param(audio_buf_size, int, S_IRUGO);
-MODULE_PARM_DESC(audio_buf_size, "Audio buffer size");
+MODULE_PARM_DESC(audio_buf_size, "Audio buffer size (0: 250ms of audio)");
+
+/* playback work writes to ALSA; give it a core of its own if need be */
+static struct usb_sched playback_sched = USB_SCHED_DEFAULT;
+USB_SCHED_MODULE_PARAMETERS(playback_work, playback_sched);
 
 static int generic_set_cmd(struct usb_audio_control *con, u8 cmd, int value);
 static int generic_get_cmd(struct usb_audio_control *con, u8 cmd);
@@ -176,15 +185,25 @@ static struct uac_format_type_i_discrete_descriptor_1 as_type_i_desc = {
 	.bSamFreqType =		1,
 };
 
-/* Standard ISO OUT Endpoint Descriptor */
-static struct usb_endpoint_descriptor as_out_ep_desc __initdata = {
+/* Standard ISO OUT Endpoint Descriptors, wMaxPacketSize is set from the
+ * playback format in f_audio_build_desc()
+ */
+static struct usb_endpoint_descriptor fs_out_ep_desc = {
 	.bLength =		USB_DT_ENDPOINT_AUDIO_SIZE,
 	.bDescriptorType =	USB_DT_ENDPOINT,
 	.bEndpointAddress =	USB_DIR_OUT,
 	.bmAttributes =		USB_ENDPOINT_SYNC_ADAPTIVE
 				| USB_ENDPOINT_XFER_ISOC,
-	.wMaxPacketSize =	__constant_cpu_to_le16(OUT_EP_MAX_PACKET_SIZE),
-	.bInterval =		4,
+	.bInterval =		1,
+};
+
+/* One packet every microframe */
+static struct usb_endpoint_descriptor hs_out_ep_desc = {
+	.bLength =		USB_DT_ENDPOINT_AUDIO_SIZE,
+	.bDescriptorType =	USB_DT_ENDPOINT,
+	.bmAttributes =		USB_ENDPOINT_SYNC_ADAPTIVE
+				| USB_ENDPOINT_XFER_ISOC,
+	.bInterval =		1,
 };
 
 /* Class-specific AS ISO OUT Endpoint Descriptor */
@@ -197,7 +216,7 @@ static struct uac_iso_endpoint_descriptor as_iso_out_desc __initdata = {
 	.wLockDelay =		__constant_cpu_to_le16(1),
 };
 
-static struct usb_descriptor_header *f_audio_desc[] __initdata = {
+static struct usb_descriptor_header *f_audio_fs_desc[] __initdata = {
 	(struct usb_descriptor_header *)&ac_interface_desc,
 	(struct usb_descriptor_header *)&ac_header_desc,
 
@@ -211,7 +230,26 @@ static struct usb_descriptor_header *f_audio_desc[] __initdata = {
 
 	(struct usb_descriptor_header *)&as_type_i_desc,
 
-	(struct usb_descriptor_header *)&as_out_ep_desc,
+	(struct usb_descriptor_header *)&fs_out_ep_desc,
+	(struct usb_descriptor_header *)&as_iso_out_desc,
+	NULL,
+};
+
+static struct usb_descriptor_header *f_audio_hs_desc[] __initdata = {
+	(struct usb_descriptor_header *)&ac_interface_desc,
+	(struct usb_descriptor_header *)&ac_header_desc,
+
+	(struct usb_descriptor_header *)&input_terminal_desc,
+	(struct usb_descriptor_header *)&output_terminal_desc,
+	(struct usb_descriptor_header *)&feature_unit_desc,
+
+	(struct usb_descriptor_header *)&as_interface_alt_0_desc,
+	(struct usb_descriptor_header *)&as_interface_alt_1_desc,
+	(struct usb_descriptor_header *)&as_header_desc,
+
+	(struct usb_descriptor_header *)&as_type_i_desc,
+
+	(struct usb_descriptor_header *)&hs_out_ep_desc,
 	(struct usb_descriptor_header *)&as_iso_out_desc,
 	NULL,
 };
@@ -247,6 +285,7 @@ static struct usb_gadget_strings *audio_strings[] = {
 struct f_audio_buf {
 	u8 *buf;
 	int actual;
+	ktime_t stamp;		/* arrival of the first packet */
 	struct list_head list;
 };
 
@@ -272,6 +311,16 @@ static void f_audio_buffer_free(struct f_audio_buf *audio_buf)
 	kfree(audio_buf->buf);
 	kfree(audio_buf);
 }
+
+static void f_audio_buffer_free_list(struct list_head *head)
+{
+	struct f_audio_buf *audio_buf, *n;
+
+	list_for_each_entry_safe(audio_buf, n, head, list) {
+		list_del(&audio_buf->list);
+		f_audio_buffer_free(audio_buf);
+	}
+}
 /*-------------------------------------------------------------------------*/
 
 struct f_audio {
@@ -281,10 +330,19 @@ struct f_audio {
 	struct usb_ep			*out_ep;
 	struct usb_endpoint_descriptor	*out_desc;
 
+	/* preallocated ISO OUT requests, queued on set_alt(1) */
+	struct usb_request		**reqs;
+	unsigned int			nreqs;
+	unsigned int			req_size;
+	bool				streaming;
+
 	spinlock_t			lock;
+	unsigned int			buf_size;
 	struct f_audio_buf *copy_buf;
 	struct work_struct playback_work;
+	struct workqueue_struct *playback_wq;	/* NULL for keventd */
 	struct list_head play_queue;
+	struct list_head free_bufs;
 
 	/* Control Set command */
 	struct list_head cs;
@@ -313,43 +371,99 @@ static void f_audio_playback_work(struct work_struct *data)
 	play_buf = list_first_entry(&audio->play_queue,
 			struct f_audio_buf, list);
 	list_del(&play_buf->list);
+	audio->card.stats.queue_depth--;
+	u_audio_stat_fill(&audio->card, audio->card.stats.queue_depth);
 	spin_unlock_irq(&audio->lock);
 
 	u_audio_playback(&audio->card, play_buf->buf, play_buf->actual);
-	f_audio_buffer_free(play_buf);
+
+	/* Recycle the buffer rather than allocating a new one from the
+	 * completion handler.
+	 */
+	spin_lock_irq(&audio->lock);
+	if (play_buf->actual)
+		u_audio_stat_latency(&audio->card, play_buf->stamp);
+	play_buf->actual = 0;
+	list_add_tail(&play_buf->list, &audio->free_bufs);
+	spin_unlock_irq(&audio->lock);
 
 	return;
 }
 
+/* Called with audio->lock held */
+static void f_audio_queue_play(struct f_audio *audio,
+		struct f_audio_buf *play_buf)
+{
+	struct gaudio_stats *stats = &audio->card.stats;
+
+	list_add_tail(&play_buf->list, &audio->play_queue);
+	if (++stats->queue_depth > stats->queue_depth_max)
+		stats->queue_depth_max = stats->queue_depth;
+	usb_sched_queue_work(audio->playback_wq, &audio->playback_work);
+}
+
+/* Called with audio->lock held */
+static struct f_audio_buf *f_audio_get_copy_buf(struct f_audio *audio)
+{
+	struct f_audio_buf *copy_buf;
+
+	if (list_empty(&audio->free_bufs))
+		return f_audio_buffer_alloc(audio->buf_size);
+
+	copy_buf = list_first_entry(&audio->free_bufs,
+			struct f_audio_buf, list);
+	list_del(&copy_buf->list);
+	return copy_buf;
+}
+
 static int f_audio_out_ep_complete(struct usb_ep *ep, struct usb_request *req)
 {
 	struct f_audio *audio = req->context;
 	struct usb_composite_dev *cdev = audio->card.func.config->cdev;
-	struct f_audio_buf *copy_buf = audio->copy_buf;
+	struct f_audio_buf *copy_buf;
+	unsigned long flags;
+	int status;
 	int err;
 
-	if (!copy_buf)
-		return -EINVAL;
+	spin_lock_irqsave(&audio->lock, flags);
+	u_audio_stat_packet(&audio->card, req->actual);
+	copy_buf = audio->copy_buf;
 
 	/* Copy buffer is full, add it to the play_queue */
-	if (audio_buf_size - copy_buf->actual < req->actual) {
-		list_add_tail(&copy_buf->list, &audio->play_queue);
-		schedule_work(&audio->playback_work);
-		copy_buf = f_audio_buffer_alloc(audio_buf_size);
-		if (IS_ERR(copy_buf))
-			return -ENOMEM;
+	if (copy_buf && audio->buf_size - copy_buf->actual < req->actual) {
+		f_audio_queue_play(audio, copy_buf);
+		copy_buf = NULL;
 	}
 
-	memcpy(copy_buf->buf + copy_buf->actual, req->buf, req->actual);
-	copy_buf->actual += req->actual;
+	/* after an allocation failure, try again with every packet */
+	if (!copy_buf) {
+		copy_buf = f_audio_get_copy_buf(audio);
+		if (IS_ERR(copy_buf))
+			copy_buf = NULL;
+	}
 	audio->copy_buf = copy_buf;
 
+	/* without a buffer only this packet's data is lost; the request
+	 * goes back to the hardware regardless
+	 */
+	if (copy_buf) {
+		if (!copy_buf->actual)
+			copy_buf->stamp = ktime_get();
+		memcpy(copy_buf->buf + copy_buf->actual, req->buf,
+				req->actual);
+		copy_buf->actual += req->actual;
+		status = 0;
+	} else {
+		audio->card.stats.dropped_packets++;
+		status = -ENOMEM;
+	}
+	spin_unlock_irqrestore(&audio->lock, flags);
+
 	err = usb_ep_queue(ep, req, GFP_ATOMIC);
 	if (err)
 		ERROR(cdev, "%s queue req: %d\n", ep->name, err);
 
-	return 0;
-
+	return status;
 }
 
 static void f_audio_complete(struct usb_ep *ep, struct usb_request *req)
@@ -371,7 +485,21 @@ static void f_audio_complete(struct usb_ep *ep, struct usb_request *req)
 			audio->set_con = NULL;
 		}
 		break;
+	case -ECONNRESET:		/* dequeued */
+	case -ESHUTDOWN:		/* disconnected, or disabled */
+		break;
 	default:
+		/* an ISO packet lost on the bus; keep the stream going */
+		if (ep == out_ep) {
+			unsigned long flags;
+
+			spin_lock_irqsave(&audio->lock, flags);
+			audio->card.stats.usb_xruns++;
+			spin_unlock_irqrestore(&audio->lock, flags);
+			if (usb_ep_queue(ep, req, GFP_ATOMIC))
+				ERROR(audio->card.func.config->cdev,
+						"%s requeue req\n", ep->name);
+		}
 		break;
 	}
 }
@@ -565,58 +693,80 @@ f_audio_setup(struct usb_function *f, const struct usb_ctrlrequest *ctrl)
 	return value;
 }
 
+static void f_audio_stop_stream(struct f_audio *audio)
+{
+	struct f_audio_buf *copy_buf;
+	unsigned long flags;
+
+	if (!audio->streaming)
+		return;
+
+	/* Returns all queued requests with -ESHUTDOWN */
+	usb_ep_disable(audio->out_ep);
+	audio->streaming = false;
+
+	spin_lock_irqsave(&audio->lock, flags);
+	copy_buf = audio->copy_buf;
+	audio->copy_buf = NULL;
+	if (copy_buf)
+		f_audio_queue_play(audio, copy_buf);
+	spin_unlock_irqrestore(&audio->lock, flags);
+}
+
+static int f_audio_start_stream(struct f_audio *audio)
+{
+	struct usb_composite_dev *cdev = audio->card.func.config->cdev;
+	struct usb_ep *out_ep = audio->out_ep;
+	struct f_audio_buf *copy_buf;
+	unsigned long flags;
+	unsigned int i, length;
+	int err;
+
+	audio->out_desc = ep_choose(cdev->gadget,
+			&hs_out_ep_desc, &fs_out_ep_desc);
+	err = usb_ep_enable(out_ep, audio->out_desc);
+	if (err)
+		return err;
+	out_ep->driver_data = audio;
+	audio->streaming = true;
+
+	spin_lock_irqsave(&audio->lock, flags);
+	copy_buf = f_audio_get_copy_buf(audio);
+	audio->copy_buf = IS_ERR(copy_buf) ? NULL : copy_buf;
+	spin_unlock_irqrestore(&audio->lock, flags);
+	if (IS_ERR(copy_buf)) {
+		f_audio_stop_stream(audio);
+		return -ENOMEM;
+	}
+
+	/* Each request carries one (micro)frame worth of audio */
+	length = req_buf_size ? : le16_to_cpu(audio->out_desc->wMaxPacketSize);
+	length = min(length, audio->req_size);
+
+	for (i = 0; i < audio->nreqs; i++) {
+		audio->reqs[i]->length = length;
+		err = usb_ep_queue(out_ep, audio->reqs[i], GFP_ATOMIC);
+		if (err) {
+			ERROR(cdev, "%s queue req: %d\n", out_ep->name, err);
+			break;
+		}
+	}
+
+	return err;
+}
+
 static int f_audio_set_alt(struct usb_function *f, unsigned intf, unsigned alt)
 {
 	struct f_audio		*audio = func_to_audio(f);
 	struct usb_composite_dev *cdev = f->config->cdev;
-	struct usb_ep *out_ep = audio->out_ep;
-	struct usb_request *req;
-	int i = 0, err = 0;
+	int err = 0;
 
 	DBG(cdev, "intf %d, alt %d\n", intf, alt);
 
 	if (intf == 1) {
-		if (alt == 1) {
-			usb_ep_enable(out_ep, audio->out_desc);
-			out_ep->driver_data = audio;
-			audio->copy_buf = f_audio_buffer_alloc(audio_buf_size);
-			if (IS_ERR(audio->copy_buf))
-				return -ENOMEM;
-
-			/*
-			 * allocate a bunch of read buffers
-			 * and queue them all at once.
-			 */
-			for (i = 0; i < req_count && err == 0; i++) {
-				req = usb_ep_alloc_request(out_ep, GFP_ATOMIC);
-				if (req) {
-					req->buf = kzalloc(req_buf_size,
-							GFP_ATOMIC);
-					if (req->buf) {
-						req->length = req_buf_size;
-						req->context = audio;
-						req->complete =
-							f_audio_complete;
-						err = usb_ep_queue(out_ep,
-							req, GFP_ATOMIC);
-						if (err)
-							ERROR(cdev,
-							"%s queue req: %d\n",
-							out_ep->name, err);
-					} else
-						err = -ENOMEM;
-				} else
-					err = -ENOMEM;
-			}
-
-		} else {
-			struct f_audio_buf *copy_buf = audio->copy_buf;
-			if (copy_buf) {
-				list_add_tail(&copy_buf->list,
-						&audio->play_queue);
-				schedule_work(&audio->playback_work);
-			}
-		}
+		f_audio_stop_stream(audio);
+		if (alt == 1)
+			err = f_audio_start_stream(audio);
 	}
 
 	return err;
@@ -624,29 +774,115 @@ static int f_audio_set_alt(struct usb_function *f, unsigned intf, unsigned alt)
 
 static void f_audio_disable(struct usb_function *f)
 {
-	return;
+	f_audio_stop_stream(func_to_audio(f));
 }
 
 /*-------------------------------------------------------------------------*/
 
-static void f_audio_build_desc(struct f_audio *audio)
+/*
+ * Bytes the host may send in one packet when sending "per_sec" packets per
+ * second; one extra sample frame absorbs the host/device clock drift.
+ */
+static unsigned int f_audio_packet_size(struct gaudio *card, unsigned per_sec)
+{
+	unsigned int frame = u_audio_get_playback_channels(card)
+			   * u_audio_get_playback_sample_bytes(card);
+
+	return (DIV_ROUND_UP(u_audio_get_playback_rate(card), per_sec) + 1)
+		* frame;
+}
+
+static int f_audio_build_desc(struct f_audio *audio)
 {
 	struct gaudio *card = &audio->card;
-	u8 *sam_freq;
-	int rate;
+	unsigned int fs_size, hs_size;
+	int channels, rate;
 
-	/* Set channel numbers */
-	input_terminal_desc.bNrChannels = u_audio_get_playback_channels(card);
-	as_type_i_desc.bNrChannels = u_audio_get_playback_channels(card);
+	/* Set channel numbers; one spatial location per channel */
+	channels = u_audio_get_playback_channels(card);
+	input_terminal_desc.bNrChannels = channels;
+	input_terminal_desc.wChannelConfig = cpu_to_le16((1 << channels) - 1);
+	as_type_i_desc.bNrChannels = channels;
 
 	/* Set sample rates */
 	rate = u_audio_get_playback_rate(card);
-	sam_freq = as_type_i_desc.tSamFreq[0];
-	memcpy(sam_freq, &rate, 3);
+	as_type_i_desc.tSamFreq[0][0] = rate & 0xff;
+	as_type_i_desc.tSamFreq[0][1] = (rate >> 8) & 0xff;
+	as_type_i_desc.tSamFreq[0][2] = (rate >> 16) & 0xff;
 
-	/* Todo: Set Sample bits and other parameters */
+	/* Set sample size */
+	as_type_i_desc.bSubframeSize = u_audio_get_playback_sample_bytes(card);
+	as_type_i_desc.bBitResolution = u_audio_get_playback_sample_bits(card);
 
-	return;
+	/* Size the packets: one per frame at full speed, one per
+	 * microframe at high speed.
+	 */
+	fs_size = f_audio_packet_size(card, 1000);
+	hs_size = f_audio_packet_size(card, 8000);
+	if (hs_size > HS_ISO_MAX_PACKET_SIZE)
+		return -EINVAL;
+	if (fs_size > FS_ISO_MAX_PACKET_SIZE) {
+		INFO(card, "%d Hz %d ch format needs high speed\n",
+			rate, channels);
+		fs_size = FS_ISO_MAX_PACKET_SIZE;
+	}
+	fs_out_ep_desc.wMaxPacketSize = cpu_to_le16(fs_size);
+	hs_out_ep_desc.wMaxPacketSize = cpu_to_le16(hs_size);
+
+	audio->req_size = max(fs_size, hs_size);
+	if (req_buf_size > audio->req_size)
+		audio->req_size = req_buf_size;
+
+	audio->buf_size = audio_buf_size ? :
+		u_audio_get_playback_rate(card) * channels
+		* u_audio_get_playback_sample_bytes(card) / 4;
+	audio->buf_size = max(audio->buf_size, audio->req_size);
+
+	return 0;
+}
+
+static void f_audio_free_requests(struct f_audio *audio)
+{
+	unsigned int i;
+
+	for (i = 0; i < audio->nreqs; i++) {
+		kfree(audio->reqs[i]->buf);
+		usb_ep_free_request(audio->out_ep, audio->reqs[i]);
+	}
+	kfree(audio->reqs);
+	audio->reqs = NULL;
+	audio->nreqs = 0;
+}
+
+/* Preallocate the ISO OUT request pool so set_alt() only has to queue */
+static int f_audio_alloc_requests(struct f_audio *audio)
+{
+	struct usb_request *req;
+	unsigned int count = max(req_count, 1);
+
+	audio->reqs = kcalloc(count, sizeof *audio->reqs, GFP_KERNEL);
+	if (!audio->reqs)
+		return -ENOMEM;
+
+	for (audio->nreqs = 0; audio->nreqs < count; audio->nreqs++) {
+		req = usb_ep_alloc_request(audio->out_ep, GFP_KERNEL);
+		if (!req)
+			goto fail;
+		req->buf = kmalloc(audio->req_size, GFP_KERNEL);
+		if (!req->buf) {
+			usb_ep_free_request(audio->out_ep, req);
+			goto fail;
+		}
+		req->context = audio;
+		req->complete = f_audio_complete;
+		audio->reqs[audio->nreqs] = req;
+	}
+
+	return 0;
+
+fail:
+	f_audio_free_requests(audio);
+	return -ENOMEM;
 }
 
 /* audio function driver setup/binding */
@@ -658,7 +894,9 @@ f_audio_bind(struct usb_configuration *c, struct usb_function *f)
 	int			status;
 	struct usb_ep		*ep;
 
-	f_audio_build_desc(audio);
+	status = f_audio_build_desc(audio);
+	if (status < 0)
+		goto fail;
 
 	/* allocate instance-specific interface IDs, and patch descriptors */
 	status = usb_interface_id(c, f);
@@ -675,12 +913,16 @@ f_audio_bind(struct usb_configuration *c, struct usb_function *f)
 	status = -ENODEV;
 
 	/* allocate instance-specific endpoints */
-	ep = usb_ep_autoconfig(cdev->gadget, &as_out_ep_desc);
+	ep = usb_ep_autoconfig(cdev->gadget, &fs_out_ep_desc);
 	if (!ep)
 		goto fail;
 	audio->out_ep = ep;
 	ep->driver_data = cdev;	/* claim */
 
+	status = f_audio_alloc_requests(audio);
+	if (status < 0)
+		goto fail;
+
 	status = -ENOMEM;
 
 	/* supcard all relevant hardware speeds... we expect that when
@@ -689,14 +931,25 @@ f_audio_bind(struct usb_configuration *c, struct usb_function *f)
 	 */
 
 	/* copy descriptors, and track endpoint copies */
+	f->descriptors = usb_copy_descriptors(f_audio_fs_desc);
+	if (!f->descriptors)
+		goto fail_free;
+
 	if (gadget_is_dualspeed(c->cdev->gadget)) {
+		hs_out_ep_desc.bEndpointAddress =
+				fs_out_ep_desc.bEndpointAddress;
 		c->highspeed = true;
-		f->hs_descriptors = usb_copy_descriptors(f_audio_desc);
-	} else
-		f->descriptors = usb_copy_descriptors(f_audio_desc);
+		f->hs_descriptors = usb_copy_descriptors(f_audio_hs_desc);
+		if (!f->hs_descriptors)
+			goto fail_free;
+	}
 
 	return 0;
 
+fail_free:
+	usb_free_descriptors(f->descriptors);
+	f->descriptors = NULL;
+	f_audio_free_requests(audio);
 fail:
 
 	return status;
@@ -707,7 +960,16 @@ f_audio_unbind(struct usb_configuration *c, struct usb_function *f)
 {
 	struct f_audio		*audio = func_to_audio(f);
 
+	f_audio_stop_stream(audio);
+	flush_work(&audio->playback_work);
+	if (audio->playback_wq)
+		destroy_workqueue(audio->playback_wq);
+	f_audio_free_requests(audio);
+	f_audio_buffer_free_list(&audio->play_queue);
+	f_audio_buffer_free_list(&audio->free_bufs);
+
 	usb_free_descriptors(f->descriptors);
+	usb_free_descriptors(f->hs_descriptors);
 	kfree(audio);
 }
 
@@ -764,7 +1026,9 @@ int __init audio_bind_config(struct usb_configuration *c)
 	audio->card.gadget = c->cdev->gadget;
 
 	INIT_LIST_HEAD(&audio->play_queue);
+	INIT_LIST_HEAD(&audio->free_bufs);
 	spin_lock_init(&audio->lock);
+	audio->card.stats_lock = &audio->lock;
 
 	/* set up ASLA audio devices */
 	status = gaudio_setup(&audio->card);
@@ -777,22 +1041,26 @@ int __init audio_bind_config(struct usb_configuration *c)
 	audio->card.func.set_alt = f_audio_set_alt;
 	audio->card.func.setup = f_audio_setup;
 	audio->card.func.disable = f_audio_disable;
-	audio->out_desc = &as_out_ep_desc;
+	audio->out_desc = &fs_out_ep_desc;
 
 	control_selector_init(audio);
 
 	INIT_WORK(&audio->playback_work, f_audio_playback_work);
+	audio->playback_wq = usb_sched_create_workqueue("g_audio",
+			&playback_sched);
 
 	status = usb_add_function(c, &audio->card.func);
 	if (status)
 		goto add_fail;
 
-	INFO(c->cdev, "audio_buf_size %d, req_buf_size %d, req_count %d\n",
-		audio_buf_size, req_buf_size, req_count);
+	INFO(c->cdev, "audio_buf_size %u, req_buf_size %u, req_count %u\n",
+		audio->buf_size, audio->req_size, audio->nreqs);
 
 	return status;
 
 add_fail:
+	if (audio->playback_wq)
+		destroy_workqueue(audio->playback_wq);
 	gaudio_cleanup();
 setup_fail:
 	kfree(audio);
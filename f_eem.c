@@ -27,8 +27,7 @@
 #include <linux/slab.h>
 
 #include "u_ether.h"
-
-#define EEM_HLEN 2
+#include "eem_framing.c"
 
 /*
  * This function is a "CDC Ethernet Emulation Model" (CDC EEM)
@@ -312,202 +311,6 @@ eem_unbind(struct usb_configuration *c, struct usb_function *f)
 	kfree(eem);
 }
 
-static void eem_cmd_complete(struct usb_ep *ep, struct usb_request *req)
-{
-}
-
-/*
- * Add the EEM header and ethernet checksum.
- * We currently do not attempt to put multiple ethernet frames
- * into a single USB transfer
- */
-static struct sk_buff *eem_wrap(struct gether *port, struct sk_buff *skb)
-{
-	struct sk_buff	*skb2 = NULL;
-	struct usb_ep	*in = port->in_ep;
-	int		padlen = 0;
-	u16		len = skb->len;
-
-	if (!skb_cloned(skb)) {
-		int headroom = skb_headroom(skb);
-		int tailroom = skb_tailroom(skb);
-
-		/* When (len + EEM_HLEN + ETH_FCS_LEN) % in->maxpacket) is 0,
-		 * stick two bytes of zero-length EEM packet on the end.
-		 */
-		if (((len + EEM_HLEN + ETH_FCS_LEN) % in->maxpacket) == 0)
-			padlen += 2;
-
-		if ((tailroom >= (ETH_FCS_LEN + padlen)) &&
-				(headroom >= EEM_HLEN))
-			goto done;
-	}
-
-	skb2 = skb_copy_expand(skb, EEM_HLEN, ETH_FCS_LEN + padlen, GFP_ATOMIC);
-	dev_kfree_skb_any(skb);
-	skb = skb2;
-	if (!skb)
-		return skb;
-
-done:
-	/* use the "no CRC" option */
-	put_unaligned_be32(0xdeadbeef, skb_put(skb, 4));
-
-	/* EEM packet header format:
-	 * b0..13:	length of ethernet frame
-	 * b14:		bmCRC (0 == sentinel CRC)
-	 * b15:		bmType (0 == data)
-	 */
-	len = skb->len;
-	put_unaligned_le16(len & 0x3FFF, skb_push(skb, 2));
-
-	/* add a zero-length EEM packet, if needed */
-	if (padlen)
-		put_unaligned_le16(0, skb_put(skb, 2));
-
-	return skb;
-}
-
-/*
- * Remove the EEM header.  Note that there can be many EEM packets in a single
- * USB transfer, so we need to break them out and handle them independently.
- */
-static int eem_unwrap(struct gether *port,
-			struct sk_buff *skb,
-			struct sk_buff_head *list)
-{
-	struct usb_composite_dev	*cdev = port->func.config->cdev;
-	int				status = 0;
-
-	do {
-		struct sk_buff	*skb2;
-		u16		header;
-		u16		len = 0;
-
-		if (skb->len < EEM_HLEN) {
-			status = -EINVAL;
-			DBG(cdev, "invalid EEM header\n");
-			goto error;
-		}
-
-		/* remove the EEM header */
-		header = get_unaligned_le16(skb->data);
-		skb_pull(skb, EEM_HLEN);
-
-		/* EEM packet header format:
-		 * b0..14:	EEM type dependent (data or command)
-		 * b15:		bmType (0 == data, 1 == command)
-		 */
-		if (header & BIT(15)) {
-			struct usb_request	*req = cdev->req;
-			u16			bmEEMCmd;
-
-			/* EEM command packet format:
-			 * b0..10:	bmEEMCmdParam
-			 * b11..13:	bmEEMCmd
-			 * b14:		reserved (must be zero)
-			 * b15:		bmType (1 == command)
-			 */
-			if (header & BIT(14))
-				continue;
-
-			bmEEMCmd = (header >> 11) & 0x7;
-			switch (bmEEMCmd) {
-			case 0: /* echo */
-				len = header & 0x7FF;
-				if (skb->len < len) {
-					status = -EOVERFLOW;
-					goto error;
-				}
-
-				skb2 = skb_clone(skb, GFP_ATOMIC);
-				if (unlikely(!skb2)) {
-					DBG(cdev, "EEM echo response error\n");
-					goto next;
-				}
-				skb_trim(skb2, len);
-				put_unaligned_le16(BIT(15) | BIT(11) | len,
-							skb_push(skb2, 2));
-				skb_copy_bits(skb, 0, req->buf, skb->len);
-				req->length = skb->len;
-				req->complete = eem_cmd_complete;
-				req->zero = 1;
-				if (usb_ep_queue(port->in_ep, req, GFP_ATOMIC))
-					DBG(cdev, "echo response queue fail\n");
-				break;
-
-			case 1:  /* echo response */
-			case 2:  /* suspend hint */
-			case 3:  /* response hint */
-			case 4:  /* response complete hint */
-			case 5:  /* tickle */
-			default: /* reserved */
-				continue;
-			}
-		} else {
-			u32		crc, crc2;
-			struct sk_buff	*skb3;
-
-			/* check for zero-length EEM packet */
-			if (header == 0)
-				continue;
-
-			/* EEM data packet format:
-			 * b0..13:	length of ethernet frame
-			 * b14:		bmCRC (0 == sentinel, 1 == calculated)
-			 * b15:		bmType (0 == data)
-			 */
-			len = header & 0x3FFF;
-			if ((skb->len < len)
-					|| (len < (ETH_HLEN + ETH_FCS_LEN))) {
-				status = -EINVAL;
-				goto error;
-			}
-
-			/* validate CRC */
-			if (header & BIT(14)) {
-				crc = get_unaligned_le32(skb->data + len
-							- ETH_FCS_LEN);
-				crc2 = ~crc32_le(~0,
-						skb->data, len - ETH_FCS_LEN);
-			} else {
-				crc = get_unaligned_be32(skb->data + len
-							- ETH_FCS_LEN);
-				crc2 = 0xdeadbeef;
-			}
-			if (crc != crc2) {
-				DBG(cdev, "invalid EEM CRC\n");
-				goto next;
-			}
-
-			skb2 = skb_clone(skb, GFP_ATOMIC);
-			if (unlikely(!skb2)) {
-				DBG(cdev, "unable to unframe EEM packet\n");
-				continue;
-			}
-			skb_trim(skb2, len - ETH_FCS_LEN);
-
-			skb3 = skb_copy_expand(skb2,
-						NET_IP_ALIGN,
-						0,
-						GFP_ATOMIC);
-			if (unlikely(!skb3)) {
-				DBG(cdev, "unable to realign EEM packet\n");
-				dev_kfree_skb_any(skb2);
-				continue;
-			}
-			dev_kfree_skb_any(skb2);
-			skb_queue_tail(list, skb3);
-		}
-next:
-		skb_pull(skb, len);
-	} while (skb->len);
-
-error:
-	dev_kfree_skb_any(skb);
-	return status;
-}
-
 /**
  * eem_bind_config - add CDC Ethernet (EEM) network link to a configuration
  * @c: the configuration to support the network link
@@ -552,6 +355,7 @@ int __init eem_bind_config(struct usb_configuration *c)
 	eem->port.wrap = eem_wrap;
 	eem->port.unwrap = eem_unwrap;
 	eem->port.header_len = EEM_HLEN;
+	eem->port.trailer_len = ETH_FCS_LEN + 2;
 
 	status = usb_add_function(c, &eem->port.func);
 	if (status)
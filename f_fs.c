@@ -187,8 +187,8 @@ struct ffs_data {
 	/* Device name, write once when file system is mounted.
 	 * Intendet for user to read if she wants. */
 	const char			*dev_name;
-	/* Private data for our user (ie. gadget).  Managed by
-	 * user. */
+	/* Private data for our user (ie. gadget).  Set from
+	 * functionfs_acquire_dev_callback() when mounted. */
 	void				*private_data;
 
 	/* filled by __ffs_data_got_descs() */
@@ -227,6 +227,15 @@ struct ffs_data {
 	struct ffs_epfile		*epfiles;
 };
 
+/* Mount/umount hooks provided by the gadget.  acquire returns the
+ * gadget's object for given dev_name (stored in ffs->private_data)
+ * or an ERR_PTR() if the instance is unknown or already mounted;
+ * release is called when the file system goes away. */
+static void *functionfs_acquire_dev_callback(const char *dev_name)
+	__attribute__((warn_unused_result, nonnull));
+static void functionfs_release_dev_callback(struct ffs_data *ffs_data)
+	__attribute__((nonnull));
+
 /* Reference counter handling */
 static void ffs_data_get(struct ffs_data *ffs);
 static void ffs_data_put(struct ffs_data *ffs);
@@ -1041,6 +1050,7 @@ struct ffs_sb_fill_data {
 	struct ffs_file_perms perms;
 	umode_t root_mode;
 	const char *dev_name;
+	struct ffs_data *ffs_data;
 };
 
 static int ffs_sb_fill(struct super_block *sb, void *_data, int silent)
@@ -1048,17 +1058,15 @@ static int ffs_sb_fill(struct super_block *sb, void *_data, int silent)
 	struct ffs_sb_fill_data *data = _data;
 	struct inode	*inode;
 	struct dentry	*d;
-	struct ffs_data	*ffs;
+	struct ffs_data	*ffs = data->ffs_data;
 
 	ENTER();
 
-	/* Initialize data */
-	ffs = ffs_data_new();
-	if (unlikely(!ffs))
-		goto enomem0;
+	/* From now on the super block owns ffs; should we fail below
+	 * ffs_fs_kill_sb() will release it. */
+	data->ffs_data       = NULL;
 
 	ffs->sb              = sb;
-	ffs->dev_name        = data->dev_name;
 	ffs->file_perms      = data->perms;
 
 	sb->s_fs_info        = ffs;
@@ -1093,8 +1101,6 @@ enomem3:
 enomem2:
 	iput(inode);
 enomem1:
-	ffs_data_put(ffs);
-enomem0:
 	return -ENOMEM;
 }
 
@@ -1189,6 +1195,8 @@ ffs_fs_get_sb(struct file_system_type *t, int flags,
 		},
 		.root_mode = S_IFDIR | 0500,
 	};
+	struct ffs_data *ffs;
+	void *ffs_dev;
 	int ret;
 
 	ENTER();
@@ -1201,21 +1209,45 @@ ffs_fs_get_sb(struct file_system_type *t, int flags,
 	if (unlikely(ret < 0))
 		return ret;
 
+	ffs = ffs_data_new();
+	if (unlikely(!ffs))
+		return -ENOMEM;
+	ffs->dev_name = dev_name;
+
+	/* Each instance gets its own super block so several
+	 * functionfs mounts may coexist; the gadget decides which
+	 * dev_names it accepts and makes sure every one is mounted
+	 * at most once. */
+	ffs_dev = functionfs_acquire_dev_callback(dev_name);
+	if (IS_ERR(ffs_dev)) {
+		ffs_data_put(ffs);
+		return PTR_ERR(ffs_dev);
+	}
+	ffs->private_data = ffs_dev;
+
 	data.dev_name = dev_name;
-	return get_sb_single(t, flags, &data, ffs_sb_fill, mnt);
+	data.ffs_data = ffs;
+	ret = get_sb_nodev(t, flags, &data, ffs_sb_fill, mnt);
+	if (unlikely(ret < 0) && data.ffs_data) {
+		functionfs_release_dev_callback(data.ffs_data);
+		ffs_data_put(data.ffs_data);
+	}
+	return ret;
 }
 
 static void
 ffs_fs_kill_sb(struct super_block *sb)
 {
-	void *ptr;
+	struct ffs_data *ffs;
 
 	ENTER();
 
 	kill_litter_super(sb);
-	ptr = xchg(&sb->s_fs_info, NULL);
-	if (ptr)
-		ffs_data_put(ptr);
+	ffs = xchg(&sb->s_fs_info, NULL);
+	if (ffs) {
+		functionfs_release_dev_callback(ffs);
+		ffs_data_put(ffs);
+	}
 }
 
 static struct file_system_type ffs_fs_type = {
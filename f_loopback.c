@@ -24,6 +24,9 @@
 #include <linux/slab.h>
 #include <linux/kernel.h>
 #include <linux/device.h>
+#include <linux/debugfs.h>
+#include <linux/ktime.h>
+#include <linux/seq_file.h>
 
 #include "g_zero.h"
 #include "gadget_chips.h"
@@ -36,16 +39,51 @@
  * them back so they can be read IN from it.  It has been used by certain
  * test applications.  It supports limited testing of data queueing logic.
  *
+ * The OUT and IN sides run independently, 'qlen' and 'in_qlen' requests
+ * deep, around a shared pool of buffers: a completed OUT buffer joins a
+ * FIFO of filled buffers and its request is requeued at once with an
+ * empty one; IN requests take filled buffers as they become free.  Data
+ * is never copied, and either side only waits for the other when the
+ * pool runs dry, so this measures full duplex throughput of the UDC.
+ * With CONFIG_USB_GADGET_DEBUG_FS, debugfs loopback/stats reports the
+ * byte counts in each direction and how often each side had to wait.
+ *
  *
  * This is currently packaged as a configuration driver, which can't be
  * combined with other functions to make composite devices.  However, it
  * can be combined with other independent configurations.
  */
+struct loop_buf {
+	void			*buf;
+	unsigned		length;
+	bool			zero;
+};
+
 struct f_loopback {
 	struct usb_function	function;
 
 	struct usb_ep		*in_ep;
 	struct usb_ep		*out_ep;
+
+	/* buffer pool, protected by lock */
+	spinlock_t		lock;
+	struct list_head	out_idle;	/* OUT reqs, no buffer */
+	struct list_head	in_idle;	/* IN reqs, no data */
+	void			**spare;	/* empty buffers */
+	unsigned		nspare;
+	struct loop_buf		*ring;	/* filled buffers, FIFO */
+	unsigned		head, fill;
+	unsigned		nbufs;
+
+	/* statistics */
+	ktime_t			start;
+	u64			out_bytes;
+	u64			in_bytes;
+	unsigned long		out_waits;	/* OUT found no buffer */
+	unsigned long		in_waits;	/* IN found no data */
+	unsigned		max_fill;
+
+	struct dentry		*dentry;
 };
 
 static inline struct f_loopback *func_to_loop(struct usb_function *f)
@@ -55,7 +93,11 @@ static inline struct f_loopback *func_to_loop(struct usb_function *f)
 
 static unsigned qlen = 32;
 module_param(qlen, uint, 0);
-MODULE_PARM_DESC(qlenn, "depth of loopback queue");
+MODULE_PARM_DESC(qlen, "depth of loopback OUT queue");
+
+static unsigned in_qlen;
+module_param(in_qlen, uint, 0);
+MODULE_PARM_DESC(in_qlen, "depth of loopback IN queue, 0 for qlen");
 
 /*-------------------------------------------------------------------------*/
 
@@ -137,6 +179,67 @@ static struct usb_gadget_strings *loopback_strings[] = {
 
 /*-------------------------------------------------------------------------*/
 
+#ifdef CONFIG_USB_GADGET_DEBUG_FS
+
+static int loop_stats_show(struct seq_file *s, void *unused)
+{
+	struct f_loopback	*loop = s->private;
+	unsigned long		flags;
+	s64			us;
+
+	spin_lock_irqsave(&loop->lock, flags);
+	us = loop->nbufs ? ktime_us_delta(ktime_get(), loop->start) : 0;
+	seq_printf(s, "elapsed_us %lld\n", (long long) us);
+	seq_printf(s, "out_bytes  %llu\n",
+			(unsigned long long) loop->out_bytes);
+	seq_printf(s, "in_bytes   %llu\n",
+			(unsigned long long) loop->in_bytes);
+	seq_printf(s, "out_waits  %lu\n", loop->out_waits);
+	seq_printf(s, "in_waits   %lu\n", loop->in_waits);
+	seq_printf(s, "buffers    %u\n", loop->nbufs);
+	seq_printf(s, "filled     %u\n", loop->fill);
+	seq_printf(s, "max_filled %u\n", loop->max_fill);
+	spin_unlock_irqrestore(&loop->lock, flags);
+	return 0;
+}
+
+static int loop_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, loop_stats_show, inode->i_private);
+}
+
+static const struct file_operations loop_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= loop_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void loop_debugfs_init(struct f_loopback *loop)
+{
+	loop->dentry = debugfs_create_dir("loopback", NULL);
+	if (IS_ERR_OR_NULL(loop->dentry)) {
+		loop->dentry = NULL;
+		return;
+	}
+	debugfs_create_file("stats", S_IRUGO, loop->dentry, loop,
+			&loop_stats_fops);
+}
+
+static void loop_debugfs_exit(struct f_loopback *loop)
+{
+	debugfs_remove_recursive(loop->dentry);
+	loop->dentry = NULL;
+}
+
+#else
+
+static inline void loop_debugfs_init(struct f_loopback *loop) { }
+static inline void loop_debugfs_exit(struct f_loopback *loop) { }
+
+#endif	/* CONFIG_USB_GADGET_DEBUG_FS */
+
 static int __init
 loopback_bind(struct usb_configuration *c, struct usb_function *f)
 {
@@ -178,56 +281,140 @@ autoconf_fail:
 	DBG(cdev, "%s speed %s: IN/%s, OUT/%s\n",
 			gadget_is_dualspeed(c->cdev->gadget) ? "dual" : "full",
 			f->name, loop->in_ep->name, loop->out_ep->name);
+	loop_debugfs_init(loop);
 	return 0;
 }
 
 static void
 loopback_unbind(struct usb_configuration *c, struct usb_function *f)
 {
-	kfree(func_to_loop(f));
+	struct f_loopback	*loop = func_to_loop(f);
+
+	loop_debugfs_exit(loop);
+	kfree(loop);
 }
 
-static void loopback_complete(struct usb_ep *ep, struct usb_request *req)
-{
-	struct f_loopback	*loop = ep->driver_data;
-	struct usb_composite_dev *cdev = loop->function.config->cdev;
-	int			status = req->status;
+/*-------------------------------------------------------------------------*/
 
-	switch (status) {
+/* The buffer pool; all of these are called with loop->lock held. */
 
-	case 0:				/* normal completion? */
-		if (ep == loop->out_ep) {
-			/* loop this OUT packet back IN to the host */
-			req->zero = (req->actual < req->length);
-			req->length = req->actual;
-			status = usb_ep_queue(loop->in_ep, req, GFP_ATOMIC);
-			if (status == 0)
-				return;
+static void loop_push_filled(struct f_loopback *loop, struct usb_request *req)
+{
+	struct loop_buf	*b = &loop->ring[(loop->head + loop->fill++)
+					 % loop->nbufs];
+
+	b->buf = req->buf;
+	b->length = req->actual;
+	b->zero = (req->actual < req->length);
+	if (loop->fill > loop->max_fill)
+		loop->max_fill = loop->fill;
+	loop->out_bytes += req->actual;
+}
+
+/* give filled buffers to idle IN requests */
+static void loop_start_in(struct f_loopback *loop)
+{
+	struct usb_composite_dev *cdev = loop->function.config->cdev;
+	struct usb_request	*req;
+	struct loop_buf		*b;
+	int			status;
 
+	while (!list_empty(&loop->in_idle)) {
+		if (!loop->fill) {
+			loop->in_waits++;
+			break;
+		}
+		b = &loop->ring[loop->head];
+		loop->head = (loop->head + 1) % loop->nbufs;
+		loop->fill--;
+
+		req = list_first_entry(&loop->in_idle, struct usb_request,
+				list);
+		list_del(&req->list);
+		req->buf = b->buf;
+		req->length = b->length;
+		req->zero = b->zero;
+		status = usb_ep_queue(loop->in_ep, req, GFP_ATOMIC);
+		if (status) {
 			/* "should never get here" */
 			ERROR(cdev, "can't loop %s to %s: %d\n",
-				ep->name, loop->in_ep->name,
+				loop->out_ep->name, loop->in_ep->name,
 				status);
+			loop->spare[loop->nspare++] = req->buf;
+			req->buf = NULL;
+			list_add(&req->list, &loop->in_idle);
+			break;
 		}
+	}
+}
 
-		/* queue the buffer for some later OUT packet */
+/* give empty buffers to idle OUT requests */
+static void loop_start_out(struct f_loopback *loop)
+{
+	struct usb_composite_dev *cdev = loop->function.config->cdev;
+	struct usb_request	*req;
+	int			status;
+
+	while (!list_empty(&loop->out_idle) && loop->nspare) {
+		req = list_first_entry(&loop->out_idle, struct usb_request,
+				list);
+		list_del(&req->list);
+		req->buf = loop->spare[--loop->nspare];
 		req->length = buflen;
 		status = usb_ep_queue(loop->out_ep, req, GFP_ATOMIC);
-		if (status == 0)
-			return;
+		if (status) {
+			/* "should never get here" */
+			ERROR(cdev, "%s queue req --> %d\n",
+				loop->out_ep->name, status);
+			loop->spare[loop->nspare++] = req->buf;
+			req->buf = NULL;
+			list_add(&req->list, &loop->out_idle);
+			break;
+		}
+	}
+}
 
-		/* "should never get here" */
-		/* FALLTHROUGH */
+static void loopback_complete(struct usb_ep *ep, struct usb_request *req)
+{
+	struct f_loopback	*loop = ep->driver_data;
+	struct usb_composite_dev *cdev = loop->function.config->cdev;
+	int			status = req->status;
+	unsigned long		flags;
+
+	switch (status) {
+
+	case 0:				/* normal completion? */
+		spin_lock_irqsave(&loop->lock, flags);
+		if (ep == loop->out_ep) {
+			/* this OUT packet goes back IN to the host when an
+			 * IN request is free; meanwhile keep reading into
+			 * an empty buffer, if there is one.
+			 */
+			loop_push_filled(loop, req);
+			req->buf = NULL;
+			list_add_tail(&req->list, &loop->out_idle);
+			if (!loop->nspare)
+				loop->out_waits++;
+			loop_start_out(loop);
+		} else {
+			loop->in_bytes += req->actual;
+			loop->spare[loop->nspare++] = req->buf;
+			req->buf = NULL;
+			list_add_tail(&req->list, &loop->in_idle);
+			loop_start_out(loop);
+		}
+		loop_start_in(loop);
+		spin_unlock_irqrestore(&loop->lock, flags);
+		return;
 
 	default:
 		ERROR(cdev, "%s loop complete --> %d, %d/%d\n", ep->name,
 				status, req->actual, req->length);
 		/* FALLTHROUGH */
 
-	/* NOTE:  since this driver doesn't maintain an explicit record
-	 * of requests it submitted (just maintains qlen count), we
-	 * rely on the hardware driver to clean up on disconnect or
-	 * endpoint disable.
+	/* NOTE:  requests still queued when the endpoints are disabled
+	 * free themselves here; disable_loopback() frees the rest of the
+	 * pool.
 	 */
 	case -ECONNABORTED:		/* hardware forced ep reset */
 	case -ECONNRESET:		/* request dequeued */
@@ -237,12 +424,44 @@ static void loopback_complete(struct usb_ep *ep, struct usb_request *req)
 	}
 }
 
+static void loop_free_pool(struct f_loopback *loop)
+{
+	struct usb_request	*req, *tmp;
+
+	list_for_each_entry_safe(req, tmp, &loop->out_idle, list) {
+		list_del(&req->list);
+		free_ep_req(loop->out_ep, req);
+	}
+	list_for_each_entry_safe(req, tmp, &loop->in_idle, list) {
+		list_del(&req->list);
+		free_ep_req(loop->in_ep, req);
+	}
+	while (loop->nspare)
+		kfree(loop->spare[--loop->nspare]);
+	while (loop->fill) {
+		kfree(loop->ring[loop->head].buf);
+		loop->head = (loop->head + 1) % loop->nbufs;
+		loop->fill--;
+	}
+	kfree(loop->spare);
+	kfree(loop->ring);
+	loop->spare = NULL;
+	loop->ring = NULL;
+	loop->nbufs = 0;
+}
+
 static void disable_loopback(struct f_loopback *loop)
 {
 	struct usb_composite_dev	*cdev;
+	unsigned long			flags;
 
 	cdev = loop->function.config->cdev;
 	disable_endpoints(cdev, loop->in_ep, loop->out_ep);
+
+	/* every queued request has completed by now */
+	spin_lock_irqsave(&loop->lock, flags);
+	loop_free_pool(loop);
+	spin_unlock_irqrestore(&loop->lock, flags);
 	VDBG(cdev, "%s disabled\n", loop->function.name);
 }
 
@@ -253,7 +472,8 @@ enable_loopback(struct usb_composite_dev *cdev, struct f_loopback *loop)
 	const struct usb_endpoint_descriptor	*src, *sink;
 	struct usb_ep				*ep;
 	struct usb_request			*req;
-	unsigned				i;
+	unsigned				i, nin;
+	unsigned long				flags;
 
 	src = ep_choose(cdev->gadget,
 			&hs_loop_source_desc, &fs_loop_source_desc);
@@ -279,28 +499,62 @@ fail0:
 	}
 	ep->driver_data = loop;
 
-	/* allocate a bunch of read buffers and queue them all at once.
-	 * we buffer at most 'qlen' transfers; fewer if any need more
-	 * than 'buflen' bytes each.
+	/* each request brings one buffer to the pool; at most 'qlen' OUT
+	 * and 'in_qlen' IN transfers are in flight at once.
 	 */
-	for (i = 0; i < qlen && result == 0; i++) {
+	nin = in_qlen ? in_qlen : qlen;
+	loop->nbufs = qlen + nin;
+	loop->spare = kcalloc(loop->nbufs, sizeof *loop->spare, GFP_ATOMIC);
+	loop->ring = kcalloc(loop->nbufs, sizeof *loop->ring, GFP_ATOMIC);
+	if (!loop->spare || !loop->ring)
+		goto fail1;
+
+	loop->head = loop->fill = loop->nspare = 0;
+	loop->out_bytes = loop->in_bytes = 0;
+	loop->out_waits = loop->in_waits = 0;
+	loop->max_fill = 0;
+	loop->start = ktime_get();
+
+	spin_lock_irqsave(&loop->lock, flags);
+	for (i = 0; i < nin; i++) {
+		req = alloc_ep_req(loop->in_ep);
+		if (!req)
+			break;
+		req->complete = loopback_complete;
+		loop->spare[loop->nspare++] = req->buf;
+		req->buf = NULL;
+		list_add_tail(&req->list, &loop->in_idle);
+	}
+	for (i = 0; i < qlen && !list_empty(&loop->in_idle); i++) {
 		req = alloc_ep_req(ep);
-		if (req) {
-			req->complete = loopback_complete;
-			result = usb_ep_queue(ep, req, GFP_ATOMIC);
-			if (result)
-				ERROR(cdev, "%s queue req --> %d\n",
-						ep->name, result);
-		} else {
-			usb_ep_disable(ep);
-			ep->driver_data = NULL;
-			result = -ENOMEM;
-			goto fail0;
-		}
+		if (!req)
+			break;
+		req->complete = loopback_complete;
+		loop->spare[loop->nspare++] = req->buf;
+		req->buf = NULL;
+		list_add_tail(&req->list, &loop->out_idle);
+	}
+	if (list_empty(&loop->out_idle)) {
+		loop_free_pool(loop);
+		spin_unlock_irqrestore(&loop->lock, flags);
+		goto fail1;
 	}
+	loop_start_out(loop);
+	spin_unlock_irqrestore(&loop->lock, flags);
 
 	DBG(cdev, "%s enabled\n", loop->function.name);
 	return result;
+
+fail1:
+	kfree(loop->spare);
+	kfree(loop->ring);
+	loop->spare = NULL;
+	loop->ring = NULL;
+	loop->nbufs = 0;
+	usb_ep_disable(ep);
+	ep->driver_data = NULL;
+	result = -ENOMEM;
+	goto fail0;
 }
 
 static int loopback_set_alt(struct usb_function *f,
@@ -333,6 +587,10 @@ static int __init loopback_bind_config(struct usb_configuration *c)
 	if (!loop)
 		return -ENOMEM;
 
+	spin_lock_init(&loop->lock);
+	INIT_LIST_HEAD(&loop->out_idle);
+	INIT_LIST_HEAD(&loop->in_idle);
+
 	loop->function.name = "loopback";
 	loop->function.descriptors = fs_loopback_descs;
 	loop->function.bind = loopback_bind;
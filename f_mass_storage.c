@@ -73,6 +73,10 @@
  *				being removable.
  *	->cdrom		Flag specifying that LUN shall be reported as
  *				being a CD-ROM.
+ *	->blksize	Logical block size of the LUN in bytes: 512,
+ *				2048 or 4096.  Zero means 512, which
+ *				is also the only size a CD-ROM LUN
+ *				accepts.
  *
  *	lun_name_format	A printf-like format for names of the LUN
  *				devices.  This determines how the
@@ -92,6 +96,8 @@
  *				MSF.  You can safely set it to NULL
  *				(in which case default "file-storage"
  *				will be used).
+ *	thread_sched	CPU and scheduling policy for that thread,
+ *				or NULL to leave them alone.
  *
  *	vendor_name
  *	product_name
@@ -127,6 +133,9 @@
  *			Default true, boolean for removable media.
  *	cdrom=b[,b...]	Default false, boolean for whether to emulate
  *				a CD-ROM drive.
+ *	blksize=N[,N...]
+ *			Default 512, logical block size (512, 2048 or
+ *				4096) reported to the host.
  *	luns=N		Default N = number of filenames, number of
  *				LUNs to support.
  *	stall		Default determined according to the type of
@@ -140,6 +149,12 @@
  * (look for FSG_MODULE_PARAMETERS() macro usage, what's inside it is
  * the prefix).
  *
+ * When built with CONFIG_USB_MASS_STORAGE_CRYPT each LUN's sysfs
+ * directory also has a "crypt" file.  Writing "<cipher> <hex key>" to
+ * it, for instance "xts(aes)" and a 64 byte key, makes the function
+ * encrypt everything it writes to the backing file and decrypt
+ * everything it reads; "none" turns that off.  See storage_crypt.c.
+ *
  *
  * Requirements are modest; only a bulk-in and a bulk-out endpoint are
  * needed.  The memory requirement amounts to two 16K buffers, size
@@ -294,6 +309,7 @@
 #include <linux/usb/gadget.h>
 
 #include "gadget_chips.h"
+#include "usb_sched.h"
 
 
 
@@ -310,6 +326,12 @@ static const char fsg_string_interface[] = "Mass Storage";
 #define FSG_NO_OTG               1
 #define FSG_NO_INTR_EP           1
 
+#ifdef CONFIG_USB_MASS_STORAGE_CRYPT
+#define FSG_CRYPT		1
+/* Receive, encrypt and write (or read, decrypt and send) at once */
+#define FSG_NUM_BUFFERS		4
+#endif
+
 #include "storage_common.c"
 
 
@@ -389,10 +411,12 @@ struct fsg_config {
 		char ro;
 		char removable;
 		char cdrom;
+		unsigned int blksize;	/* 0 means 512 */
 	} luns[FSG_MAX_LUNS];
 
 	const char		*lun_name_format;
 	const char		*thread_name;
+	const struct usb_sched	*thread_sched;
 
 	/* Callback function to call when thread exits.  If no
 	 * callback is set or it returns value lower then zero MSF
@@ -705,13 +729,43 @@ static int sleep_thread(struct fsg_common *common)
 }
 
 
+#include "storage_crypt.c"
+
+
 /*-------------------------------------------------------------------------*/
 
+/* Wait until a buffer do_read() filled has been decrypted */
+static void read_decrypted(struct fsg_common *common, struct fsg_buffhd *bh)
+{
+	struct fsg_lun	*curlun = common->curlun;
+	int		rc = fsg_crypt_wait(bh);
+
+	if (rc) {
+		LERROR(curlun, "decryption failed: %d\n", rc);
+		memset(bh->buf, 0, bh->inreq->length);
+		curlun->sense_data = SS_UNRECOVERED_READ_ERROR;
+	}
+}
+
+static int send_read_buffer(struct fsg_common *common, struct fsg_buffhd *bh)
+{
+	read_decrypted(common, bh);
+	bh->inreq->zero = 0;
+	START_TRANSFER_OR(common, bulk_in, bh->inreq,
+		       &bh->inreq_busy, &bh->state)
+		/* Don't know what to do if
+		 * common->fsg is NULL */
+		return -EIO;
+	common->next_buffhd_to_fill = bh->next;
+	return 0;
+}
+
 static int do_read(struct fsg_common *common)
 {
 	struct fsg_lun		*curlun = common->curlun;
 	u32			lba;
 	struct fsg_buffhd	*bh;
+	struct fsg_buffhd	*pending = NULL;	/* Being decrypted */
 	int			rc;
 	u32			amount_left;
 	loff_t			file_offset, file_offset_tmp;
@@ -738,7 +792,7 @@ static int do_read(struct fsg_common *common)
 		curlun->sense_data = SS_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE;
 		return -EINVAL;
 	}
-	file_offset = ((loff_t) lba) << 9;
+	file_offset = ((loff_t) lba) << curlun->blkbits;
 
 	/* Carry out the file reads */
 	amount_left = common->data_size_from_cmnd;
@@ -764,7 +818,7 @@ static int do_read(struct fsg_common *common)
 					partial_page);
 
 		/* Wait for the next buffer to become available */
-		bh = common->next_buffhd_to_fill;
+		bh = pending ? pending->next : common->next_buffhd_to_fill;
 		while (bh->state != BUF_STATE_EMPTY) {
 			rc = sleep_thread(common);
 			if (rc)
@@ -776,7 +830,8 @@ static int do_read(struct fsg_common *common)
 		if (amount == 0) {
 			curlun->sense_data =
 					SS_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE;
-			curlun->sense_data_info = file_offset >> 9;
+			curlun->sense_data_info =
+					file_offset >> curlun->blkbits;
 			curlun->info_valid = 1;
 			bh->inreq->length = 0;
 			bh->state = BUF_STATE_FULL;
@@ -801,7 +856,8 @@ static int do_read(struct fsg_common *common)
 		} else if (nread < amount) {
 			LDBG(curlun, "partial file read: %d/%u\n",
 					(int) nread, amount);
-			nread -= (nread & 511);	/* Round down to a block */
+			/* Round down to a block */
+			nread -= (nread & ((1 << curlun->blkbits) - 1));
 		}
 		file_offset  += nread;
 		amount_left  -= nread;
@@ -809,10 +865,15 @@ static int do_read(struct fsg_common *common)
 		bh->inreq->length = nread;
 		bh->state = BUF_STATE_FULL;
 
+		/* Decrypt while the next buffer is being read */
+		fsg_crypt_start(common, curlun, bh, file_offset - nread,
+				nread, 0);
+
 		/* If an error occurred, report it and its position */
 		if (nread < amount) {
 			curlun->sense_data = SS_UNRECOVERED_READ_ERROR;
-			curlun->sense_data_info = file_offset >> 9;
+			curlun->sense_data_info =
+					file_offset >> curlun->blkbits;
 			curlun->info_valid = 1;
 			break;
 		}
@@ -820,15 +881,32 @@ static int do_read(struct fsg_common *common)
 		if (amount_left == 0)
 			break;		/* No more left to read */
 
-		/* Send this buffer and go read some more */
-		bh->inreq->zero = 0;
-		START_TRANSFER_OR(common, bulk_in, bh->inreq,
-			       &bh->inreq_busy, &bh->state)
-			/* Don't know what to do if
-			 * common->fsg is NULL */
-			return -EIO;
-		common->next_buffhd_to_fill = bh->next;
+		/* Send the previous buffer, now that this one is read */
+		if (pending) {
+			rc = send_read_buffer(common, pending);
+			if (rc)
+				return rc;
+			pending = NULL;
+		}
+
+		/* Send this buffer (unless it isn't decrypted yet) and
+		 * go read some more */
+		if (fsg_crypt_busy(bh)) {
+			pending = bh;
+			continue;
+		}
+		rc = send_read_buffer(common, bh);
+		if (rc)
+			return rc;
+	}
+
+	/* The last buffer is left for finish_reply() */
+	if (pending) {
+		rc = send_read_buffer(common, pending);
+		if (rc)
+			return rc;
 	}
+	read_decrypted(common, bh);
 
 	return -EIO;		/* No default reply */
 }
@@ -836,6 +914,30 @@ static int do_read(struct fsg_common *common)
 
 /*-------------------------------------------------------------------------*/
 
+/* Start encrypting the buffers received but not yet written, starting
+ * with the one at file_offset */
+static void encrypt_received(struct fsg_common *common, loff_t file_offset)
+{
+	struct fsg_buffhd	*bh = common->next_buffhd_to_drain;
+
+	do {
+		if (bh->state != BUF_STATE_FULL)
+			break;
+		smp_rmb();
+		if (bh->outreq->status != 0)
+			break;
+		if (!fsg_crypt_started(bh))
+			fsg_crypt_start(common, common->curlun, bh,
+					file_offset, bh->outreq->actual, 1);
+
+		/* After a short packet comes the next command */
+		if (bh->outreq->actual != bh->outreq->length)
+			break;
+		file_offset += bh->outreq->actual;
+		bh = bh->next;
+	} while (bh != common->next_buffhd_to_drain);
+}
+
 static int do_write(struct fsg_common *common)
 {
 	struct fsg_lun		*curlun = common->curlun;
@@ -846,6 +948,7 @@ static int do_write(struct fsg_common *common)
 	loff_t			usb_offset, file_offset, file_offset_tmp;
 	unsigned int		amount;
 	unsigned int		partial_page;
+	unsigned int		dropped;
 	ssize_t			nwritten;
 	int			rc;
 
@@ -885,7 +988,7 @@ static int do_write(struct fsg_common *common)
 
 	/* Carry out the file writes */
 	get_some_more = 1;
-	file_offset = usb_offset = ((loff_t) lba) << 9;
+	file_offset = usb_offset = ((loff_t) lba) << curlun->blkbits;
 	amount_left_to_req = common->data_size_from_cmnd;
 	amount_left_to_write = common->data_size_from_cmnd;
 
@@ -916,11 +1019,12 @@ static int do_write(struct fsg_common *common)
 				get_some_more = 0;
 				curlun->sense_data =
 					SS_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE;
-				curlun->sense_data_info = usb_offset >> 9;
+				curlun->sense_data_info =
+						usb_offset >> curlun->blkbits;
 				curlun->info_valid = 1;
 				continue;
 			}
-			amount -= (amount & 511);
+			amount -= (amount & ((1 << curlun->blkbits) - 1));
 			if (amount == 0) {
 
 				/* Why were we were asked to transfer a
@@ -936,8 +1040,8 @@ static int do_write(struct fsg_common *common)
 			if (amount_left_to_req == 0)
 				get_some_more = 0;
 
-			/* amount is always divisible by 512, hence by
-			 * the bulk-out maxpacket size */
+			/* amount is always divisible by the block size,
+			 * hence by the bulk-out maxpacket size */
 			bh->outreq->length = amount;
 			bh->bulk_out_intended_length = amount;
 			bh->outreq->short_not_ok = 1;
@@ -950,11 +1054,16 @@ static int do_write(struct fsg_common *common)
 			continue;
 		}
 
+		/* Encrypt what has arrived while earlier buffers are
+		 * being written */
+		if (fsg_lun_crypt(curlun))
+			encrypt_received(common, file_offset);
+
 		/* Write the received data to the backing file */
 		bh = common->next_buffhd_to_drain;
 		if (bh->state == BUF_STATE_EMPTY && !get_some_more)
 			break;			/* We stopped early */
-		if (bh->state == BUF_STATE_FULL) {
+		if (bh->state == BUF_STATE_FULL && !fsg_crypt_busy(bh)) {
 			smp_rmb();
 			common->next_buffhd_to_drain = bh->next;
 			bh->state = BUF_STATE_EMPTY;
@@ -962,12 +1071,30 @@ static int do_write(struct fsg_common *common)
 			/* Did something go wrong with the transfer? */
 			if (bh->outreq->status != 0) {
 				curlun->sense_data = SS_COMMUNICATION_FAILURE;
-				curlun->sense_data_info = file_offset >> 9;
+				curlun->sense_data_info =
+						file_offset >> curlun->blkbits;
 				curlun->info_valid = 1;
 				break;
 			}
 
+			rc = fsg_crypt_wait(bh);
+			if (rc) {
+				LERROR(curlun, "encryption failed: %d\n", rc);
+				curlun->sense_data = SS_WRITE_ERROR;
+				curlun->sense_data_info =
+						file_offset >> curlun->blkbits;
+				curlun->info_valid = 1;
+				break;
+			}
+
+			/* Only whole sectors were encrypted; a short
+			 * packet's trailing partial sector is dropped */
 			amount = bh->outreq->actual;
+			dropped = 0;
+			if (fsg_lun_crypt(curlun)) {
+				dropped = amount & (FSG_CRYPT_SECTOR_SIZE - 1);
+				amount -= dropped;
+			}
 			if (curlun->file_length - file_offset < amount) {
 				LERROR(curlun,
 	"write %u @ %llu beyond end %llu\n",
@@ -994,8 +1121,9 @@ static int do_write(struct fsg_common *common)
 			} else if (nwritten < amount) {
 				LDBG(curlun, "partial file write: %d/%u\n",
 						(int) nwritten, amount);
-				nwritten -= (nwritten & 511);
 				/* Round down to a block */
+				nwritten -= nwritten &
+						((1 << curlun->blkbits) - 1);
 			}
 			file_offset += nwritten;
 			amount_left_to_write -= nwritten;
@@ -1004,8 +1132,23 @@ static int do_write(struct fsg_common *common)
 			/* If an error occurred, report it and its position */
 			if (nwritten < amount) {
 				curlun->sense_data = SS_WRITE_ERROR;
-				curlun->sense_data_info = file_offset >> 9;
+				curlun->sense_data_info =
+						file_offset >> curlun->blkbits;
+				curlun->info_valid = 1;
+				break;
+			}
+
+			/* The residue already leaves out the dropped bytes;
+			 * fail the command too, so the host doesn't take it
+			 * for a clean early stop */
+			if (dropped) {
+				LDBG(curlun, "dropped partial sector: %u\n",
+						dropped);
+				curlun->sense_data = SS_WRITE_ERROR;
+				curlun->sense_data_info =
+						file_offset >> curlun->blkbits;
 				curlun->info_valid = 1;
+				common->short_packet_received = 1;
 				break;
 			}
 
@@ -1086,8 +1229,8 @@ static int do_verify(struct fsg_common *common)
 		return -EIO;		/* No default reply */
 
 	/* Prepare to carry out the file verify */
-	amount_left = verification_length << 9;
-	file_offset = ((loff_t) lba) << 9;
+	amount_left = verification_length << curlun->blkbits;
+	file_offset = ((loff_t) lba) << curlun->blkbits;
 
 	/* Write out all the dirty buffers before invalidating them */
 	fsg_lun_fsync_sub(curlun);
@@ -1113,7 +1256,8 @@ static int do_verify(struct fsg_common *common)
 		if (amount == 0) {
 			curlun->sense_data =
 					SS_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE;
-			curlun->sense_data_info = file_offset >> 9;
+			curlun->sense_data_info =
+					file_offset >> curlun->blkbits;
 			curlun->info_valid = 1;
 			break;
 		}
@@ -1136,11 +1280,13 @@ static int do_verify(struct fsg_common *common)
 		} else if (nread < amount) {
 			LDBG(curlun, "partial file verify: %d/%u\n",
 					(int) nread, amount);
-			nread -= (nread & 511);	/* Round down to a sector */
+			/* Round down to a block */
+			nread -= (nread & ((1 << curlun->blkbits) - 1));
 		}
 		if (nread == 0) {
 			curlun->sense_data = SS_UNRECOVERED_READ_ERROR;
-			curlun->sense_data_info = file_offset >> 9;
+			curlun->sense_data_info =
+					file_offset >> curlun->blkbits;
 			curlun->info_valid = 1;
 			break;
 		}
@@ -1248,7 +1394,8 @@ static int do_read_capacity(struct fsg_common *common, struct fsg_buffhd *bh)
 
 	put_unaligned_be32(curlun->num_sectors - 1, &buf[0]);
 						/* Max logical block */
-	put_unaligned_be32(512, &buf[4]);	/* Block length */
+	put_unaligned_be32(1 << curlun->blkbits, &buf[4]);
+						/* Block length */
 	return 8;
 }
 
@@ -1472,7 +1619,8 @@ static int do_read_format_capacities(struct fsg_common *common,
 
 	put_unaligned_be32(curlun->num_sectors, &buf[0]);
 						/* Number of blocks */
-	put_unaligned_be32(512, &buf[4]);	/* Block length */
+	put_unaligned_be32(1 << curlun->blkbits, &buf[4]);
+						/* Block length */
 	buf[4] = 0x02;				/* Current capacity */
 	return 12;
 }
@@ -1904,6 +2052,18 @@ static int check_command(struct fsg_common *common, int cmnd_size,
 }
 
 
+/* Transfer length of a READ or WRITE command, which counts logical blocks
+ * of the addressed LUN, in bytes.  This runs before check_command() has
+ * picked common->curlun; a bad LUN gets rejected there. */
+static u32 fsg_blocks_to_bytes(struct fsg_common *common, u32 blocks)
+{
+	unsigned int	blkbits = 9;
+
+	if (common->lun >= 0 && common->lun < common->nluns)
+		blkbits = common->luns[common->lun].blkbits;
+	return blocks << blkbits;
+}
+
 static int do_scsi_command(struct fsg_common *common)
 {
 	struct fsg_buffhd	*bh;
@@ -1986,7 +2146,8 @@ static int do_scsi_command(struct fsg_common *common)
 
 	case SC_READ_6:
 		i = common->cmnd[4];
-		common->data_size_from_cmnd = (i == 0 ? 256 : i) << 9;
+		common->data_size_from_cmnd =
+				fsg_blocks_to_bytes(common, i == 0 ? 256 : i);
 		reply = check_command(common, 6, DATA_DIR_TO_HOST,
 				      (7<<1) | (1<<4), 1,
 				      "READ(6)");
@@ -1996,7 +2157,8 @@ static int do_scsi_command(struct fsg_common *common)
 
 	case SC_READ_10:
 		common->data_size_from_cmnd =
-				get_unaligned_be16(&common->cmnd[7]) << 9;
+				fsg_blocks_to_bytes(common,
+					get_unaligned_be16(&common->cmnd[7]));
 		reply = check_command(common, 10, DATA_DIR_TO_HOST,
 				      (1<<1) | (0xf<<2) | (3<<7), 1,
 				      "READ(10)");
@@ -2006,7 +2168,8 @@ static int do_scsi_command(struct fsg_common *common)
 
 	case SC_READ_12:
 		common->data_size_from_cmnd =
-				get_unaligned_be32(&common->cmnd[6]) << 9;
+				fsg_blocks_to_bytes(common,
+					get_unaligned_be32(&common->cmnd[6]));
 		reply = check_command(common, 12, DATA_DIR_TO_HOST,
 				      (1<<1) | (0xf<<2) | (0xf<<6), 1,
 				      "READ(12)");
@@ -2104,7 +2267,8 @@ static int do_scsi_command(struct fsg_common *common)
 
 	case SC_WRITE_6:
 		i = common->cmnd[4];
-		common->data_size_from_cmnd = (i == 0 ? 256 : i) << 9;
+		common->data_size_from_cmnd =
+				fsg_blocks_to_bytes(common, i == 0 ? 256 : i);
 		reply = check_command(common, 6, DATA_DIR_FROM_HOST,
 				      (7<<1) | (1<<4), 1,
 				      "WRITE(6)");
@@ -2114,7 +2278,8 @@ static int do_scsi_command(struct fsg_common *common)
 
 	case SC_WRITE_10:
 		common->data_size_from_cmnd =
-				get_unaligned_be16(&common->cmnd[7]) << 9;
+				fsg_blocks_to_bytes(common,
+					get_unaligned_be16(&common->cmnd[7]));
 		reply = check_command(common, 10, DATA_DIR_FROM_HOST,
 				      (1<<1) | (0xf<<2) | (3<<7), 1,
 				      "WRITE(10)");
@@ -2124,7 +2289,8 @@ static int do_scsi_command(struct fsg_common *common)
 
 	case SC_WRITE_12:
 		common->data_size_from_cmnd =
-				get_unaligned_be32(&common->cmnd[6]) << 9;
+				fsg_blocks_to_bytes(common,
+					get_unaligned_be32(&common->cmnd[6]));
 		reply = check_command(common, 12, DATA_DIR_FROM_HOST,
 				      (1<<1) | (0xf<<2) | (0xf<<6), 1,
 				      "WRITE(12)");
@@ -2154,6 +2320,7 @@ unknown_cmnd:
 		}
 		break;
 	}
+	fsg_crypt_sync(common);		/* Buffers may be reused */
 	up_read(&common->filesem);
 
 	if (reply == -EINTR || signal_pending(current))
@@ -2466,6 +2633,9 @@ static void handle_exception(struct fsg_common *common)
 			usb_ep_fifo_flush(common->fsg->bulk_out);
 	}
 
+	/* Nobody else may use the buffers either */
+	fsg_crypt_sync(common);
+
 	/* Reset the I/O buffer states and pointers, the SCSI
 	 * state, and the exception.  Then invoke the handler. */
 	spin_lock_irq(&common->lock);
@@ -2713,6 +2883,18 @@ static struct fsg_common *fsg_common_init(struct fsg_common *common,
 	init_rwsem(&common->filesem);
 
 	for (i = 0, lcfg = cfg->luns; i < nluns; ++i, ++curlun, ++lcfg) {
+		/* The CD-ROM emulation counts 512-byte blocks, four to a
+		 * frame (see store_cdrom_address()), so it stays at 512 */
+		if (lcfg->blksize && lcfg->blksize != 512 &&
+		    (lcfg->cdrom ||
+		     (lcfg->blksize != 2048 && lcfg->blksize != 4096))) {
+			ERROR(common, "invalid block size %u for LUN%d\n",
+			      lcfg->blksize, i);
+			common->nluns = i;
+			rc = -EINVAL;
+			goto error_release;
+		}
+		curlun->blkbits = blksize_bits(lcfg->blksize ?: 512);
 		curlun->cdrom = !!lcfg->cdrom;
 		curlun->ro = lcfg->cdrom || lcfg->ro;
 		curlun->removable = lcfg->removable;
@@ -2737,6 +2919,9 @@ static struct fsg_common *fsg_common_init(struct fsg_common *common,
 		if (rc)
 			goto error_luns;
 		rc = device_create_file(&curlun->dev, &dev_attr_file);
+		if (rc)
+			goto error_luns;
+		rc = fsg_crypt_lun_init(curlun);
 		if (rc)
 			goto error_luns;
 
@@ -2815,6 +3000,11 @@ buffhds_first_it:
 		rc = PTR_ERR(common->thread_task);
 		goto error_release;
 	}
+	if (cfg->thread_sched) {
+		rc = usb_sched_apply(cfg->thread_sched, common->thread_task);
+		if (rc)
+			WARNING(common, "thread scheduling: error %d\n", rc);
+	}
 	init_completion(&common->thread_notifier);
 	init_waitqueue_head(&common->fsg_wait);
 #undef OR
@@ -2885,6 +3075,7 @@ static void fsg_common_release(struct kref *ref)
 		for (; i; --i, ++lun) {
 			device_remove_file(&lun->dev, &dev_attr_ro);
 			device_remove_file(&lun->dev, &dev_attr_file);
+			fsg_crypt_lun_exit(lun);
 			fsg_lun_close(lun);
 			device_unregister(&lun->dev);
 		}
@@ -2896,6 +3087,7 @@ static void fsg_common_release(struct kref *ref)
 		struct fsg_buffhd *bh = common->buffhds;
 		unsigned i = FSG_NUM_BUFFERS;
 		do {
+			fsg_crypt_free(bh);
 			kfree(bh->buf);
 		} while (++bh, --i);
 	}
@@ -3034,10 +3226,14 @@ struct fsg_module_parameters {
 	int		ro[FSG_MAX_LUNS];
 	int		removable[FSG_MAX_LUNS];
 	int		cdrom[FSG_MAX_LUNS];
+	unsigned int	blksize[FSG_MAX_LUNS];
 
 	unsigned int	file_count, ro_count, removable_count, cdrom_count;
+	unsigned int	blksize_count;
 	unsigned int	luns;	/* nluns */
 	int		stall;	/* can_stall */
+
+	struct usb_sched thread_sched;	/* initialize to USB_SCHED_DEFAULT */
 };
 
 
@@ -3061,10 +3257,14 @@ struct fsg_module_parameters {
 				"true to simulate removable media");	\
 	_FSG_MODULE_PARAM_ARRAY(prefix, params, cdrom, bool,		\
 				"true to simulate CD-ROM instead of disk"); \
+	_FSG_MODULE_PARAM_ARRAY(prefix, params, blksize, uint,		\
+				"logical block size: 512, 2048 or 4096"); \
 	_FSG_MODULE_PARAM(prefix, params, luns, uint,			\
 			  "number of LUNs");				\
 	_FSG_MODULE_PARAM(prefix, params, stall, bool,			\
-			  "false to prevent bulk stalls")
+			  "false to prevent bulk stalls");		\
+	USB_SCHED_MODULE_PARAMETERS(prefix ## thread,			\
+				    params.thread_sched)
 
 
 static void
@@ -3081,6 +3281,9 @@ fsg_config_from_params(struct fsg_config *cfg,
 	for (i = 0, lun = cfg->luns; i < cfg->nluns; ++i, ++lun) {
 		lun->ro = !!params->ro[i];
 		lun->cdrom = !!params->cdrom[i];
+		lun->blksize = params->blksize_count > i
+			? params->blksize[i]
+			: 0;
 		lun->removable = /* Removable by default */
 			params->removable_count <= i || params->removable[i];
 		lun->filename =
@@ -3092,6 +3295,7 @@ fsg_config_from_params(struct fsg_config *cfg,
 	/* Let MSF use defaults */
 	cfg->lun_name_format = 0;
 	cfg->thread_name = 0;
+	cfg->thread_sched = &params->thread_sched;
 	cfg->vendor_name = 0;
 	cfg->product_name = 0;
 	cfg->release = 0xffff;
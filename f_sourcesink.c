@@ -27,6 +27,7 @@
 
 #include "g_zero.h"
 #include "gadget_chips.h"
+#include "ep_batch.h"
 
 
 /*
@@ -70,6 +71,10 @@ static unsigned pattern;
 module_param(pattern, uint, 0);
 MODULE_PARM_DESC(pattern, "0 = all zeroes, 1 = mod63 ");
 
+static unsigned qlen = 1;
+module_param(qlen, uint, 0);
+MODULE_PARM_DESC(qlen, "requests kept queued on each endpoint");
+
 /*-------------------------------------------------------------------------*/
 
 static struct usb_interface_descriptor source_sink_intf = {
@@ -250,7 +255,8 @@ static void reinit_write_data(struct usb_ep *ep, struct usb_request *req)
 	}
 }
 
-static void source_sink_complete(struct usb_ep *ep, struct usb_request *req)
+/* check or refill a completed request; false if it was freed */
+static bool source_sink_process(struct usb_ep *ep, struct usb_request *req)
 {
 	struct f_sourcesink	*ss = ep->driver_data;
 	struct usb_composite_dev *cdev = ss->function.config->cdev;
@@ -275,7 +281,7 @@ static void source_sink_complete(struct usb_ep *ep, struct usb_request *req)
 		if (ep == ss->out_ep)
 			check_read_data(ss, req);
 		free_ep_req(ep, req);
-		return;
+		return false;
 
 	case -EOVERFLOW:		/* buffer overrun on read means that
 					 * we didn't provide a big enough
@@ -289,6 +295,17 @@ static void source_sink_complete(struct usb_ep *ep, struct usb_request *req)
 	case -EREMOTEIO:		/* short read */
 		break;
 	}
+	return true;
+}
+
+static void source_sink_complete(struct usb_ep *ep, struct usb_request *req)
+{
+	struct f_sourcesink	*ss = ep->driver_data;
+	struct usb_composite_dev *cdev = ss->function.config->cdev;
+	int			status;
+
+	if (!source_sink_process(ep, req))
+		return;
 
 	status = usb_ep_queue(ep, req, GFP_ATOMIC);
 	if (status) {
@@ -299,32 +316,69 @@ static void source_sink_complete(struct usb_ep *ep, struct usb_request *req)
 	}
 }
 
+/* batched completions:  check or refill everything, resubmit at once */
+static void source_sink_complete_list(struct usb_ep *ep,
+		struct list_head *done)
+{
+	struct f_sourcesink	*ss = ep->driver_data;
+	struct usb_composite_dev *cdev = ss->function.config->cdev;
+	struct usb_request	*req, *tmp;
+	int			status;
+	LIST_HEAD(batch);
+
+	list_for_each_entry_safe(req, tmp, done, list) {
+		list_del(&req->list);
+		if (source_sink_process(ep, req))
+			list_add_tail(&req->list, &batch);
+	}
+
+	status = usb_ep_queue_list(cdev->gadget, ep, &batch, GFP_ATOMIC);
+	if (status) {
+		ERROR(cdev, "kill %s:  resubmit --> %d\n", ep->name, status);
+		usb_ep_set_halt(ep);
+		list_for_each_entry_safe(req, tmp, &batch, list) {
+			list_del(&req->list);
+			free_ep_req(ep, req);
+		}
+	}
+}
+
 static int source_sink_start_ep(struct f_sourcesink *ss, bool is_in)
 {
+	struct usb_composite_dev	*cdev = ss->function.config->cdev;
 	struct usb_ep		*ep;
-	struct usb_request	*req;
+	struct usb_request	*req, *tmp;
+	unsigned		i;
 	int			status;
+	LIST_HEAD(reqs);
 
 	ep = is_in ? ss->in_ep : ss->out_ep;
-	req = alloc_ep_req(ep);
-	if (!req)
+	for (i = 0; i < max_t(unsigned, qlen, 1); i++) {
+		req = alloc_ep_req(ep);
+		if (!req)
+			break;
+
+		req->complete = source_sink_complete;
+		if (is_in)
+			reinit_write_data(ep, req);
+		else
+			memset(req->buf, 0x55, req->length);
+		list_add_tail(&req->list, &reqs);
+	}
+	if (!i)
 		return -ENOMEM;
 
-	req->complete = source_sink_complete;
-	if (is_in)
-		reinit_write_data(ep, req);
-	else
-		memset(req->buf, 0x55, req->length);
+	usb_ep_set_complete_list(cdev->gadget, ep, source_sink_complete_list);
 
-	status = usb_ep_queue(ep, req, GFP_ATOMIC);
+	status = usb_ep_queue_list(cdev->gadget, ep, &reqs, GFP_ATOMIC);
 	if (status) {
-		struct usb_composite_dev	*cdev;
-
-		cdev = ss->function.config->cdev;
 		ERROR(cdev, "start %s %s --> %d\n",
 				is_in ? "IN" : "OUT",
 				ep->name, status);
-		free_ep_req(ep, req);
+		list_for_each_entry_safe(req, tmp, &reqs, list) {
+			list_del(&req->list);
+			free_ep_req(ep, req);
+		}
 	}
 
 	return status;
@@ -144,6 +144,241 @@ static const struct usb_descriptor_header * const uvc_hs_streaming[] = {
 	NULL,
 };
 
+/* --------------------------------------------------------------------------
+ * Cached controls
+ */
+
+static struct uvc_control_entry *
+uvc_control_find(struct uvc_device *uvc, const struct usb_ctrlrequest *ctrl)
+{
+	unsigned int intf = le16_to_cpu(ctrl->wIndex) & 0xff;
+	unsigned int entity = le16_to_cpu(ctrl->wIndex) >> 8;
+	unsigned int selector = le16_to_cpu(ctrl->wValue) >> 8;
+	unsigned int i;
+
+	if (intf == uvc->control_intf)
+		intf = UVC_INTF_CONTROL;
+	else if (intf == uvc->streaming_intf)
+		intf = UVC_INTF_STREAMING;
+	else
+		return NULL;
+
+	for (i = 0; i < uvc->num_controls; ++i) {
+		struct uvc_control_entry *entry = &uvc->controls[i];
+
+		if (entry->intf == intf && entry->entity == entity &&
+		    entry->selector == selector)
+			return entry;
+	}
+
+	return NULL;
+}
+
+#ifndef UVC_CONTROL_CAP_SET
+#define UVC_CONTROL_CAP_SET			(1 << 1)
+#endif
+
+/* Whether a probe or commit control of length len holds field. UVC 1.0
+ * controls are 26 bytes, UVC 1.1 ones 34.
+ */
+#define UVC_STREAMING_HAS(len, field) \
+	(offsetof(struct uvc_streaming_control, field) + \
+	 sizeof(((struct uvc_streaming_control *)0)->field) <= (len))
+
+/* Negotiate a probe or commit request: clamp the host-selected fields
+ * between the min and max values and fill in the device-selected ones
+ * from the default value.
+ */
+static void
+uvc_control_negotiate(const struct uvc_control_entry *entry,
+		      struct uvc_streaming_control *ctrl)
+{
+	const struct uvc_streaming_control *min = (const void *)entry->min;
+	const struct uvc_streaming_control *max = (const void *)entry->max;
+	const struct uvc_streaming_control *def = (const void *)entry->def;
+	u32 interval;
+
+	if (!UVC_STREAMING_HAS(entry->length, dwMaxPayloadTransferSize))
+		return;
+
+	ctrl->bFormatIndex = clamp(ctrl->bFormatIndex, min->bFormatIndex,
+				   max->bFormatIndex);
+	ctrl->bFrameIndex = clamp(ctrl->bFrameIndex, min->bFrameIndex,
+				  max->bFrameIndex);
+
+	interval = le32_to_cpu(ctrl->dwFrameInterval);
+	if (interval == 0)
+		ctrl->dwFrameInterval = def->dwFrameInterval;
+	else
+		ctrl->dwFrameInterval = cpu_to_le32(clamp(interval,
+				le32_to_cpu(min->dwFrameInterval),
+				le32_to_cpu(max->dwFrameInterval)));
+
+	ctrl->wDelay = def->wDelay;
+	ctrl->dwMaxVideoFrameSize = def->dwMaxVideoFrameSize;
+	ctrl->dwMaxPayloadTransferSize = def->dwMaxPayloadTransferSize;
+
+	if (UVC_STREAMING_HAS(entry->length, dwClockFrequency))
+		ctrl->dwClockFrequency = def->dwClockFrequency;
+	if (UVC_STREAMING_HAS(entry->length, bmFramingInfo))
+		ctrl->bmFramingInfo = def->bmFramingInfo;
+	if (UVC_STREAMING_HAS(entry->length, bPreferedVersion))
+		ctrl->bPreferedVersion = def->bPreferedVersion;
+	if (UVC_STREAMING_HAS(entry->length, bMinVersion))
+		ctrl->bMinVersion = def->bMinVersion;
+	if (UVC_STREAMING_HAS(entry->length, bMaxVersion))
+		ctrl->bMaxVersion = def->bMaxVersion;
+}
+
+/* Handle the data stage of a SET_CUR request on a cached control. */
+static void
+uvc_control_set(struct uvc_device *uvc, struct usb_request *req)
+{
+	struct v4l2_event v4l2_event;
+	struct uvc_event *uvc_event = (void *)&v4l2_event.u.data;
+	struct uvc_control_entry *entry;
+	unsigned long flags;
+	int notify = 0;
+
+	memset(&v4l2_event, 0, sizeof(v4l2_event));
+
+	spin_lock_irqsave(&uvc->control_lock, flags);
+	entry = uvc_control_find(uvc, &uvc->control_set);
+	if (entry == NULL || req->status || req->actual != entry->length)
+		goto done;
+
+	memcpy(entry->cur, req->buf, entry->length);
+
+	if (entry->intf == UVC_INTF_STREAMING &&
+	    (entry->selector == UVC_VS_PROBE_CONTROL ||
+	     entry->selector == UVC_VS_COMMIT_CONTROL))
+		uvc_control_negotiate(entry, (void *)entry->cur);
+
+	/* The committed frame interval paces the stream, see
+	 * UVCIOC_SET_PACING.
+	 */
+	if (entry->intf == UVC_INTF_STREAMING &&
+	    entry->selector == UVC_VS_COMMIT_CONTROL &&
+	    UVC_STREAMING_HAS(entry->length, dwFrameInterval)) {
+		const struct uvc_streaming_control *commit = (void *)entry->cur;
+
+		uvc->video.frame_interval =
+			le32_to_cpu(commit->dwFrameInterval);
+	}
+
+	/* Probing is handled entirely in the kernel, only report values
+	 * that actually take effect.
+	 */
+	if (entry->intf != UVC_INTF_STREAMING ||
+	    entry->selector != UVC_VS_PROBE_CONTROL) {
+		v4l2_event.type = UVC_EVENT_CONTROL;
+		uvc_event->control.intf = entry->intf;
+		uvc_event->control.entity = entry->entity;
+		uvc_event->control.selector = entry->selector;
+		uvc_event->control.length = entry->length;
+		memcpy(uvc_event->control.data, entry->cur, entry->length);
+		notify = 1;
+	}
+
+done:
+	spin_unlock_irqrestore(&uvc->control_lock, flags);
+
+	if (notify)
+		v4l2_event_queue(uvc->vdev, &v4l2_event);
+}
+
+/* Answer a class request from the cached control table. Returns
+ * -EOPNOTSUPP if the control isn't cached and the request must be
+ * forwarded to userspace.
+ */
+static int
+uvc_control_setup(struct uvc_device *uvc, const struct usb_ctrlrequest *ctrl)
+{
+	struct usb_composite_dev *cdev = uvc->func.config->cdev;
+	struct usb_request *req = uvc->control_req;
+	unsigned int length = le16_to_cpu(ctrl->wLength);
+	struct uvc_control_entry *entry;
+	const void *data = NULL;
+	unsigned int size;
+	unsigned long flags;
+	__le16 len;
+
+	spin_lock_irqsave(&uvc->control_lock, flags);
+
+	entry = uvc_control_find(uvc, ctrl);
+	if (entry == NULL) {
+		spin_unlock_irqrestore(&uvc->control_lock, flags);
+		return -EOPNOTSUPP;
+	}
+
+	size = entry->length;
+
+	/* SET_CUR is the only host-to-device request, and only valid on
+	 * controls that advertise SET support in GET_INFO.
+	 */
+	if ((ctrl->bRequest == UVC_SET_CUR) !=
+	    !(ctrl->bRequestType & USB_DIR_IN))
+		goto stall;
+
+	switch (ctrl->bRequest) {
+	case UVC_SET_CUR:
+		if (!(entry->info & UVC_CONTROL_CAP_SET))
+			goto stall;
+		if (length != entry->length)
+			goto stall;
+		uvc->control_set = *ctrl;
+		uvc->control_set_pending = 1;
+		break;
+
+	case UVC_GET_CUR:
+		data = entry->cur;
+		break;
+	case UVC_GET_MIN:
+		data = entry->min;
+		break;
+	case UVC_GET_MAX:
+		data = entry->max;
+		break;
+	case UVC_GET_DEF:
+		data = entry->def;
+		break;
+	case UVC_GET_RES:
+		data = entry->res;
+		break;
+	case UVC_GET_LEN:
+		len = cpu_to_le16(entry->length);
+		data = &len;
+		size = sizeof(len);
+		break;
+	case UVC_GET_INFO:
+		data = &entry->info;
+		size = sizeof(entry->info);
+		break;
+
+	default:
+		goto stall;
+	}
+
+	if (data) {
+		size = min(size, length);
+		memcpy(req->buf, data, size);
+		req->length = size;
+		req->zero = size < length;
+	} else {
+		req->length = length;
+		req->zero = 0;
+	}
+
+	spin_unlock_irqrestore(&uvc->control_lock, flags);
+
+	req->dma = DMA_ADDR_INVALID;
+	return usb_ep_queue(cdev->gadget->ep0, req, GFP_ATOMIC);
+
+stall:
+	spin_unlock_irqrestore(&uvc->control_lock, flags);
+	return -EINVAL;
+}
+
 /* --------------------------------------------------------------------------
  * Control requests
  */
@@ -155,6 +390,12 @@ uvc_function_ep0_complete(struct usb_ep *ep, struct usb_request *req)
 	struct v4l2_event v4l2_event;
 	struct uvc_event *uvc_event = (void *)&v4l2_event.u.data;
 
+	if (uvc->control_set_pending) {
+		uvc->control_set_pending = 0;
+		uvc_control_set(uvc, req);
+		return;
+	}
+
 	if (uvc->event_setup_out) {
 		uvc->event_setup_out = 0;
 
@@ -172,6 +413,7 @@ uvc_function_setup(struct usb_function *f, const struct usb_ctrlrequest *ctrl)
 	struct uvc_device *uvc = to_uvc(f);
 	struct v4l2_event v4l2_event;
 	struct uvc_event *uvc_event = (void *)&v4l2_event.u.data;
+	int ret;
 
 	/* printk(KERN_INFO "setup request %02x %02x value %04x index %04x %04x\n",
 	 *	ctrl->bRequestType, ctrl->bRequest, le16_to_cpu(ctrl->wValue),
@@ -187,6 +429,10 @@ uvc_function_setup(struct usb_function *f, const struct usb_ctrlrequest *ctrl)
 	if (le16_to_cpu(ctrl->wLength) > UVC_MAX_REQUEST_SIZE)
 		return -EINVAL;
 
+	ret = uvc_control_setup(uvc, ctrl);
+	if (ret != -EOPNOTSUPP)
+		return ret;
+
 	memset(&v4l2_event, 0, sizeof(v4l2_event));
 	v4l2_event.type = UVC_EVENT_SETUP;
 	memcpy(&uvc_event->req, ctrl, sizeof(uvc_event->req));
@@ -248,8 +494,10 @@ uvc_function_set_alt(struct usb_function *f, unsigned interface, unsigned alt)
 		if (uvc->state != UVC_STATE_STREAMING)
 			return 0;
 
-		if (uvc->video.ep)
+		if (uvc->video.ep) {
+			uvc_video_stop(&uvc->video);
 			usb_ep_disable(uvc->video.ep);
+		}
 
 		memset(&v4l2_event, 0, sizeof(v4l2_event));
 		v4l2_event.type = UVC_EVENT_STREAMOFF;
@@ -262,8 +510,9 @@ uvc_function_set_alt(struct usb_function *f, unsigned interface, unsigned alt)
 		if (uvc->state != UVC_STATE_CONNECTED)
 			return 0;
 
-		if (uvc->video.ep)
-			usb_ep_enable(uvc->video.ep, &uvc_streaming_ep);
+		if (uvc->video.ep &&
+		    usb_ep_enable(uvc->video.ep, &uvc_streaming_ep) == 0)
+			uvc_video_start(&uvc->video);
 
 		memset(&v4l2_event, 0, sizeof(v4l2_event));
 		v4l2_event.type = UVC_EVENT_STREAMON;
@@ -291,6 +540,8 @@ uvc_function_disable(struct usb_function *f)
 	v4l2_event.type = UVC_EVENT_DISCONNECT;
 	v4l2_event_queue(uvc->vdev, &v4l2_event);
 
+	if (uvc->video.ep)
+		uvc_video_stop(&uvc->video);
 	uvc->state = UVC_STATE_DISCONNECTED;
 }
 
@@ -474,15 +725,22 @@ uvc_function_unbind(struct usb_configuration *c, struct usb_function *f)
 	if (uvc->video.ep)
 		uvc->video.ep->driver_data = NULL;
 
-	if (uvc->control_req) {
-		usb_ep_free_request(cdev->gadget->ep0, uvc->control_req);
-		kfree(uvc->control_buf);
-	}
+	uvc_video_debugfs_cleanup(&uvc->video);
+	if (uvc->video.req_size)
+		uvc_video_pace_stop(&uvc->video);
+	uvc_video_free_requests(&uvc->video);
+
+	if (uvc->control_req)
+		usb_mem_free_request(&uvc_mem, cdev->gadget->ep0,
+				uvc->control_req);
+	usb_mem_kfree(&uvc_mem, uvc->control_buf);
 
+	kfree(uvc->controls);
 	kfree(f->descriptors);
 	kfree(f->hs_descriptors);
 
 	kfree(uvc);
+	usb_mem_unregister(&uvc_mem, NULL);
 }
 
 static int __init
@@ -495,6 +753,8 @@ uvc_function_bind(struct usb_configuration *c, struct usb_function *f)
 
 	INFO(cdev, "uvc_function_bind\n");
 
+	usb_mem_register(&uvc_mem, NULL);
+
 	/* Allocate endpoints. */
 	ep = usb_ep_autoconfig(cdev->gadget, &uvc_control_ep);
 	if (!ep) {
@@ -530,8 +790,10 @@ uvc_function_bind(struct usb_configuration *c, struct usb_function *f)
 	f->hs_descriptors = uvc_copy_descriptors(uvc, USB_SPEED_HIGH);
 
 	/* Preallocate control endpoint request. */
-	uvc->control_req = usb_ep_alloc_request(cdev->gadget->ep0, GFP_KERNEL);
-	uvc->control_buf = kmalloc(UVC_MAX_REQUEST_SIZE, GFP_KERNEL);
+	uvc->control_req = usb_mem_alloc_request(&uvc_mem, cdev->gadget->ep0,
+			GFP_KERNEL);
+	uvc->control_buf = usb_mem_kmalloc(&uvc_mem, UVC_MAX_REQUEST_SIZE,
+			GFP_KERNEL);
 	if (uvc->control_req == NULL || uvc->control_buf == NULL) {
 		ret = -ENOMEM;
 		goto error;
@@ -552,6 +814,13 @@ uvc_function_bind(struct usb_configuration *c, struct usb_function *f)
 	if (ret < 0)
 		goto error;
 
+	ret = uvc_video_alloc_requests(&uvc->video,
+			le16_to_cpu(uvc_streaming_ep.wMaxPacketSize) & 0x7ff);
+	if (ret < 0)
+		goto error;
+
+	uvc_video_debugfs_init(&uvc->video);
+
 	/* Register a V4L2 device. */
 	ret = uvc_register_video(uvc);
 	if (ret < 0) {
@@ -600,6 +869,7 @@ uvc_bind_config(struct usb_configuration *c,
 		return -ENOMEM;
 
 	uvc->state = UVC_STATE_DISCONNECTED;
+	spin_lock_init(&uvc->control_lock);
 
 	/* Validate the descriptors. */
 	if (control == NULL || control[0] == NULL ||
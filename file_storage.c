@@ -252,6 +252,7 @@
 #include <linux/usb/gadget.h>
 
 #include "gadget_chips.h"
+#include "usb_sched.h"
 
 
 
@@ -321,6 +322,8 @@ static struct {
 	int		protocol_type;
 	char		*protocol_name;
 
+	struct usb_sched thread_sched;
+
 } mod_data = {					// Default values
 	.transport_parm		= "BBB",
 	.protocol_parm		= "SCSI",
@@ -335,6 +338,7 @@ static struct {
 	.product		= FSG_PRODUCT_ID,
 	.release		= 0xffff,	// Use controller chip type
 	.buflen			= 16384,
+	.thread_sched		= USB_SCHED_DEFAULT,
 	};
 
 
@@ -357,6 +361,8 @@ MODULE_PARM_DESC(stall, "false to prevent bulk stalls");
 module_param_named(cdrom, mod_data.cdrom, bool, S_IRUGO);
 MODULE_PARM_DESC(cdrom, "true to emulate cdrom instead of disk");
 
+USB_SCHED_MODULE_PARAMETERS(thread, mod_data.thread_sched);
+
 
 /* In the non-TEST version, only the module parameters listed above
  * are available. */
@@ -3526,6 +3532,9 @@ static int __init fsg_bind(struct usb_gadget *gadget)
 		rc = PTR_ERR(fsg->thread_task);
 		goto out;
 	}
+	rc = usb_sched_apply(&mod_data.thread_sched, fsg->thread_task);
+	if (rc)
+		WARNING(fsg, "thread scheduling: error %d\n", rc);
 
 	INFO(fsg, DRIVER_DESC ", version: " DRIVER_VERSION "\n");
 	INFO(fsg, "Number of LUNs=%d\n", fsg->nluns);
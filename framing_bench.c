@@ -0,0 +1,387 @@
+/*
+ * framing_bench.c -- microbenchmarks for gadget framing and copy routines
+ *
+ * Copyright (C) 2010
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * This module never touches a USB link.  It feeds synthetic buffers
+ * through the per-packet helpers the function drivers use on their
+ * data paths, and reports ns per call and the resulting throughput:
+ *
+ *   - RNDIS header add/remove (rndis_add_header, rndis_rm_hdr)
+ *   - EEM wrap/unwrap (eem_wrap, eem_unwrap)
+ *   - the serial TX circular buffer (gs_buf_put, gs_buf_get)
+ *   - UVC payload encoding (uvc_video_encode_bulk, uvc_video_encode_isoc)
+ *   - MIDI to USB-MIDI encoding (gmidi_transmit_byte)
+ *
+ * The benchmarks run once at module load, with results in the kernel
+ * log; reload the module to measure again.  Nothing else is set up, so
+ * no gadget driver or netdev/tty/video node is registered.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/ktime.h>
+#include <linux/vmalloc.h>
+#include <linux/skbuff.h>
+#include <linux/slab.h>
+
+#include "u_ether.h"
+#include "rndis.h"
+
+/*
+ * Kbuild is not very cooperative with respect to linking separately
+ * compiled library objects into one module.  So the per-packet helpers
+ * live in small files of their own, which the function drivers and this
+ * module both #include; none of the drivers around them is built here.
+ */
+#include "gs_buf.c"
+#include "rndis_framing.c"
+#include "eem_framing.c"
+#include "uvc_encode.c"
+#include "midi_common.c"
+
+/*-------------------------------------------------------------------------*/
+
+MODULE_DESCRIPTION("USB gadget framing microbenchmarks");
+MODULE_LICENSE("GPL");
+
+static const char shortname[] = "framing_bench";
+
+static unsigned iterations = 10000;
+module_param(iterations, uint, 0);
+MODULE_PARM_DESC(iterations, "calls measured per routine and size");
+
+static unsigned tx_headroom = NET_SKB_PAD;
+module_param(tx_headroom, uint, 0);
+MODULE_PARM_DESC(tx_headroom, "headroom of synthetic TX skbs");
+
+static unsigned uvc_frame = 640 * 480 * 2;
+module_param(uvc_frame, uint, 0);
+MODULE_PARM_DESC(uvc_frame, "bytes per synthetic video frame");
+
+/* skbs are prepared, then processed, this many at a time */
+#define BENCH_BATCH	64
+
+/* same size as u_serial's TX buffer */
+#define BENCH_GS_BUF	8192
+
+static const unsigned net_sizes[] = { 64, 512, 1514 };
+static const unsigned gs_sizes[] = { 1, 64, 512, 4096 };
+static const unsigned uvc_req_sizes[] = { 512, 3072, 16384 };
+
+static void bench_report(const char *name, unsigned size,
+		unsigned long ops, u64 bytes, s64 ns)
+{
+	if (!ops || ns <= 0) {
+		pr_info("%s: %-24s %6u: no result\n", shortname, name, size);
+		return;
+	}
+	pr_info("%s: %-24s %6u: %6llu ns/op %9llu KB/s\n",
+		shortname, name, size, div_u64(ns, ops),
+		div64_u64(bytes * NSEC_PER_SEC, ns) >> 10);
+}
+
+/*-------------------------------------------------------------------------*/
+
+/* Ethernet framing: what the stack hands u_ether, and what comes back */
+
+static struct sk_buff *bench_tx_skb(unsigned size, unsigned headroom)
+{
+	struct sk_buff	*skb;
+
+	skb = alloc_skb(headroom + size, GFP_KERNEL);
+	if (skb) {
+		skb_reserve(skb, headroom);
+		memset(skb_put(skb, size), 0x5a, size);
+	}
+	return skb;
+}
+
+static void bench_wrap(const char *name, struct gether *port,
+		struct sk_buff *(*wrap)(struct gether *, struct sk_buff *),
+		unsigned size)
+{
+	struct sk_buff	*skb[BENCH_BATCH];
+	unsigned long	ops = 0;
+	s64		ns = 0;
+	unsigned	i, n;
+
+	while (ops < iterations) {
+		ktime_t	t0;
+
+		for (n = 0; n < BENCH_BATCH; n++) {
+			skb[n] = bench_tx_skb(size, tx_headroom);
+			if (!skb[n])
+				break;
+		}
+
+		t0 = ktime_get();
+		for (i = 0; i < n; i++)
+			skb[i] = wrap(port, skb[i]);
+		ns += ktime_to_ns(ktime_sub(ktime_get(), t0));
+		ops += n;
+
+		for (i = 0; i < n; i++)
+			dev_kfree_skb_any(skb[i]);
+		if (n < BENCH_BATCH)
+			break;
+	}
+	bench_report(name, size, ops, (u64)ops * size, ns);
+}
+
+static void bench_unwrap(const char *name, struct gether *port,
+		struct sk_buff *(*wrap)(struct gether *, struct sk_buff *),
+		int (*unwrap)(struct gether *, struct sk_buff *,
+				struct sk_buff_head *),
+		unsigned size)
+{
+	struct sk_buff		*skb[BENCH_BATCH];
+	struct sk_buff_head	list;
+	unsigned long		ops = 0;
+	s64			ns = 0;
+	unsigned		i, n;
+
+	skb_queue_head_init(&list);
+	while (ops < iterations) {
+		ktime_t	t0;
+
+		/* framed the same way the host would have done it */
+		for (n = 0; n < BENCH_BATCH; n++) {
+			skb[n] = bench_tx_skb(size, 64);
+			if (skb[n])
+				skb[n] = wrap(port, skb[n]);
+			if (!skb[n])
+				break;
+		}
+
+		t0 = ktime_get();
+		for (i = 0; i < n; i++)
+			unwrap(port, skb[i], &list);
+		ns += ktime_to_ns(ktime_sub(ktime_get(), t0));
+		ops += n;
+
+		skb_queue_purge(&list);
+		if (n < BENCH_BATCH)
+			break;
+	}
+	bench_report(name, size, ops, (u64)ops * size, ns);
+}
+
+static void bench_ether(void)
+{
+	static struct usb_gadget	gadget;
+	static struct usb_composite_dev	cdev = { .gadget = &gadget, };
+	static struct usb_configuration	config = { .cdev = &cdev, };
+	static struct usb_ep		in_ep = { .maxpacket = 512, };
+	struct gether			port = {
+		.func.config	= &config,
+		.in_ep		= &in_ep,
+	};
+	unsigned			i;
+
+	for (i = 0; i < ARRAY_SIZE(net_sizes); i++) {
+		bench_wrap("rndis_add_header", &port, rndis_add_header,
+				net_sizes[i]);
+		bench_unwrap("rndis_rm_hdr", &port, rndis_add_header,
+				rndis_rm_hdr, net_sizes[i]);
+		bench_wrap("eem_wrap", &port, eem_wrap, net_sizes[i]);
+		bench_unwrap("eem_unwrap", &port, eem_wrap, eem_unwrap,
+				net_sizes[i]);
+	}
+}
+
+/*-------------------------------------------------------------------------*/
+
+/* serial: a tty write followed by the TX path draining it */
+
+static void bench_gs_buf(void)
+{
+	struct gs_buf	gb;
+	char		*data;
+	unsigned	i, n;
+
+	data = kmalloc(gs_sizes[ARRAY_SIZE(gs_sizes) - 1], GFP_KERNEL);
+	if (!data || gs_buf_alloc(&gb, BENCH_GS_BUF)) {
+		kfree(data);
+		return;
+	}
+	memset(data, 0x5a, gs_sizes[ARRAY_SIZE(gs_sizes) - 1]);
+
+	for (i = 0; i < ARRAY_SIZE(gs_sizes); i++) {
+		unsigned	size = gs_sizes[i];
+		u64		bytes = 0;
+		ktime_t		t0;
+		s64		ns;
+
+		t0 = ktime_get();
+		for (n = 0; n < iterations; n++) {
+			bytes += gs_buf_put(&gb, data, size);
+			gs_buf_get(&gb, data, size);
+		}
+		ns = ktime_to_ns(ktime_sub(ktime_get(), t0));
+		bench_report("gs_buf_put+get", size, iterations, bytes, ns);
+	}
+
+	gs_buf_free(&gb);
+	kfree(data);
+}
+
+/*-------------------------------------------------------------------------*/
+
+/* UVC: split whole frames into requests, as the completion handler does */
+
+static void bench_uvc_encode(const char *name, struct uvc_video *video,
+		void (*encode)(struct usb_request *, struct uvc_video *,
+				struct uvc_buffer *),
+		struct usb_request *req)
+{
+	struct uvc_video_queue	*queue = &video->queue;
+	struct uvc_buffer	*buf = &queue->buffer[0];
+	unsigned long		ops = 0;
+	u64			bytes = 0;
+	ktime_t			t0;
+
+	video->fid = 0;
+	video->payload_size = 0;
+	queue->buf_used = 0;
+
+	t0 = ktime_get();
+	while (ops < iterations) {
+		buf->state = UVC_BUF_STATE_QUEUED;
+		buf->buf.bytesused = uvc_frame;
+		list_add_tail(&buf->queue, &queue->irqqueue);
+
+		while (buf->state != UVC_BUF_STATE_DONE) {
+			encode(req, video, buf);
+			bytes += req->length;
+			ops++;
+		}
+	}
+	bench_report(name, video->req_size, ops, bytes,
+			ktime_to_ns(ktime_sub(ktime_get(), t0)));
+}
+
+static void bench_uvc(void)
+{
+	struct uvc_video	*video;
+	struct uvc_buffer	*buf;
+	struct usb_request	req = { };
+	unsigned		i;
+
+	video = kzalloc(sizeof *video, GFP_KERNEL);
+	if (!video)
+		return;
+	spin_lock_init(&video->queue.irqlock);
+	INIT_LIST_HEAD(&video->queue.irqqueue);
+
+	video->queue.mem = vmalloc(uvc_frame);
+	req.buf = kmalloc(uvc_req_sizes[ARRAY_SIZE(uvc_req_sizes) - 1],
+			GFP_KERNEL);
+	if (!video->queue.mem || !req.buf)
+		goto done;
+	memset(video->queue.mem, 0x80, uvc_frame);
+
+	buf = &video->queue.buffer[0];
+	buf->buf.m.offset = 0;
+	buf->buf.length = uvc_frame;
+	init_waitqueue_head(&buf->wait);
+
+	for (i = 0; i < ARRAY_SIZE(uvc_req_sizes); i++) {
+		video->req_size = uvc_req_sizes[i];
+
+		/* bulk: one payload per frame */
+		video->max_payload_size = uvc_frame;
+		bench_uvc_encode("uvc_video_encode_bulk", video,
+				uvc_video_encode_bulk, &req);
+
+		video->max_payload_size = 0;
+		bench_uvc_encode("uvc_video_encode_isoc", video,
+				uvc_video_encode_isoc, &req);
+	}
+
+done:
+	kfree(req.buf);
+	vfree(video->queue.mem);
+	kfree(video);
+}
+
+/*-------------------------------------------------------------------------*/
+
+/* MIDI: one rawmidi byte at a time into a bulk IN request */
+
+static void bench_midi_stream(const char *name, const u8 *stream,
+		unsigned len, struct usb_request *req, unsigned buflen)
+{
+	struct gmidi_in_port	port = { };
+	unsigned long		n;
+	ktime_t			t0;
+
+	req->length = 0;
+	t0 = ktime_get();
+	for (n = 0; n < iterations; n++) {
+		/* same fill limit gmidi_transmit() uses */
+		if (req->length + 3 >= buflen)
+			req->length = 0;
+		gmidi_transmit_byte(req, &port, stream[n % len]);
+	}
+	bench_report(name, 1, iterations, iterations,
+			ktime_to_ns(ktime_sub(ktime_get(), t0)));
+}
+
+static void bench_midi(void)
+{
+	static const u8		notes[] = {
+		0x90, 0x3c, 0x7f, 0x80, 0x3c, 0x00,	/* on, off */
+		0xb0, 0x07, 0x64, 0xc0, 0x05,		/* cc, program */
+		0xf8,					/* clock */
+	};
+	static const u8		sysex[] = {
+		0xf0, 0x7e, 0x7f, 0x06, 0x01, 0x10, 0x20, 0x30, 0xf7,
+	};
+	struct usb_request	req = { };
+	unsigned		buflen = 512;
+
+	req.buf = kmalloc(buflen, GFP_KERNEL);
+	if (!req.buf)
+		return;
+
+	bench_midi_stream("gmidi_transmit_byte", notes, sizeof notes,
+			&req, buflen);
+	bench_midi_stream("gmidi_transmit_byte/sysex", sysex, sizeof sysex,
+			&req, buflen);
+	kfree(req.buf);
+}
+
+/*-------------------------------------------------------------------------*/
+
+static int __init init(void)
+{
+	if (!iterations)
+		return -EINVAL;
+
+	pr_info("%s: %u calls per routine and size\n",
+			shortname, iterations);
+	bench_ether();
+	bench_gs_buf();
+	bench_uvc();
+	bench_midi();
+	return 0;
+}
+module_init(init);
+
+static void __exit cleanup(void)
+{
+}
+module_exit(cleanup);
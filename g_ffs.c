@@ -209,15 +209,59 @@ static struct usb_composite_driver gfs_driver = {
 };
 
 
-static struct ffs_data *gfs_ffs_data;
-static unsigned long gfs_registered;
+/* FunctionFS instances.  With no "functions" parameter a single
+ * instance is created which accepts any dev_name (the historical
+ * behaviour); otherwise one instance per listed name is created and
+ * the gadget is registered only once every one of them has received
+ * its descriptors and strings. */
+
+#define GFS_MAX_DEVS	10
+
+struct gfs_ffs_obj {
+	const char		*name;
+	bool			mounted;
+	bool			desc_ready;
+	struct ffs_data		*ffs_data;
+};
+
+static char *gfs_func_names[GFS_MAX_DEVS];
+static unsigned gfs_func_num;
+module_param_array_named(functions, gfs_func_names, charp, &gfs_func_num, 0);
+MODULE_PARM_DESC(functions, "Comma separated list of FunctionFS instance names (dev_name passed to mount), at most 10.  Each instance gets its own interfaces in every configuration.  If not given a single instance accepting any name is created.");
+
+static struct gfs_ffs_obj *gfs_ffs_tab;
+static unsigned gfs_missing_funcs;
+static bool gfs_registered;
+static bool gfs_bound;
+
+/* Protects gfs_ffs_tab entries, gfs_missing_funcs and gfs_registered. */
+static DEFINE_MUTEX(gfs_lock);
 
 
 static int  gfs_init(void)
 {
+	unsigned i;
+	int ret;
+
 	ENTER();
 
-	return functionfs_init();
+	if (!gfs_func_num) {
+		gfs_func_num = 1;
+		gfs_func_names[0] = NULL;
+	}
+
+	gfs_ffs_tab = kcalloc(gfs_func_num, sizeof *gfs_ffs_tab, GFP_KERNEL);
+	if (unlikely(!gfs_ffs_tab))
+		return -ENOMEM;
+
+	for (i = 0; i < gfs_func_num; ++i)
+		gfs_ffs_tab[i].name = gfs_func_names[i];
+	gfs_missing_funcs = gfs_func_num;
+
+	ret = functionfs_init();
+	if (unlikely(ret < 0))
+		kfree(gfs_ffs_tab);
+	return ret;
 }
 module_init(gfs_init);
 
@@ -225,53 +269,152 @@ static void  gfs_exit(void)
 {
 	ENTER();
 
-	if (test_and_clear_bit(0, &gfs_registered))
+	mutex_lock(&gfs_lock);
+	if (gfs_registered)
 		usb_composite_unregister(&gfs_driver);
+	gfs_registered = false;
+	mutex_unlock(&gfs_lock);
 
 	functionfs_cleanup();
+	kfree(gfs_ffs_tab);
 }
 module_exit(gfs_exit);
 
 
+static struct gfs_ffs_obj *gfs_find_dev(const char *dev_name)
+{
+	unsigned i;
+
+	if (!gfs_ffs_tab[0].name)
+		return gfs_ffs_tab;
+
+	for (i = 0; i < gfs_func_num; ++i)
+		if (!strcmp(gfs_ffs_tab[i].name, dev_name))
+			return gfs_ffs_tab + i;
+
+	return NULL;
+}
+
+
 static int functionfs_ready_callback(struct ffs_data *ffs)
 {
-	int ret;
+	struct gfs_ffs_obj *ffs_obj = ffs->private_data;
+	int ret = 0;
 
 	ENTER();
 
-	if (WARN_ON(test_and_set_bit(0, &gfs_registered)))
-		return -EBUSY;
+	if (WARN_ON(!ffs_obj))
+		return -EINVAL;
+
+	mutex_lock(&gfs_lock);
+
+	if (WARN_ON(ffs_obj->desc_ready)) {
+		ret = -EBUSY;
+		goto done;
+	}
+	ffs_obj->desc_ready = true;
+	ffs_obj->ffs_data = ffs;
+
+	if (--gfs_missing_funcs)
+		goto done;
+
+	if (WARN_ON(gfs_registered)) {
+		ret = -EBUSY;
+		goto undo;
+	}
 
-	gfs_ffs_data = ffs;
 	ret = usb_composite_register(&gfs_driver);
-	if (unlikely(ret < 0))
-		clear_bit(0, &gfs_registered);
+	if (likely(ret >= 0)) {
+		gfs_registered = true;
+		goto done;
+	}
+
+undo:
+	++gfs_missing_funcs;
+	ffs_obj->desc_ready = false;
+	ffs_obj->ffs_data = NULL;
+done:
+	mutex_unlock(&gfs_lock);
 	return ret;
 }
 
 static void functionfs_closed_callback(struct ffs_data *ffs)
 {
+	struct gfs_ffs_obj *ffs_obj = ffs->private_data;
+
 	ENTER();
 
-	if (test_and_clear_bit(0, &gfs_registered))
+	if (WARN_ON(!ffs_obj))
+		return;
+
+	mutex_lock(&gfs_lock);
+
+	/* A stale instance, one a remount has replaced, never became
+	 * part of the gadget; leave the live instance's state alone. */
+	if (ffs_obj->ffs_data != ffs)
+		goto done;
+
+	/* Any instance going away takes the whole gadget down; it
+	 * comes back once the daemon writes its descriptors again. */
+	if (gfs_registered)
 		usb_composite_unregister(&gfs_driver);
+	gfs_registered = false;
+
+	ffs_obj->desc_ready = false;
+	ffs_obj->ffs_data = NULL;
+	++gfs_missing_funcs;
+
+done:
+	mutex_unlock(&gfs_lock);
 }
 
 
 static int functionfs_check_dev_callback(const char *dev_name)
 {
-	return 0;
+	return gfs_find_dev(dev_name) ? 0 : -ENOENT;
+}
+
+static void *functionfs_acquire_dev_callback(const char *dev_name)
+{
+	struct gfs_ffs_obj *ffs_obj;
+
+	ENTER();
+
+	mutex_lock(&gfs_lock);
+
+	ffs_obj = gfs_find_dev(dev_name);
+	if (unlikely(!ffs_obj))
+		ffs_obj = ERR_PTR(-ENOENT);
+	else if (ffs_obj->mounted)
+		ffs_obj = ERR_PTR(-EBUSY);
+	else
+		ffs_obj->mounted = true;
+
+	mutex_unlock(&gfs_lock);
+	return ffs_obj;
+}
+
+static void functionfs_release_dev_callback(struct ffs_data *ffs_data)
+{
+	struct gfs_ffs_obj *ffs_obj = ffs_data->private_data;
+
+	ENTER();
+
+	mutex_lock(&gfs_lock);
+	ffs_obj->mounted = false;
+	mutex_unlock(&gfs_lock);
 }
 
 
 
 static int gfs_bind(struct usb_composite_dev *cdev)
 {
+	unsigned i;
 	int ret;
 
 	ENTER();
 
-	if (WARN_ON(!gfs_ffs_data))
+	if (WARN_ON(gfs_missing_funcs))
 		return -ENODEV;
 
 	ret = gether_setup(cdev->gadget, gfs_hostaddr);
@@ -320,9 +463,11 @@ static int gfs_bind(struct usb_composite_dev *cdev)
 	gfs_generic_config_driver.iConfiguration = ret;
 #endif
 
-	ret = functionfs_bind(gfs_ffs_data, cdev);
-	if (unlikely(ret < 0))
-		goto error;
+	for (i = 0; i < gfs_func_num; ++i) {
+		ret = functionfs_bind(gfs_ffs_tab[i].ffs_data, cdev);
+		if (unlikely(ret < 0))
+			goto error_unbind_some;
+	}
 
 	ret = gfs_add_rndis_config(cdev);
 	if (unlikely(ret < 0))
@@ -336,14 +481,17 @@ static int gfs_bind(struct usb_composite_dev *cdev)
 	if (unlikely(ret < 0))
 		goto error_unbind;
 
+	gfs_bound = true;
 	return 0;
 
 error_unbind:
-	functionfs_unbind(gfs_ffs_data);
+	i = gfs_func_num;
+error_unbind_some:
+	while (i--)
+		functionfs_unbind(gfs_ffs_tab[i].ffs_data);
 error:
 	gether_cleanup();
 error_quick:
-	gfs_ffs_data = NULL;
 	return ret;
 }
 
@@ -353,15 +501,18 @@ static int gfs_unbind(struct usb_composite_dev *cdev)
 
 	/* We may have been called in an error recovery frem
 	 * composite_bind() after gfs_unbind() failure so we need to
-	 * check if gfs_ffs_data is not NULL since gfs_bind() handles
+	 * check if we are bound since gfs_bind() handles
 	 * all error recovery itself.  I'd rather we werent called
 	 * from composite on orror recovery, but what you're gonna
 	 * do...? */
 
-	if (gfs_ffs_data) {
+	if (gfs_bound) {
+		unsigned i;
+
 		gether_cleanup();
-		functionfs_unbind(gfs_ffs_data);
-		gfs_ffs_data = NULL;
+		for (i = 0; i < gfs_func_num; ++i)
+			functionfs_unbind(gfs_ffs_tab[i].ffs_data);
+		gfs_bound = false;
 	}
 
 	return 0;
@@ -372,9 +523,10 @@ static int __gfs_do_config(struct usb_configuration *c,
 			   int (*eth)(struct usb_configuration *c, u8 *ethaddr),
 			   u8 *ethaddr)
 {
+	unsigned i;
 	int ret;
 
-	if (WARN_ON(!gfs_ffs_data))
+	if (WARN_ON(gfs_missing_funcs))
 		return -ENODEV;
 
 	if (gadget_is_otg(c->cdev->gadget)) {
@@ -388,9 +540,11 @@ static int __gfs_do_config(struct usb_configuration *c,
 			return ret;
 	}
 
-	ret = functionfs_add(c->cdev, c, gfs_ffs_data);
-	if (unlikely(ret < 0))
-		return ret;
+	for (i = 0; i < gfs_func_num; ++i) {
+		ret = functionfs_add(c->cdev, c, gfs_ffs_tab[i].ffs_data);
+		if (unlikely(ret < 0))
+			return ret;
+	}
 
 	/* After previous do_configs there may be some invalid
 	 * pointers in c->interface array.  This happens every time
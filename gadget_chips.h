@@ -230,4 +230,15 @@ static inline bool gadget_supports_altsettings(struct usb_gadget *gadget)
 	return true;
 }
 
+/**
+ * gadget_supports_batch - return true if usb_ep_queue_list() is native
+ * @gadget: the gadget in question
+ *
+ * These controllers' endpoint ops are a struct usb_ep_batch_ops.
+ */
+static inline bool gadget_supports_batch(struct usb_gadget *gadget)
+{
+	return gadget_is_dummy(gadget) || gadget_is_arcotg(gadget);
+}
+
 #endif /* __GADGET_CHIPS_H */
@@ -0,0 +1,517 @@
+/*
+ * gadgetmon.c - device side USB traffic capture
+ *
+ * See gadgetmon.h for what is captured and the ring layout.  This file
+ * is included by composite.c, which attaches the monitor to the gadget
+ * it binds to.
+ *
+ * Capture must work with every controller driver in the tree, so it
+ * doesn't live in any of them.  Instead each endpoint's ops pointer is
+ * switched to a private copy of the controller's ops, with queue() (and
+ * the batch calls from ep_batch.h) interposed.  While capturing, a
+ * submitted request's complete() is swapped for one that logs the
+ * completion and restores the original before calling it.
+ *
+ * Copyright (C) 2010
+ *
+ * This software is distributed under the terms of the GNU General
+ * Public License ("GPL") as published by the Free Software Foundation,
+ * either version 2 of that License or (at your option) any later version.
+ */
+
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/hash.h>
+#include <linux/percpu.h>
+#include <linux/mutex.h>
+#include <linux/debugfs.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/gadget.h>
+
+#include "gadgetmon.h"
+#include "ep_batch.h"
+
+static unsigned gadgetmon_snaplen;
+module_param(gadgetmon_snaplen, uint, S_IRUGO|S_IWUSR);
+MODULE_PARM_DESC(gadgetmon_snaplen, "payload bytes captured per request");
+
+#define GMON_MAX_CAPLEN		4096
+
+static unsigned gadgetmon_ring_kb = 256;
+module_param(gadgetmon_ring_kb, uint, S_IRUGO);
+MODULE_PARM_DESC(gadgetmon_ring_kb, "capture ring size per CPU, in KB");
+
+/* per endpoint:  the controller's ops, and our copy of them */
+struct gmon_ep {
+	struct usb_ep_batch_ops	ops;
+	const struct usb_ep_ops	*orig;
+	struct usb_ep		*ep;
+
+	u8			epnum;
+	u8			xfer;
+
+	/* the function driver's, when it takes batched completions */
+	void			(*complete_list)(struct usb_ep *ep,
+						struct list_head *done);
+};
+
+static struct usb_gadget	*gmon_gadget;
+static struct gmon_ep		*gmon_eps;
+static unsigned			gmon_neps;
+
+/* nonzero while the rings exist, i.e. while some reader has one open */
+static int			gmon_capturing;
+static DEFINE_PER_CPU(struct gadgetmon_ring *, gmon_ring);
+static DEFINE_PER_CPU(struct gadgetmon_ring *, gmon_retired);
+static DEFINE_MUTEX(gmon_lock);
+static unsigned			gmon_users;
+static struct dentry		*gmon_dentry;
+
+static inline struct gmon_ep *gmon_ep(struct usb_ep *ep)
+{
+	return container_of(ep->ops, struct gmon_ep, ops.ops);
+}
+
+static inline const struct usb_ep_batch_ops *gmon_orig_batch(
+		struct gmon_ep *gm)
+{
+	return container_of(gm->orig, struct usb_ep_batch_ops, ops);
+}
+
+/*-------------------------------------------------------------------------*/
+
+/* Requests whose complete() we replaced, and what it was.  Entries come
+ * from a fixed pool; when that runs dry, requests go out unwrapped and
+ * their completions are simply not logged.
+ */
+#define GMON_PENDING		1024
+#define GMON_HASH_BITS		8
+
+struct gmon_pending {
+	struct hlist_node	node;
+	struct usb_request	*req;
+	void			(*complete)(struct usb_ep *ep,
+						struct usb_request *req);
+};
+
+static struct gmon_pending	gmon_pending[GMON_PENDING];
+static struct hlist_head	gmon_hash[1 << GMON_HASH_BITS];
+static struct hlist_head	gmon_free;
+static DEFINE_SPINLOCK(gmon_pending_lock);
+
+static void gmon_complete(struct usb_ep *ep, struct usb_request *req);
+
+static bool gmon_wrap(struct usb_request *req)
+{
+	struct gmon_pending	*p;
+	unsigned long		flags;
+
+	spin_lock_irqsave(&gmon_pending_lock, flags);
+	if (hlist_empty(&gmon_free)) {
+		spin_unlock_irqrestore(&gmon_pending_lock, flags);
+		return false;
+	}
+	p = hlist_entry(gmon_free.first, struct gmon_pending, node);
+	hlist_del(&p->node);
+	p->req = req;
+	p->complete = req->complete;
+	hlist_add_head(&p->node, &gmon_hash[hash_ptr(req, GMON_HASH_BITS)]);
+	req->complete = gmon_complete;
+	spin_unlock_irqrestore(&gmon_pending_lock, flags);
+	return true;
+}
+
+/* put back the request's own complete(); false if we hadn't wrapped it */
+static bool gmon_unwrap(struct usb_request *req)
+{
+	struct gmon_pending	*p;
+	struct hlist_node	*pos;
+	unsigned long		flags;
+	bool			found = false;
+
+	if (req->complete != gmon_complete)
+		return false;
+
+	spin_lock_irqsave(&gmon_pending_lock, flags);
+	hlist_for_each_entry(p, pos,
+			&gmon_hash[hash_ptr(req, GMON_HASH_BITS)], node) {
+		if (p->req == req) {
+			req->complete = p->complete;
+			hlist_del(&p->node);
+			hlist_add_head(&p->node, &gmon_free);
+			found = true;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&gmon_pending_lock, flags);
+	return found;
+}
+
+static void gmon_pending_init(void)
+{
+	unsigned	i;
+
+	INIT_HLIST_HEAD(&gmon_free);
+	for (i = 0; i < ARRAY_SIZE(gmon_hash); i++)
+		INIT_HLIST_HEAD(&gmon_hash[i]);
+	for (i = 0; i < GMON_PENDING; i++)
+		hlist_add_head(&gmon_pending[i].node, &gmon_free);
+}
+
+/*-------------------------------------------------------------------------*/
+
+static void gmon_log(struct gmon_ep *gm, struct usb_request *req,
+		u8 type, int status)
+{
+	struct gadgetmon_ring	*r;
+	struct gadgetmon_event	*e;
+	unsigned long		flags;
+	unsigned		length, caplen, size, off, pad;
+	u64			head, tail;
+	void			*data;
+
+	if (type == 'S') {
+		length = req->length;
+		caplen = (gm->epnum & USB_DIR_IN) ? length : 0;
+	} else {
+		length = req->actual;
+		caplen = (gm->epnum & USB_DIR_IN) && gm->epnum ? 0 : length;
+	}
+	caplen = min_t(unsigned, caplen, gadgetmon_snaplen);
+	caplen = min_t(unsigned, caplen, GMON_MAX_CAPLEN);
+	if (!req->buf)
+		caplen = 0;
+
+	/* the ring may be going away; see gmon_free_rings() */
+	local_irq_save(flags);
+	r = __get_cpu_var(gmon_ring);
+	if (!r)
+		goto out;
+
+	/* no record may exceed a quarter of the ring */
+	caplen = min(caplen, r->data_size / 4 - (unsigned) sizeof *e);
+	size = ALIGN(sizeof *e + caplen, 8);
+
+	head = r->head;
+	tail = ACCESS_ONCE(r->tail);
+	smp_mb();	/* the reader is done with what it consumed */
+
+	off = head & (r->data_size - 1);
+	pad = (r->data_size - off < size) ? r->data_size - off : 0;
+	if (head + pad + size - tail > r->data_size) {
+		r->lost++;
+		goto out;
+	}
+
+	data = (void *) r + r->data_offset;
+	if (pad) {
+		if (pad >= sizeof *e) {
+			e = data + off;
+			memset(e, 0, sizeof *e);
+			e->size = pad;
+		}
+		head += pad;
+		off = 0;
+	}
+
+	e = data + off;
+	e->id = (unsigned long) req;
+	e->ts_ns = ktime_to_ns(ktime_get());
+	e->status = status;
+	e->length = length;
+	e->caplen = caplen;
+	e->size = size;
+	e->type = type;
+	e->epnum = gm->epnum;
+	e->xfer = gm->xfer;
+	e->flags = (req->zero ? GADGETMON_ZERO : 0)
+		| (req->no_interrupt ? GADGETMON_NO_INTR : 0)
+		| (req->short_not_ok ? GADGETMON_SHORT_NOT_OK : 0);
+	if (caplen)
+		memcpy(e + 1, req->buf, caplen);
+
+	smp_wmb();	/* the record before the head that covers it */
+	r->head = head + size;
+out:
+	local_irq_restore(flags);
+}
+
+static void gmon_complete(struct usb_ep *ep, struct usb_request *req)
+{
+	struct gmon_ep	*gm = gmon_ep(ep);
+
+	if (!gmon_unwrap(req)) {
+		WARN_ONCE(1, "gadgetmon: lost track of %s request\n",
+				ep->name);
+		return;
+	}
+	if (ACCESS_ONCE(gmon_capturing))
+		gmon_log(gm, req, 'C', req->status);
+	req->complete(ep, req);
+}
+
+static void gmon_complete_list(struct usb_ep *ep, struct list_head *done)
+{
+	struct gmon_ep		*gm = gmon_ep(ep);
+	struct usb_request	*req;
+	bool			capturing = ACCESS_ONCE(gmon_capturing);
+
+	/* the controller calls no complete(), but ours must not leak */
+	list_for_each_entry(req, done, list) {
+		gmon_unwrap(req);
+		if (capturing)
+			gmon_log(gm, req, 'C', req->status);
+	}
+	gm->complete_list(ep, done);
+}
+
+static int gmon_enable(struct usb_ep *ep,
+		const struct usb_endpoint_descriptor *desc)
+{
+	struct gmon_ep	*gm = gmon_ep(ep);
+
+	gm->epnum = desc->bEndpointAddress;
+	gm->xfer = desc->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK;
+	return gm->orig->enable(ep, desc);
+}
+
+static int gmon_queue(struct usb_ep *ep, struct usb_request *req,
+		gfp_t gfp_flags)
+{
+	struct gmon_ep	*gm = gmon_ep(ep);
+	int		status;
+
+	if (likely(!ACCESS_ONCE(gmon_capturing)))
+		return gm->orig->queue(ep, req, gfp_flags);
+
+	/* log first:  the completion may come before queue() returns */
+	gmon_log(gm, req, 'S', 0);
+	gmon_wrap(req);
+	status = gm->orig->queue(ep, req, gfp_flags);
+	if (status < 0) {
+		gmon_unwrap(req);
+		gmon_log(gm, req, 'E', status);
+	}
+	return status;
+}
+
+static int gmon_queue_list(struct usb_ep *ep, struct list_head *reqs,
+		gfp_t gfp_flags)
+{
+	struct gmon_ep		*gm = gmon_ep(ep);
+	struct usb_request	*req;
+	int			status;
+
+	if (likely(!ACCESS_ONCE(gmon_capturing)))
+		return gmon_orig_batch(gm)->queue_list(ep, reqs, gfp_flags);
+
+	list_for_each_entry(req, reqs, list) {
+		gmon_log(gm, req, 'S', 0);
+		gmon_wrap(req);
+	}
+	status = gmon_orig_batch(gm)->queue_list(ep, reqs, gfp_flags);
+	if (status < 0) {
+		list_for_each_entry(req, reqs, list) {
+			gmon_unwrap(req);
+			gmon_log(gm, req, 'E', status);
+		}
+	}
+	return status;
+}
+
+static int gmon_set_complete_list(struct usb_ep *ep,
+		void (*complete_list)(struct usb_ep *ep, struct list_head *done))
+{
+	struct gmon_ep	*gm = gmon_ep(ep);
+
+	gm->complete_list = complete_list;
+	return gmon_orig_batch(gm)->set_complete_list(ep,
+			complete_list ? gmon_complete_list : NULL);
+}
+
+static void gmon_attach_ep(struct gmon_ep *gm, struct usb_gadget *gadget,
+		struct usb_ep *ep)
+{
+	gm->ep = ep;
+	gm->orig = ep->ops;
+	if (gadget_supports_batch(gadget)) {
+		gm->ops = *gmon_orig_batch(gm);
+		gm->ops.queue_list = gmon_queue_list;
+		gm->ops.set_complete_list = gmon_set_complete_list;
+	} else {
+		gm->ops.ops = *ep->ops;
+	}
+	gm->ops.ops.enable = gmon_enable;
+	gm->ops.ops.queue = gmon_queue;
+	ep->ops = &gm->ops.ops;
+}
+
+/*-------------------------------------------------------------------------*/
+
+/*
+ * A writer may have passed its gmon_capturing check before the flag was
+ * cleared.  It only looks up its ring with IRQs off, so unpublish every
+ * ring, wait for those sections to finish, and only then free them.
+ */
+static void gmon_free_rings(void)
+{
+	int	cpu;
+
+	for_each_possible_cpu(cpu) {
+		per_cpu(gmon_retired, cpu) = per_cpu(gmon_ring, cpu);
+		per_cpu(gmon_ring, cpu) = NULL;
+	}
+
+	synchronize_sched();
+
+	for_each_possible_cpu(cpu) {
+		vfree(per_cpu(gmon_retired, cpu));
+		per_cpu(gmon_retired, cpu) = NULL;
+	}
+}
+
+static int gmon_alloc_rings(void)
+{
+	unsigned		size;
+	int			cpu;
+
+	size = roundup_pow_of_two(max(gadgetmon_ring_kb, 16u) << 10);
+	for_each_possible_cpu(cpu) {
+		struct gadgetmon_ring	*r;
+
+		/* vmalloc_user() zeroes, and allows remap_vmalloc_range() */
+		r = vmalloc_user(PAGE_SIZE + size);
+		if (!r) {
+			gmon_free_rings();
+			return -ENOMEM;
+		}
+		r->magic = GADGETMON_MAGIC;
+		r->version = GADGETMON_VERSION;
+		r->data_offset = PAGE_SIZE;
+		r->data_size = size;
+		per_cpu(gmon_ring, cpu) = r;
+	}
+	return 0;
+}
+
+static int gmon_open(struct inode *inode, struct file *file)
+{
+	int	status = 0;
+
+	mutex_lock(&gmon_lock);
+	if (!gmon_users) {
+		status = gmon_alloc_rings();
+		if (status == 0) {
+			smp_wmb();	/* rings before the flag */
+			gmon_capturing = 1;
+		}
+	}
+	if (status == 0) {
+		gmon_users++;
+		file->private_data = inode->i_private;
+	}
+	mutex_unlock(&gmon_lock);
+	return status;
+}
+
+/* last close, or munmap, of any ring */
+static int gmon_release(struct inode *inode, struct file *file)
+{
+	mutex_lock(&gmon_lock);
+	if (!--gmon_users) {
+		gmon_capturing = 0;
+		gmon_free_rings();
+	}
+	mutex_unlock(&gmon_lock);
+	return 0;
+}
+
+static int gmon_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	int			cpu = (long) file->private_data;
+	struct gadgetmon_ring	*r = per_cpu(gmon_ring, cpu);
+
+	if (!r || vma->vm_pgoff)
+		return -EINVAL;
+	if (vma->vm_end - vma->vm_start > r->data_offset + r->data_size)
+		return -EINVAL;
+	return remap_vmalloc_range(vma, r, 0);
+}
+
+static const struct file_operations gmon_fops = {
+	.owner		= THIS_MODULE,
+	.open		= gmon_open,
+	.release	= gmon_release,
+	.mmap		= gmon_mmap,
+};
+
+/*-------------------------------------------------------------------------*/
+
+/**
+ * gadgetmon_attach - get ready to capture a gadget's traffic
+ * @gadget: the gadget, about to be bound
+ * Context: may sleep
+ *
+ * Switches every endpoint to the monitor's ops, and publishes one
+ * debugfs file per CPU.  Nothing is logged until one is opened.
+ */
+static void gadgetmon_attach(struct usb_gadget *gadget)
+{
+	struct usb_ep	*ep;
+	unsigned	n = 1;
+	int		cpu;
+
+	list_for_each_entry(ep, &gadget->ep_list, ep_list)
+		n++;
+	gmon_eps = kcalloc(n, sizeof *gmon_eps, GFP_KERNEL);
+	if (!gmon_eps)
+		return;
+	gmon_neps = n;
+	gmon_pending_init();
+
+	gmon_attach_ep(&gmon_eps[0], gadget, gadget->ep0);
+	gmon_eps[0].xfer = USB_ENDPOINT_XFER_CONTROL;
+	n = 1;
+	list_for_each_entry(ep, &gadget->ep_list, ep_list)
+		gmon_attach_ep(&gmon_eps[n++], gadget, ep);
+	gmon_gadget = gadget;
+
+	gmon_dentry = debugfs_create_dir("gadgetmon", NULL);
+	if (IS_ERR_OR_NULL(gmon_dentry))
+		return;
+	for_each_possible_cpu(cpu) {
+		char	name[16];
+
+		snprintf(name, sizeof name, "cpu%d", cpu);
+		debugfs_create_file(name, S_IRUSR|S_IWUSR, gmon_dentry,
+				(void *) (long) cpu, &gmon_fops);
+	}
+}
+
+/**
+ * gadgetmon_detach - undo gadgetmon_attach()
+ * @gadget: the gadget, now unbound
+ * Context: may sleep; no I/O may be pending on @gadget
+ */
+static void gadgetmon_detach(struct usb_gadget *gadget)
+{
+	unsigned	i;
+
+	if (gadget != gmon_gadget)
+		return;
+
+	if (!IS_ERR_OR_NULL(gmon_dentry))
+		debugfs_remove_recursive(gmon_dentry);
+	gmon_dentry = NULL;
+
+	for (i = 0; i < gmon_neps; i++)
+		gmon_eps[i].ep->ops = gmon_eps[i].orig;
+	kfree(gmon_eps);
+	gmon_eps = NULL;
+	gmon_neps = 0;
+	gmon_gadget = NULL;
+}
@@ -0,0 +1,80 @@
+/*
+ * gadgetmon.h - device side USB traffic capture
+ *
+ * The peripheral side counterpart of usbmon:  every usb_request a
+ * composite gadget submits, and its completion, is logged with its
+ * endpoint, length, status, a timestamp and optionally the first few
+ * payload bytes.  Logging happens only while somebody has one of the
+ * debugfs files gadgetmon/cpuN open; otherwise the cost is one test
+ * per request.
+ *
+ * Each CPU logs into a ring of its own, which a reader mmap()s from
+ * gadgetmon/cpuN:  a struct gadgetmon_ring in the first page, then
+ * data_size bytes of struct gadgetmon_event records, each followed by
+ * its payload and padded to eight bytes.  The kernel only advances
+ * "head" and the reader only advances "tail"; both count bytes from
+ * the start of capture.  A record never wraps around the end of the
+ * data area:  when there isn't room for it, a record of type 0 (or, if
+ * fewer than sizeof(struct gadgetmon_event) bytes are left, nothing)
+ * pads the rest and the next record starts at offset zero.  Events that
+ * find the ring full are counted in "lost".
+ *
+ * tools/gadgetmon converts captures to pcap files, in the same format
+ * usbmon produces.
+ *
+ * This software is distributed under the terms of the GNU General
+ * Public License ("GPL") as published by the Free Software Foundation,
+ * either version 2 of that License or (at your option) any later version.
+ */
+
+#ifndef __GADGETMON_H
+#define __GADGETMON_H
+
+#include <linux/types.h>
+
+#define GADGETMON_MAGIC		0x474d4f4e	/* "GMON" */
+#define GADGETMON_VERSION	1
+
+struct gadgetmon_ring {
+	__u32	magic;
+	__u32	version;
+	__u32	data_offset;	/* from the start of the mapping */
+	__u32	data_size;	/* a power of two */
+	__u64	head;		/* bytes written; advanced by the kernel */
+	__u64	tail;		/* bytes consumed; advanced by the reader */
+	__u64	lost;		/* events dropped because the ring was full */
+};
+
+struct gadgetmon_event {
+	__u64	id;		/* the usb_request; pairs 'S' with 'C' */
+	__u64	ts_ns;		/* CLOCK_MONOTONIC */
+	__s32	status;		/* for 'C' and 'E' */
+	__u32	length;		/* req->length for 'S', else req->actual */
+	__u16	caplen;		/* payload bytes following this header */
+	__u16	size;		/* of the record, payload and padding included */
+	__u8	type;		/* 'S'ubmit, 'C'omplete, 'E'rror, 0 padding */
+	__u8	epnum;		/* bEndpointAddress, 0 for ep0 */
+	__u8	xfer;		/* USB_ENDPOINT_XFER_* */
+	__u8	flags;
+};
+
+/* flags */
+#define GADGETMON_ZERO		0x01	/* req->zero */
+#define GADGETMON_NO_INTR	0x02	/* req->no_interrupt */
+#define GADGETMON_SHORT_NOT_OK	0x04	/* req->short_not_ok */
+
+#ifdef __KERNEL__
+
+struct usb_gadget;
+
+#ifdef CONFIG_USB_GADGETMON
+static void gadgetmon_attach(struct usb_gadget *gadget);
+static void gadgetmon_detach(struct usb_gadget *gadget);
+#else
+static inline void gadgetmon_attach(struct usb_gadget *gadget) { }
+static inline void gadgetmon_detach(struct usb_gadget *gadget) { }
+#endif
+
+#endif	/* __KERNEL__ */
+
+#endif /* __GADGETMON_H */
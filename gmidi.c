@@ -35,6 +35,7 @@
 #include <linux/usb/midi.h>
 
 #include "gadget_chips.h"
+#include "usb_mem.h"
 
 
 /*
@@ -47,6 +48,7 @@
 #include "usbstring.c"
 #include "config.c"
 #include "epautoconf.c"
+#include "midi_common.c"
 
 /*-------------------------------------------------------------------------*/
 
@@ -105,26 +107,11 @@ static const char *EP_OUT_NAME;
 
 
 /* big enough to hold our biggest descriptor */
-#define USB_BUFSIZ 256
-
-
-/* This is a gadget, and the IN/OUT naming is from the host's perspective.
-   USB -> OUT endpoint -> rawmidi
-   USB <- IN endpoint  <- rawmidi */
-struct gmidi_in_port {
-	struct gmidi_device* dev;
-	int active;
-	uint8_t cable;		/* cable number << 4 */
-	uint8_t state;
-#define STATE_UNKNOWN	0
-#define STATE_1PARAM	1
-#define STATE_2PARAM_1	2
-#define STATE_2PARAM_2	3
-#define STATE_SYSEX_0	4
-#define STATE_SYSEX_1	5
-#define STATE_SYSEX_2	6
-	uint8_t data[2];
-};
+#define USB_BUFSIZ 1024
+
+/* USB-MIDI addresses up to 16 virtual cables per endpoint */
+#define GMIDI_MAX_CABLES	16
+
 
 struct gmidi_device {
 	spinlock_t		lock;
@@ -134,13 +121,12 @@ struct gmidi_device {
 	struct usb_ep		*in_ep, *out_ep;
 	struct snd_card		*card;
 	struct snd_rawmidi	*rmidi;
-	struct snd_rawmidi_substream *in_substream;
-	struct snd_rawmidi_substream *out_substream;
 
-	/* For the moment we only support one port in
-	   each direction, but in_port is kept as a
-	   separate struct so we can have more later. */
-	struct gmidi_in_port	in_port;
+	/* One rawmidi substream per cable and direction; each
+	   IN cable has its own encoder state. */
+	struct snd_rawmidi_substream *in_substream[GMIDI_MAX_CABLES];
+	struct snd_rawmidi_substream *out_substream[GMIDI_MAX_CABLES];
+	struct gmidi_in_port	in_port[GMIDI_MAX_CABLES];
 	unsigned long		out_triggered;
 	struct tasklet_struct	tasklet;
 };
@@ -160,9 +146,12 @@ static void gmidi_transmit(struct gmidi_device* dev, struct usb_request* req);
 
 static unsigned buflen = 256;
 static unsigned qlen = 32;
+static unsigned cables = 1;
 
 module_param(buflen, uint, S_IRUGO);
 module_param(qlen, uint, S_IRUGO);
+module_param(cables, uint, S_IRUGO);
+MODULE_PARM_DESC(cables, "Number of MIDI cables (ports) per direction, 1-16");
 
 
 /* Thanks to Grey Innovation for donating this product ID.
@@ -194,7 +183,7 @@ module_param(qlen, uint, S_IRUGO);
 
 DECLARE_UAC_AC_HEADER_DESCRIPTOR(1);
 DECLARE_USB_MIDI_OUT_JACK_DESCRIPTOR(1);
-DECLARE_USB_MS_ENDPOINT_DESCRIPTOR(1);
+DECLARE_USB_MS_ENDPOINT_DESCRIPTOR(16);
 
 /* B.1  Device Descriptor */
 static struct usb_device_descriptor device_desc = {
@@ -262,68 +251,31 @@ static const struct usb_interface_descriptor ms_interface_desc = {
 };
 
 /* B.4.2  Class-Specific MS Interface Descriptor */
-static const struct usb_ms_header_descriptor ms_header_desc = {
+static struct usb_ms_header_descriptor ms_header_desc = {
 	.bLength =		USB_DT_MS_HEADER_SIZE,
 	.bDescriptorType =	USB_DT_CS_INTERFACE,
 	.bDescriptorSubtype =	USB_MS_HEADER,
 	.bcdMSC =		cpu_to_le16(0x0100),
-	.wTotalLength =		cpu_to_le16(USB_DT_MS_HEADER_SIZE
-				+ 2*USB_DT_MIDI_IN_SIZE
-				+ 2*USB_DT_MIDI_OUT_SIZE(1)),
+	/* wTotalLength depends on the number of cables */
 };
 
-#define JACK_IN_EMB	1
-#define JACK_IN_EXT	2
-#define JACK_OUT_EMB	3
-#define JACK_OUT_EXT	4
+/* Each cable has four jacks: USB OUT -> embedded IN jack -> external
+ * OUT jack, and external IN jack -> embedded OUT jack -> USB IN.
+ */
+#define JACK_IN_EMB(n)	(4 * (n) + 1)
+#define JACK_IN_EXT(n)	(4 * (n) + 2)
+#define JACK_OUT_EMB(n)	(4 * (n) + 3)
+#define JACK_OUT_EXT(n)	(4 * (n) + 4)
 
 /* B.4.3  MIDI IN Jack Descriptors */
-static const struct usb_midi_in_jack_descriptor jack_in_emb_desc = {
-	.bLength =		USB_DT_MIDI_IN_SIZE,
-	.bDescriptorType =	USB_DT_CS_INTERFACE,
-	.bDescriptorSubtype =	USB_MS_MIDI_IN_JACK,
-	.bJackType =		USB_MS_EMBEDDED,
-	.bJackID =		JACK_IN_EMB,
-};
-
-static const struct usb_midi_in_jack_descriptor jack_in_ext_desc = {
-	.bLength =		USB_DT_MIDI_IN_SIZE,
-	.bDescriptorType =	USB_DT_CS_INTERFACE,
-	.bDescriptorSubtype =	USB_MS_MIDI_IN_JACK,
-	.bJackType =		USB_MS_EXTERNAL,
-	.bJackID =		JACK_IN_EXT,
-};
+static struct usb_midi_in_jack_descriptor jack_in_emb_desc[GMIDI_MAX_CABLES];
+static struct usb_midi_in_jack_descriptor jack_in_ext_desc[GMIDI_MAX_CABLES];
 
 /* B.4.4  MIDI OUT Jack Descriptors */
-static const struct usb_midi_out_jack_descriptor_1 jack_out_emb_desc = {
-	.bLength =		USB_DT_MIDI_OUT_SIZE(1),
-	.bDescriptorType =	USB_DT_CS_INTERFACE,
-	.bDescriptorSubtype =	USB_MS_MIDI_OUT_JACK,
-	.bJackType =		USB_MS_EMBEDDED,
-	.bJackID =		JACK_OUT_EMB,
-	.bNrInputPins =		1,
-	.pins = {
-		[0] = {
-			.baSourceID =	JACK_IN_EXT,
-			.baSourcePin =	1,
-		}
-	}
-};
-
-static const struct usb_midi_out_jack_descriptor_1 jack_out_ext_desc = {
-	.bLength =		USB_DT_MIDI_OUT_SIZE(1),
-	.bDescriptorType =	USB_DT_CS_INTERFACE,
-	.bDescriptorSubtype =	USB_MS_MIDI_OUT_JACK,
-	.bJackType =		USB_MS_EXTERNAL,
-	.bJackID =		JACK_OUT_EXT,
-	.bNrInputPins =		1,
-	.pins = {
-		[0] = {
-			.baSourceID =	JACK_IN_EMB,
-			.baSourcePin =	1,
-		}
-	}
-};
+static struct usb_midi_out_jack_descriptor_1
+		jack_out_emb_desc[GMIDI_MAX_CABLES];
+static struct usb_midi_out_jack_descriptor_1
+		jack_out_ext_desc[GMIDI_MAX_CABLES];
 
 /* B.5.1  Standard Bulk OUT Endpoint Descriptor */
 static struct usb_endpoint_descriptor bulk_out_desc = {
@@ -334,14 +286,10 @@ static struct usb_endpoint_descriptor bulk_out_desc = {
 };
 
 /* B.5.2  Class-specific MS Bulk OUT Endpoint Descriptor */
-static const struct usb_ms_endpoint_descriptor_1 ms_out_desc = {
-	.bLength =		USB_DT_MS_ENDPOINT_SIZE(1),
+static struct usb_ms_endpoint_descriptor_16 ms_out_desc = {
 	.bDescriptorType =	USB_DT_CS_ENDPOINT,
 	.bDescriptorSubtype =	USB_MS_GENERAL,
-	.bNumEmbMIDIJack =	1,
-	.baAssocJackID = {
-		[0] =		JACK_IN_EMB,
-	}
+	/* bLength, bNumEmbMIDIJack and baAssocJackID set at bind */
 };
 
 /* B.6.1  Standard Bulk IN Endpoint Descriptor */
@@ -353,34 +301,85 @@ static struct usb_endpoint_descriptor bulk_in_desc = {
 };
 
 /* B.6.2  Class-specific MS Bulk IN Endpoint Descriptor */
-static const struct usb_ms_endpoint_descriptor_1 ms_in_desc = {
-	.bLength =		USB_DT_MS_ENDPOINT_SIZE(1),
+static struct usb_ms_endpoint_descriptor_16 ms_in_desc = {
 	.bDescriptorType =	USB_DT_CS_ENDPOINT,
 	.bDescriptorSubtype =	USB_MS_GENERAL,
-	.bNumEmbMIDIJack =	1,
-	.baAssocJackID = {
-		[0] =		JACK_OUT_EMB,
-	}
+	/* bLength, bNumEmbMIDIJack and baAssocJackID set at bind */
 };
 
-static const struct usb_descriptor_header *gmidi_function [] = {
-	(struct usb_descriptor_header *)&ac_interface_desc,
-	(struct usb_descriptor_header *)&ac_header_desc,
-	(struct usb_descriptor_header *)&ms_interface_desc,
-
-	(struct usb_descriptor_header *)&ms_header_desc,
-	(struct usb_descriptor_header *)&jack_in_emb_desc,
-	(struct usb_descriptor_header *)&jack_in_ext_desc,
-	(struct usb_descriptor_header *)&jack_out_emb_desc,
-	(struct usb_descriptor_header *)&jack_out_ext_desc,
-	/* If you add more jacks, update ms_header_desc.wTotalLength */
-
-	(struct usb_descriptor_header *)&bulk_out_desc,
-	(struct usb_descriptor_header *)&ms_out_desc,
-	(struct usb_descriptor_header *)&bulk_in_desc,
-	(struct usb_descriptor_header *)&ms_in_desc,
-	NULL,
-};
+/* filled in by gmidi_init_descriptors() */
+static const struct usb_descriptor_header
+		*gmidi_function[4 + 4 * GMIDI_MAX_CABLES + 4 + 1];
+
+/*
+ * Build the jack and MS endpoint descriptors for @n cables, and the list
+ * of descriptors in the configuration.
+ */
+static void gmidi_init_descriptors(unsigned n)
+{
+	const struct usb_descriptor_header **d = gmidi_function;
+	unsigned i;
+
+	*d++ = (struct usb_descriptor_header *)&ac_interface_desc;
+	*d++ = (struct usb_descriptor_header *)&ac_header_desc;
+	*d++ = (struct usb_descriptor_header *)&ms_interface_desc;
+	*d++ = (struct usb_descriptor_header *)&ms_header_desc;
+
+	for (i = 0; i < n; i++) {
+		struct usb_midi_in_jack_descriptor *in;
+		struct usb_midi_out_jack_descriptor_1 *out;
+
+		in = &jack_in_emb_desc[i];
+		in->bLength = USB_DT_MIDI_IN_SIZE;
+		in->bDescriptorType = USB_DT_CS_INTERFACE;
+		in->bDescriptorSubtype = USB_MS_MIDI_IN_JACK;
+		in->bJackType = USB_MS_EMBEDDED;
+		in->bJackID = JACK_IN_EMB(i);
+		*d++ = (struct usb_descriptor_header *)in;
+
+		in = &jack_in_ext_desc[i];
+		*in = jack_in_emb_desc[i];
+		in->bJackType = USB_MS_EXTERNAL;
+		in->bJackID = JACK_IN_EXT(i);
+		*d++ = (struct usb_descriptor_header *)in;
+
+		out = &jack_out_emb_desc[i];
+		out->bLength = USB_DT_MIDI_OUT_SIZE(1);
+		out->bDescriptorType = USB_DT_CS_INTERFACE;
+		out->bDescriptorSubtype = USB_MS_MIDI_OUT_JACK;
+		out->bJackType = USB_MS_EMBEDDED;
+		out->bJackID = JACK_OUT_EMB(i);
+		out->bNrInputPins = 1;
+		out->pins[0].baSourceID = JACK_IN_EXT(i);
+		out->pins[0].baSourcePin = 1;
+		*d++ = (struct usb_descriptor_header *)out;
+
+		out = &jack_out_ext_desc[i];
+		*out = jack_out_emb_desc[i];
+		out->bJackType = USB_MS_EXTERNAL;
+		out->bJackID = JACK_OUT_EXT(i);
+		out->pins[0].baSourceID = JACK_IN_EMB(i);
+		*d++ = (struct usb_descriptor_header *)out;
+
+		ms_out_desc.baAssocJackID[i] = JACK_IN_EMB(i);
+		ms_in_desc.baAssocJackID[i] = JACK_OUT_EMB(i);
+	}
+
+	ms_header_desc.wTotalLength = cpu_to_le16(USB_DT_MS_HEADER_SIZE
+			+ n * (2 * USB_DT_MIDI_IN_SIZE
+			       + 2 * USB_DT_MIDI_OUT_SIZE(1)));
+
+	ms_out_desc.bLength = USB_DT_MS_ENDPOINT_SIZE(n);
+	ms_out_desc.bNumEmbMIDIJack = n;
+	ms_in_desc.bLength = USB_DT_MS_ENDPOINT_SIZE(n);
+	ms_in_desc.bNumEmbMIDIJack = n;
+
+	*d++ = (struct usb_descriptor_header *)&bulk_out_desc;
+	*d++ = (struct usb_descriptor_header *)&ms_out_desc;
+	*d++ = (struct usb_descriptor_header *)&bulk_in_desc;
+	*d++ = (struct usb_descriptor_header *)&ms_in_desc;
+	*d = NULL;
+}
 
 static char manufacturer[50];
 static char product_desc[40] = "MIDI Gadget";
@@ -418,16 +417,19 @@ static int config_buf(struct usb_gadget *gadget,
 	return len;
 }
 
+/* requests and buffers held, in debugfs usb_mem/midi */
+static struct usb_mem_account gmidi_mem = USB_MEM_ACCOUNT("midi");
+
 static struct usb_request *alloc_ep_req(struct usb_ep *ep, unsigned length)
 {
 	struct usb_request	*req;
 
-	req = usb_ep_alloc_request(ep, GFP_ATOMIC);
+	req = usb_mem_alloc_request(&gmidi_mem, ep, GFP_ATOMIC);
 	if (req) {
 		req->length = length;
-		req->buf = kmalloc(length, GFP_ATOMIC);
+		req->buf = usb_mem_kmalloc(&gmidi_mem, length, GFP_ATOMIC);
 		if (!req->buf) {
-			usb_ep_free_request(ep, req);
+			usb_mem_free_request(&gmidi_mem, ep, req);
 			req = NULL;
 		}
 	}
@@ -436,8 +438,8 @@ static struct usb_request *alloc_ep_req(struct usb_ep *ep, unsigned length)
 
 static void free_ep_req(struct usb_ep *ep, struct usb_request *req)
 {
-	kfree(req->buf);
-	usb_ep_free_request(ep, req);
+	usb_mem_kfree(&gmidi_mem, req->buf);
+	usb_mem_free_request(&gmidi_mem, ep, req);
 }
 
 static const uint8_t gmidi_cin_length[] = {
@@ -445,36 +447,56 @@ static const uint8_t gmidi_cin_length[] = {
 };
 
 /*
- * Receives a chunk of MIDI data.
+ * Receives a chunk of MIDI data for one cable.
  */
-static void gmidi_read_data(struct usb_ep *ep, int cable,
+static void gmidi_read_data(struct gmidi_device *dev, unsigned cable,
 				   uint8_t *data, int length)
 {
-	struct gmidi_device *dev = ep->driver_data;
-	/* cable is ignored, because for now we only have one. */
+	struct snd_rawmidi_substream *substream;
 
-	if (!dev->out_substream) {
+	if (length == 0 || cable >= cables) {
+		return;
+	}
+	substream = dev->out_substream[cable];
+	if (!substream) {
 		/* Nobody is listening - throw it on the floor. */
 		return;
 	}
-	if (!test_bit(dev->out_substream->number, &dev->out_triggered)) {
+	if (!test_bit(cable, &dev->out_triggered)) {
 		return;
 	}
-	snd_rawmidi_receive(dev->out_substream, data, length);
+	snd_rawmidi_receive(substream, data, length);
 }
 
+/*
+ * Unpacks the event packets in place: the MIDI bytes of consecutive
+ * packets for the same cable are gathered at the front of the buffer and
+ * handed to rawmidi in one call, instead of one call per packet.
+ */
 static void gmidi_handle_out_data(struct usb_ep *ep, struct usb_request *req)
 {
-	unsigned i;
+	struct gmidi_device *dev = ep->driver_data;
 	u8 *buf = req->buf;
+	u8 *run = buf, *end = buf;
+	unsigned cable = 0;
+	unsigned i;
 
 	for (i = 0; i + 3 < req->actual; i += 4) {
 		if (buf[i] != 0) {
-			int cable = buf[i] >> 4;
+			unsigned c = buf[i] >> 4;
 			int length = gmidi_cin_length[buf[i] & 0x0f];
-			gmidi_read_data(ep, cable, &buf[i + 1], length);
+
+			if (c != cable) {
+				gmidi_read_data(dev, cable, run, end - run);
+				run = end;
+				cable = c;
+			}
+			/* end never passes &buf[i], but may overlap it */
+			memmove(end, &buf[i + 1], length);
+			end += length;
 		}
 	}
+	gmidi_read_data(dev, cable, run, end - run);
 }
 
 static void gmidi_complete(struct usb_ep *ep, struct usb_request *req)
@@ -855,124 +877,14 @@ static int gmidi_snd_free(struct snd_device *device)
 	return 0;
 }
 
-static void gmidi_transmit_packet(struct usb_request *req, uint8_t p0,
-					uint8_t p1, uint8_t p2, uint8_t p3)
-{
-	unsigned length = req->length;
-	u8 *buf = (u8 *)req->buf + length;
-
-	buf[0] = p0;
-	buf[1] = p1;
-	buf[2] = p2;
-	buf[3] = p3;
-	req->length = length + 4;
-}
-
-/*
- * Converts MIDI commands to USB MIDI packets.
- */
-static void gmidi_transmit_byte(struct usb_request *req,
-				struct gmidi_in_port *port, uint8_t b)
-{
-	uint8_t p0 = port->cable;
-
-	if (b >= 0xf8) {
-		gmidi_transmit_packet(req, p0 | 0x0f, b, 0, 0);
-	} else if (b >= 0xf0) {
-		switch (b) {
-		case 0xf0:
-			port->data[0] = b;
-			port->state = STATE_SYSEX_1;
-			break;
-		case 0xf1:
-		case 0xf3:
-			port->data[0] = b;
-			port->state = STATE_1PARAM;
-			break;
-		case 0xf2:
-			port->data[0] = b;
-			port->state = STATE_2PARAM_1;
-			break;
-		case 0xf4:
-		case 0xf5:
-			port->state = STATE_UNKNOWN;
-			break;
-		case 0xf6:
-			gmidi_transmit_packet(req, p0 | 0x05, 0xf6, 0, 0);
-			port->state = STATE_UNKNOWN;
-			break;
-		case 0xf7:
-			switch (port->state) {
-			case STATE_SYSEX_0:
-				gmidi_transmit_packet(req,
-					p0 | 0x05, 0xf7, 0, 0);
-				break;
-			case STATE_SYSEX_1:
-				gmidi_transmit_packet(req,
-					p0 | 0x06, port->data[0], 0xf7, 0);
-				break;
-			case STATE_SYSEX_2:
-				gmidi_transmit_packet(req,
-					p0 | 0x07, port->data[0],
-					port->data[1], 0xf7);
-				break;
-			}
-			port->state = STATE_UNKNOWN;
-			break;
-		}
-	} else if (b >= 0x80) {
-		port->data[0] = b;
-		if (b >= 0xc0 && b <= 0xdf)
-			port->state = STATE_1PARAM;
-		else
-			port->state = STATE_2PARAM_1;
-	} else { /* b < 0x80 */
-		switch (port->state) {
-		case STATE_1PARAM:
-			if (port->data[0] < 0xf0) {
-				p0 |= port->data[0] >> 4;
-			} else {
-				p0 |= 0x02;
-				port->state = STATE_UNKNOWN;
-			}
-			gmidi_transmit_packet(req, p0, port->data[0], b, 0);
-			break;
-		case STATE_2PARAM_1:
-			port->data[1] = b;
-			port->state = STATE_2PARAM_2;
-			break;
-		case STATE_2PARAM_2:
-			if (port->data[0] < 0xf0) {
-				p0 |= port->data[0] >> 4;
-				port->state = STATE_2PARAM_1;
-			} else {
-				p0 |= 0x03;
-				port->state = STATE_UNKNOWN;
-			}
-			gmidi_transmit_packet(req,
-				p0, port->data[0], port->data[1], b);
-			break;
-		case STATE_SYSEX_0:
-			port->data[0] = b;
-			port->state = STATE_SYSEX_1;
-			break;
-		case STATE_SYSEX_1:
-			port->data[1] = b;
-			port->state = STATE_SYSEX_2;
-			break;
-		case STATE_SYSEX_2:
-			gmidi_transmit_packet(req,
-				p0 | 0x04, port->data[0], port->data[1], b);
-			port->state = STATE_SYSEX_0;
-			break;
-		}
-	}
-}
+/* rawmidi bytes taken from one cable at a time */
+#define GMIDI_TX_CHUNK	16
 
 static void gmidi_transmit(struct gmidi_device *dev, struct usb_request *req)
 {
 	struct usb_ep *ep = dev->in_ep;
-	struct gmidi_in_port *port = &dev->in_port;
+	int busy;
+	unsigned i;
 
 	if (!ep) {
 		return;
@@ -987,18 +899,39 @@ static void gmidi_transmit(struct gmidi_device *dev, struct usb_request *req)
 	req->length = 0;
 	req->complete = gmidi_complete;
 
-	if (port->active) {
-		while (req->length + 3 < buflen) {
-			uint8_t b;
-			if (snd_rawmidi_transmit(dev->in_substream, &b, 1)
-				!= 1)
-			{
-				port->active = 0;
+	/* Take the triggered cables' pending bytes a chunk at a time, round
+	 * robin, until the request is full.  Each byte yields at most one
+	 * event packet, so a chunk never overflows the request.
+	 */
+	do {
+		busy = 0;
+		for (i = 0; i < cables; i++) {
+			struct gmidi_in_port *port = &dev->in_port[i];
+			uint8_t chunk[GMIDI_TX_CHUNK];
+			int n, k;
+
+			if (!port->active) {
+				continue;
+			}
+			n = min_t(int, (buflen - req->length) / 4,
+				  sizeof(chunk));
+			if (n <= 0) {
 				break;
 			}
-			gmidi_transmit_byte(req, port, b);
+			n = snd_rawmidi_transmit_peek(dev->in_substream[i],
+						      chunk, n);
+			if (n <= 0) {
+				port->active = 0;
+				continue;
+			}
+			for (k = 0; k < n; k++) {
+				gmidi_transmit_byte(req, port, chunk[k]);
+			}
+			snd_rawmidi_transmit_ack(dev->in_substream[i], n);
+			busy = 1;
 		}
-	}
+	} while (busy && req->length + 3 < buflen);
+
 	if (req->length > 0) {
 		usb_ep_queue(ep, req, GFP_ATOMIC);
 	} else {
@@ -1017,9 +950,9 @@ static int gmidi_in_open(struct snd_rawmidi_substream *substream)
 {
 	struct gmidi_device *dev = substream->rmidi->private_data;
 
-	VDBG(dev, "gmidi_in_open\n");
-	dev->in_substream = substream;
-	dev->in_port.state = STATE_UNKNOWN;
+	VDBG(dev, "gmidi_in_open %d\n", substream->number);
+	dev->in_substream[substream->number] = substream;
+	dev->in_port[substream->number].state = STATE_UNKNOWN;
 	return 0;
 }
 
@@ -1035,8 +968,8 @@ static void gmidi_in_trigger(struct snd_rawmidi_substream *substream, int up)
 {
 	struct gmidi_device *dev = substream->rmidi->private_data;
 
-	VDBG(dev, "gmidi_in_trigger %d\n", up);
-	dev->in_port.active = up;
+	VDBG(dev, "gmidi_in_trigger %d %d\n", substream->number, up);
+	dev->in_port[substream->number].active = up;
 	if (up) {
 		tasklet_hi_schedule(&dev->tasklet);
 	}
@@ -1046,8 +979,8 @@ static int gmidi_out_open(struct snd_rawmidi_substream *substream)
 {
 	struct gmidi_device *dev = substream->rmidi->private_data;
 
-	VDBG(dev, "gmidi_out_open\n");
-	dev->out_substream = substream;
+	VDBG(dev, "gmidi_out_open %d\n", substream->number);
+	dev->out_substream[substream->number] = substream;
 	return 0;
 }
 
@@ -1088,9 +1021,11 @@ static int gmidi_register_card(struct gmidi_device *dev)
 {
 	struct snd_card *card;
 	struct snd_rawmidi *rmidi;
+	struct snd_rawmidi_substream *substream;
 	int err;
-	int out_ports = 1;
-	int in_ports = 1;
+	int out_ports = cables;
+	int in_ports = cables;
+	int i;
 	static struct snd_device_ops ops = {
 		.dev_free = gmidi_snd_free,
 	};
@@ -1113,8 +1048,11 @@ static int gmidi_register_card(struct gmidi_device *dev)
 	strcpy(card->shortname, shortname);
 
 	/* Set up rawmidi */
-	dev->in_port.dev = dev;
-	dev->in_port.active = 0;
+	for (i = 0; i < cables; i++) {
+		dev->in_port[i].dev = dev;
+		dev->in_port[i].active = 0;
+		dev->in_port[i].cable = i << 4;
+	}
 	snd_component_add(card, "MIDI");
 	err = snd_rawmidi_new(card, "USB MIDI Gadget", 0,
 			      out_ports, in_ports, &rmidi);
@@ -1134,6 +1072,15 @@ static int gmidi_register_card(struct gmidi_device *dev)
 	snd_rawmidi_set_ops(rmidi, SNDRV_RAWMIDI_STREAM_OUTPUT, &gmidi_in_ops);
 	snd_rawmidi_set_ops(rmidi, SNDRV_RAWMIDI_STREAM_INPUT, &gmidi_out_ops);
 
+	/* substream N is cable N, in both directions */
+	for (i = 0; i < 2; i++) {
+		list_for_each_entry(substream, &rmidi->streams[i].substreams,
+				    list) {
+			snprintf(substream->name, sizeof(substream->name),
+				 "%s %d", shortname, substream->number + 1);
+		}
+	}
+
 	snd_card_set_dev(card, &dev->gadget->dev);
 
 	/* register it - we're ready to go */
@@ -1163,6 +1110,13 @@ static int __init gmidi_bind(struct usb_gadget *gadget)
 	struct usb_ep *in_ep, *out_ep;
 	int gcnum, err = 0;
 
+	if (cables < 1 || cables > GMIDI_MAX_CABLES) {
+		pr_err("%s: cables must be 1 to %d\n", shortname,
+			GMIDI_MAX_CABLES);
+		return -EINVAL;
+	}
+	gmidi_init_descriptors(cables);
+
 	/* support optional vendor/distro customization */
 	if (idVendor) {
 		if (!idProduct) {
@@ -1309,13 +1263,20 @@ static struct usb_gadget_driver gmidi_driver = {
 
 static int __init gmidi_init(void)
 {
-	return usb_gadget_register_driver(&gmidi_driver);
+	int	status;
+
+	usb_mem_register(&gmidi_mem, NULL);
+	status = usb_gadget_register_driver(&gmidi_driver);
+	if (status)
+		usb_mem_unregister(&gmidi_mem, NULL);
+	return status;
 }
 module_init(gmidi_init);
 
 static void __exit gmidi_cleanup(void)
 {
 	usb_gadget_unregister_driver(&gmidi_driver);
+	usb_mem_unregister(&gmidi_mem, NULL);
 }
 module_exit(gmidi_cleanup);
 
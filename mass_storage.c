@@ -128,7 +128,8 @@ static struct usb_gadget_strings *dev_strings[] = {
 /****************************** Configurations ******************************/
 
 static struct fsg_module_parameters mod_data = {
-	.stall = 1
+	.stall = 1,
+	.thread_sched = USB_SCHED_DEFAULT,
 };
 FSG_MODULE_PARAMETERS(/* no prefix */, mod_data);
 
@@ -146,7 +146,8 @@ static u8 hostaddr[ETH_ALEN];
 /****************************** Configurations ******************************/
 
 static struct fsg_module_parameters mod_data = {
-	.stall = 1
+	.stall = 1,
+	.thread_sched = USB_SCHED_DEFAULT,
 };
 FSG_MODULE_PARAMETERS(/* no prefix */, mod_data);
 
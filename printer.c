@@ -52,6 +52,7 @@
 #include <linux/usb/g_printer.h>
 
 #include "gadget_chips.h"
+#include "usb_mem.h"
 
 
 /*
@@ -360,18 +361,21 @@ static struct usb_gadget_strings	stringtab = {
 
 /*-------------------------------------------------------------------------*/
 
+/* requests and buffers held, in debugfs usb_mem/printer */
+static struct usb_mem_account printer_mem = USB_MEM_ACCOUNT("printer");
+
 static struct usb_request *
 printer_req_alloc(struct usb_ep *ep, unsigned len, gfp_t gfp_flags)
 {
 	struct usb_request	*req;
 
-	req = usb_ep_alloc_request(ep, gfp_flags);
+	req = usb_mem_alloc_request(&printer_mem, ep, gfp_flags);
 
 	if (req != NULL) {
 		req->length = len;
-		req->buf = kmalloc(len, gfp_flags);
+		req->buf = usb_mem_kmalloc(&printer_mem, len, gfp_flags);
 		if (req->buf == NULL) {
-			usb_ep_free_request(ep, req);
+			usb_mem_free_request(&printer_mem, ep, req);
 			return NULL;
 		}
 	}
@@ -383,8 +387,8 @@ static void
 printer_req_free(struct usb_ep *ep, struct usb_request *req)
 {
 	if (ep != NULL && req != NULL) {
-		kfree(req->buf);
-		usb_ep_free_request(ep, req);
+		usb_mem_kfree(&printer_mem, req->buf);
+		usb_mem_free_request(&printer_mem, ep, req);
 	}
 }
 
@@ -1578,8 +1582,10 @@ init(void)
 		return status;
 	}
 
+	usb_mem_register(&printer_mem, NULL);
 	status = usb_gadget_register_driver(&printer_driver);
 	if (status) {
+		usb_mem_unregister(&printer_mem, NULL);
 		class_destroy(usb_gadget_class);
 		unregister_chrdev_region(g_printer_devno, 1);
 		DBG(dev, "usb_gadget_register_driver %x\n", status);
@@ -1601,6 +1607,7 @@ cleanup(void)
 	status = usb_gadget_unregister_driver(&printer_driver);
 	if (status)
 		ERROR(dev, "usb_gadget_unregister_driver %x\n", status);
+	usb_mem_unregister(&printer_mem, NULL);
 
 	mutex_unlock(&usb_printer_gadget.lock_printer_io);
 }
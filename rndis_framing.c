@@ -0,0 +1,72 @@
+/*
+ * rndis_framing.c -- RNDIS data message header add/remove
+ *
+ * Copyright (C) 2003-2005,2008 David Brownell
+ * Copyright (C) 2003-2004 Robert Schwebel, Benedikt Spranger
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Split out of rndis.c and f_rndis.c so the data path framing can be
+ * built on its own, e.g. by framing_bench.c; it depends on nothing but
+ * the skb and the message layout in rndis.h.
+ */
+
+#include <linux/skbuff.h>
+#include <asm/unaligned.h>
+
+void rndis_add_hdr (struct sk_buff *skb)
+{
+	struct rndis_packet_msg_type	*header;
+
+	if (!skb)
+		return;
+	header = (void *) skb_push (skb, sizeof *header);
+	memset (header, 0, sizeof *header);
+	header->MessageType = cpu_to_le32(REMOTE_NDIS_PACKET_MSG);
+	header->MessageLength = cpu_to_le32(skb->len);
+	header->DataOffset = cpu_to_le32 (36);
+	header->DataLength = cpu_to_le32(skb->len - sizeof *header);
+}
+
+int rndis_rm_hdr(struct gether *port,
+			struct sk_buff *skb,
+			struct sk_buff_head *list)
+{
+	/* tmp points to a struct rndis_packet_msg_type */
+	__le32		*tmp = (void *) skb->data;
+
+	/* MessageType, MessageLength */
+	if (cpu_to_le32(REMOTE_NDIS_PACKET_MSG)
+			!= get_unaligned(tmp++)) {
+		dev_kfree_skb_any(skb);
+		return -EINVAL;
+	}
+	tmp++;
+
+	/* DataOffset, DataLength */
+	if (!skb_pull(skb, get_unaligned_le32(tmp++) + 8)) {
+		dev_kfree_skb_any(skb);
+		return -EOVERFLOW;
+	}
+	skb_trim(skb, get_unaligned_le32(tmp++));
+
+	skb_queue_tail(list, skb);
+	return 0;
+}
+
+/* the header room of TCP's clones is ours to write, so this normally
+ * neither copies nor allocates
+ */
+static struct sk_buff *rndis_add_header(struct gether *port,
+					struct sk_buff *skb)
+{
+	if (skb_cow_head(skb, sizeof(struct rndis_packet_msg_type))) {
+		dev_kfree_skb_any(skb);
+		return NULL;
+	}
+	rndis_add_hdr(skb);
+	return skb;
+}
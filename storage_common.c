@@ -51,6 +51,13 @@
  * When FSG_BUFFHD_STATIC_BUFFER is defined when this file is included
  * the fsg_buffhd structure's buf field will be an array of FSG_BUFLEN
  * characters rather then a pointer to void.
+ *
+ * FSG_NUM_BUFFERS may be defined before including this file to make
+ * the buffer pipeline longer than two stages.
+ *
+ * When FSG_CRYPT is defined the fsg_lun structure gets a cipher and the
+ * fsg_buffhd structure a pointer to the state used to encrypt its
+ * buffer; see storage_crypt.c.
  */
 
 
@@ -260,7 +267,9 @@ struct interrupt_data {
 struct fsg_lun {
 	struct file	*filp;
 	loff_t		file_length;
-	loff_t		num_sectors;
+	loff_t		num_sectors;	/* in logical blocks */
+	unsigned int	blkbits;	/* log2 of the logical block size;
+					 * 0 means 9 (512 bytes) */
 
 	unsigned int	initially_ro:1;
 	unsigned int	ro:1;
@@ -274,6 +283,10 @@ struct fsg_lun {
 	u32		sense_data_info;
 	u32		unit_attention_data;
 
+#ifdef FSG_CRYPT
+	struct crypto_ablkcipher	*tfm;	/* NULL: not encrypted */
+#endif
+
 	struct device	dev;
 };
 
@@ -290,7 +303,9 @@ static struct fsg_lun *fsg_lun_from_dev(struct device *dev)
 #define DELAYED_STATUS	(EP0_BUFSIZE + 999)	/* An impossibly large value */
 
 /* Number of buffers we will use.  2 is enough for double-buffering */
+#ifndef FSG_NUM_BUFFERS
 #define FSG_NUM_BUFFERS	2
+#endif
 
 /* Default size of buffer length. */
 #define FSG_BUFLEN	((u32)16384)
@@ -322,6 +337,10 @@ struct fsg_buffhd {
 	int				inreq_busy;
 	struct usb_request		*outreq;
 	int				outreq_busy;
+
+#ifdef FSG_CRYPT
+	struct fsg_crypt_buf		*crypt;
+#endif
 };
 
 enum fsg_state {
@@ -559,6 +578,7 @@ static int fsg_lun_open(struct fsg_lun *curlun, const char *filename)
 	loff_t				size;
 	loff_t				num_sectors;
 	loff_t				min_sectors;
+	unsigned int			blkbits = curlun->blkbits ?: 9;
 
 	/* R/W if we can, R/O if we must */
 	ro = curlun->initially_ro;
@@ -602,9 +622,9 @@ static int fsg_lun_open(struct fsg_lun *curlun, const char *filename)
 		rc = (int) size;
 		goto out;
 	}
-	num_sectors = size >> 9;	/* File size in 512-byte blocks */
+	num_sectors = size >> blkbits;	/* File size in logical blocks */
 	min_sectors = 1;
-	if (curlun->cdrom) {
+	if (curlun->cdrom) {		/* CD-ROMs always use 512 here */
 		num_sectors &= ~3;	/* Reduce to a multiple of 2048 */
 		min_sectors = 300*4;	/* Smallest track is 300 frames */
 		if (num_sectors >= 256*60*75*4) {
@@ -0,0 +1,427 @@
+/*
+ * storage_crypt.c -- encryption of Mass Storage Function backing data
+ *
+ * This file is included by f_mass_storage.c, after the definition of
+ * struct fsg_common, when FSG_CRYPT is defined.  Otherwise it provides
+ * stubs that do nothing.
+ *
+ * Each LUN may have a cipher and key, set through its "crypt" sysfs
+ * attribute, in which case data is encrypted between the host and the
+ * backing file:  what the host writes is encrypted in the buffer it
+ * arrived in before it goes to vfs_write(), and what vfs_read() returns
+ * is decrypted in place before it is sent.  Every 512-byte sector is a
+ * separate request whose IV is the little-endian sector number in the
+ * backing file, so an image is laid out as dm-crypt's plain64 IV mode
+ * would lay it out (for instance "aes-xts-plain64" for "xts(aes)").
+ *
+ * Requests go through the asynchronous block cipher API, and an
+ * asynchronous implementation of the cipher is preferred:  a hardware
+ * engine if there is one, otherwise the software cipher run by cryptd.
+ * Either way the main thread only submits the work, so a buffer is
+ * being encrypted while the one before it is written and the one after
+ * it is received from the host (decryption likewise overlaps with the
+ * next vfs_read()).  do_write() and do_read() keep up to FSG_NUM_BUFFERS
+ * buffers in flight this way, and every buffer's crypto is finished
+ * before a command gives up filesem.
+ *
+ * Copyright (C) 2010
+ *
+ * This software is distributed under the terms of the GNU General
+ * Public License ("GPL") as published by the Free Software Foundation,
+ * either version 2 of that License or (at your option) any later version.
+ */
+
+/* The unit of encryption, whatever the LUN's logical block size */
+#define FSG_CRYPT_SECTOR_SHIFT	9
+#define FSG_CRYPT_SECTOR_SIZE	(1 << FSG_CRYPT_SECTOR_SHIFT)
+
+
+#ifdef FSG_CRYPT
+
+#include <linux/crypto.h>
+#include <linux/scatterlist.h>
+
+#define FSG_CRYPT_MAX_KEY	64		/* xts(aes) with AES-256 */
+#define FSG_CRYPT_MAX_IV	16
+
+enum fsg_crypt_state {
+	FSG_CRYPT_IDLE = 0,	/* buffer contents not (yet) handed over */
+	FSG_CRYPT_BUSY,
+	FSG_CRYPT_DONE
+};
+
+struct fsg_crypt_sector {
+	struct ablkcipher_request	*req;
+	struct scatterlist		sg;
+	u8				iv[FSG_CRYPT_MAX_IV] __aligned(8);
+};
+
+/* Per buffer head */
+struct fsg_crypt_buf {
+	struct fsg_common		*common;
+	enum fsg_crypt_state		state;
+	int				status;
+	atomic_t			pending;
+	struct completion		done;
+
+	/* Every request has room for this much tfm context */
+	unsigned int			reqsize;
+	struct fsg_crypt_sector		sectors[FSG_BUFLEN >>
+						FSG_CRYPT_SECTOR_SHIFT];
+};
+
+
+static inline int fsg_lun_crypt(struct fsg_lun *curlun)
+{
+	return curlun->tfm != NULL;
+}
+
+static void fsg_crypt_put(struct fsg_crypt_buf *c, int err)
+{
+	unsigned long	flags;
+
+	if (err)
+		c->status = err;
+	if (!atomic_dec_and_test(&c->pending))
+		return;
+
+	c->state = FSG_CRYPT_DONE;
+	complete(&c->done);
+
+	spin_lock_irqsave(&c->common->lock, flags);
+	wakeup_thread(c->common);
+	spin_unlock_irqrestore(&c->common->lock, flags);
+}
+
+static void fsg_crypt_complete(struct crypto_async_request *areq, int err)
+{
+	/* A backlogged request was accepted; the real completion follows */
+	if (err == -EINPROGRESS)
+		return;
+	fsg_crypt_put(areq->data, err);
+}
+
+/**
+ * fsg_crypt_start - start encrypting or decrypting a buffer in place
+ * @common: the function
+ * @curlun: the LUN whose cipher to use; nothing is done without one
+ * @bh: the buffer head
+ * @offset: byte offset of the buffer's data in the backing file
+ * @len: number of bytes; a trailing partial sector is left alone
+ * @encrypt: direction
+ *
+ * Called by the main thread.  fsg_crypt_busy() tells whether the work
+ * is still going on, and fsg_crypt_wait() collects its status; every
+ * start must be matched by a wait before the buffer is used again.
+ */
+static void fsg_crypt_start(struct fsg_common *common,
+			    struct fsg_lun *curlun, struct fsg_buffhd *bh,
+			    loff_t offset, unsigned int len, int encrypt)
+{
+	struct fsg_crypt_buf	*c = bh->crypt;
+	u64			sector = offset >> FSG_CRYPT_SECTOR_SHIFT;
+	unsigned int		i, n = len >> FSG_CRYPT_SECTOR_SHIFT;
+
+	if (!curlun->tfm)
+		return;
+
+	c->state = FSG_CRYPT_BUSY;
+	c->status = 0;
+	INIT_COMPLETION(c->done);
+
+	/* The extra reference keeps "done" from firing during the loop */
+	atomic_set(&c->pending, n + 1);
+
+	for (i = 0; i < n; ++i, ++sector) {
+		struct fsg_crypt_sector		*s = &c->sectors[i];
+		struct ablkcipher_request	*req = s->req;
+		int				rc;
+
+		memset(s->iv, 0, sizeof s->iv);
+		put_unaligned_le64(sector, s->iv);
+		sg_init_one(&s->sg, bh->buf + (i << FSG_CRYPT_SECTOR_SHIFT),
+			    FSG_CRYPT_SECTOR_SIZE);
+
+		ablkcipher_request_set_tfm(req, curlun->tfm);
+		ablkcipher_request_set_callback(req,
+				CRYPTO_TFM_REQ_MAY_BACKLOG |
+				CRYPTO_TFM_REQ_MAY_SLEEP,
+				fsg_crypt_complete, c);
+		ablkcipher_request_set_crypt(req, &s->sg, &s->sg,
+					     FSG_CRYPT_SECTOR_SIZE, s->iv);
+
+		rc = encrypt ? crypto_ablkcipher_encrypt(req)
+			     : crypto_ablkcipher_decrypt(req);
+		if (rc != -EINPROGRESS && rc != -EBUSY)
+			fsg_crypt_put(c, rc);
+	}
+	fsg_crypt_put(c, 0);
+}
+
+static inline int fsg_crypt_started(struct fsg_buffhd *bh)
+{
+	return bh->crypt && bh->crypt->state != FSG_CRYPT_IDLE;
+}
+
+static inline int fsg_crypt_busy(struct fsg_buffhd *bh)
+{
+	return bh->crypt && bh->crypt->state == FSG_CRYPT_BUSY;
+}
+
+/* Returns the status of the last fsg_crypt_start(), or 0 if none */
+static int fsg_crypt_wait(struct fsg_buffhd *bh)
+{
+	struct fsg_crypt_buf	*c = bh->crypt;
+
+	if (!c || c->state == FSG_CRYPT_IDLE)
+		return 0;
+	wait_for_completion(&c->done);
+	c->state = FSG_CRYPT_IDLE;
+	return c->status;
+}
+
+/* Let every buffer's crypto finish, before the buffers are reused */
+static void fsg_crypt_sync(struct fsg_common *common)
+{
+	int	i;
+
+	for (i = 0; i < FSG_NUM_BUFFERS; ++i)
+		fsg_crypt_wait(&common->buffhds[i]);
+}
+
+/* Make sure each buffer has requests big enough for a tfm.
+ * The caller must own filesem for writing. */
+static int fsg_crypt_reserve(struct fsg_common *common, unsigned int reqsize)
+{
+	int	i, j;
+
+	for (i = 0; i < FSG_NUM_BUFFERS; ++i) {
+		struct fsg_buffhd	*bh = &common->buffhds[i];
+		struct fsg_crypt_buf	*c = bh->crypt;
+
+		if (!c) {
+			c = kzalloc(sizeof *c, GFP_KERNEL);
+			if (!c)
+				return -ENOMEM;
+			c->common = common;
+			init_completion(&c->done);
+			bh->crypt = c;
+		}
+		if (c->reqsize >= reqsize)
+			continue;
+
+		for (j = 0; j < ARRAY_SIZE(c->sectors); ++j) {
+			struct ablkcipher_request	*req;
+
+			req = kmalloc(sizeof *req + reqsize, GFP_KERNEL);
+			if (!req)
+				return -ENOMEM;
+			kfree(c->sectors[j].req);
+			c->sectors[j].req = req;
+		}
+		c->reqsize = reqsize;
+	}
+	return 0;
+}
+
+static void fsg_crypt_free(struct fsg_buffhd *bh)
+{
+	struct fsg_crypt_buf	*c = bh->crypt;
+	int			j;
+
+	if (!c)
+		return;
+	for (j = 0; j < ARRAY_SIZE(c->sectors); ++j)
+		kfree(c->sectors[j].req);
+	kfree(c);
+	bh->crypt = NULL;
+}
+
+/* Prefer an implementation that doesn't run in the caller's context */
+static struct crypto_ablkcipher *fsg_crypt_alloc(const char *name)
+{
+	struct crypto_ablkcipher	*tfm;
+	char				wrapped[CRYPTO_MAX_ALG_NAME];
+
+	tfm = crypto_alloc_ablkcipher(name, CRYPTO_ALG_ASYNC,
+				      CRYPTO_ALG_ASYNC);
+	if (!IS_ERR(tfm))
+		return tfm;
+
+	if (snprintf(wrapped, sizeof wrapped, "cryptd(%s)", name)
+			< sizeof wrapped) {
+		tfm = crypto_alloc_ablkcipher(wrapped, 0, 0);
+		if (!IS_ERR(tfm))
+			return tfm;
+	}
+
+	return crypto_alloc_ablkcipher(name, 0, 0);
+}
+
+static ssize_t fsg_show_crypt(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct fsg_lun		*curlun = fsg_lun_from_dev(dev);
+	struct rw_semaphore	*filesem = dev_get_drvdata(dev);
+	ssize_t			rc;
+
+	down_read(filesem);
+	if (curlun->tfm)
+		rc = sprintf(buf, "%s\n", crypto_tfm_alg_name(
+				crypto_ablkcipher_tfm(curlun->tfm)));
+	else
+		rc = sprintf(buf, "none\n");
+	up_read(filesem);
+	return rc;
+}
+
+/*
+ * "<cipher> <hex key>", e.g. "xts(aes) 0011...eeff", sets the LUN's
+ * cipher; "none" or an empty string turns encryption off.  Changing it
+ * under a medium the host has locked isn't allowed; otherwise the host
+ * is told the medium changed.
+ */
+static ssize_t fsg_store_crypt(struct device *dev,
+			       struct device_attribute *attr,
+			       const char *buf, size_t count)
+{
+	struct fsg_lun		*curlun = fsg_lun_from_dev(dev);
+	struct rw_semaphore	*filesem = dev_get_drvdata(dev);
+	struct fsg_common	*common =
+			container_of(filesem, struct fsg_common, filesem);
+	struct crypto_ablkcipher *tfm = NULL;
+	u8			key[FSG_CRYPT_MAX_KEY];
+	unsigned int		keylen = 0;
+	char			*copy, *name, *hex;
+	int			rc = 0;
+
+	copy = kstrndup(buf, count, GFP_KERNEL);
+	if (!copy)
+		return -ENOMEM;
+	hex = strim(copy);
+	name = strsep(&hex, " \t");
+	hex = hex ? skip_spaces(hex) : "";
+
+	if (*name && strcmp(name, "none")) {
+		int	hi, lo;
+
+		for (; hex[0] && hex[1]; hex += 2) {
+			hi = hex_to_bin(hex[0]);
+			lo = hex_to_bin(hex[1]);
+			if (hi < 0 || lo < 0 || keylen == sizeof key)
+				break;
+			key[keylen++] = (hi << 4) | lo;
+		}
+		if (*hex || !keylen) {
+			LDBG(curlun, "invalid key for %s\n", name);
+			rc = -EINVAL;
+			goto out;
+		}
+
+		tfm = fsg_crypt_alloc(name);
+		if (IS_ERR(tfm)) {
+			LINFO(curlun, "no cipher %s: %ld\n",
+			      name, PTR_ERR(tfm));
+			rc = PTR_ERR(tfm);
+			tfm = NULL;
+			goto out;
+		}
+		if (crypto_ablkcipher_ivsize(tfm) > FSG_CRYPT_MAX_IV ||
+		    FSG_CRYPT_SECTOR_SIZE %
+				crypto_ablkcipher_blocksize(tfm)) {
+			LINFO(curlun, "cipher %s not usable\n", name);
+			rc = -EINVAL;
+			goto out;
+		}
+		rc = crypto_ablkcipher_setkey(tfm, key, keylen);
+		if (rc) {
+			LDBG(curlun, "invalid key for %s: %d\n", name, rc);
+			goto out;
+		}
+	}
+
+	down_write(filesem);
+	if (curlun->prevent_medium_removal && fsg_lun_is_open(curlun)) {
+		LDBG(curlun, "cipher change prevented\n");
+		rc = -EBUSY;
+	} else {
+		if (tfm)
+			rc = fsg_crypt_reserve(common,
+					crypto_ablkcipher_reqsize(tfm));
+		if (rc == 0) {
+			swap(curlun->tfm, tfm);
+			if (fsg_lun_is_open(curlun))
+				curlun->unit_attention_data =
+					SS_NOT_READY_TO_READY_TRANSITION;
+			LDBG(curlun, "cipher set to %s\n",
+			     curlun->tfm ? name : "none");
+		}
+	}
+	up_write(filesem);
+
+out:
+	/* The old cipher on success, the new one on failure */
+	if (tfm)
+		crypto_free_ablkcipher(tfm);
+	memset(key, 0, sizeof key);
+	kzfree(copy);
+	return rc < 0 ? rc : count;
+}
+
+/* Root only: the file mode is the only access control on the key */
+static DEVICE_ATTR(crypt, 0600, fsg_show_crypt, fsg_store_crypt);
+
+static int fsg_crypt_lun_init(struct fsg_lun *curlun)
+{
+	return device_create_file(&curlun->dev, &dev_attr_crypt);
+}
+
+static void fsg_crypt_lun_exit(struct fsg_lun *curlun)
+{
+	device_remove_file(&curlun->dev, &dev_attr_crypt);
+	if (curlun->tfm) {
+		crypto_free_ablkcipher(curlun->tfm);
+		curlun->tfm = NULL;
+	}
+}
+
+#else
+
+static inline int fsg_lun_crypt(struct fsg_lun *curlun)
+{
+	return 0;
+}
+
+static inline void fsg_crypt_start(struct fsg_common *common,
+				   struct fsg_lun *curlun,
+				   struct fsg_buffhd *bh, loff_t offset,
+				   unsigned int len, int encrypt)
+{
+}
+
+static inline int fsg_crypt_started(struct fsg_buffhd *bh)
+{
+	return 0;
+}
+
+static inline int fsg_crypt_busy(struct fsg_buffhd *bh)
+{
+	return 0;
+}
+
+static inline int fsg_crypt_wait(struct fsg_buffhd *bh)
+{
+	return 0;
+}
+
+static inline void fsg_crypt_sync(struct fsg_common *common) { }
+static inline void fsg_crypt_free(struct fsg_buffhd *bh) { }
+
+static inline int fsg_crypt_lun_init(struct fsg_lun *curlun)
+{
+	return 0;
+}
+
+static inline void fsg_crypt_lun_exit(struct fsg_lun *curlun) { }
+
+#endif /* FSG_CRYPT */
@@ -0,0 +1,447 @@
+/*
+ * gadget_bench.c -- host side throughput/latency driver for USB gadgets
+ *
+ * Copyright (C) 2010
+ *
+ * This software is distributed under the terms of the GNU General
+ * Public License ("GPL") as published by the Free Software Foundation,
+ * either version 2 of that License or (at your option) any later version.
+ *
+ * Build:  cc -O2 -Wall -o gadget_bench gadget_bench.c -lusb-1.0
+ *
+ * This talks to any gadget interface exposing a bulk endpoint pair (or
+ * just one bulk endpoint, for one-way streaming) through libusb, so the
+ * same numbers can be taken from Gadget Zero, generic serial, FunctionFS
+ * daemons and so on, whether they sit behind real hardware or dummy_hcd.
+ * Results go to stdout as one JSON object; see run.sh for the scenarios.
+ *
+ * Modes:
+ *	out	stream host->device for -t seconds at each -s size/-q depth
+ *	in	stream device->host, likewise
+ *	rpc	write one -s sized message and read the echo back, -n times;
+ *		the gadget side must loop OUT data back on its IN endpoint
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libusb-1.0/libusb.h>
+
+#define MAX_LIST	16
+#define MAX_DEPTH	256
+
+struct bench {
+	libusb_context		*ctx;
+	libusb_device_handle	*handle;
+	uint16_t		vid, pid;
+	int			config;
+	int			intf;
+	int			alt;
+	unsigned char		ep_in, ep_out;
+	unsigned		timeout_ms;
+
+	unsigned		sizes[MAX_LIST];
+	unsigned		n_sizes;
+	unsigned		depths[MAX_LIST];
+	unsigned		n_depths;
+	double			seconds;
+	unsigned		iterations;
+	const char		*label;
+};
+
+/* state for one streaming run, shared with the transfer callbacks */
+struct stream {
+	struct bench		*b;
+	double			deadline;
+	unsigned		in_flight;
+	unsigned long long	bytes;
+	unsigned long		transfers;
+	unsigned long		errors;
+	int			stop;
+};
+
+static double now(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned parse_list(const char *arg, unsigned *list)
+{
+	char		*copy = strdup(arg), *tok, *save;
+	unsigned	n = 0;
+
+	for (tok = strtok_r(copy, ",", &save); tok && n < MAX_LIST;
+			tok = strtok_r(NULL, ",", &save))
+		list[n++] = strtoul(tok, NULL, 0);
+	free(copy);
+	return n;
+}
+
+/*-------------------------------------------------------------------------*/
+
+static int find_endpoints(struct bench *b)
+{
+	struct libusb_config_descriptor		*config;
+	const struct libusb_interface_descriptor *alt = NULL;
+	int					i, status;
+
+	status = libusb_get_active_config_descriptor(
+			libusb_get_device(b->handle), &config);
+	if (status)
+		return status;
+
+	for (i = 0; i < config->bNumInterfaces; i++) {
+		const struct libusb_interface	*intf = &config->interface[i];
+		int				j;
+
+		for (j = 0; j < intf->num_altsetting; j++) {
+			if (intf->altsetting[j].bInterfaceNumber == b->intf
+					&& intf->altsetting[j].bAlternateSetting
+						== b->alt)
+				alt = &intf->altsetting[j];
+		}
+	}
+
+	for (i = 0; alt && i < alt->bNumEndpoints; i++) {
+		const struct libusb_endpoint_descriptor	*ep = &alt->endpoint[i];
+
+		if ((ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK)
+				!= LIBUSB_TRANSFER_TYPE_BULK)
+			continue;
+		if (ep->bEndpointAddress & LIBUSB_ENDPOINT_IN) {
+			if (!b->ep_in)
+				b->ep_in = ep->bEndpointAddress;
+		} else if (!b->ep_out) {
+			b->ep_out = ep->bEndpointAddress;
+		}
+	}
+	libusb_free_config_descriptor(config);
+
+	if (!alt)
+		return LIBUSB_ERROR_NOT_FOUND;
+	return 0;
+}
+
+static int open_device(struct bench *b)
+{
+	int	status;
+
+	status = libusb_init(&b->ctx);
+	if (status)
+		return status;
+
+	b->handle = libusb_open_device_with_vid_pid(b->ctx, b->vid, b->pid);
+	if (!b->handle)
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	if (b->config > 0) {
+		status = libusb_set_configuration(b->handle, b->config);
+		if (status)
+			return status;
+	}
+
+	/* cdc_acm, usbserial, usbtest etc may have bound first */
+	libusb_set_auto_detach_kernel_driver(b->handle, 1);
+	status = libusb_claim_interface(b->handle, b->intf);
+	if (status)
+		return status;
+	if (b->alt) {
+		status = libusb_set_interface_alt_setting(b->handle,
+				b->intf, b->alt);
+		if (status)
+			return status;
+	}
+
+	return find_endpoints(b);
+}
+
+/*-------------------------------------------------------------------------*/
+
+static void LIBUSB_CALL stream_complete(struct libusb_transfer *xfer)
+{
+	struct stream	*s = xfer->user_data;
+
+	switch (xfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		s->bytes += xfer->actual_length;
+		s->transfers++;
+		break;
+	case LIBUSB_TRANSFER_CANCELLED:
+		break;
+	default:
+		s->errors++;
+		break;
+	}
+
+	if (!s->stop && now() < s->deadline
+			&& xfer->status != LIBUSB_TRANSFER_NO_DEVICE
+			&& libusb_submit_transfer(xfer) == 0)
+		return;
+
+	s->stop = 1;
+	s->in_flight--;
+}
+
+static int run_stream(struct bench *b, unsigned char ep, unsigned size,
+		unsigned depth, int first)
+{
+	struct libusb_transfer	*xfer[MAX_DEPTH];
+	struct stream		s;
+	double			start, elapsed;
+	unsigned		i;
+	int			status = 0;
+
+	if (depth > MAX_DEPTH)
+		depth = MAX_DEPTH;
+
+	memset(&s, 0, sizeof s);
+	s.b = b;
+
+	for (i = 0; i < depth; i++) {
+		unsigned char	*buf = malloc(size);
+
+		xfer[i] = libusb_alloc_transfer(0);
+		if (!buf || !xfer[i]) {
+			free(buf);
+			libusb_free_transfer(xfer[i]);
+			while (i--) {
+				free(xfer[i]->buffer);
+				libusb_free_transfer(xfer[i]);
+			}
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		memset(buf, i, size);
+		libusb_fill_bulk_transfer(xfer[i], b->handle, ep, buf, size,
+				stream_complete, &s, b->timeout_ms);
+	}
+
+	start = now();
+	s.deadline = start + b->seconds;
+	for (i = 0; i < depth; i++) {
+		status = libusb_submit_transfer(xfer[i]);
+		if (status)
+			break;
+		s.in_flight++;
+	}
+	if (status)
+		s.stop = 1;
+
+	while (s.in_flight) {
+		struct timeval	tv = { 0, 100000 };
+
+		libusb_handle_events_timeout(b->ctx, &tv);
+		if (now() > s.deadline + b->timeout_ms / 1000.0 + 1) {
+			/* device stopped answering; reap what's left */
+			s.stop = 1;
+			for (i = 0; i < depth; i++)
+				libusb_cancel_transfer(xfer[i]);
+		}
+	}
+	elapsed = now() - start;
+
+	for (i = 0; i < depth; i++) {
+		free(xfer[i]->buffer);
+		libusb_free_transfer(xfer[i]);
+	}
+
+	printf("%s\n    {\"size\": %u, \"depth\": %u, \"seconds\": %.6f, "
+		"\"bytes\": %llu, \"transfers\": %lu, \"errors\": %lu, "
+		"\"MBps\": %.3f, \"transfers_per_sec\": %.1f}",
+		first ? "" : ",", size, depth, elapsed, s.bytes,
+		s.transfers, s.errors,
+		elapsed > 0 ? s.bytes / elapsed / 1e6 : 0.0,
+		elapsed > 0 ? s.transfers / elapsed : 0.0);
+	return status;
+}
+
+/*-------------------------------------------------------------------------*/
+
+static int cmp_double(const void *a, const void *b)
+{
+	double	x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static int run_rpc(struct bench *b, unsigned size, int first)
+{
+	unsigned char	*tx = malloc(size), *rx = malloc(size);
+	double		*lat = calloc(b->iterations, sizeof *lat);
+	double		sum = 0;
+	unsigned	i, done = 0, mismatches = 0, errors = 0;
+
+	if (!tx || !rx || !lat)
+		return LIBUSB_ERROR_NO_MEM;
+
+	for (i = 0; i < b->iterations; i++) {
+		double	t0;
+		int	len, got = 0, status;
+
+		memset(tx, i, size);
+		t0 = now();
+		status = libusb_bulk_transfer(b->handle, b->ep_out, tx, size,
+				&len, b->timeout_ms);
+		if (status || len != (int)size) {
+			errors++;
+			continue;
+		}
+
+		/* the echo may be split across several IN transfers */
+		while (got < (int)size) {
+			status = libusb_bulk_transfer(b->handle, b->ep_in,
+					rx + got, size - got, &len,
+					b->timeout_ms);
+			if (status)
+				break;
+			got += len;
+		}
+		if (got != (int)size) {
+			errors++;
+			continue;
+		}
+
+		lat[done] = (now() - t0) * 1e6;
+		sum += lat[done++];
+		if (memcmp(tx, rx, size))
+			mismatches++;
+	}
+
+	qsort(lat, done, sizeof *lat, cmp_double);
+	printf("%s\n    {\"size\": %u, \"iterations\": %u, \"completed\": %u, "
+		"\"errors\": %u, \"mismatches\": %u, \"usec_min\": %.1f, "
+		"\"usec_avg\": %.1f, \"usec_p50\": %.1f, \"usec_p99\": %.1f, "
+		"\"usec_max\": %.1f}",
+		first ? "" : ",", size, b->iterations, done, errors,
+		mismatches,
+		done ? lat[0] : 0.0, done ? sum / done : 0.0,
+		done ? lat[done / 2] : 0.0,
+		done ? lat[(done * 99) / 100] : 0.0,
+		done ? lat[done - 1] : 0.0);
+
+	free(tx);
+	free(rx);
+	free(lat);
+	return 0;
+}
+
+/*-------------------------------------------------------------------------*/
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		"usage: %s -d VID:PID [-c config] [-i intf] [-a alt]\n"
+		"\t[-m out|in|rpc] [-s sizes] [-q depths] [-t seconds]\n"
+		"\t[-n iterations] [-T timeout_ms] [-l label]\n"
+		"sizes and depths are comma separated lists\n", argv0);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench	b;
+	const char	*mode = "out";
+	unsigned	i, j;
+	int		c, status = 0, first = 1;
+
+	memset(&b, 0, sizeof b);
+	b.timeout_ms = 2000;
+	b.seconds = 5;
+	b.iterations = 1000;
+	b.label = "";
+	b.n_sizes = parse_list("512,4096,16384,65536", b.sizes);
+	b.n_depths = parse_list("1,4,16", b.depths);
+
+	while ((c = getopt(argc, argv, "d:c:i:a:m:s:q:t:n:T:l:")) != -1) {
+		switch (c) {
+		case 'd':
+			if (sscanf(optarg, "%hx:%hx", &b.vid, &b.pid) != 2)
+				usage(argv[0]);
+			break;
+		case 'c':
+			b.config = atoi(optarg);
+			break;
+		case 'i':
+			b.intf = atoi(optarg);
+			break;
+		case 'a':
+			b.alt = atoi(optarg);
+			break;
+		case 'm':
+			mode = optarg;
+			break;
+		case 's':
+			b.n_sizes = parse_list(optarg, b.sizes);
+			break;
+		case 'q':
+			b.n_depths = parse_list(optarg, b.depths);
+			break;
+		case 't':
+			b.seconds = atof(optarg);
+			break;
+		case 'n':
+			b.iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 'T':
+			b.timeout_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			b.label = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!b.vid || !b.n_sizes || !b.n_depths || !b.iterations)
+		usage(argv[0]);
+
+	status = open_device(&b);
+	if (status) {
+		fprintf(stderr, "%04x:%04x: %s\n", b.vid, b.pid,
+				libusb_error_name(status));
+		return 1;
+	}
+
+	if ((!strcmp(mode, "out") && !b.ep_out)
+			|| (!strcmp(mode, "in") && !b.ep_in)
+			|| (!strcmp(mode, "rpc") && !(b.ep_in && b.ep_out))) {
+		fprintf(stderr, "interface %d has no bulk endpoints for %s\n",
+				b.intf, mode);
+		return 1;
+	}
+
+	printf("{\n  \"tool\": \"gadget_bench\", \"label\": \"%s\", "
+		"\"device\": \"%04x:%04x\", \"interface\": %d, "
+		"\"mode\": \"%s\",\n  \"results\": [",
+		b.label, b.vid, b.pid, b.intf, mode);
+
+	for (i = 0; i < b.n_sizes && !status; i++) {
+		if (!strcmp(mode, "rpc")) {
+			status = run_rpc(&b, b.sizes[i], first);
+			first = 0;
+			continue;
+		}
+		for (j = 0; j < b.n_depths && !status; j++) {
+			status = run_stream(&b, strcmp(mode, "in")
+						? b.ep_out : b.ep_in,
+					b.sizes[i], b.depths[j], first);
+			first = 0;
+		}
+	}
+
+	printf("\n  ],\n  \"status\": \"%s\"\n}\n",
+		status ? libusb_error_name(status) : "ok");
+
+	libusb_release_interface(b.handle, b.intf);
+	libusb_close(b.handle);
+	libusb_exit(b.ctx);
+	return status ? 1 : 0;
+}
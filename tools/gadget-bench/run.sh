@@ -0,0 +1,270 @@
+#!/bin/bash
+#
+# run.sh -- standard gadget benchmark scenarios over dummy_hcd
+#
+# Loads dummy_hcd plus one gadget driver at a time, so both the gadget
+# and the host side of each link live on this machine, then measures it:
+#
+#	zero	bulk OUT streaming into Gadget Zero's sink
+#	serial	generic serial: bulk streaming and echo (RPC) latency
+#	msc	mass storage: sequential and random block I/O
+#	ether	CDC Ethernet: iperf3 between two network namespaces
+#	ffs	FunctionFS: streaming against a user supplied daemon
+#
+# Every scenario writes one JSON file; they are merged into $OUT.
+#
+# usage: run.sh [scenario ...]		(default: all but ffs)
+#
+# Environment:
+#	MODDIR		directory holding the .ko files; else use modprobe
+#	OUT		merged results file (default results-<date>.json)
+#	SECONDS_PER	duration of each streaming run (default 5)
+#	SIZES, DEPTHS	transfer sizes and queue depths for streaming
+#	FFS_DAEMON	command starting the FunctionFS daemon; it gets the
+#			mounted ffs directory as its only argument
+#	FFS_ID		VID:PID the ffs daemon's gadget enumerates as
+#
+# Needs root, libusb-1.0, and optionally fio, iperf3 and ip(8).
+
+set -u
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+BENCH=${BENCH:-$HERE/gadget_bench}
+OUT=${OUT:-results-$(date +%Y%m%d-%H%M%S).json}
+SECONDS_PER=${SECONDS_PER:-5}
+SIZES=${SIZES:-512,4096,16384,65536}
+DEPTHS=${DEPTHS:-1,4,16}
+TMP=$(mktemp -d /tmp/gadget-bench.XXXXXX)
+PIDS=""
+
+log() { echo "gadget-bench: $*" >&2; }
+
+load() {
+	local mod=$1; shift
+	if [ -n "${MODDIR:-}" ]; then
+		insmod "$MODDIR/$mod.ko" "$@"
+	else
+		modprobe "$mod" "$@"
+	fi
+}
+
+unload() {
+	for pid in $PIDS; do
+		kill "$pid" 2>/dev/null
+	done
+	wait 2>/dev/null
+	PIDS=""
+	rmmod "$@" 2>/dev/null
+}
+
+cleanup() {
+	unload g_zero g_serial g_mass_storage g_ether g_ffs
+	rmmod dummy_hcd 2>/dev/null
+	rm -rf "$TMP"
+}
+trap cleanup EXIT
+
+# wait until a device with this VID:PID has been enumerated
+wait_for() {
+	local i
+	for i in $(seq 50); do
+		lsusb -d "$1" >/dev/null 2>&1 && return 0
+		sleep 0.2
+	done
+	log "$1 never enumerated"
+	return 1
+}
+
+# one JSON fragment per scenario, wrapped with its name
+emit() {
+	local name=$1 file=$2
+	[ -s "$file" ] || return
+	echo "{\"scenario\": \"$name\", \"data\": $(cat "$file")}" \
+		> "$TMP/result-$name.json"
+}
+
+#-------------------------------------------------------------------------
+
+scenario_zero() {
+	load g_zero || return
+	wait_for efef:0036 || return
+
+	# the sink only moves data while someone reads its char device
+	[ -c /dev/gzero ] || mknod /dev/gzero c 249 0
+	dd if=/dev/gzero of=/dev/null bs=128 2>/dev/null &
+	PIDS="$PIDS $!"
+
+	"$BENCH" -d efef:0036 -m out -s "$SIZES" -q "$DEPTHS" \
+		-t "$SECONDS_PER" -l zero > "$TMP/zero.json"
+	emit zero "$TMP/zero.json"
+	unload g_zero
+}
+
+scenario_serial() {
+	local echo_pid
+
+	load g_serial use_acm=0 || return
+	wait_for 0525:a4a6 || return
+	sleep 0.5
+
+	# gadget side echoes everything back, for the RPC test
+	stty -F /dev/ttyGS0 raw -echo
+	cat /dev/ttyGS0 > /dev/ttyGS0 &
+	echo_pid=$!
+	PIDS="$PIDS $echo_pid"
+
+	"$BENCH" -d 0525:a4a6 -m rpc -s 1,16,64,512 -n 2000 \
+		-l serial-rpc > "$TMP/serial-rpc.json"
+	emit serial-rpc "$TMP/serial-rpc.json"
+
+	# nobody reads IN while streaming OUT, so an echo would stall
+	# once the TX side fills; just drain what arrives
+	kill "$echo_pid" 2>/dev/null
+	wait "$echo_pid" 2>/dev/null
+	cat /dev/ttyGS0 > /dev/null &
+	PIDS="$PIDS $!"
+
+	"$BENCH" -d 0525:a4a6 -m out -s "$SIZES" -q "$DEPTHS" \
+		-t "$SECONDS_PER" -l serial-out > "$TMP/serial-out.json"
+	emit serial-out "$TMP/serial-out.json"
+	unload g_serial
+}
+
+# the host side disk is the one whose sysfs path runs through dummy_hcd
+find_dummy_disk() {
+	local d
+	for d in /sys/block/sd*; do
+		readlink -f "$d" | grep -q dummy_hcd && basename "$d" && return
+	done
+}
+
+scenario_msc() {
+	local img=$TMP/msc.img disk
+	local mb=256
+
+	dd if=/dev/zero of="$img" bs=1M count=$mb 2>/dev/null
+	load g_mass_storage file="$img" removable=1 || return
+	sleep 2
+	disk=$(find_dummy_disk)
+	[ -n "$disk" ] || { log "no dummy_hcd disk"; unload g_mass_storage; return; }
+
+	local t0 t1 wr rd
+	t0=$(date +%s.%N)
+	dd if=/dev/zero of=/dev/$disk bs=1M count=$mb oflag=direct 2>/dev/null
+	t1=$(date +%s.%N)
+	wr=$(echo "$mb * 1048576 / ($t1 - $t0)" | bc -l)
+	t0=$(date +%s.%N)
+	dd if=/dev/$disk of=/dev/null bs=1M count=$mb iflag=direct 2>/dev/null
+	t1=$(date +%s.%N)
+	rd=$(echo "$mb * 1048576 / ($t1 - $t0)" | bc -l)
+
+	{
+		printf '{"seq_write_Bps": %.0f, "seq_read_Bps": %.0f' "$wr" "$rd"
+		if command -v fio >/dev/null; then
+			printf ', "fio_randrw_4k": '
+			fio --name=rand --filename=/dev/$disk --direct=1 \
+				--rw=randrw --bs=4k --iodepth=8 \
+				--ioengine=libaio --runtime=$SECONDS_PER \
+				--time_based --output-format=json 2>/dev/null
+		fi
+		echo '}'
+	} > "$TMP/msc.json"
+	emit msc "$TMP/msc.json"
+	unload g_mass_storage
+}
+
+scenario_ether() {
+	command -v iperf3 >/dev/null || { log "ether: no iperf3"; return; }
+
+	load g_ether || return
+	sleep 2
+
+	# usb0 is the gadget's netdev; the other new link is the host's
+	local gdev hdev n
+	for n in /sys/class/net/*; do
+		case $(readlink -f "$n/device" 2>/dev/null) in
+		*dummy_udc*)	gdev=$(basename "$n") ;;
+		*dummy_hcd*)	hdev=$(basename "$n") ;;
+		esac
+	done
+	if [ -z "${gdev:-}" ] || [ -z "${hdev:-}" ]; then
+		log "ether: links not found"
+		unload g_ether
+		return
+	fi
+
+	# a namespace keeps the kernel from short-circuiting the route
+	ip netns add gbench
+	ip link set "$gdev" netns gbench
+	ip netns exec gbench ip addr add 192.168.250.1/24 dev "$gdev"
+	ip netns exec gbench ip link set "$gdev" up
+	ip addr add 192.168.250.2/24 dev "$hdev"
+	ip link set "$hdev" up
+
+	ip netns exec gbench iperf3 -s -1 >/dev/null 2>&1 &
+	PIDS="$PIDS $!"
+	sleep 1
+	iperf3 -c 192.168.250.1 -t "$SECONDS_PER" -J > "$TMP/ether-tx.json"
+	emit ether-tx "$TMP/ether-tx.json"
+
+	ip netns exec gbench iperf3 -s -1 >/dev/null 2>&1 &
+	PIDS="$PIDS $!"
+	sleep 1
+	iperf3 -c 192.168.250.1 -t "$SECONDS_PER" -R -J > "$TMP/ether-rx.json"
+	emit ether-rx "$TMP/ether-rx.json"
+
+	ip netns del gbench
+	unload g_ether
+}
+
+scenario_ffs() {
+	if [ -z "${FFS_DAEMON:-}" ] || [ -z "${FFS_ID:-}" ]; then
+		log "ffs: set FFS_DAEMON and FFS_ID"
+		return
+	fi
+
+	load g_ffs || return
+	mkdir -p "$TMP/ffs"
+	mount -t functionfs ffs "$TMP/ffs" || { unload g_ffs; return; }
+	$FFS_DAEMON "$TMP/ffs" &
+	PIDS="$PIDS $!"
+	wait_for "$FFS_ID" || { umount "$TMP/ffs"; unload g_ffs; return; }
+
+	"$BENCH" -d "$FFS_ID" -m out -s "$SIZES" -q "$DEPTHS" \
+		-t "$SECONDS_PER" -l ffs-out > "$TMP/ffs-out.json"
+	emit ffs-out "$TMP/ffs-out.json"
+	"$BENCH" -d "$FFS_ID" -m in -s "$SIZES" -q "$DEPTHS" \
+		-t "$SECONDS_PER" -l ffs-in > "$TMP/ffs-in.json"
+	emit ffs-in "$TMP/ffs-in.json"
+
+	unload
+	umount "$TMP/ffs"
+	rmmod g_ffs
+}
+
+#-------------------------------------------------------------------------
+
+[ -x "$BENCH" ] || { log "build $BENCH first (see gadget_bench.c)"; exit 1; }
+[ "$(id -u)" = 0 ] || { log "must run as root"; exit 1; }
+
+load dummy_hcd || exit 1
+
+SCENARIOS=${*:-zero serial msc ether}
+for s in $SCENARIOS; do
+	log "running $s"
+	"scenario_$s"
+done
+
+{
+	echo "{\"kernel\": \"$(uname -r)\", \"date\": \"$(date -Iseconds)\","
+	echo " \"seconds_per_run\": $SECONDS_PER, \"scenarios\": ["
+	first=1
+	for f in "$TMP"/result-*.json; do
+		[ -e "$f" ] || continue
+		[ $first = 1 ] || echo ","
+		cat "$f"
+		first=0
+	done
+	echo "]}"
+} > "$OUT"
+log "results in $OUT"
@@ -0,0 +1,399 @@
+/*
+ * gadgetmon.c -- write device side USB captures as pcap files
+ *
+ * Copyright (C) 2010
+ *
+ * This software is distributed under the terms of the GNU General
+ * Public License ("GPL") as published by the Free Software Foundation,
+ * either version 2 of that License or (at your option) any later version.
+ *
+ * Build:  cc -O2 -Wall -I../.. -o gadgetmon gadgetmon.c
+ *
+ * Maps every per-CPU ring a gadget kernel built with CONFIG_USB_GADGETMON
+ * publishes in debugfs (gadgetmon/cpuN), drains them until interrupted or
+ * for -t seconds, and writes what they logged as a pcap file of type
+ * LINKTYPE_USB_LINUX_MMAPPED, the format usbmon captures use, so tcpdump
+ * and wireshark read it as they would a host side capture.
+ *
+ * Everything is seen from the device:  IN data is logged when the gadget
+ * submits it, OUT data when it completes; there are no SETUP packets, and
+ * device and bus numbers are zero.  Events are time ordered within each
+ * polling interval.
+ *
+ * usage:  gadgetmon [-d debugfs/gadgetmon] [-t seconds] [-o file.pcap]
+ *
+ * The payload length captured is the gadget module's gadgetmon_snaplen
+ * parameter, zero by default.
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "gadgetmon.h"
+
+#define MAX_RINGS	64
+#define POLL_US		10000
+
+#define LINKTYPE_USB_LINUX_MMAPPED	220
+
+struct ring {
+	char			name[NAME_MAX + 1];
+	int			fd;
+	void			*map;
+	size_t			map_size;
+	struct gadgetmon_ring	*hdr;
+	unsigned char		*data;
+};
+
+/* what usbmon's binary interface (and so the pcap format) uses */
+struct usbmon_packet {
+	uint64_t	id;
+	unsigned char	type;
+	unsigned char	xfer_type;
+	unsigned char	epnum;
+	unsigned char	devnum;
+	uint16_t	busnum;
+	char		flag_setup;
+	char		flag_data;
+	int64_t		ts_sec;
+	int32_t		ts_usec;
+	int32_t		status;
+	uint32_t	length;
+	uint32_t	len_cap;
+	unsigned char	setup[8];
+	int32_t		interval;
+	int32_t		start_frame;
+	uint32_t	xfer_flags;
+	uint32_t	ndesc;
+};
+
+struct pcap_file_header {
+	uint32_t	magic;
+	uint16_t	version_major;
+	uint16_t	version_minor;
+	int32_t		thiszone;
+	uint32_t	sigfigs;
+	uint32_t	snaplen;
+	uint32_t	linktype;
+};
+
+struct pcap_rec_header {
+	uint32_t	ts_sec;
+	uint32_t	ts_usec;
+	uint32_t	incl_len;
+	uint32_t	orig_len;
+};
+
+/* one event copied out of a ring, for sorting */
+struct event {
+	struct gadgetmon_event	e;
+	unsigned char		*payload;
+};
+
+static volatile sig_atomic_t	stop;
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+static int64_t mono_to_real_ns(void)
+{
+	struct timespec	mono, real;
+
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	clock_gettime(CLOCK_REALTIME, &real);
+	return (real.tv_sec - mono.tv_sec) * 1000000000LL
+		+ (real.tv_nsec - mono.tv_nsec);
+}
+
+static int ring_open(struct ring *r, const char *dir, const char *name)
+{
+	char			path[512];
+	struct gadgetmon_ring	*hdr;
+	long			page = sysconf(_SC_PAGESIZE);
+
+	snprintf(r->name, sizeof r->name, "%s", name);
+	snprintf(path, sizeof path, "%s/%s", dir, name);
+	r->fd = open(path, O_RDWR);
+	if (r->fd < 0) {
+		perror(path);
+		return -1;
+	}
+
+	/* the header says how big the whole mapping is */
+	hdr = mmap(NULL, page, PROT_READ, MAP_SHARED, r->fd, 0);
+	if (hdr == MAP_FAILED) {
+		perror(path);
+		goto fail;
+	}
+	if (hdr->magic != GADGETMON_MAGIC
+			|| hdr->version != GADGETMON_VERSION) {
+		fprintf(stderr, "%s: not a gadgetmon v%d ring\n",
+				path, GADGETMON_VERSION);
+		munmap(hdr, page);
+		goto fail;
+	}
+	r->map_size = hdr->data_offset + hdr->data_size;
+	munmap(hdr, page);
+
+	r->map = mmap(NULL, r->map_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED, r->fd, 0);
+	if (r->map == MAP_FAILED) {
+		perror(path);
+		goto fail;
+	}
+	r->hdr = r->map;
+	r->data = (unsigned char *) r->map + r->hdr->data_offset;
+
+	/* start from now, not from whatever an earlier reader left */
+	r->hdr->tail = r->hdr->head;
+	__sync_synchronize();
+	return 0;
+
+fail:
+	close(r->fd);
+	return -1;
+}
+
+static void ring_close(struct ring *r)
+{
+	munmap(r->map, r->map_size);
+	close(r->fd);
+}
+
+/* copy out everything logged so far; returns the new tail */
+static uint64_t ring_drain(struct ring *r, struct event **events,
+		size_t *n, size_t *max)
+{
+	uint64_t	head, tail = r->hdr->tail;
+	uint32_t	mask = r->hdr->data_size - 1;
+
+	/* head before the records it covers */
+	head = __atomic_load_n(&r->hdr->head, __ATOMIC_ACQUIRE);
+
+	while (tail != head) {
+		uint32_t		off = tail & mask;
+		struct gadgetmon_event	*e;
+		struct event		*ev;
+
+		if (r->hdr->data_size - off < sizeof *e) {
+			tail += r->hdr->data_size - off;
+			continue;
+		}
+		e = (struct gadgetmon_event *) (r->data + off);
+		if (!e->type) {
+			tail += r->hdr->data_size - off;
+			continue;
+		}
+		if (!e->size || e->size > head - tail) {
+			fprintf(stderr, "%s: corrupt record at %llu\n",
+					r->name, (unsigned long long) tail);
+			tail = head;
+			break;
+		}
+
+		if (*n == *max) {
+			*max = *max ? 2 * *max : 1024;
+			*events = realloc(*events, *max * sizeof **events);
+			if (!*events) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		ev = &(*events)[(*n)++];
+		ev->e = *e;
+		ev->payload = NULL;
+		if (e->caplen) {
+			ev->payload = malloc(e->caplen);
+			if (!ev->payload) {
+				perror("malloc");
+				exit(1);
+			}
+			memcpy(ev->payload, e + 1, e->caplen);
+		}
+		tail += e->size;
+	}
+	return tail;
+}
+
+static int by_time(const void *a, const void *b)
+{
+	const struct event	*x = a, *y = b;
+
+	if (x->e.ts_ns != y->e.ts_ns)
+		return x->e.ts_ns < y->e.ts_ns ? -1 : 1;
+	return 0;
+}
+
+static void write_event(FILE *out, const struct event *ev, int64_t offset)
+{
+	/* USB_ENDPOINT_XFER_* to usbmon's transfer types */
+	static const unsigned char	xfer_type[4] = { 2, 0, 3, 1 };
+	struct usbmon_packet		p;
+	struct pcap_rec_header		rec;
+	int64_t				ns = ev->e.ts_ns + offset;
+
+	memset(&p, 0, sizeof p);
+	p.id = ev->e.id;
+	p.type = ev->e.type;
+	p.xfer_type = xfer_type[ev->e.xfer & 3];
+	p.epnum = ev->e.epnum;
+	p.flag_setup = '-';
+	p.flag_data = ev->e.caplen ? 0 : (ev->e.type == 'S' ? '<' : '>');
+	p.ts_sec = ns / 1000000000;
+	p.ts_usec = (ns % 1000000000) / 1000;
+	p.status = ev->e.status;
+	p.length = ev->e.length;
+	p.len_cap = ev->e.caplen;
+
+	rec.ts_sec = p.ts_sec;
+	rec.ts_usec = p.ts_usec;
+	rec.incl_len = sizeof p + ev->e.caplen;
+	rec.orig_len = sizeof p + ev->e.length;
+
+	fwrite(&rec, sizeof rec, 1, out);
+	fwrite(&p, sizeof p, 1, out);
+	if (ev->e.caplen)
+		fwrite(ev->payload, ev->e.caplen, 1, out);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-d dir] [-t seconds] [-o file.pcap]\n",
+			prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	const char		*dir = "/sys/kernel/debug/gadgetmon";
+	const char		*outname = NULL;
+	double			seconds = 0;
+	struct ring		rings[MAX_RINGS];
+	unsigned		nrings = 0, i;
+	struct event		*events = NULL;
+	size_t			nevents = 0, maxevents = 0, total = 0;
+	struct pcap_file_header	fh;
+	struct timespec		start, now;
+	int64_t			offset;
+	uint64_t		lost = 0;
+	DIR			*d;
+	struct dirent		*de;
+	FILE			*out = stdout;
+	int			c;
+
+	while ((c = getopt(argc, argv, "d:o:t:h")) != -1) {
+		switch (c) {
+		case 'd':
+			dir = optarg;
+			break;
+		case 'o':
+			outname = optarg;
+			break;
+		case 't':
+			seconds = atof(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	d = opendir(dir);
+	if (!d) {
+		perror(dir);
+		return 1;
+	}
+	while ((de = readdir(d)) != NULL && nrings < MAX_RINGS) {
+		if (strncmp(de->d_name, "cpu", 3))
+			continue;
+		if (ring_open(&rings[nrings], dir, de->d_name) == 0)
+			nrings++;
+	}
+	closedir(d);
+	if (!nrings) {
+		fprintf(stderr, "%s: no rings\n", dir);
+		return 1;
+	}
+
+	if (outname) {
+		out = fopen(outname, "w");
+		if (!out) {
+			perror(outname);
+			return 1;
+		}
+	}
+	fh.magic = 0xa1b2c3d4;
+	fh.version_major = 2;
+	fh.version_minor = 4;
+	fh.thiszone = 0;
+	fh.sigfigs = 0;
+	fh.snaplen = 65535;
+	fh.linktype = LINKTYPE_USB_LINUX_MMAPPED;
+	fwrite(&fh, sizeof fh, 1, out);
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	offset = mono_to_real_ns();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (!stop) {
+		uint64_t	tails[MAX_RINGS];
+		size_t		j;
+
+		usleep(POLL_US);
+
+		for (i = 0; i < nrings; i++)
+			tails[i] = ring_drain(&rings[i], &events,
+					&nevents, &maxevents);
+
+		/* records are copied; let the kernel reuse the space */
+		__sync_synchronize();
+		for (i = 0; i < nrings; i++)
+			rings[i].hdr->tail = tails[i];
+
+		qsort(events, nevents, sizeof *events, by_time);
+		for (j = 0; j < nevents; j++) {
+			write_event(out, &events[j], offset);
+			free(events[j].payload);
+		}
+		total += nevents;
+		nevents = 0;
+		fflush(out);
+
+		if (seconds > 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (now.tv_sec - start.tv_sec
+					+ (now.tv_nsec - start.tv_nsec) / 1e9
+					>= seconds)
+				break;
+		}
+	}
+
+	for (i = 0; i < nrings; i++) {
+		lost += rings[i].hdr->lost;
+		ring_close(&rings[i]);
+	}
+	if (out != stdout)
+		fclose(out);
+	free(events);
+
+	fprintf(stderr, "%zu events", total);
+	if (lost)
+		fprintf(stderr, ", %llu lost (ring full)",
+				(unsigned long long) lost);
+	fprintf(stderr, "\n");
+	return 0;
+}
@@ -16,6 +16,8 @@
 #include <linux/ctype.h>
 #include <linux/random.h>
 #include <linux/syscalls.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #include "u_audio.h"
 
@@ -39,6 +41,18 @@ static char *fn_cntl = FILE_CONTROL;
 module_param(fn_cntl, charp, S_IRUGO);
 MODULE_PARM_DESC(fn_cntl, "Control device file name");
 
+static int p_chans = 2;
+module_param(p_chans, int, S_IRUGO);
+MODULE_PARM_DESC(p_chans, "Playback channel count (1..8)");
+
+static int p_srate = 48000;
+module_param(p_srate, int, S_IRUGO);
+MODULE_PARM_DESC(p_srate, "Playback sample rate in Hz (up to 192000)");
+
+static int p_ssize = 2;
+module_param(p_ssize, int, S_IRUGO);
+MODULE_PARM_DESC(p_ssize, "Playback sample size in bytes (2, 3 or 4)");
+
 /*-------------------------------------------------------------------------*/
 
 /**
@@ -115,14 +129,24 @@ static int playback_default_hw_params(struct gaudio_snd_dev *snd)
 
        /*
 	* SNDRV_PCM_ACCESS_RW_INTERLEAVED,
-	* SNDRV_PCM_FORMAT_S16_LE
-	* CHANNELS: 2
-	* RATE: 48000
+	* FORMAT: S16_LE, S24_3LE or S32_LE according to p_ssize
+	* CHANNELS: p_chans
+	* RATE: p_srate
 	*/
 	snd->access = SNDRV_PCM_ACCESS_RW_INTERLEAVED;
-	snd->format = SNDRV_PCM_FORMAT_S16_LE;
-	snd->channels = 2;
-	snd->rate = 48000;
+	switch (p_ssize) {
+	case 3:
+		snd->format = SNDRV_PCM_FORMAT_S24_3LE;
+		break;
+	case 4:
+		snd->format = SNDRV_PCM_FORMAT_S32_LE;
+		break;
+	default:
+		snd->format = SNDRV_PCM_FORMAT_S16_LE;
+		break;
+	}
+	snd->channels = clamp(p_chans, 1, 8);
+	snd->rate = clamp(p_srate, 8000, 192000);
 
 	params = kzalloc(sizeof(*params), GFP_KERNEL);
 	if (!params)
@@ -164,6 +188,167 @@ static int playback_default_hw_params(struct gaudio_snd_dev *snd)
 	return 0;
 }
 
+/*-------------------------------------------------------------------------*/
+
+/*
+ * Playback statistics
+ */
+
+static inline unsigned u_audio_hist_bucket(s64 us)
+{
+	if (us <= 0)
+		return 0;
+	if (us >= 1LL << (GAUDIO_HIST_BUCKETS - 2))
+		return GAUDIO_HIST_BUCKETS - 1;
+	return fls((u32)us);
+}
+
+/* Called from the OUT endpoint completion for every ISO packet */
+static void u_audio_stat_packet(struct gaudio *card, unsigned len)
+{
+	struct gaudio_stats *stats = &card->stats;
+	ktime_t now = ktime_get();
+
+	stats->packets++;
+	stats->bytes += len;
+	if (!len)
+		stats->empty_packets++;
+
+	if (stats->last_arrival.tv64)
+		stats->arrival_hist[u_audio_hist_bucket(
+			ktime_us_delta(now, stats->last_arrival))]++;
+	stats->last_arrival = now;
+}
+
+/* Called when a buffer filled since "first" has been handed to ALSA */
+static void u_audio_stat_latency(struct gaudio *card, ktime_t first)
+{
+	struct gaudio_stats *stats = &card->stats;
+	s64 us = ktime_us_delta(ktime_get(), first);
+
+	stats->latency_hist[u_audio_hist_bucket(us)]++;
+	if (us > stats->latency_max_us)
+		stats->latency_max_us = us;
+}
+
+/* Sample the USB side backlog and the ALSA buffer fill level */
+static void u_audio_stat_fill(struct gaudio *card, unsigned queued)
+{
+	struct gaudio_stats *stats = &card->stats;
+	struct snd_pcm_substream *substream = card->playback.substream;
+	unsigned i = stats->fill_head++ % GAUDIO_FILL_SAMPLES;
+
+	stats->fill[i].jiffies = jiffies;
+	stats->fill[i].queued = queued;
+	stats->fill[i].alsa_frames = substream && substream->runtime
+		? snd_pcm_playback_hw_avail(substream->runtime) : 0;
+}
+
+#ifdef CONFIG_USB_GADGET_DEBUG_FS
+
+static void u_audio_show_hist(struct seq_file *m, const char *name,
+		const unsigned long *hist)
+{
+	unsigned i;
+
+	seq_printf(m, "%s (us):\n", name);
+	for (i = 0; i < GAUDIO_HIST_BUCKETS; i++) {
+		if (!hist[i])
+			continue;
+		if (i == GAUDIO_HIST_BUCKETS - 1)
+			seq_printf(m, "\t>= %8lu: %lu\n",
+				1UL << (i - 1), hist[i]);
+		else
+			seq_printf(m, "\t<  %8lu: %lu\n", 1UL << i, hist[i]);
+	}
+}
+
+static int u_audio_stats_show(struct seq_file *m, void *unused)
+{
+	struct gaudio *card = m->private;
+	struct gaudio_stats *stats = &card->stats;
+	unsigned i, n;
+
+	seq_printf(m, "packets %lu bytes %lu empty %lu dropped %lu\n",
+		stats->packets, stats->bytes, stats->empty_packets,
+		stats->dropped_packets);
+	seq_printf(m, "xruns %lu usb %lu write errors %lu\n",
+		stats->xruns, stats->usb_xruns, stats->write_errors);
+	seq_printf(m, "queue depth %u max %u\n",
+		stats->queue_depth, stats->queue_depth_max);
+	seq_printf(m, "latency max %u us\n", stats->latency_max_us);
+
+	u_audio_show_hist(m, "packet inter-arrival", stats->arrival_hist);
+	u_audio_show_hist(m, "usb to alsa latency", stats->latency_hist);
+
+	seq_printf(m, "fill level (jiffies queued alsa_frames):\n");
+	n = min_t(unsigned, stats->fill_head, GAUDIO_FILL_SAMPLES);
+	for (i = stats->fill_head - n; i != stats->fill_head; i++)
+		seq_printf(m, "\t%lu %u %u\n",
+			stats->fill[i % GAUDIO_FILL_SAMPLES].jiffies,
+			stats->fill[i % GAUDIO_FILL_SAMPLES].queued,
+			stats->fill[i % GAUDIO_FILL_SAMPLES].alsa_frames);
+
+	return 0;
+}
+
+static int u_audio_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, u_audio_stats_show, inode->i_private);
+}
+
+/* Writing anything resets the statistics */
+static ssize_t u_audio_stats_write(struct file *file, const char __user *buf,
+		size_t count, loff_t *ppos)
+{
+	struct gaudio *card = ((struct seq_file *)file->private_data)->private;
+	unsigned long flags;
+	unsigned queue_depth;
+
+	/* the queue depth is live state, not a counter */
+	spin_lock_irqsave(card->stats_lock, flags);
+	queue_depth = card->stats.queue_depth;
+	memset(&card->stats, 0, sizeof card->stats);
+	card->stats.queue_depth = queue_depth;
+	spin_unlock_irqrestore(card->stats_lock, flags);
+	return count;
+}
+
+static const struct file_operations u_audio_stats_fops = {
+	.open		= u_audio_stats_open,
+	.read		= seq_read,
+	.write		= u_audio_stats_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+	.owner		= THIS_MODULE,
+};
+
+static void u_audio_create_debug_files(struct gaudio *card)
+{
+	card->debugfs_root = debugfs_create_dir("g_audio", NULL);
+	if (IS_ERR_OR_NULL(card->debugfs_root)) {
+		card->debugfs_root = NULL;
+		return;
+	}
+	debugfs_create_file("stats", S_IRUGO | S_IWUSR, card->debugfs_root,
+			card, &u_audio_stats_fops);
+}
+
+static void u_audio_remove_debug_files(struct gaudio *card)
+{
+	debugfs_remove_recursive(card->debugfs_root);
+	card->debugfs_root = NULL;
+}
+
+#else	/* !CONFIG_USB_GADGET_DEBUG_FS */
+
+#define u_audio_create_debug_files(card) do {} while (0)
+#define u_audio_remove_debug_files(card) do {} while (0)
+
+#endif	/* CONFIG_USB_GADGET_DEBUG_FS */
+
+/*-------------------------------------------------------------------------*/
+
 /**
  * Playback audio buffer data by ALSA PCM device
  */
@@ -175,10 +360,14 @@ static size_t u_audio_playback(struct gaudio *card, void *buf, size_t count)
 	mm_segment_t old_fs;
 	ssize_t result;
 	snd_pcm_sframes_t frames;
+	unsigned long flags;
 
 try_again:
 	if (runtime->status->state == SNDRV_PCM_STATE_XRUN ||
 		runtime->status->state == SNDRV_PCM_STATE_SUSPENDED) {
+		spin_lock_irqsave(card->stats_lock, flags);
+		card->stats.xruns++;
+		spin_unlock_irqrestore(card->stats_lock, flags);
 		result = snd_pcm_kernel_ioctl(substream,
 				SNDRV_PCM_IOCTL_PREPARE, NULL);
 		if (result < 0) {
@@ -194,6 +383,9 @@ try_again:
 	result = snd_pcm_lib_write(snd->substream, buf, frames);
 	if (result != frames) {
 		ERROR(card, "Playback error: %d\n", (int)result);
+		spin_lock_irqsave(card->stats_lock, flags);
+		card->stats.write_errors++;
+		spin_unlock_irqrestore(card->stats_lock, flags);
 		set_fs(old_fs);
 		goto try_again;
 	}
@@ -212,6 +404,18 @@ static int u_audio_get_playback_rate(struct gaudio *card)
 	return card->playback.rate;
 }
 
+/* Bytes per sample as carried over USB (subframe size) */
+static int u_audio_get_playback_sample_bytes(struct gaudio *card)
+{
+	return snd_pcm_format_physical_width(card->playback.format) / 8;
+}
+
+/* Significant bits per sample */
+static int u_audio_get_playback_sample_bits(struct gaudio *card)
+{
+	return snd_pcm_format_width(card->playback.format);
+}
+
 /**
  * Open ALSA PCM and control device files
  * Initial the PCM or control device
@@ -308,6 +512,8 @@ int __init gaudio_setup(struct gaudio *card)
 	if (!the_card)
 		the_card = card;
 
+	u_audio_create_debug_files(card);
+
 	return ret;
 
 }
@@ -320,6 +526,7 @@ int __init gaudio_setup(struct gaudio *card)
 void gaudio_cleanup(void)
 {
 	if (the_card) {
+		u_audio_remove_debug_files(the_card);
 		gaudio_close_snd_dev(the_card);
 		the_card = NULL;
 	}
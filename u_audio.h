@@ -14,6 +14,7 @@
 
 #include <linux/device.h>
 #include <linux/err.h>
+#include <linux/ktime.h>
 #include <linux/usb/audio.h>
 #include <linux/usb/composite.h>
 
@@ -38,6 +39,44 @@ struct gaudio_snd_dev {
 	int				rate;
 };
 
+/* log2 histogram buckets, in microseconds: bucket n counts [2^(n-1), 2^n) */
+#define GAUDIO_HIST_BUCKETS		20
+/* number of buffer fill level samples kept */
+#define GAUDIO_FILL_SAMPLES		64
+
+/*
+ * Playback statistics.  Packet counters are updated from the OUT endpoint
+ * completion, the others from the playback work, all under the function's
+ * lock (gaudio.stats_lock); readers don't lock.
+ */
+struct gaudio_stats {
+	unsigned long			packets;
+	unsigned long			bytes;
+	unsigned long			empty_packets;
+	unsigned long			dropped_packets;
+	unsigned long			xruns;
+	unsigned long			usb_xruns;	/* ISO errors */
+	unsigned long			write_errors;
+
+	ktime_t				last_arrival;
+	unsigned long			arrival_hist[GAUDIO_HIST_BUCKETS];
+
+	/* time from first packet of a buffer until ALSA accepted it */
+	unsigned long			latency_hist[GAUDIO_HIST_BUCKETS];
+	unsigned			latency_max_us;
+
+	/* buffers waiting for the playback work */
+	unsigned			queue_depth;
+	unsigned			queue_depth_max;
+
+	struct {
+		unsigned long		jiffies;
+		unsigned		queued;		/* buffers */
+		unsigned		alsa_frames;	/* frames in ALSA */
+	}				fill[GAUDIO_FILL_SAMPLES];
+	unsigned			fill_head;
+};
+
 struct gaudio {
 	struct usb_function		func;
 	struct usb_gadget		*gadget;
@@ -47,6 +86,12 @@ struct gaudio {
 	struct gaudio_snd_dev		playback;
 	struct gaudio_snd_dev		capture;
 
+	struct gaudio_stats		stats;
+	spinlock_t			*stats_lock;
+#ifdef CONFIG_USB_GADGET_DEBUG_FS
+	struct dentry			*debugfs_root;
+#endif
+
 	/* TODO */
 };
 
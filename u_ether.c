@@ -30,6 +30,8 @@
 #include <linux/ethtool.h>
 
 #include "u_ether.h"
+#include "ep_batch.h"
+#include "usb_sched.h"
 
 
 /*
@@ -65,10 +67,18 @@ struct eth_dev {
 	struct net_device	*net;
 	struct usb_gadget	*gadget;
 
-	spinlock_t		req_lock;	/* guard {rx,tx}_reqs */
+	spinlock_t		req_lock;	/* guard {rx,tx}_reqs, tx_tails */
 	struct list_head	tx_reqs, rx_reqs;
+	struct list_head	tx_tails;	/* see tx_tail_prep() */
+	struct usb_ep		*tail_ep;	/* NULL after free_tails() */
 	atomic_t		tx_qlen;
 
+	/* the pools outlive disconnects; these are the endpoints their
+	 * requests were allocated on, so reconnects can reuse them
+	 */
+	struct usb_ep		*tx_ep, *rx_ep;
+	struct sk_buff_head	rx_spare;	/* unused rx skbs, parked */
+
 	struct sk_buff_head	rx_frames;
 
 	unsigned		header_len;
@@ -78,6 +88,7 @@ struct eth_dev {
 						struct sk_buff_head *list);
 
 	struct work_struct	work;
+	struct workqueue_struct	*wq;		/* NULL for keventd */
 
 	unsigned long		todo;
 #define	WORK_RX_MEMORY		0
@@ -92,6 +103,8 @@ struct eth_dev {
 
 #define DEFAULT_QLEN	2	/* double buffering by default */
 
+#define TX_TAIL_BUFSIZ	(512 + 16)	/* partial packet, trailer, pad */
+
 
 #ifdef CONFIG_USB_GADGET_DUALSPEED
 
@@ -103,6 +116,10 @@ MODULE_PARM_DESC(qmult, "queue length multiplier at high speed");
 #define qmult		1
 #endif
 
+/* eth_work() refills the rx queue when memory was short */
+static struct usb_sched eth_work_sched = USB_SCHED_DEFAULT;
+USB_SCHED_MODULE_PARAMETERS(ether_work, eth_work_sched);
+
 /* for dual-speed hardware, use deeper queues at highspeed */
 static inline int qlen(struct usb_gadget *gadget)
 {
@@ -195,7 +212,7 @@ static void defer_kevent(struct eth_dev *dev, int flag)
 {
 	if (test_and_set_bit(flag, &dev->todo))
 		return;
-	if (!schedule_work(&dev->work))
+	if (!usb_sched_queue_work(dev->wq, &dev->work))
 		ERROR(dev, "kevent %d may have been dropped\n", flag);
 	else
 		DBG(dev, "kevent %d scheduled\n", flag);
@@ -203,25 +220,13 @@ static void defer_kevent(struct eth_dev *dev, int flag)
 
 static void rx_complete(struct usb_ep *ep, struct usb_request *req);
 
+/* attach a fresh skb to an OUT request, without queueing it */
 static int
-rx_submit(struct eth_dev *dev, struct usb_request *req, gfp_t gfp_flags)
+rx_prep(struct eth_dev *dev, struct usb_request *req, struct usb_ep *out,
+		gfp_t gfp_flags)
 {
 	struct sk_buff	*skb;
-	int		retval = -ENOMEM;
 	size_t		size = 0;
-	struct usb_ep	*out;
-	unsigned long	flags;
-
-	spin_lock_irqsave(&dev->lock, flags);
-	if (dev->port_usb)
-		out = dev->port_usb->out_ep;
-	else
-		out = NULL;
-	spin_unlock_irqrestore(&dev->lock, flags);
-
-	if (!out)
-		return -ENOTCONN;
-
 
 	/* Padding up to RX_EXTRA handles minor disagreements with host.
 	 * Normally we use the USB "terminate on short read" convention;
@@ -240,31 +245,62 @@ rx_submit(struct eth_dev *dev, struct usb_request *req, gfp_t gfp_flags)
 	size += out->maxpacket - 1;
 	size -= size % out->maxpacket;
 
-	skb = alloc_skb(size + NET_IP_ALIGN, gfp_flags);
-	if (skb == NULL) {
-		DBG(dev, "no rx skb\n");
-		goto enomem;
+	/* reuse an skb parked by the last disconnect if it's big enough */
+	skb = skb_dequeue(&dev->rx_spare);
+	if (skb && skb_tailroom(skb) < size) {
+		dev_kfree_skb_any(skb);
+		skb = NULL;
 	}
 
-	/* Some platforms perform better when IP packets are aligned,
-	 * but on at least one, checksumming fails otherwise.  Note:
-	 * RNDIS headers involve variable numbers of LE32 values.
-	 */
-	skb_reserve(skb, NET_IP_ALIGN);
+	if (!skb) {
+		skb = alloc_skb(size + NET_IP_ALIGN, gfp_flags);
+		if (skb == NULL) {
+			DBG(dev, "no rx skb\n");
+			return -ENOMEM;
+		}
+
+		/* Some platforms perform better when IP packets are
+		 * aligned, but on at least one, checksumming fails
+		 * otherwise.  Note: RNDIS headers involve variable
+		 * numbers of LE32 values.
+		 */
+		skb_reserve(skb, NET_IP_ALIGN);
+	}
 
 	req->buf = skb->data;
 	req->length = size;
 	req->complete = rx_complete;
 	req->context = skb;
+	return 0;
+}
+
+static int
+rx_submit(struct eth_dev *dev, struct usb_request *req, gfp_t gfp_flags)
+{
+	int		retval;
+	struct usb_ep	*out;
+	unsigned long	flags;
+
+	spin_lock_irqsave(&dev->lock, flags);
+	if (dev->port_usb)
+		out = dev->port_usb->out_ep;
+	else
+		out = NULL;
+	spin_unlock_irqrestore(&dev->lock, flags);
+
+	if (!out)
+		return -ENOTCONN;
 
-	retval = usb_ep_queue(out, req, gfp_flags);
+	retval = rx_prep(dev, req, out, gfp_flags);
+	if (retval == 0) {
+		retval = usb_ep_queue(out, req, gfp_flags);
+		if (retval)
+			dev_kfree_skb_any(req->context);
+	}
 	if (retval == -ENOMEM)
-enomem:
 		defer_kevent(dev, WORK_RX_MEMORY);
 	if (retval) {
 		DBG(dev, "rx submit --> %d\n", retval);
-		if (skb)
-			dev_kfree_skb_any(skb);
 		spin_lock_irqsave(&dev->req_lock, flags);
 		list_add(&req->list, &dev->rx_reqs);
 		spin_unlock_irqrestore(&dev->req_lock, flags);
@@ -272,10 +308,13 @@ enomem:
 	return retval;
 }
 
-static void rx_complete(struct usb_ep *ep, struct usb_request *req)
+/* hand a completed OUT request's data up the stack; returns false if
+ * the request went back to the idle pool, else it should be resubmitted
+ */
+static bool rx_process(struct eth_dev *dev, struct usb_ep *ep,
+		struct usb_request *req)
 {
 	struct sk_buff	*skb = req->context, *skb2;
-	struct eth_dev	*dev = ep->driver_data;
 	int		status = req->status;
 
 	switch (status) {
@@ -337,7 +376,11 @@ next_frame:
 		DBG(dev, "rx %s reset\n", ep->name);
 		defer_kevent(dev, WORK_RX_MEMORY);
 quiesce:
-		dev_kfree_skb_any(skb);
+		/* the skb never got data; keep it for the next rx_prep() */
+		if (skb_queue_len(&dev->rx_spare) < qlen(dev->gadget))
+			skb_queue_tail(&dev->rx_spare, skb);
+		else
+			dev_kfree_skb_any(skb);
 		goto clean;
 
 	/* data overrun */
@@ -358,12 +401,76 @@ clean:
 		spin_lock(&dev->req_lock);
 		list_add(&req->list, &dev->rx_reqs);
 		spin_unlock(&dev->req_lock);
-		req = NULL;
+		return false;
 	}
-	if (req)
+	return true;
+}
+
+static void rx_complete(struct usb_ep *ep, struct usb_request *req)
+{
+	struct eth_dev	*dev = ep->driver_data;
+
+	if (rx_process(dev, ep, req))
 		rx_submit(dev, req, GFP_ATOMIC);
 }
 
+/* queue a batch of prepared OUT requests; whatever isn't queued loses
+ * its skb and goes back to the idle pool
+ */
+static int rx_queue_batch(struct eth_dev *dev, struct usb_ep *out,
+		struct list_head *batch, gfp_t gfp_flags)
+{
+	struct usb_request	*req;
+	unsigned long		flags;
+	int			status;
+
+	status = usb_ep_queue_list(dev->gadget, out, batch, gfp_flags);
+	if (status < 0) {
+		DBG(dev, "rx submit --> %d\n", status);
+		list_for_each_entry(req, batch, list)
+			dev_kfree_skb_any(req->context);
+		spin_lock_irqsave(&dev->req_lock, flags);
+		list_splice_init(batch, &dev->rx_reqs);
+		spin_unlock_irqrestore(&dev->req_lock, flags);
+	}
+	return status;
+}
+
+/* batched completions:  process everything, then resubmit in one call */
+static void rx_complete_list(struct usb_ep *ep, struct list_head *done)
+{
+	struct eth_dev		*dev = ep->driver_data;
+	struct usb_request	*req, *tmp;
+	int			status = 0;
+	bool			connected;
+	LIST_HEAD(batch);
+
+	spin_lock(&dev->lock);
+	connected = (dev->port_usb != NULL);
+	spin_unlock(&dev->lock);
+
+	list_for_each_entry_safe(req, tmp, done, list) {
+		list_del(&req->list);
+		if (!rx_process(dev, ep, req))
+			continue;
+		if (connected && rx_prep(dev, req, ep, GFP_ATOMIC) == 0) {
+			list_add_tail(&req->list, &batch);
+			continue;
+		}
+		if (connected)
+			status = -ENOMEM;
+		spin_lock(&dev->req_lock);
+		list_add(&req->list, &dev->rx_reqs);
+		spin_unlock(&dev->req_lock);
+	}
+
+	if (!list_empty(&batch) && rx_queue_batch(dev, ep, &batch,
+				GFP_ATOMIC) < 0)
+		status = -ENOMEM;
+	if (status < 0)
+		defer_kevent(dev, WORK_RX_MEMORY);
+}
+
 static int prealloc(struct list_head *list, struct usb_ep *ep, unsigned n)
 {
 	unsigned		i;
@@ -403,6 +510,25 @@ extra:
 	return 0;
 }
 
+/* give a pool's requests back to the endpoint they were allocated on */
+static void free_requests(struct eth_dev *dev, struct list_head *list,
+		struct usb_ep *ep)
+{
+	struct usb_request	*req;
+	unsigned long		flags;
+
+	spin_lock_irqsave(&dev->req_lock, flags);
+	while (!list_empty(list)) {
+		req = container_of(list->next, struct usb_request, list);
+		list_del(&req->list);
+
+		spin_unlock_irqrestore(&dev->req_lock, flags);
+		usb_ep_free_request(ep, req);
+		spin_lock_irqsave(&dev->req_lock, flags);
+	}
+	spin_unlock_irqrestore(&dev->req_lock, flags);
+}
+
 static int alloc_requests(struct eth_dev *dev, struct gether *link, unsigned n)
 {
 	int	status;
@@ -424,25 +550,48 @@ done:
 
 static void rx_fill(struct eth_dev *dev, gfp_t gfp_flags)
 {
-	struct usb_request	*req;
+	struct usb_request	*req, *tmp;
+	struct usb_ep		*out;
 	unsigned long		flags;
+	int			status = 0;
+	LIST_HEAD(idle);
+	LIST_HEAD(batch);
+
+	spin_lock_irqsave(&dev->lock, flags);
+	if (dev->port_usb)
+		out = dev->port_usb->out_ep;
+	else
+		out = NULL;
+	spin_unlock_irqrestore(&dev->lock, flags);
 
-	/* fill unused rxq slots with some skb */
+	if (!out)
+		return;
+
+	/* fill unused rxq slots with some skb, then queue them all at once */
 	spin_lock_irqsave(&dev->req_lock, flags);
-	while (!list_empty(&dev->rx_reqs)) {
-		req = container_of(dev->rx_reqs.next,
-				struct usb_request, list);
-		list_del_init(&req->list);
-		spin_unlock_irqrestore(&dev->req_lock, flags);
+	list_splice_init(&dev->rx_reqs, &idle);
+	spin_unlock_irqrestore(&dev->req_lock, flags);
 
-		if (rx_submit(dev, req, gfp_flags) < 0) {
-			defer_kevent(dev, WORK_RX_MEMORY);
-			return;
-		}
+	list_for_each_entry_safe(req, tmp, &idle, list) {
+		status = rx_prep(dev, req, out, gfp_flags);
+		if (status < 0)
+			break;
+		list_move_tail(&req->list, &batch);
+	}
+
+	if (!list_empty(&batch) && rx_queue_batch(dev, out, &batch,
+				gfp_flags) < 0)
+		status = -ENOMEM;
 
+	/* requests we had no skb for go back to the pool */
+	if (!list_empty(&idle)) {
 		spin_lock_irqsave(&dev->req_lock, flags);
+		list_splice(&idle, &dev->rx_reqs);
+		spin_unlock_irqrestore(&dev->req_lock, flags);
 	}
-	spin_unlock_irqrestore(&dev->req_lock, flags);
+
+	if (status < 0)
+		defer_kevent(dev, WORK_RX_MEMORY);
 }
 
 static void eth_work(struct work_struct *work)
@@ -458,10 +607,13 @@ static void eth_work(struct work_struct *work)
 		DBG(dev, "work done, flags = 0x%lx\n", dev->todo);
 }
 
-static void tx_complete(struct usb_ep *ep, struct usb_request *req)
+static void tx_account(struct eth_dev *dev, struct usb_request *req)
 {
 	struct sk_buff	*skb = req->context;
-	struct eth_dev	*dev = ep->driver_data;
+
+	/* tail requests hold no skb; the frame was accounted already */
+	if (!skb)
+		return;
 
 	switch (req->status) {
 	default:
@@ -475,17 +627,171 @@ static void tx_complete(struct usb_ep *ep, struct usb_request *req)
 		dev->net->stats.tx_bytes += skb->len;
 	}
 	dev->net->stats.tx_packets++;
+	dev_kfree_skb_any(skb);
+}
+
+static void tx_complete(struct usb_ep *ep, struct usb_request *req)
+{
+	struct eth_dev	*dev = ep->driver_data;
+
+	tx_account(dev, req);
 
 	spin_lock(&dev->req_lock);
 	list_add(&req->list, &dev->tx_reqs);
 	spin_unlock(&dev->req_lock);
-	dev_kfree_skb_any(skb);
 
 	atomic_dec(&dev->tx_qlen);
 	if (netif_carrier_ok(dev->net))
 		netif_wake_queue(dev->net);
 }
 
+/* a tail coming back after free_tails() (xmit racing a disconnect)
+ * doesn't rejoin the pool; nothing else would free it
+ */
+static void tx_tail_put(struct eth_dev *dev, struct usb_ep *in,
+		struct usb_request *tail)
+{
+	unsigned long	flags;
+
+	spin_lock_irqsave(&dev->req_lock, flags);
+	if (dev->tail_ep == in) {
+		list_add(&tail->list, &dev->tx_tails);
+		tail = NULL;
+	}
+	spin_unlock_irqrestore(&dev->req_lock, flags);
+
+	if (tail) {
+		kfree(tail->buf);
+		usb_ep_free_request(in, tail);
+	}
+}
+
+static void tx_tail_complete(struct usb_ep *ep, struct usb_request *req)
+{
+	tx_tail_put(ep->driver_data, ep, req);
+}
+
+/* batched completions:  one trip through req_lock, one queue wakeup */
+static void tx_complete_list(struct usb_ep *ep, struct list_head *done)
+{
+	struct eth_dev		*dev = ep->driver_data;
+	struct usb_request	*req, *tmp;
+	int			n = 0;
+	LIST_HEAD(tails);
+
+	list_for_each_entry_safe(req, tmp, done, list) {
+		if (req->complete == tx_tail_complete) {
+			list_move(&req->list, &tails);
+			continue;
+		}
+		tx_account(dev, req);
+		n++;
+	}
+
+	spin_lock(&dev->req_lock);
+	list_splice(done, &dev->tx_reqs);
+	list_splice(&tails, &dev->tx_tails);
+	spin_unlock(&dev->req_lock);
+
+	atomic_sub(n, &dev->tx_qlen);
+	if (netif_carrier_ok(dev->net))
+		netif_wake_queue(dev->net);
+}
+
+/* tail requests carry their own small buffer, and are used only by
+ * links whose wrap() adds a trailer; a short pool only costs copies
+ */
+static void alloc_tails(struct eth_dev *dev, struct usb_ep *in, unsigned n)
+{
+	struct usb_request	*req;
+
+	while (n--) {
+		req = usb_ep_alloc_request(in, GFP_ATOMIC);
+		if (!req)
+			break;
+		req->buf = kmalloc(TX_TAIL_BUFSIZ, GFP_ATOMIC);
+		if (!req->buf) {
+			usb_ep_free_request(in, req);
+			break;
+		}
+		req->context = NULL;
+		req->complete = tx_tail_complete;
+
+		spin_lock(&dev->req_lock);
+		list_add(&req->list, &dev->tx_tails);
+		dev->tail_ep = in;
+		spin_unlock(&dev->req_lock);
+	}
+}
+
+static void free_tails(struct eth_dev *dev, struct usb_ep *in)
+{
+	struct usb_request	*req;
+	unsigned long		flags;
+
+	spin_lock_irqsave(&dev->req_lock, flags);
+	dev->tail_ep = NULL;
+	while (!list_empty(&dev->tx_tails)) {
+		req = container_of(dev->tx_tails.next,
+				struct usb_request, list);
+		list_del(&req->list);
+
+		spin_unlock_irqrestore(&dev->req_lock, flags);
+		kfree(req->buf);
+		usb_ep_free_request(in, req);
+		spin_lock_irqsave(&dev->req_lock, flags);
+	}
+	spin_unlock_irqrestore(&dev->req_lock, flags);
+}
+
+/*
+ * The skb's data is shared, so wrap() left its trailer in skb->cb.
+ * Rather than copy the frame to append it, send the data in place up
+ * to its last packet boundary (no short packet, so the transfer goes
+ * on) and let a tail request carry the rest of the last packet plus
+ * the trailer.  Returns NULL if the caller must copy after all.
+ */
+static struct usb_request *tx_tail_prep(struct eth_dev *dev,
+		struct usb_ep *in, struct sk_buff *skb)
+{
+	struct gether_trailer	*t = gether_trailer(skb);
+	unsigned		head = skb->len - skb->len % in->maxpacket;
+	unsigned		rest = skb->len - head;
+	struct usb_request	*tail;
+	unsigned long		flags;
+
+	/* room for the zlp pad byte too */
+	if (!head || rest + t->len >= TX_TAIL_BUFSIZ)
+		return NULL;
+
+	spin_lock_irqsave(&dev->req_lock, flags);
+	if (list_empty(&dev->tx_tails)) {
+		spin_unlock_irqrestore(&dev->req_lock, flags);
+		return NULL;
+	}
+	tail = container_of(dev->tx_tails.next, struct usb_request, list);
+	list_del(&tail->list);
+	spin_unlock_irqrestore(&dev->req_lock, flags);
+
+	memcpy(tail->buf, skb->data + head, rest);
+	memcpy(tail->buf + rest, t->data, t->len);
+	tail->length = rest + t->len;
+	return tail;
+}
+
+/* the fallback:  a private copy of the frame, with the trailer appended */
+static struct sk_buff *tx_append_trailer(struct sk_buff *skb)
+{
+	struct gether_trailer	t = *gether_trailer(skb);
+	struct sk_buff		*skb2;
+
+	skb2 = skb_copy_expand(skb, 0, t.len, GFP_ATOMIC);
+	dev_kfree_skb_any(skb);
+	if (skb2)
+		memcpy(skb_put(skb2, t.len), t.data, t.len);
+	return skb2;
+}
+
 static inline int is_promisc(u16 cdc_filter)
 {
 	return cdc_filter & USB_CDC_PACKET_TYPE_PROMISCUOUS;
@@ -498,6 +804,7 @@ static netdev_tx_t eth_start_xmit(struct sk_buff *skb,
 	int			length = skb->len;
 	int			retval;
 	struct usb_request	*req = NULL;
+	struct usb_request	*tail = NULL;
 	unsigned long		flags;
 	struct usb_ep		*in;
 	u16			cdc_filter;
@@ -565,6 +872,8 @@ static netdev_tx_t eth_start_xmit(struct sk_buff *skb,
 	if (dev->wrap) {
 		unsigned long	flags;
 
+		gether_trailer(skb)->len = 0;
+
 		spin_lock_irqsave(&dev->lock, flags);
 		if (dev->port_usb)
 			skb = dev->wrap(dev->port_usb, skb);
@@ -573,6 +882,17 @@ static netdev_tx_t eth_start_xmit(struct sk_buff *skb,
 			goto drop;
 
 		length = skb->len;
+		if (gether_trailer(skb)->len) {
+			tail = tx_tail_prep(dev, in, skb);
+			if (tail) {
+				length -= length % in->maxpacket;
+			} else {
+				skb = tx_append_trailer(skb);
+				if (!skb)
+					goto drop;
+				length = skb->len;
+			}
+		}
 	}
 	req->buf = skb->data;
 	req->context = skb;
@@ -581,10 +901,20 @@ static netdev_tx_t eth_start_xmit(struct sk_buff *skb,
 	/* use zlp framing on tx for strict CDC-Ether conformance,
 	 * though any robust network rx path ignores extra padding.
 	 * and some hardware doesn't like to write zlps.
+	 *
+	 * A split frame's head is whole packets; its tail ends the
+	 * transfer instead.
 	 */
-	req->zero = 1;
-	if (!dev->zlp && (length % in->maxpacket) == 0)
-		length++;
+	if (tail) {
+		req->zero = 0;
+		tail->zero = 1;
+		if (!dev->zlp && (tail->length % in->maxpacket) == 0)
+			tail->length++;
+	} else {
+		req->zero = 1;
+		if (!dev->zlp && (length % in->maxpacket) == 0)
+			length++;
+	}
 
 	req->length = length;
 
@@ -594,7 +924,39 @@ static netdev_tx_t eth_start_xmit(struct sk_buff *skb,
 			? ((atomic_read(&dev->tx_qlen) % qmult) != 0)
 			: 0;
 
-	retval = usb_ep_queue(in, req, GFP_ATOMIC);
+	if (tail) {
+		LIST_HEAD(batch);
+
+		/* the tail's completion retires both */
+		tail->no_interrupt = req->no_interrupt;
+		req->no_interrupt = 1;
+
+		list_add_tail(&req->list, &batch);
+		list_add_tail(&tail->list, &batch);
+		retval = usb_ep_queue_list(dev->gadget, in, &batch,
+				GFP_ATOMIC);
+		if (retval) {
+			/* whatever is left on the batch wasn't queued */
+			bool	head_queued = (batch.next != &req->list);
+
+			list_del(&tail->list);
+			tx_tail_put(dev, in, tail);
+			if (head_queued) {
+				/* the head is whole packets and can't end the
+				 * transfer; pull it back.  Its completion frees
+				 * the skb and recycles req.
+				 */
+				DBG(dev, "tx tail err %d\n", retval);
+				atomic_inc(&dev->tx_qlen);
+				usb_ep_dequeue(in, req);
+				dev->net->stats.tx_errors++;
+				return NETDEV_TX_OK;
+			}
+			list_del(&req->list);
+		}
+	} else {
+		retval = usb_ep_queue(in, req, GFP_ATOMIC);
+	}
 	switch (retval) {
 	default:
 		DBG(dev, "tx queue err %d\n", retval);
@@ -781,9 +1143,12 @@ int gether_setup(struct usb_gadget *g, u8 ethaddr[ETH_ALEN])
 	spin_lock_init(&dev->lock);
 	spin_lock_init(&dev->req_lock);
 	INIT_WORK(&dev->work, eth_work);
+	dev->wq = usb_sched_create_workqueue("u_ether", &eth_work_sched);
 	INIT_LIST_HEAD(&dev->tx_reqs);
 	INIT_LIST_HEAD(&dev->rx_reqs);
+	INIT_LIST_HEAD(&dev->tx_tails);
 
+	skb_queue_head_init(&dev->rx_spare);
 	skb_queue_head_init(&dev->rx_frames);
 
 	/* network device setup */
@@ -818,6 +1183,8 @@ int gether_setup(struct usb_gadget *g, u8 ethaddr[ETH_ALEN])
 	status = register_netdev(net);
 	if (status < 0) {
 		dev_dbg(&g->dev, "register_netdev failed, %d\n", status);
+		if (dev->wq)
+			destroy_workqueue(dev->wq);
 		free_netdev(net);
 	} else {
 		INFO(dev, "MAC %pM\n", net->dev_addr);
@@ -841,10 +1208,21 @@ void gether_cleanup(void)
 		return;
 
 	unregister_netdev(the_dev->net);
-	free_netdev(the_dev->net);
 
-	/* assuming we used keventd, it must quiesce too */
-	flush_scheduled_work();
+	/* release what gether_disconnect() left parked */
+	if (the_dev->tx_ep)
+		free_requests(the_dev, &the_dev->tx_reqs, the_dev->tx_ep);
+	if (the_dev->rx_ep)
+		free_requests(the_dev, &the_dev->rx_reqs, the_dev->rx_ep);
+	skb_queue_purge(&the_dev->rx_spare);
+
+	/* whichever workqueue eth_work() used must quiesce too */
+	if (the_dev->wq)
+		destroy_workqueue(the_dev->wq);
+	else
+		flush_scheduled_work();
+
+	free_netdev(the_dev->net);
 
 	the_dev = NULL;
 }
@@ -890,9 +1268,36 @@ struct net_device *gether_connect(struct gether *link)
 		goto fail1;
 	}
 
+	/* requests parked by the last disconnect are reused if they were
+	 * allocated on these same endpoints; alloc_requests() then only
+	 * tops up (or trims) the pools
+	 */
+	if (dev->tx_ep != link->in_ep) {
+		if (dev->tx_ep)
+			free_requests(dev, &dev->tx_reqs, dev->tx_ep);
+		dev->tx_ep = link->in_ep;
+	}
+	if (dev->rx_ep != link->out_ep) {
+		if (dev->rx_ep)
+			free_requests(dev, &dev->rx_reqs, dev->rx_ep);
+		dev->rx_ep = link->out_ep;
+	}
+
 	if (result == 0)
 		result = alloc_requests(dev, link, qlen(dev->gadget));
 
+	/* one more tail than heads:  a head may complete before its tail */
+	if (result == 0 && link->trailer_len)
+		alloc_tails(dev, link->in_ep, qlen(dev->gadget) + 1);
+
+	/* take completions a list at a time where the controller can */
+	if (result == 0) {
+		usb_ep_set_complete_list(dev->gadget, link->in_ep,
+				tx_complete_list);
+		usb_ep_set_complete_list(dev->gadget, link->out_ep,
+				rx_complete_list);
+	}
+
 	if (result == 0) {
 		dev->zlp = link->is_zlp_ok;
 		DBG(dev, "qlen %d\n", qlen(dev->gadget));
@@ -901,6 +1306,12 @@ struct net_device *gether_connect(struct gether *link)
 		dev->unwrap = link->unwrap;
 		dev->wrap = link->wrap;
 
+		/* have the stack leave room for our framing, so wrap()
+		 * needn't reallocate; this outlives the connection
+		 */
+		dev->net->needed_headroom = link->header_len;
+		dev->net->needed_tailroom = link->trailer_len;
+
 		spin_lock(&dev->lock);
 		dev->port_usb = link;
 		link->ioport = dev;
@@ -941,11 +1352,12 @@ fail0:
  * On return, the state is as if gether_connect() had never been called.
  * The endpoints are inactive, and accordingly without active USB I/O.
  * Pointers to endpoint descriptors and endpoint private data are nulled.
+ * The request pools (and unused rx skbs) stay parked for the next
+ * gether_connect(); gether_cleanup() frees them.
  */
 void gether_disconnect(struct gether *link)
 {
 	struct eth_dev		*dev = link->ioport;
-	struct usb_request	*req;
 
 	WARN_ON(!dev);
 	if (!dev)
@@ -957,36 +1369,16 @@ void gether_disconnect(struct gether *link)
 	netif_carrier_off(dev->net);
 
 	/* disable endpoints, forcing (synchronous) completion
-	 * of all pending i/o.  then free the request objects
-	 * and forget about the endpoints.
+	 * of all pending i/o, which brings every request back to
+	 * its idle pool.  The pools stay parked there, so that a
+	 * reconnect needn't reallocate them; forget the endpoints.
 	 */
 	usb_ep_disable(link->in_ep);
-	spin_lock(&dev->req_lock);
-	while (!list_empty(&dev->tx_reqs)) {
-		req = container_of(dev->tx_reqs.next,
-					struct usb_request, list);
-		list_del(&req->list);
-
-		spin_unlock(&dev->req_lock);
-		usb_ep_free_request(link->in_ep, req);
-		spin_lock(&dev->req_lock);
-	}
-	spin_unlock(&dev->req_lock);
+	free_tails(dev, link->in_ep);
 	link->in_ep->driver_data = NULL;
 	link->in = NULL;
 
 	usb_ep_disable(link->out_ep);
-	spin_lock(&dev->req_lock);
-	while (!list_empty(&dev->rx_reqs)) {
-		req = container_of(dev->rx_reqs.next,
-					struct usb_request, list);
-		list_del(&req->list);
-
-		spin_unlock(&dev->req_lock);
-		usb_ep_free_request(link->out_ep, req);
-		spin_lock(&dev->req_lock);
-	}
-	spin_unlock(&dev->req_lock);
 	link->out_ep->driver_data = NULL;
 	link->out = NULL;
 
@@ -25,6 +25,7 @@
 
 #include <linux/err.h>
 #include <linux/if_ether.h>
+#include <linux/skbuff.h>
 #include <linux/usb/composite.h>
 #include <linux/usb/cdc.h>
 
@@ -60,8 +61,11 @@ struct gether {
 
 	u16				cdc_filter;
 
-	/* hooks for added framing, as needed for RNDIS and EEM. */
+	/* hooks for added framing, as needed for RNDIS and EEM.
+	 * header_len and trailer_len are the most wrap() adds.
+	 */
 	u32				header_len;
+	u32				trailer_len;
 	struct sk_buff			*(*wrap)(struct gether *port,
 						struct sk_buff *skb);
 	int				(*unwrap)(struct gether *port,
@@ -73,6 +77,22 @@ struct gether {
 	void				(*close)(struct gether *);
 };
 
+/*
+ * A wrap() hook may not append to an skb whose data is shared with a
+ * clone, as TCP's always is.  It leaves such trailers (at most eight
+ * bytes) in the skb's control buffer instead, and the link layer sends
+ * them right after the data.  The link layer clears "len" beforehand.
+ */
+struct gether_trailer {
+	u8	len;
+	u8	data[8];
+};
+
+static inline struct gether_trailer *gether_trailer(struct sk_buff *skb)
+{
+	return (struct gether_trailer *) skb->cb;
+}
+
 #define	DEFAULT_FILTER	(USB_CDC_PACKET_TYPE_BROADCAST \
 			|USB_CDC_PACKET_TYPE_ALL_MULTICAST \
 			|USB_CDC_PACKET_TYPE_PROMISCUOUS \
@@ -24,8 +24,11 @@
 #include <linux/tty.h>
 #include <linux/tty_flip.h>
 #include <linux/slab.h>
+#include <linux/console.h>
 
 #include "u_serial.h"
+#include "ep_batch.h"
+#include "usb_sched.h"
 
 
 /*
@@ -51,6 +54,13 @@
  * for a telephone or fax link.  And ttyGS2 might be something that just
  * needs a simple byte stream interface for some messaging protocol that
  * is managed in userspace ... OBEX, PTP, and MTP have been mentioned.
+ *
+ * With CONFIG_USB_G_SERIAL_CONSOLE, one port can also be the kernel
+ * console ("console=ttyGS0").  printk() output goes into a ring of its
+ * own which the console write() fills without taking port_lock or ever
+ * waiting; gs_start_tx() drains it ahead of TTY data whenever the port
+ * is connected, whether or not /dev/ttyGS* is open.  When the host
+ * doesn't read, the ring fills and further output is dropped.
  */
 
 #define PREFIX	"ttyGS"
@@ -79,13 +89,8 @@
 #define QUEUE_SIZE		16
 #define WRITE_BUF_SIZE		8192		/* TX only */
 
-/* circular buffer */
-struct gs_buf {
-	unsigned		buf_size;
-	char			*buf_buf;
-	char			*buf_get;
-	char			*buf_put;
-};
+/* TX circular buffer */
+#include "gs_buf.c"
 
 /*
  * The port structure holds info for each port, one for each minor number
@@ -104,11 +109,14 @@ struct gs_port {
 	wait_queue_head_t	close_wait;	/* wait for last close */
 
 	struct list_head	read_pool;
+	int			read_allocated;
 	struct list_head	read_queue;
 	unsigned		n_read;
 	struct tasklet_struct	push;
+	bool			push_hi;	/* use HI_SOFTIRQ */
 
 	struct list_head	write_pool;
+	int			write_allocated;
 	struct gs_buf		port_write_buf;
 	wait_queue_head_t	drain_wait;	/* wait while writes drain */
 
@@ -116,16 +124,22 @@ struct gs_port {
 	struct usb_cdc_line_coding port_line_coding;	/* 8-N-1 etc */
 };
 
-/* increase N_PORTS if you need more */
-#define N_PORTS		4
+/* port numbers are u8, which bounds how many ports may be set up;
+ * the portmaster table itself is sized by gserial_setup().
+ */
+#define MAX_PORTS	256
 static struct portmaster {
 	struct mutex	lock;			/* protect open/close */
 	struct gs_port	*port;
-} ports[N_PORTS];
+} *ports;
 static unsigned	n_ports;
 
 #define GS_CLOSE_TIMEOUT		15		/* seconds */
 
+/* only the policy matters to the RX push tasklets, see usb_sched.h */
+static struct usb_sched gs_push_sched = USB_SCHED_DEFAULT;
+USB_SCHED_MODULE_PARAMETERS(serial_push, gs_push_sched);
+
 
 
 #ifdef VERBOSE_DEBUG
@@ -138,180 +152,136 @@ static unsigned	n_ports;
 
 /*-------------------------------------------------------------------------*/
 
-/* Circular Buffer */
+/* I/O glue between TTY (upper) and USB function (lower) driver layers */
 
 /*
- * gs_buf_alloc
+ * gs_alloc_req
  *
- * Allocate a circular buffer and all associated memory.
+ * Allocate a usb_request and its buffer.  Returns a pointer to the
+ * usb_request or NULL if there is an error.
  */
-static int gs_buf_alloc(struct gs_buf *gb, unsigned size)
+struct usb_request *
+gs_alloc_req(struct usb_ep *ep, unsigned len, gfp_t kmalloc_flags)
 {
-	gb->buf_buf = kmalloc(size, GFP_KERNEL);
-	if (gb->buf_buf == NULL)
-		return -ENOMEM;
-
-	gb->buf_size = size;
-	gb->buf_put = gb->buf_buf;
-	gb->buf_get = gb->buf_buf;
+	struct usb_request *req;
 
-	return 0;
-}
+	req = usb_ep_alloc_request(ep, kmalloc_flags);
 
-/*
- * gs_buf_free
- *
- * Free the buffer and all associated memory.
- */
-static void gs_buf_free(struct gs_buf *gb)
-{
-	kfree(gb->buf_buf);
-	gb->buf_buf = NULL;
-}
+	if (req != NULL) {
+		req->length = len;
+		req->buf = kmalloc(len, kmalloc_flags);
+		if (req->buf == NULL) {
+			usb_ep_free_request(ep, req);
+			return NULL;
+		}
+	}
 
-/*
- * gs_buf_clear
- *
- * Clear out all data in the circular buffer.
- */
-static void gs_buf_clear(struct gs_buf *gb)
-{
-	gb->buf_get = gb->buf_put;
-	/* equivalent to a get of all data available */
+	return req;
 }
 
 /*
- * gs_buf_data_avail
+ * gs_free_req
  *
- * Return the number of bytes of data written into the circular
- * buffer.
+ * Free a usb_request and its buffer.
  */
-static unsigned gs_buf_data_avail(struct gs_buf *gb)
+void gs_free_req(struct usb_ep *ep, struct usb_request *req)
 {
-	return (gb->buf_size + gb->buf_put - gb->buf_get) % gb->buf_size;
+	kfree(req->buf);
+	usb_ep_free_request(ep, req);
 }
 
-/*
- * gs_buf_space_avail
- *
- * Return the number of bytes of space available in the circular
- * buffer.
- */
-static unsigned gs_buf_space_avail(struct gs_buf *gb)
-{
-	return (gb->buf_size + gb->buf_get - gb->buf_put - 1) % gb->buf_size;
-}
+#ifdef CONFIG_USB_G_SERIAL_CONSOLE
 
 /*
- * gs_buf_put
- *
- * Copy data data from a user buffer and put it into the circular buffer.
- * Restrict to the amount of space available.
- *
- * Return the number of bytes copied.
+ * Console output ring.  The only producer is gs_console_write(), which
+ * the printk code calls with the console semaphore held, so writers are
+ * already serialized; the only consumer is gs_start_tx(), under the
+ * console port's port_lock.  Head and tail run freely and are published
+ * with barriers, so neither side ever waits for the other.
  */
-static unsigned
-gs_buf_put(struct gs_buf *gb, const char *buf, unsigned count)
-{
-	unsigned len;
+#define GS_CONSOLE_BUF_SIZE	8192		/* power of two */
 
-	len  = gs_buf_space_avail(gb);
-	if (count > len)
-		count = len;
+static struct {
+	char		buf[GS_CONSOLE_BUF_SIZE];
+	unsigned	head;		/* written by gs_console_write() */
+	unsigned	tail;		/* written by gs_console_get() */
+	unsigned long	dropped;	/* bytes lost to a full ring */
+} gs_console_ring;
 
-	if (count == 0)
-		return 0;
+/* port_num of the console port, or -1 */
+static int gs_console_port = -1;
 
-	len = gb->buf_buf + gb->buf_size - gb->buf_put;
-	if (count > len) {
-		memcpy(gb->buf_put, buf, len);
-		memcpy(gb->buf_buf, buf+len, count - len);
-		gb->buf_put = gb->buf_buf + count - len;
-	} else {
-		memcpy(gb->buf_put, buf, count);
-		if (count < len)
-			gb->buf_put += count;
-		else /* count == len */
-			gb->buf_put = gb->buf_buf;
-	}
+static inline bool gs_is_console(struct gs_port *port)
+{
+	return port->port_num == gs_console_port;
+}
 
-	return count;
+static unsigned gs_console_avail(void)
+{
+	return ACCESS_ONCE(gs_console_ring.head) - gs_console_ring.tail;
 }
 
 /*
- * gs_buf_get
- *
- * Get data from the circular buffer and copy to the given buffer.
- * Restrict to the amount of data available.
+ * Copy up to @size bytes of console output to @packet.
  *
- * Return the number of bytes copied.
+ * Called with the console port's port_lock held.
  */
-static unsigned
-gs_buf_get(struct gs_buf *gb, char *buf, unsigned count)
+static unsigned gs_console_get(char *packet, unsigned size)
 {
-	unsigned len;
+	unsigned	tail = gs_console_ring.tail;
+	unsigned	n, i;
 
-	len = gs_buf_data_avail(gb);
-	if (count > len)
-		count = len;
+	n = ACCESS_ONCE(gs_console_ring.head) - tail;
+	if (n > size)
+		n = size;
+	smp_rmb();	/* read the data only after its head */
 
-	if (count == 0)
-		return 0;
-
-	len = gb->buf_buf + gb->buf_size - gb->buf_get;
-	if (count > len) {
-		memcpy(buf, gb->buf_get, len);
-		memcpy(buf+len, gb->buf_buf, count - len);
-		gb->buf_get = gb->buf_buf + count - len;
-	} else {
-		memcpy(buf, gb->buf_get, count);
-		if (count < len)
-			gb->buf_get += count;
-		else /* count == len */
-			gb->buf_get = gb->buf_buf;
-	}
+	for (i = 0; i < n; i++)
+		packet[i] = gs_console_ring.buf[(tail + i)
+				& (GS_CONSOLE_BUF_SIZE - 1)];
 
-	return count;
+	smp_mb();	/* finish reading before the space is reused */
+	gs_console_ring.tail = tail + n;
+	return n;
 }
 
-/*-------------------------------------------------------------------------*/
-
-/* I/O glue between TTY (upper) and USB function (lower) driver layers */
+#else
 
-/*
- * gs_alloc_req
- *
- * Allocate a usb_request and its buffer.  Returns a pointer to the
- * usb_request or NULL if there is an error.
- */
-struct usb_request *
-gs_alloc_req(struct usb_ep *ep, unsigned len, gfp_t kmalloc_flags)
+static inline bool gs_is_console(struct gs_port *port)
 {
-	struct usb_request *req;
-
-	req = usb_ep_alloc_request(ep, kmalloc_flags);
+	return false;
+}
 
-	if (req != NULL) {
-		req->length = len;
-		req->buf = kmalloc(len, kmalloc_flags);
-		if (req->buf == NULL) {
-			usb_ep_free_request(ep, req);
-			return NULL;
-		}
-	}
+static inline unsigned gs_console_avail(void)
+{
+	return 0;
+}
 
-	return req;
+static inline unsigned gs_console_get(char *packet, unsigned size)
+{
+	return 0;
 }
 
+#endif	/* CONFIG_USB_G_SERIAL_CONSOLE */
+
 /*
- * gs_free_req
+ * gs_tx_pending
  *
- * Free a usb_request and its buffer.
+ * Return how many bytes are waiting to be sent: console output, if this
+ * is the console port, and data in the circular buffer, if the TTY has
+ * one.
+ *
+ * Called with port_lock held.
  */
-void gs_free_req(struct usb_ep *ep, struct usb_request *req)
+static unsigned gs_tx_pending(struct gs_port *port)
 {
-	kfree(req->buf);
-	usb_ep_free_request(ep, req);
+	unsigned	len = 0;
+
+	if (gs_is_console(port))
+		len = gs_console_avail();
+	if (port->port_write_buf.buf_buf)
+		len += gs_buf_data_avail(&port->port_write_buf);
+	return len;
 }
 
 /*
@@ -319,21 +289,36 @@ void gs_free_req(struct usb_ep *ep, struct usb_request *req)
  *
  * If there is data to send, a packet is built in the given
  * buffer and the size is returned.  If there is no data to
- * send, 0 is returned.
+ * send, 0 is returned.  Console output goes first.
  *
  * Called with port_lock held.
  */
 static unsigned
 gs_send_packet(struct gs_port *port, char *packet, unsigned size)
 {
-	unsigned len;
-
-	len = gs_buf_data_avail(&port->port_write_buf);
-	if (len < size)
-		size = len;
-	if (size != 0)
-		size = gs_buf_get(&port->port_write_buf, packet, size);
-	return size;
+	unsigned len = 0;
+
+	if (gs_is_console(port))
+		len = gs_console_get(packet, size);
+
+	/* the TTY's buffer is gone while it's closed */
+	if (len < size && port->port_write_buf.buf_buf)
+		len += gs_buf_get(&port->port_write_buf, packet + len,
+				size - len);
+	return len;
+}
+
+static void gs_free_requests(struct usb_ep *ep, struct list_head *head,
+		int *allocated)
+{
+	struct usb_request	*req;
+
+	while (!list_empty(head)) {
+		req = list_entry(head->next, struct usb_request, list);
+		list_del(&req->list);
+		gs_free_req(ep, req);
+		(*allocated)--;
+	}
 }
 
 /*
@@ -354,9 +339,11 @@ __acquires(&port->port_lock)
 */
 {
 	struct list_head	*pool = &port->write_pool;
-	struct usb_ep		*in = port->port_usb->in;
+	struct gserial		*gser = port->port_usb;
+	struct usb_ep		*in = gser->in;
 	int			status = 0;
 	bool			do_tty_wake = false;
+	LIST_HEAD(batch);
 
 	while (!list_empty(pool)) {
 		struct usb_request	*req;
@@ -371,34 +358,38 @@ __acquires(&port->port_lock)
 		do_tty_wake = true;
 
 		req->length = len;
-		list_del(&req->list);
-		req->zero = (gs_buf_data_avail(&port->port_write_buf) == 0);
+		list_move_tail(&req->list, &batch);
+		req->zero = (gs_tx_pending(port) == 0);
 
 		pr_vdebug(PREFIX "%d: tx len=%d, 0x%02x 0x%02x 0x%02x ...\n",
 				port->port_num, len, *((u8 *)req->buf),
 				*((u8 *)req->buf+1), *((u8 *)req->buf+2));
+	}
 
-		/* Drop lock while we call out of driver; completions
-		 * could be issued while we do so.  Disconnection may
-		 * happen too; maybe immediately before we queue this!
-		 *
-		 * NOTE that we may keep sending data for a while after
-		 * the TTY closed (dev->ioport->port_tty is NULL).
-		 */
+	/* Drop lock while we call out of driver, once for everything
+	 * filled above; completions could be issued while we do so.
+	 * Disconnection may happen too; maybe immediately before we
+	 * queue this!
+	 *
+	 * NOTE that we may keep sending data for a while after
+	 * the TTY closed (dev->ioport->port_tty is NULL).
+	 */
+	if (!list_empty(&batch)) {
 		spin_unlock(&port->port_lock);
-		status = usb_ep_queue(in, req, GFP_ATOMIC);
+		status = usb_ep_queue_list(gser->func.config->cdev->gadget,
+				in, &batch, GFP_ATOMIC);
 		spin_lock(&port->port_lock);
 
 		if (status) {
 			pr_debug("%s: %s %s err %d\n",
 					__func__, "queue", in->name, status);
-			list_add(&req->list, pool);
-			break;
+			/* disconnect may have freed the pool meanwhile */
+			if (port->port_usb)
+				list_splice(&batch, pool);
+			else
+				gs_free_requests(in, &batch,
+						&port->write_allocated);
 		}
-
-		/* abort immediately after disconnect */
-		if (!port->port_usb)
-			break;
 	}
 
 	if (do_tty_wake && port->port_tty)
@@ -416,45 +407,55 @@ __acquires(&port->port_lock)
 */
 {
 	struct list_head	*pool = &port->read_pool;
-	struct usb_ep		*out = port->port_usb->out;
+	struct gserial		*gser = port->port_usb;
+	struct usb_ep		*out = gser->out;
+	struct usb_request	*req;
 	unsigned		started = 0;
+	int			status;
+	LIST_HEAD(batch);
 
-	while (!list_empty(pool)) {
-		struct usb_request	*req;
-		int			status;
-		struct tty_struct	*tty;
-
-		/* no more rx if closed */
-		tty = port->port_tty;
-		if (!tty)
-			break;
+	/* no more rx if closed */
+	if (!port->port_tty)
+		return 0;
 
+	while (!list_empty(pool)) {
 		req = list_entry(pool->next, struct usb_request, list);
-		list_del(&req->list);
+		list_move_tail(&req->list, &batch);
 		req->length = out->maxpacket;
-
-		/* drop lock while we call out; the controller driver
-		 * may need to call us back (e.g. for disconnect)
-		 */
-		spin_unlock(&port->port_lock);
-		status = usb_ep_queue(out, req, GFP_ATOMIC);
-		spin_lock(&port->port_lock);
-
-		if (status) {
-			pr_debug("%s: %s %s err %d\n",
-					__func__, "queue", out->name, status);
-			list_add(&req->list, pool);
-			break;
-		}
 		started++;
+	}
+	if (!started)
+		return 0;
 
-		/* abort immediately after disconnect */
-		if (!port->port_usb)
-			break;
+	/* drop lock while we call out; the controller driver
+	 * may need to call us back (e.g. for disconnect)
+	 */
+	spin_unlock(&port->port_lock);
+	status = usb_ep_queue_list(gser->func.config->cdev->gadget,
+			out, &batch, GFP_ATOMIC);
+	spin_lock(&port->port_lock);
+
+	if (status) {
+		pr_debug("%s: %s %s err %d\n",
+				__func__, "queue", out->name, status);
+		list_for_each_entry(req, &batch, list)
+			started--;
+		if (port->port_usb)
+			list_splice(&batch, pool);
+		else
+			gs_free_requests(out, &batch, &port->read_allocated);
 	}
 	return started;
 }
 
+static inline void gs_rx_schedule(struct gs_port *port)
+{
+	if (port->push_hi)
+		tasklet_hi_schedule(&port->push);
+	else
+		tasklet_schedule(&port->push);
+}
+
 /*
  * RX tasklet takes data out of the RX queue and hands it up to the TTY
  * layer until it refuses to take any more data (or is throttled back).
@@ -555,7 +556,7 @@ recycle:
 	if (!list_empty(queue) && tty) {
 		if (!test_bit(TTY_THROTTLED, &tty->flags)) {
 			if (do_push)
-				tasklet_schedule(&port->push);
+				gs_rx_schedule(port);
 			else
 				pr_warning(PREFIX "%d: RX not scheduled?\n",
 					port->port_num);
@@ -576,7 +577,7 @@ static void gs_read_complete(struct usb_ep *ep, struct usb_request *req)
 	/* Queue all received data until the tty layer is ready for it. */
 	spin_lock(&port->port_lock);
 	list_add_tail(&req->list, &port->read_queue);
-	tasklet_schedule(&port->push);
+	gs_rx_schedule(port);
 	spin_unlock(&port->port_lock);
 }
 
@@ -585,6 +586,17 @@ static void gs_write_complete(struct usb_ep *ep, struct usb_request *req)
 	struct gs_port	*port = ep->driver_data;
 
 	spin_lock(&port->port_lock);
+
+	/* the tty closed while this was in flight; don't keep it around
+	 * unless console output still needs it
+	 */
+	if (!port->port_tty && port->port_usb && !gs_is_console(port)) {
+		gs_free_req(ep, req);
+		port->write_allocated--;
+		spin_unlock(&port->port_lock);
+		return;
+	}
+
 	list_add(&req->list, &port->write_pool);
 
 	switch (req->status) {
@@ -607,33 +619,24 @@ static void gs_write_complete(struct usb_ep *ep, struct usb_request *req)
 	spin_unlock(&port->port_lock);
 }
 
-static void gs_free_requests(struct usb_ep *ep, struct list_head *head)
-{
-	struct usb_request	*req;
-
-	while (!list_empty(head)) {
-		req = list_entry(head->next, struct usb_request, list);
-		list_del(&req->list);
-		gs_free_req(ep, req);
-	}
-}
-
 static int gs_alloc_requests(struct usb_ep *ep, struct list_head *head,
-		void (*fn)(struct usb_ep *, struct usb_request *))
+		void (*fn)(struct usb_ep *, struct usb_request *),
+		int *allocated)
 {
-	int			i;
 	struct usb_request	*req;
 
 	/* Pre-allocate up to QUEUE_SIZE transfers, but if we can't
 	 * do quite that many this time, don't fail ... we just won't
-	 * be as speedy as we might otherwise be.
+	 * be as speedy as we might otherwise be.  Requests still in
+	 * flight from before a close/reopen count against that limit.
 	 */
-	for (i = 0; i < QUEUE_SIZE; i++) {
+	while (*allocated < QUEUE_SIZE) {
 		req = gs_alloc_req(ep, ep->maxpacket, GFP_ATOMIC);
 		if (!req)
 			return list_empty(head) ? -ENOMEM : 0;
 		req->complete = fn;
 		list_add_tail(&req->list, head);
+		(*allocated)++;
 	}
 	return 0;
 }
@@ -660,14 +663,15 @@ static int gs_start_io(struct gs_port *port)
 	 * configurations may use different endpoints with a given port;
 	 * and high speed vs full speed changes packet sizes too.
 	 */
-	status = gs_alloc_requests(ep, head, gs_read_complete);
+	status = gs_alloc_requests(ep, head, gs_read_complete,
+			&port->read_allocated);
 	if (status)
 		return status;
 
 	status = gs_alloc_requests(port->port_usb->in, &port->write_pool,
-			gs_write_complete);
+			gs_write_complete, &port->write_allocated);
 	if (status) {
-		gs_free_requests(ep, head);
+		gs_free_requests(ep, head, &port->read_allocated);
 		return status;
 	}
 
@@ -675,12 +679,15 @@ static int gs_start_io(struct gs_port *port)
 	port->n_read = 0;
 	started = gs_start_rx(port);
 
-	/* unblock any pending writes into our circular buffer */
-	if (started) {
+	/* unblock any pending writes into our circular buffer; on reopen
+	 * the RX requests may all still be queued from before the close
+	 */
+	if (started || list_empty(head)) {
 		tty_wakeup(port->port_tty);
 	} else {
-		gs_free_requests(ep, head);
-		gs_free_requests(port->port_usb->in, &port->write_pool);
+		gs_free_requests(ep, head, &port->read_allocated);
+		gs_free_requests(port->port_usb->in, &port->write_pool,
+				&port->write_allocated);
 		status = -EIO;
 	}
 
@@ -849,14 +856,20 @@ static void gs_close(struct tty_struct *tty, struct file *file)
 		gser = port->port_usb;
 	}
 
-	/* Iff we're disconnected, there can be no I/O in flight so it's
-	 * ok to free the circular buffer; else just scrub it.  And don't
-	 * let the push tasklet fire again until we're re-opened.
+	/* TX requests carry their own copy of the data, so the circular
+	 * buffer can go even if I/O is still in flight; gs_open() will
+	 * allocate a new one.  Likewise give back the idle TX requests;
+	 * any still queued to the hardware are freed as they complete,
+	 * since the TX completion sees port_tty == NULL.
+	 *
+	 * RX requests stay:  most sit queued to the OUT endpoint until the
+	 * host sends something, so gserial_disconnect() frees them and a
+	 * reopen reuses them.
 	 */
-	if (gser == NULL)
-		gs_buf_free(&port->port_write_buf);
-	else
-		gs_buf_clear(&port->port_write_buf);
+	gs_buf_free(&port->port_write_buf);
+	if (gser && !gs_is_console(port))
+		gs_free_requests(gser->in, &port->write_pool,
+				&port->write_allocated);
 
 	tty->driver_data = NULL;
 	port->port_tty = NULL;
@@ -965,7 +978,7 @@ static void gs_unthrottle(struct tty_struct *tty)
 		 * rts/cts, or other handshaking with the host, but if the
 		 * read queue backs up enough we'll be NAKing OUT packets.
 		 */
-		tasklet_schedule(&port->push);
+		gs_rx_schedule(port);
 		pr_vdebug(PREFIX "%d: unthrottle\n", port->port_num);
 	}
 	spin_unlock_irqrestore(&port->port_lock, flags);
@@ -1005,6 +1018,120 @@ static const struct tty_operations gs_tty_ops = {
 
 static struct tty_driver *gs_tty_driver;
 
+#ifdef CONFIG_USB_G_SERIAL_CONSOLE
+
+/* drains the console ring outside of the printk path */
+static void gs_console_push(unsigned long unused)
+{
+	struct gs_port	*port;
+	unsigned long	flags;
+
+	if (gs_console_port < 0)
+		return;
+	port = ports[gs_console_port].port;
+	if (!port)
+		return;
+
+	spin_lock_irqsave(&port->port_lock, flags);
+	if (port->port_usb)
+		gs_start_tx(port);
+	spin_unlock_irqrestore(&port->port_lock, flags);
+}
+
+static DECLARE_TASKLET(gs_console_tasklet, gs_console_push, 0);
+
+static void gs_console_write(struct console *co, const char *buf,
+		unsigned count)
+{
+	unsigned	head = gs_console_ring.head;
+	unsigned	tail = ACCESS_ONCE(gs_console_ring.tail);
+	char		*ring = gs_console_ring.buf;
+	unsigned	i;
+
+	smp_mb();	/* see the space before filling it */
+
+	for (i = 0; i < count; i++) {
+		/* newlines go out as CR LF */
+		if (buf[i] == '\n') {
+			if (head - tail > GS_CONSOLE_BUF_SIZE - 2)
+				break;
+			ring[head++ & (GS_CONSOLE_BUF_SIZE - 1)] = '\r';
+		} else if (head - tail > GS_CONSOLE_BUF_SIZE - 1) {
+			break;
+		}
+		ring[head++ & (GS_CONSOLE_BUF_SIZE - 1)] = buf[i];
+	}
+	gs_console_ring.dropped += count - i;
+
+	smp_wmb();	/* publish the data before the head */
+	gs_console_ring.head = head;
+
+	tasklet_schedule(&gs_console_tasklet);
+}
+
+static int gs_console_setup(struct console *co, char *options)
+{
+	if (co->index < 0)
+		co->index = 0;
+	if (co->index >= n_ports)
+		return -ENODEV;
+	gs_console_port = co->index;
+	return 0;
+}
+
+static struct tty_driver *gs_console_device(struct console *co, int *index)
+{
+	*index = co->index;
+	return gs_tty_driver;
+}
+
+static struct console gs_console = {
+	.name =		PREFIX,
+	.write =	gs_console_write,
+	.device =	gs_console_device,
+	.setup =	gs_console_setup,
+	.flags =	CON_PRINTBUFFER,
+	.index =	-1,
+};
+
+static void gs_console_register(void)
+{
+	register_console(&gs_console);
+}
+
+static void gs_console_unregister(void)
+{
+	unregister_console(&gs_console);
+	tasklet_kill(&gs_console_tasklet);
+	gs_console_port = -1;
+	if (gs_console_ring.dropped)
+		pr_debug("%s: console dropped %lu bytes\n", __func__,
+				gs_console_ring.dropped);
+}
+
+/*
+ * The console port keeps its TX requests while connected, so output
+ * can flow without /dev/ttyGS* being open.
+ *
+ * Called with port_lock held; port_usb is non-null.
+ */
+static void gs_console_connect(struct gs_port *port)
+{
+	if (!gs_is_console(port))
+		return;
+	if (gs_alloc_requests(port->port_usb->in, &port->write_pool,
+			gs_write_complete, &port->write_allocated) == 0)
+		gs_start_tx(port);
+}
+
+#else
+
+static inline void gs_console_register(void) { }
+static inline void gs_console_unregister(void) { }
+static inline void gs_console_connect(struct gs_port *port) { }
+
+#endif	/* CONFIG_USB_G_SERIAL_CONSOLE */
+
 static int __init
 gs_port_alloc(unsigned port_num, struct usb_cdc_line_coding *coding)
 {
@@ -1019,6 +1146,7 @@ gs_port_alloc(unsigned port_num, struct usb_cdc_line_coding *coding)
 	init_waitqueue_head(&port->drain_wait);
 
 	tasklet_init(&port->push, gs_rx_push, (unsigned long) port);
+	port->push_hi = usb_sched_is_rt(&gs_push_sched);
 
 	INIT_LIST_HEAD(&port->read_pool);
 	INIT_LIST_HEAD(&port->read_queue);
@@ -1049,6 +1177,11 @@ gs_port_alloc(unsigned port_num, struct usb_cdc_line_coding *coding)
  * One configuration could even expose port 1 while the other
  * one doesn't.
  *
+ * Up to 256 ports may be set up.  Each costs only its bookkeeping
+ * until its /dev/ttyGS* node is opened; the TX buffer and the USB
+ * request pools are allocated on open (and connect), and released
+ * again on close.
+ *
  * Returns negative errno or zero.
  */
 int __init gserial_setup(struct usb_gadget *g, unsigned count)
@@ -1057,12 +1190,19 @@ int __init gserial_setup(struct usb_gadget *g, unsigned count)
 	struct usb_cdc_line_coding	coding;
 	int				status;
 
-	if (count == 0 || count > N_PORTS)
+	if (count == 0 || count > MAX_PORTS)
 		return -EINVAL;
 
+	ports = kcalloc(count, sizeof *ports, GFP_KERNEL);
+	if (!ports)
+		return -ENOMEM;
+
 	gs_tty_driver = alloc_tty_driver(count);
-	if (!gs_tty_driver)
+	if (!gs_tty_driver) {
+		kfree(ports);
+		ports = NULL;
 		return -ENOMEM;
+	}
 
 	gs_tty_driver->owner = THIS_MODULE;
 	gs_tty_driver->driver_name = "g_serial";
@@ -1122,10 +1262,15 @@ int __init gserial_setup(struct usb_gadget *g, unsigned count)
 	pr_debug("%s: registered %d ttyGS* device%s\n", __func__,
 			count, (count == 1) ? "" : "s");
 
+	gs_console_register();
+
 	return status;
 fail:
 	while (count--)
 		kfree(ports[count].port);
+	kfree(ports);
+	ports = NULL;
+	n_ports = 0;
 	put_tty_driver(gs_tty_driver);
 	gs_tty_driver = NULL;
 	return status;
@@ -1161,6 +1306,8 @@ void gserial_cleanup(void)
 	if (!gs_tty_driver)
 		return;
 
+	gs_console_unregister();
+
 	/* start sysfs and /dev/ttyGS* node removal */
 	for (i = 0; i < n_ports; i++)
 		tty_unregister_device(gs_tty_driver, i);
@@ -1181,6 +1328,8 @@ void gserial_cleanup(void)
 
 		kfree(port);
 	}
+	kfree(ports);
+	ports = NULL;
 	n_ports = 0;
 
 	tty_unregister_driver(gs_tty_driver);
@@ -1259,6 +1408,8 @@ int gserial_connect(struct gserial *gser, u8 port_num)
 			gser->disconnect(gser);
 	}
 
+	gs_console_connect(port);
+
 	spin_unlock_irqrestore(&port->port_lock, flags);
 
 	return status;
@@ -1314,8 +1465,8 @@ void gserial_disconnect(struct gserial *gser)
 	spin_lock_irqsave(&port->port_lock, flags);
 	if (port->open_count == 0 && !port->openclose)
 		gs_buf_free(&port->port_write_buf);
-	gs_free_requests(gser->out, &port->read_pool);
-	gs_free_requests(gser->out, &port->read_queue);
-	gs_free_requests(gser->in, &port->write_pool);
+	gs_free_requests(gser->out, &port->read_pool, &port->read_allocated);
+	gs_free_requests(gser->out, &port->read_queue, &port->read_allocated);
+	gs_free_requests(gser->in, &port->write_pool, &port->write_allocated);
 	spin_unlock_irqrestore(&port->port_lock, flags);
 }
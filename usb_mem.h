@@ -0,0 +1,182 @@
+/*
+ * usb_mem.h - account for the memory a gadget function holds
+ *
+ * usb_requests and their buffers come out of the generic kmalloc caches,
+ * so /proc/slabinfo can't say what one function costs.  A function that
+ * allocates through the helpers below keeps a running count in its own
+ * struct usb_mem_account: requests, I/O buffers (at their real slab size)
+ * and live streaming DMA mappings, plus the most buffer memory it ever
+ * held at once.  With CONFIG_USB_GADGET_DEBUG_FS, each registered account
+ * reads back from a debugfs file, by default usb_mem/<name>.
+ *
+ * This software is distributed under the terms of the GNU General
+ * Public License ("GPL") as published by the Free Software Foundation,
+ * either version 2 of that License or (at your option) any later version.
+ */
+
+#ifndef __USB_MEM_H
+#define __USB_MEM_H
+
+#include <linux/slab.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/usb/gadget.h>
+
+#include <asm/atomic.h>
+
+struct usb_mem_account {
+	const char	*name;
+	atomic_t	requests;	/* usb_requests held */
+	atomic_t	buffers;	/* I/O buffers held ... */
+	atomic_long_t	bytes;		/* ... and their size */
+	long		peak;		/* largest "bytes" seen */
+	atomic_t	dma_maps;	/* streaming DMA mappings live ... */
+	atomic_long_t	dma_bytes;	/* ... and their size */
+
+	struct dentry	*dentry;
+};
+
+#define USB_MEM_ACCOUNT(_name) { .name = _name }
+
+static inline void usb_mem_add(struct usb_mem_account *acct, size_t size)
+{
+	long	now;
+
+	atomic_inc(&acct->buffers);
+	now = atomic_long_add_return(size, &acct->bytes);
+	if (now > acct->peak)		/* racy, but only a statistic */
+		acct->peak = now;
+}
+
+static inline void usb_mem_sub(struct usb_mem_account *acct, size_t size)
+{
+	atomic_dec(&acct->buffers);
+	atomic_long_sub(size, &acct->bytes);
+}
+
+static inline void *usb_mem_kmalloc(struct usb_mem_account *acct,
+		size_t size, gfp_t gfp_flags)
+{
+	void	*buf = kmalloc(size, gfp_flags);
+
+	if (buf)
+		usb_mem_add(acct, ksize(buf));
+	return buf;
+}
+
+static inline void usb_mem_kfree(struct usb_mem_account *acct, void *buf)
+{
+	if (buf) {
+		usb_mem_sub(acct, ksize(buf));
+		kfree(buf);
+	}
+}
+
+static inline struct usb_request *usb_mem_alloc_request(
+		struct usb_mem_account *acct, struct usb_ep *ep,
+		gfp_t gfp_flags)
+{
+	struct usb_request	*req = usb_ep_alloc_request(ep, gfp_flags);
+
+	if (req)
+		atomic_inc(&acct->requests);
+	return req;
+}
+
+static inline void usb_mem_free_request(struct usb_mem_account *acct,
+		struct usb_ep *ep, struct usb_request *req)
+{
+	atomic_dec(&acct->requests);
+	usb_ep_free_request(ep, req);
+}
+
+static inline void usb_mem_dma_map(struct usb_mem_account *acct,
+		size_t size)
+{
+	atomic_inc(&acct->dma_maps);
+	atomic_long_add(size, &acct->dma_bytes);
+}
+
+static inline void usb_mem_dma_unmap(struct usb_mem_account *acct,
+		size_t size)
+{
+	atomic_dec(&acct->dma_maps);
+	atomic_long_sub(size, &acct->dma_bytes);
+}
+
+#ifdef CONFIG_USB_GADGET_DEBUG_FS
+
+/* the default directory, shared by every account of this module */
+static struct dentry	*usb_mem_root;
+static unsigned		usb_mem_users;
+
+static int usb_mem_show(struct seq_file *s, void *unused)
+{
+	struct usb_mem_account	*acct = s->private;
+
+	seq_printf(s, "requests   %d\n", atomic_read(&acct->requests));
+	seq_printf(s, "buffers    %d\n", atomic_read(&acct->buffers));
+	seq_printf(s, "bytes      %ld\n", atomic_long_read(&acct->bytes));
+	seq_printf(s, "peak_bytes %ld\n", acct->peak);
+	seq_printf(s, "dma_maps   %d\n", atomic_read(&acct->dma_maps));
+	seq_printf(s, "dma_bytes  %ld\n",
+			atomic_long_read(&acct->dma_bytes));
+	return 0;
+}
+
+static int usb_mem_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, usb_mem_show, inode->i_private);
+}
+
+static const struct file_operations usb_mem_fops = {
+	.owner		= THIS_MODULE,
+	.open		= usb_mem_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/**
+ * usb_mem_register - publish an account in debugfs
+ * @acct: the account; its name becomes the file name
+ * @parent: directory for the file, or NULL for usb_mem/
+ *
+ * Drivers in separate modules must not both use the default directory;
+ * controller drivers pass one of their own.
+ */
+static inline void usb_mem_register(struct usb_mem_account *acct,
+		struct dentry *parent)
+{
+	if (!parent) {
+		if (!usb_mem_users++)
+			usb_mem_root = debugfs_create_dir("usb_mem", NULL);
+		parent = usb_mem_root;
+	}
+	if (!IS_ERR_OR_NULL(parent))
+		acct->dentry = debugfs_create_file(acct->name, S_IRUGO,
+				parent, acct, &usb_mem_fops);
+}
+
+static inline void usb_mem_unregister(struct usb_mem_account *acct,
+		struct dentry *parent)
+{
+	debugfs_remove(acct->dentry);
+	acct->dentry = NULL;
+	if (!parent && !--usb_mem_users) {
+		if (!IS_ERR_OR_NULL(usb_mem_root))
+			debugfs_remove(usb_mem_root);
+		usb_mem_root = NULL;
+	}
+}
+
+#else
+
+static inline void usb_mem_register(struct usb_mem_account *acct,
+		struct dentry *parent) { }
+static inline void usb_mem_unregister(struct usb_mem_account *acct,
+		struct dentry *parent) { }
+
+#endif	/* CONFIG_USB_GADGET_DEBUG_FS */
+
+#endif	/* __USB_MEM_H */
@@ -0,0 +1,160 @@
+/*
+ * usb_sched.h - where, and how urgently, gadget worker contexts run
+ *
+ * Function drivers defer work to kthreads, workqueues and tasklets,
+ * which by default run wherever and however the scheduler likes.  On a
+ * small SMP system that lets a mass storage thread hold up audio work
+ * on the same core.  A driver describes each such context with a
+ * struct usb_sched, publishes it with USB_SCHED_MODULE_PARAMETERS() (so
+ * it shows up in /sys/module/.../parameters), and applies it whenever
+ * it creates the context:
+ *
+ *  - kthreads:  usb_sched_apply() before the first wakeup;
+ *  - work items:  usb_sched_create_workqueue() gives them a thread of
+ *    their own set up the same way, or NULL (keventd, as before) when
+ *    nothing was asked for;
+ *  - tasklets run on whichever CPU schedules them, normally the one
+ *    taking the controller's IRQ (see /proc/irq/N/smp_affinity), so
+ *    only the policy applies:  realtime ones use the high priority
+ *    softirq.
+ *
+ * Settings changed later take effect when the context is next created.
+ *
+ * This software is distributed under the terms of the GNU General
+ * Public License ("GPL") as published by the Free Software Foundation,
+ * either version 2 of that License or (at your option) any later version.
+ */
+
+#ifndef __USB_SCHED_H
+#define __USB_SCHED_H
+
+#include <linux/kernel.h>
+#include <linux/moduleparam.h>
+#include <linux/sched.h>
+#include <linux/cpumask.h>
+#include <linux/workqueue.h>
+
+struct usb_sched {
+	int	cpu;		/* -1 for any */
+	int	policy;		/* SCHED_NORMAL, SCHED_FIFO or SCHED_RR */
+	int	prio;		/* nice value, or realtime priority */
+};
+
+#define USB_SCHED_DEFAULT	{ .cpu = -1, .policy = SCHED_NORMAL, }
+
+#define USB_SCHED_MODULE_PARAMETERS(name, sched)			\
+	module_param_named(name ## _cpu, (sched).cpu, int,		\
+			   S_IRUGO|S_IWUSR);				\
+	MODULE_PARM_DESC(name ## _cpu,					\
+			 "CPU for " #name " work, or -1 for any");	\
+	module_param_named(name ## _policy, (sched).policy, int,	\
+			   S_IRUGO|S_IWUSR);				\
+	MODULE_PARM_DESC(name ## _policy,				\
+			 #name " policy: 0 normal, 1 FIFO, 2 RR");	\
+	module_param_named(name ## _prio, (sched).prio, int,		\
+			   S_IRUGO|S_IWUSR);				\
+	MODULE_PARM_DESC(name ## _prio,					\
+			 #name " nice value, or realtime priority")
+
+static inline bool usb_sched_is_default(const struct usb_sched *s)
+{
+	return s->cpu < 0 && s->policy == SCHED_NORMAL && !s->prio;
+}
+
+static inline bool usb_sched_is_rt(const struct usb_sched *s)
+{
+	return s->policy == SCHED_FIFO || s->policy == SCHED_RR;
+}
+
+/**
+ * usb_sched_apply - set a task's CPU and scheduling policy
+ * @s: the settings
+ * @p: the task, typically a kthread not yet woken
+ *
+ * Applies as much of @s as it can; returns a negative errno if some
+ * of it was invalid or refused.
+ */
+static inline int usb_sched_apply(const struct usb_sched *s,
+		struct task_struct *p)
+{
+	struct sched_param	param = { .sched_priority = 0, };
+	int			status = 0;
+
+	if (s->cpu >= 0) {
+		if (s->cpu < nr_cpu_ids && cpu_online(s->cpu))
+			status = set_cpus_allowed_ptr(p, cpumask_of(s->cpu));
+		else
+			status = -EINVAL;
+	}
+
+	switch (s->policy) {
+	case SCHED_NORMAL:
+		set_user_nice(p, clamp(s->prio, -20, 19));
+		break;
+	case SCHED_FIFO:
+	case SCHED_RR:
+		param.sched_priority = clamp(s->prio, 1, MAX_USER_RT_PRIO - 1);
+		if (sched_setscheduler(p, s->policy, &param) < 0)
+			status = -EPERM;
+		break;
+	default:
+		status = -EINVAL;
+	}
+	return status;
+}
+
+struct usb_sched_setup {
+	struct work_struct	work;
+	const struct usb_sched	*sched;
+	int			status;
+};
+
+static inline void usb_sched_setup_work(struct work_struct *work)
+{
+	struct usb_sched_setup	*setup;
+
+	setup = container_of(work, struct usb_sched_setup, work);
+	setup->status = usb_sched_apply(setup->sched, current);
+}
+
+/**
+ * usb_sched_create_workqueue - a workqueue whose thread obeys @s
+ * @name: name of the workqueue (and its thread)
+ * @s: the settings
+ * Context: may sleep
+ *
+ * Returns NULL when @s asks for nothing special, or on failure; callers
+ * then use keventd through usb_sched_queue_work() as before.
+ */
+static inline struct workqueue_struct *
+usb_sched_create_workqueue(const char *name, const struct usb_sched *s)
+{
+	struct workqueue_struct	*wq;
+	struct usb_sched_setup	setup;
+
+	if (usb_sched_is_default(s))
+		return NULL;
+	wq = create_singlethread_workqueue(name);
+	if (!wq)
+		return NULL;
+
+	/* the thread isn't bound to a CPU, and can adjust itself */
+	setup.sched = s;
+	INIT_WORK_ON_STACK(&setup.work, usb_sched_setup_work);
+	queue_work(wq, &setup.work);
+	flush_workqueue(wq);
+	destroy_work_on_stack(&setup.work);
+
+	if (setup.status)
+		pr_warning("%s: scheduling settings not all applied, %d\n",
+				name, setup.status);
+	return wq;
+}
+
+static inline int usb_sched_queue_work(struct workqueue_struct *wq,
+		struct work_struct *work)
+{
+	return wq ? queue_work(wq, work) : schedule_work(work);
+}
+
+#endif /* __USB_SCHED_H */
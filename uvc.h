@@ -25,7 +25,11 @@
 #define UVC_EVENT_STREAMOFF		(V4L2_EVENT_PRIVATE_START + 3)
 #define UVC_EVENT_SETUP			(V4L2_EVENT_PRIVATE_START + 4)
 #define UVC_EVENT_DATA			(V4L2_EVENT_PRIVATE_START + 5)
-#define UVC_EVENT_LAST			(V4L2_EVENT_PRIVATE_START + 5)
+#define UVC_EVENT_CONTROL		(V4L2_EVENT_PRIVATE_START + 6)
+#define UVC_EVENT_LAST			(V4L2_EVENT_PRIVATE_START + 6)
+
+#define UVC_CONTROL_MAX_SIZE		60
+#define UVC_MAX_CONTROLS		64
 
 struct uvc_request_data
 {
@@ -33,16 +37,72 @@ struct uvc_request_data
 	__u8 data[60];
 };
 
+/* Cached control, answered by the kernel without involving userspace.
+ * GET_MIN/MAX/DEF/RES/LEN/INFO are served from the table, GET_CUR from
+ * cur, which SET_CUR updates if info has the SET capability bit (1 << 1)
+ * set; otherwise SET_CUR stalls. For the VS_PROBE and VS_COMMIT controls
+ * the kernel clamps the host request between min and max and fills the
+ * device-chosen fields from def.
+ */
+struct uvc_control_entry
+{
+	__u8 intf;		/* UVC_INTF_CONTROL or UVC_INTF_STREAMING */
+	__u8 entity;		/* Unit/terminal ID, 0 for streaming controls */
+	__u8 selector;
+	__u8 info;
+	__u16 length;
+	__u8 cur[UVC_CONTROL_MAX_SIZE];
+	__u8 min[UVC_CONTROL_MAX_SIZE];
+	__u8 max[UVC_CONTROL_MAX_SIZE];
+	__u8 def[UVC_CONTROL_MAX_SIZE];
+	__u8 res[UVC_CONTROL_MAX_SIZE];
+};
+
+struct uvc_control_table
+{
+	unsigned int count;
+	struct uvc_control_entry __user *entries;
+};
+
+/* Sent when the host changes a cached control (except VS_PROBE). */
+struct uvc_control_change
+{
+	__u8 intf;
+	__u8 entity;
+	__u8 selector;
+	__u8 length;
+	__u8 data[UVC_CONTROL_MAX_SIZE];
+};
+
 struct uvc_event
 {
 	union {
 		enum usb_device_speed speed;
 		struct usb_ctrlrequest req;
 		struct uvc_request_data data;
+		struct uvc_control_change control;
 	};
 };
 
 #define UVCIOC_SEND_RESPONSE		_IOW('U', 1, struct uvc_request_data)
+#define UVCIOC_SET_CONTROLS		_IOW('U', 2, struct uvc_control_table)
+/* Non-zero: a queued buffer supersedes older buffers not yet being sent,
+ * which are returned with V4L2_BUF_FLAG_ERROR set.
+ */
+#define UVCIOC_SET_LATEST_FRAME		_IOW('U', 3, int)
+
+/* Spread each frame's payloads evenly over a frame interval instead of
+ * sending them back to back. interval is in 100 ns units, like
+ * dwFrameInterval; 0 selects the interval committed through a cached
+ * VS_COMMIT control.
+ */
+struct uvc_pacing
+{
+	__u32 enable;
+	__u32 interval;
+};
+
+#define UVCIOC_SET_PACING		_IOW('U', 4, struct uvc_pacing)
 
 #define UVC_INTF_CONTROL		0
 #define UVC_INTF_STREAMING		1
@@ -86,6 +146,8 @@ struct uvc_streaming_control {
 
 #ifdef __KERNEL__
 
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
 #include <linux/usb.h>	/* For usb_endpoint_* */
 #include <linux/usb/gadget.h>
 #include <linux/videodev2.h>
@@ -144,6 +206,19 @@ extern unsigned int uvc_gadget_trace_param;
  * Structures
  */
 
+/* Stream start latency, from a reference point to the first video request
+ * the host completes.
+ */
+struct uvc_start_stats
+{
+	ktime_t time;
+	unsigned int pending : 1;
+	unsigned int count;
+	s64 last_us;
+	s64 min_us;
+	s64 max_us;
+};
+
 struct uvc_video
 {
 	struct usb_ep *ep;
@@ -162,6 +237,12 @@ struct uvc_video
 	struct list_head req_free;
 	spinlock_t req_lock;
 
+	/* Requests filled before SET_INTERFACE enabled the endpoint, and
+	 * whether it is enabled. Both protected by the queue irqlock.
+	 */
+	struct list_head req_ready;
+	unsigned int ep_active : 1;
+
 	void (*encode) (struct usb_request *req, struct uvc_video *video,
 			struct uvc_buffer *buf);
 
@@ -171,6 +252,20 @@ struct uvc_video
 
 	struct uvc_video_queue queue;
 	unsigned int fid;
+
+	/* Bandwidth pacing */
+	unsigned int pace;		/* UVCIOC_SET_PACING enable */
+	u32 pace_interval;		/* 100 ns units, 0 for frame_interval */
+	u32 frame_interval;		/* committed dwFrameInterval */
+	struct hrtimer pace_timer;	/* releases one request per slot */
+	unsigned int pace_running;	/* pace_timer armed, under req_lock */
+	ktime_t pace_next;		/* next release, under req_lock */
+	u64 pace_slot;			/* ns between two releases */
+
+	/* Stream start latency */
+	struct uvc_start_stats start_alt;	/* from SET_INTERFACE */
+	struct uvc_start_stats start_streamon;	/* from VIDIOC_STREAMON */
+	struct dentry *debugfs;
 };
 
 enum uvc_state
@@ -204,6 +299,13 @@ struct uvc_device
 	/* Events */
 	unsigned int event_length;
 	unsigned int event_setup_out : 1;
+
+	/* Cached controls */
+	spinlock_t control_lock;
+	struct uvc_control_entry *controls;
+	unsigned int num_controls;
+	struct usb_ctrlrequest control_set;
+	unsigned int control_set_pending : 1;
 };
 
 static inline struct uvc_device *to_uvc(struct usb_function *f)
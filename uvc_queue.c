@@ -76,6 +76,13 @@
  *    process waiting on the buffer might restart the dequeue operation
  *    immediately.
  *
+ * 3. Latest-frame-wins mode is enabled and the host falls behind.
+ *
+ *    When a buffer is queued, all buffers in the irq queue whose transmission
+ *    hasn't started are removed from it, marked as done with
+ *    V4L2_BUF_FLAG_ERROR set and woken up. They stay on the main queue and
+ *    are dequeued in order, so userspace sees which frames were skipped.
+ *
  */
 
 static void
@@ -215,6 +222,54 @@ done:
 	return ret;
 }
 
+/*
+ * Drop all queued buffers whose transmission hasn't started yet. The buffer
+ * at the head of the irq queue is kept if some of its data has already been
+ * sent. Dropped buffers are completed with V4L2_BUF_FLAG_ERROR set.
+ *
+ * This function must be called with the queue irqlock held.
+ */
+static void __uvc_queue_drop_pending(struct uvc_video_queue *queue)
+{
+	struct uvc_buffer *buf, *n;
+
+	list_for_each_entry_safe(buf, n, &queue->irqqueue, queue) {
+		if (buf->state != UVC_BUF_STATE_QUEUED)
+			continue;
+		if (buf == list_first_entry(&queue->irqqueue,
+					    struct uvc_buffer, queue) &&
+		    queue->buf_used != 0)
+			continue;
+
+		uvc_trace(UVC_TRACE_CAPTURE, "Dropping buffer %u.\n",
+			buf->buf.index);
+
+		list_del(&buf->queue);
+		buf->buf.flags |= V4L2_BUF_FLAG_ERROR;
+		do_gettimeofday(&buf->buf.timestamp);
+		buf->state = UVC_BUF_STATE_DONE;
+		wake_up(&buf->wait);
+	}
+}
+
+/*
+ * Enable or disable latest-frame-wins mode. When enabled, queuing a buffer
+ * supersedes all older buffers that haven't started transmission, keeping
+ * the latency at one frame when the host can't keep up.
+ */
+static void
+uvc_queue_set_latest_frame(struct uvc_video_queue *queue, int enable)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&queue->irqlock, flags);
+	if (enable)
+		queue->flags |= UVC_QUEUE_LATEST_FRAME;
+	else
+		queue->flags &= ~UVC_QUEUE_LATEST_FRAME;
+	spin_unlock_irqrestore(&queue->irqlock, flags);
+}
+
 /*
  * Queue a video buffer. Attempting to queue a buffer that has already been
  * queued will return -EINVAL.
@@ -262,6 +317,7 @@ uvc_queue_buffer(struct uvc_video_queue *queue, struct v4l2_buffer *v4l2_buf)
 		buf->buf.bytesused = 0;
 	else
 		buf->buf.bytesused = v4l2_buf->bytesused;
+	buf->buf.flags &= ~V4L2_BUF_FLAG_ERROR;
 
 	spin_lock_irqsave(&queue->irqlock, flags);
 	if (queue->flags & UVC_QUEUE_DISCONNECTED) {
@@ -274,6 +330,9 @@ uvc_queue_buffer(struct uvc_video_queue *queue, struct v4l2_buffer *v4l2_buf)
 	ret = (queue->flags & UVC_QUEUE_PAUSED) != 0;
 	queue->flags &= ~UVC_QUEUE_PAUSED;
 
+	if (queue->flags & UVC_QUEUE_LATEST_FRAME)
+		__uvc_queue_drop_pending(queue);
+
 	list_add_tail(&buf->stream, &queue->mainqueue);
 	list_add_tail(&buf->queue, &queue->irqqueue);
 	spin_unlock_irqrestore(&queue->irqlock, flags);
@@ -544,35 +603,6 @@ done:
 	return ret;
 }
 
-static struct uvc_buffer *
-uvc_queue_next_buffer(struct uvc_video_queue *queue, struct uvc_buffer *buf)
-{
-	struct uvc_buffer *nextbuf;
-	unsigned long flags;
-
-	if ((queue->flags & UVC_QUEUE_DROP_INCOMPLETE) &&
-	    buf->buf.length != buf->buf.bytesused) {
-		buf->state = UVC_BUF_STATE_QUEUED;
-		buf->buf.bytesused = 0;
-		return buf;
-	}
-
-	spin_lock_irqsave(&queue->irqlock, flags);
-	list_del(&buf->queue);
-	if (!list_empty(&queue->irqqueue))
-		nextbuf = list_first_entry(&queue->irqqueue, struct uvc_buffer,
-					   queue);
-	else
-		nextbuf = NULL;
-	spin_unlock_irqrestore(&queue->irqlock, flags);
-
-	buf->buf.sequence = queue->sequence++;
-	do_gettimeofday(&buf->buf.timestamp);
-
-	wake_up(&buf->wait);
-	return nextbuf;
-}
-
 static struct uvc_buffer *uvc_queue_head(struct uvc_video_queue *queue)
 {
 	struct uvc_buffer *buf = NULL;
@@ -39,6 +39,12 @@ struct uvc_buffer {
 #define UVC_QUEUE_DISCONNECTED		(1 << 1)
 #define UVC_QUEUE_DROP_INCOMPLETE	(1 << 2)
 #define UVC_QUEUE_PAUSED		(1 << 3)
+#define UVC_QUEUE_LATEST_FRAME		(1 << 4)
+
+/* Set on buffers superseded by a newer frame before transmission. */
+#ifndef V4L2_BUF_FLAG_ERROR
+#define V4L2_BUF_FLAG_ERROR		0x0040
+#endif
 
 struct uvc_video_queue {
 	enum v4l2_buf_type type;
@@ -16,6 +16,7 @@
 #include <linux/errno.h>
 #include <linux/list.h>
 #include <linux/mutex.h>
+#include <linux/uaccess.h>
 #include <linux/version.h>
 #include <linux/videodev2.h>
 #include <linux/vmalloc.h>
@@ -50,6 +51,49 @@ uvc_send_response(struct uvc_device *uvc, struct uvc_request_data *data)
 	return usb_ep_queue(cdev->gadget->ep0, req, GFP_KERNEL);
 }
 
+static int
+uvc_set_controls(struct uvc_device *uvc, struct uvc_control_table *table)
+{
+	struct uvc_control_entry *controls = NULL;
+	unsigned long flags;
+	unsigned int i;
+
+	if (table->count > UVC_MAX_CONTROLS)
+		return -EINVAL;
+
+	if (table->count) {
+		controls = kmalloc(table->count * sizeof(*controls),
+				   GFP_KERNEL);
+		if (controls == NULL)
+			return -ENOMEM;
+
+		if (copy_from_user(controls, table->entries,
+				   table->count * sizeof(*controls))) {
+			kfree(controls);
+			return -EFAULT;
+		}
+
+		for (i = 0; i < table->count; ++i) {
+			if (controls[i].length == 0 ||
+			    controls[i].length > UVC_CONTROL_MAX_SIZE ||
+			    controls[i].intf > UVC_INTF_STREAMING) {
+				kfree(controls);
+				return -EINVAL;
+			}
+		}
+	}
+
+	/* An empty table hands all requests back to userspace. */
+	spin_lock_irqsave(&uvc->control_lock, flags);
+	swap(uvc->controls, controls);
+	uvc->num_controls = table->count;
+	uvc->control_set_pending = 0;
+	spin_unlock_irqrestore(&uvc->control_lock, flags);
+
+	kfree(controls);
+	return 0;
+}
+
 /* --------------------------------------------------------------------------
  * V4L2
  */
@@ -324,6 +368,18 @@ uvc_v4l2_do_ioctl(struct file *file, unsigned int cmd, void *arg)
 		ret = uvc_send_response(uvc, arg);
 		break;
 
+	case UVCIOC_SET_CONTROLS:
+		ret = uvc_set_controls(uvc, arg);
+		break;
+
+	case UVCIOC_SET_LATEST_FRAME:
+		uvc_queue_set_latest_frame(&video->queue, *(int *)arg);
+		break;
+
+	case UVCIOC_SET_PACING:
+		ret = uvc_video_set_pacing(video, arg);
+		break;
+
 	default:
 		return -ENOIOCTLCMD;
 	}
@@ -12,8 +12,13 @@
  */
 
 #include <linux/kernel.h>
+#include <linux/debugfs.h>
 #include <linux/device.h>
 #include <linux/errno.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/seq_file.h>
 #include <linux/usb/ch9.h>
 #include <linux/usb/gadget.h>
 
@@ -21,107 +26,260 @@
 
 #include "uvc.h"
 #include "uvc_queue.h"
+#include "ep_batch.h"
+#include "usb_mem.h"
 
 /* --------------------------------------------------------------------------
  * Video codecs
  */
 
-static int
-uvc_video_encode_header(struct uvc_video *video, struct uvc_buffer *buf,
-		u8 *data, int len)
+#include "uvc_encode.c"
+
+/* --------------------------------------------------------------------------
+ * Stream start latency
+ */
+
+static void
+uvc_video_start_mark(struct uvc_start_stats *stats)
 {
-	data[0] = 2;
-	data[1] = UVC_STREAM_EOH | video->fid;
+	stats->time = ktime_get();
+	stats->pending = 1;
+}
+
+static void
+uvc_video_start_done(struct uvc_start_stats *stats, ktime_t now)
+{
+	s64 us;
+
+	if (!stats->pending)
+		return;
+
+	stats->pending = 0;
+	us = ktime_us_delta(now, stats->time);
+	if (stats->count++ == 0 || us < stats->min_us)
+		stats->min_us = us;
+	if (us > stats->max_us)
+		stats->max_us = us;
+	stats->last_us = us;
+}
 
-	if (buf->buf.bytesused - video->queue.buf_used <= len - 2)
-		data[1] |= UVC_STREAM_EOF;
+#ifdef CONFIG_USB_GADGET_DEBUG_FS
 
-	return 2;
+static void
+uvc_video_show_start(struct seq_file *s, const char *name,
+		const struct uvc_start_stats *stats)
+{
+	seq_printf(s, "%-14s starts %u last %lld min %lld max %lld us\n",
+		   name, stats->count, (long long)stats->last_us,
+		   (long long)stats->min_us, (long long)stats->max_us);
 }
 
 static int
-uvc_video_encode_data(struct uvc_video *video, struct uvc_buffer *buf,
-		u8 *data, int len)
+uvc_video_stats_show(struct seq_file *s, void *unused)
 {
-	struct uvc_video_queue *queue = &video->queue;
-	unsigned int nbytes;
-	void *mem;
+	struct uvc_video *video = s->private;
 
-	/* Copy video data to the USB buffer. */
-	mem = queue->mem + buf->buf.m.offset + queue->buf_used;
-	nbytes = min((unsigned int)len, buf->buf.bytesused - queue->buf_used);
+	uvc_video_show_start(s, "set_interface", &video->start_alt);
+	uvc_video_show_start(s, "streamon", &video->start_streamon);
+	return 0;
+}
 
-	memcpy(data, mem, nbytes);
-	queue->buf_used += nbytes;
+static int
+uvc_video_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, uvc_video_stats_show, inode->i_private);
+}
+
+static const struct file_operations uvc_video_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= uvc_video_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
 
-	return nbytes;
+/*
+ * Publish the stream start latency in debugfs, as uvc/stream_start.
+ */
+static void
+uvc_video_debugfs_init(struct uvc_video *video)
+{
+	video->debugfs = debugfs_create_dir("uvc", NULL);
+	if (IS_ERR_OR_NULL(video->debugfs)) {
+		video->debugfs = NULL;
+		return;
+	}
+
+	debugfs_create_file("stream_start", S_IRUGO, video->debugfs, video,
+			    &uvc_video_stats_fops);
 }
 
 static void
-uvc_video_encode_bulk(struct usb_request *req, struct uvc_video *video,
-		struct uvc_buffer *buf)
+uvc_video_debugfs_cleanup(struct uvc_video *video)
 {
-	void *mem = req->buf;
-	int len = video->req_size;
-	int ret;
+	debugfs_remove_recursive(video->debugfs);
+	video->debugfs = NULL;
+}
 
-	/* Add a header at the beginning of the payload. */
-	if (video->payload_size == 0) {
-		ret = uvc_video_encode_header(video, buf, mem, len);
-		video->payload_size += ret;
-		mem += ret;
-		len -= ret;
-	}
+#else
 
-	/* Process video data. */
-	len = min((int)(video->max_payload_size - video->payload_size), len);
-	ret = uvc_video_encode_data(video, buf, mem, len);
+static inline void uvc_video_debugfs_init(struct uvc_video *video) { }
+static inline void uvc_video_debugfs_cleanup(struct uvc_video *video) { }
 
-	video->payload_size += ret;
-	len -= ret;
+#endif	/* CONFIG_USB_GADGET_DEBUG_FS */
 
-	req->length = video->req_size - len;
-	req->zero = video->payload_size == video->max_payload_size;
+/* --------------------------------------------------------------------------
+ * Bandwidth pacing
+ */
 
-	if (buf->buf.bytesused == video->queue.buf_used) {
-		video->queue.buf_used = 0;
-		buf->state = UVC_BUF_STATE_DONE;
-		uvc_queue_next_buffer(&video->queue, buf);
-		video->fid ^= UVC_STREAM_FID;
+/*
+ * Without pacing, every free request is filled and queued as soon as video
+ * data is available, so a bulk stream sends each frame at full link rate
+ * and other functions sharing the bus wait for it to finish. In pacing mode
+ * a timer releases the requests one at a time, evenly spread over the frame
+ * interval: the completion handler only returns requests to req_free, and
+ * uvc_video_pump() merely makes sure the timer runs. Falling behind never
+ * causes a catch-up burst, the schedule restarts from the current time.
+ */
 
-		video->payload_size = 0;
-	}
+static inline u32
+uvc_video_pace_interval(struct uvc_video *video)
+{
+	return video->pace_interval ? video->pace_interval
+				    : video->frame_interval;
+}
 
-	if (video->payload_size == video->max_payload_size ||
-	    buf->buf.bytesused == video->queue.buf_used)
-		video->payload_size = 0;
+static inline int
+uvc_video_paced(struct uvc_video *video)
+{
+	return video->pace && uvc_video_pace_interval(video);
 }
 
+/*
+ * Start pacing a new frame: one request slot is the frame interval divided
+ * by the number of requests the frame needs.
+ */
 static void
-uvc_video_encode_isoc(struct usb_request *req, struct uvc_video *video,
-		struct uvc_buffer *buf)
+uvc_video_pace_frame(struct uvc_video *video, struct uvc_buffer *buf)
 {
-	void *mem = req->buf;
-	int len = video->req_size;
-	int ret;
+	unsigned int count;
 
-	/* Add the header. */
-	ret = uvc_video_encode_header(video, buf, mem, len);
-	mem += ret;
-	len -= ret;
+	count = DIV_ROUND_UP(buf->buf.bytesused, video->req_size - 2);
+	video->pace_slot = div_u64((u64)uvc_video_pace_interval(video) * 100,
+				   max(count, 1U));
+}
 
-	/* Process video data. */
-	ret = uvc_video_encode_data(video, buf, mem, len);
-	len -= ret;
+/*
+ * Arm the pacing timer if it isn't running and a request is free. Called
+ * with req_lock held.
+ */
+static void
+__uvc_video_pace_kick(struct uvc_video *video)
+{
+	ktime_t now;
+
+	if (video->pace_running || list_empty(&video->req_free))
+		return;
+
+	now = ktime_get();
+	if (video->pace_next.tv64 < now.tv64)
+		video->pace_next = now;
+
+	video->pace_running = 1;
+	hrtimer_start(&video->pace_timer, video->pace_next, HRTIMER_MODE_ABS);
+}
+
+static void
+uvc_video_pace_kick(struct uvc_video *video)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&video->req_lock, flags);
+	__uvc_video_pace_kick(video);
+	spin_unlock_irqrestore(&video->req_lock, flags);
+}
+
+static enum hrtimer_restart
+uvc_video_pace_timer(struct hrtimer *timer)
+{
+	struct uvc_video *video = container_of(timer, struct uvc_video,
+					       pace_timer);
+	struct usb_request *req = NULL;
+	struct uvc_buffer *buf = NULL;
+	unsigned long flags;
+	ktime_t now;
+	int ret = 0;
+
+	spin_lock_irqsave(&video->queue.irqlock, flags);
+	if (video->ep_active && uvc_video_paced(video))
+		buf = uvc_queue_head(&video->queue);
 
-	req->length = video->req_size - len;
+	if (buf != NULL) {
+		spin_lock(&video->req_lock);
+		if (!list_empty(&video->req_free)) {
+			req = list_first_entry(&video->req_free,
+					       struct usb_request, list);
+			list_del(&req->list);
+		}
+		spin_unlock(&video->req_lock);
+	}
+
+	if (req != NULL) {
+		if (video->queue.buf_used == 0)
+			uvc_video_pace_frame(video, buf);
 
-	if (buf->buf.bytesused == video->queue.buf_used) {
-		video->queue.buf_used = 0;
-		buf->state = UVC_BUF_STATE_DONE;
-		uvc_queue_next_buffer(&video->queue, buf);
-		video->fid ^= UVC_STREAM_FID;
+		video->encode(req, video, buf);
+
+		if ((ret = usb_ep_queue(video->ep, req, GFP_ATOMIC)) < 0) {
+			printk(KERN_INFO "Failed to queue request (%d).\n",
+				ret);
+			usb_ep_set_halt(video->ep);
+		}
+	}
+	spin_unlock_irqrestore(&video->queue.irqlock, flags);
+
+	spin_lock_irqsave(&video->req_lock, flags);
+	if (req != NULL && ret < 0) {
+		list_add_tail(&req->list, &video->req_free);
+		req = NULL;
 	}
+
+	/* Stop when out of data or requests, QBUF or a completion restarts
+	 * the timer.
+	 */
+	if (req == NULL || list_empty(&video->req_free)) {
+		if (req != NULL)
+			video->pace_next = ktime_add_ns(video->pace_next,
+							video->pace_slot);
+		video->pace_running = 0;
+		spin_unlock_irqrestore(&video->req_lock, flags);
+		return HRTIMER_NORESTART;
+	}
+
+	video->pace_next = ktime_add_ns(video->pace_next, video->pace_slot);
+	now = ktime_get();
+	if (video->pace_next.tv64 < now.tv64)
+		video->pace_next = now;
+	hrtimer_set_expires(timer, video->pace_next);
+	spin_unlock_irqrestore(&video->req_lock, flags);
+
+	return HRTIMER_RESTART;
+}
+
+/*
+ * Stop the pacing timer. Called once the endpoint or the queue has been
+ * stopped, so a concurrent kick can't rearm it for more than one run.
+ */
+static void
+uvc_video_pace_stop(struct uvc_video *video)
+{
+	unsigned long flags;
+
+	hrtimer_cancel(&video->pace_timer);
+
+	spin_lock_irqsave(&video->req_lock, flags);
+	video->pace_running = 0;
+	spin_unlock_irqrestore(&video->req_lock, flags);
 }
 
 /* --------------------------------------------------------------------------
@@ -168,6 +326,19 @@ uvc_video_complete(struct usb_ep *ep, struct usb_request *req)
 
 	switch (req->status) {
 	case 0:
+		if (video->start_alt.pending || video->start_streamon.pending) {
+			ktime_t now = ktime_get();
+
+			uvc_video_start_done(&video->start_alt, now);
+			uvc_video_start_done(&video->start_streamon, now);
+		}
+		if (uvc_video_paced(video)) {
+			spin_lock_irqsave(&video->req_lock, flags);
+			list_add_tail(&req->list, &video->req_free);
+			__uvc_video_pace_kick(video);
+			spin_unlock_irqrestore(&video->req_lock, flags);
+			return;
+		}
 		break;
 
 	case -ESHUTDOWN:
@@ -205,6 +376,9 @@ requeue:
 	spin_unlock_irqrestore(&video->req_lock, flags);
 }
 
+/* requests and buffers held by the function, in debugfs usb_mem/uvc */
+static struct usb_mem_account uvc_mem = USB_MEM_ACCOUNT("uvc");
+
 static int
 uvc_video_free_requests(struct uvc_video *video)
 {
@@ -212,12 +386,13 @@ uvc_video_free_requests(struct uvc_video *video)
 
 	for (i = 0; i < UVC_NUM_REQUESTS; ++i) {
 		if (video->req[i]) {
-			usb_ep_free_request(video->ep, video->req[i]);
+			usb_mem_free_request(&uvc_mem, video->ep,
+					video->req[i]);
 			video->req[i] = NULL;
 		}
 
 		if (video->req_buffer[i]) {
-			kfree(video->req_buffer[i]);
+			usb_mem_kfree(&uvc_mem, video->req_buffer[i]);
 			video->req_buffer[i] = NULL;
 		}
 	}
@@ -227,8 +402,12 @@ uvc_video_free_requests(struct uvc_video *video)
 	return 0;
 }
 
+/*
+ * Allocate the USB requests, each with a @size bytes buffer. This is done
+ * once at bind time, the request size doesn't depend on the video format.
+ */
 static int
-uvc_video_alloc_requests(struct uvc_video *video)
+uvc_video_alloc_requests(struct uvc_video *video, unsigned int size)
 {
 	unsigned int i;
 	int ret = -ENOMEM;
@@ -236,11 +415,13 @@ uvc_video_alloc_requests(struct uvc_video *video)
 	BUG_ON(video->req_size);
 
 	for (i = 0; i < UVC_NUM_REQUESTS; ++i) {
-		video->req_buffer[i] = kmalloc(video->ep->maxpacket, GFP_KERNEL);
+		video->req_buffer[i] = usb_mem_kmalloc(&uvc_mem, size,
+				GFP_KERNEL);
 		if (video->req_buffer[i] == NULL)
 			goto error;
 
-		video->req[i] = usb_ep_alloc_request(video->ep, GFP_KERNEL);
+		video->req[i] = usb_mem_alloc_request(&uvc_mem, video->ep,
+				GFP_KERNEL);
 		if (video->req[i] == NULL)
 			goto error;
 
@@ -253,7 +434,7 @@ uvc_video_alloc_requests(struct uvc_video *video)
 		list_add_tail(&video->req[i]->list, &video->req_free);
 	}
 
-	video->req_size = video->ep->maxpacket;
+	video->req_size = size;
 	return 0;
 
 error:
@@ -269,62 +450,147 @@ error:
  * uvc_video_pump - Pump video data into the USB requests
  *
  * This function fills the available USB requests (listed in req_free) with
- * video data from the queued buffers.
+ * video data from the queued buffers, and queues all of them to the
+ * endpoint in a single call.
+ *
+ * Nothing is filled before VIDIOC_STREAMON. Until SET_INTERFACE enables the
+ * endpoint, filled requests are parked on req_ready; they go out first, as
+ * soon as the endpoint is enabled, without waiting for the next QBUF.
  */
 static int
 uvc_video_pump(struct uvc_video *video)
 {
-	struct usb_request *req;
+	struct uvc_device *uvc = container_of(video, struct uvc_device, video);
+	struct usb_request *req, *tmp;
 	struct uvc_buffer *buf;
 	unsigned long flags;
+	LIST_HEAD(idle);
+	LIST_HEAD(batch);
 	int ret;
 
 	/* FIXME TODO Race between uvc_video_pump and requests completion
 	 * handler ???
 	 */
 
-	while (1) {
-		/* Retrieve the first available USB request, protected by the
-		 * request lock.
-		 */
-		spin_lock_irqsave(&video->req_lock, flags);
-		if (list_empty(&video->req_free)) {
-			spin_unlock_irqrestore(&video->req_lock, flags);
-			return 0;
-		}
-		req = list_first_entry(&video->req_free, struct usb_request,
-					list);
-		list_del(&req->list);
-		spin_unlock_irqrestore(&video->req_lock, flags);
+	if (!uvc_queue_streaming(&video->queue))
+		return 0;
+
+	if (uvc_video_paced(video)) {
+		uvc_video_pace_kick(video);
+		return 0;
+	}
+
+	/* Take all available USB requests, protected by the request lock. */
+	spin_lock_irqsave(&video->req_lock, flags);
+	list_splice_init(&video->req_free, &idle);
+	spin_unlock_irqrestore(&video->req_lock, flags);
 
-		/* Retrieve the first available video buffer and fill the
-		 * request, protected by the video queue irqlock.
-		 */
-		spin_lock_irqsave(&video->queue.irqlock, flags);
+	/* Fill as many requests as there is video data for, and queue them,
+	 * protected by the video queue irqlock.
+	 */
+	spin_lock_irqsave(&video->queue.irqlock, flags);
+	list_for_each_entry_safe(req, tmp, &idle, list) {
 		buf = uvc_queue_head(&video->queue);
-		if (buf == NULL) {
-			spin_unlock_irqrestore(&video->queue.irqlock, flags);
+		if (buf == NULL)
 			break;
-		}
 
 		video->encode(req, video, buf);
+		list_move_tail(&req->list, &batch);
+	}
 
-		/* Queue the USB request */
-		if ((ret = usb_ep_queue(video->ep, req, GFP_KERNEL)) < 0) {
-			printk(KERN_INFO "Failed to queue request (%d)\n", ret);
-			usb_ep_set_halt(video->ep);
-			spin_unlock_irqrestore(&video->queue.irqlock, flags);
-			break;
-		}
+	if (!video->ep_active) {
+		list_splice_tail_init(&batch, &video->req_ready);
 		spin_unlock_irqrestore(&video->queue.irqlock, flags);
+		goto done;
 	}
 
+	/* Requests filled ahead of time carry the older data. */
+	list_splice_init(&video->req_ready, &batch);
+
+	ret = usb_ep_queue_list(uvc->func.config->cdev->gadget, video->ep,
+				&batch, GFP_ATOMIC);
+	if (ret < 0) {
+		printk(KERN_INFO "Failed to queue request (%d)\n", ret);
+		usb_ep_set_halt(video->ep);
+	}
+	spin_unlock_irqrestore(&video->queue.irqlock, flags);
+
+done:
+
+	/* Give back the requests that weren't queued. */
 	spin_lock_irqsave(&video->req_lock, flags);
-	list_add_tail(&req->list, &video->req_free);
+	list_splice_tail(&batch, &video->req_free);
+	list_splice_tail(&idle, &video->req_free);
 	spin_unlock_irqrestore(&video->req_lock, flags);
 	return 0;
 }
 
+/*
+ * Give the requests filled ahead of SET_INTERFACE back to req_free.
+ */
+static void
+uvc_video_reclaim_ready(struct uvc_video *video, int ep_active)
+{
+	unsigned long flags;
+	LIST_HEAD(ready);
+
+	spin_lock_irqsave(&video->queue.irqlock, flags);
+	video->ep_active = ep_active;
+	list_splice_init(&video->req_ready, &ready);
+	spin_unlock_irqrestore(&video->queue.irqlock, flags);
+
+	spin_lock_irqsave(&video->req_lock, flags);
+	list_splice_tail(&ready, &video->req_free);
+	spin_unlock_irqrestore(&video->req_lock, flags);
+}
+
+/*
+ * The streaming endpoint has just been enabled by SET_INTERFACE: send the
+ * pre-filled requests, and whatever more the queued buffers allow.
+ */
+static int
+uvc_video_start(struct uvc_video *video)
+{
+	unsigned long flags;
+
+	uvc_video_start_mark(&video->start_alt);
+
+	spin_lock_irqsave(&video->queue.irqlock, flags);
+	video->ep_active = 1;
+	spin_unlock_irqrestore(&video->queue.irqlock, flags);
+
+	return uvc_video_pump(video);
+}
+
+/*
+ * The streaming endpoint is about to be disabled.
+ */
+static void
+uvc_video_stop(struct uvc_video *video)
+{
+	video->start_alt.pending = 0;
+	uvc_video_reclaim_ready(video, 0);
+	uvc_video_pace_stop(video);
+}
+
+/*
+ * Turn bandwidth pacing on or off (UVCIOC_SET_PACING).
+ */
+static int
+uvc_video_set_pacing(struct uvc_video *video, const struct uvc_pacing *pacing)
+{
+	video->pace_interval = pacing->interval;
+	video->pace = pacing->enable ? 1 : 0;
+
+	/* When going back to unpaced streaming, the pump refills the
+	 * requests the timer left behind.
+	 */
+	if (!video->pace)
+		uvc_video_pace_stop(video);
+
+	return uvc_video_pump(video);
+}
+
 /*
  * Enable or disable the video stream.
  */
@@ -341,26 +607,27 @@ uvc_video_enable(struct uvc_video *video, int enable)
 	}
 
 	if (!enable) {
+		video->start_streamon.pending = 0;
 		for (i = 0; i < UVC_NUM_REQUESTS; ++i)
 			usb_ep_dequeue(video->ep, video->req[i]);
 
-		uvc_video_free_requests(video);
+		uvc_video_reclaim_ready(video, video->ep_active);
 		uvc_queue_enable(&video->queue, 0);
+		uvc_video_pace_stop(video);
 		return 0;
 	}
 
 	if ((ret = uvc_queue_enable(&video->queue, 1)) < 0)
 		return ret;
 
-	if ((ret = uvc_video_alloc_requests(video)) < 0)
-		return ret;
-
 	if (video->max_payload_size) {
 		video->encode = uvc_video_encode_bulk;
 		video->payload_size = 0;
 	} else
 		video->encode = uvc_video_encode_isoc;
 
+	/* Fill every request from the buffers queued so far right away. */
+	uvc_video_start_mark(&video->start_streamon);
 	return uvc_video_pump(video);
 }
 
@@ -371,8 +638,12 @@ static int
 uvc_video_init(struct uvc_video *video)
 {
 	INIT_LIST_HEAD(&video->req_free);
+	INIT_LIST_HEAD(&video->req_ready);
 	spin_lock_init(&video->req_lock);
 
+	hrtimer_init(&video->pace_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	video->pace_timer.function = uvc_video_pace_timer;
+
 	video->fcc = V4L2_PIX_FMT_YUYV;
 	video->bpp = 16;
 	video->width = 320;